@@ -7,6 +7,16 @@ typedef enum AssemblerErrorHandler
     AssemblerErrorHandler_ERROR = 1,
 } AssemblerErrorHandler;
 
-AssemblerErrorHandler assembleFile(const char* input_file, const char* output_file);
+typedef struct AssemblerOptions
+{
+    bool fuse_superinstructions;
+    bool raw_output;               // old headerless format with unaligned operands
+    bool compact_output;           // constant pool and relative targets, see program_format.h
+    bool source_map;               // line and procedure of every instruction for the profiler
+} AssemblerOptions;
+
+AssemblerErrorHandler assembleFile(const char*                    input_file,
+                                   const char*                    output_file,
+                                   const AssemblerOptions* const options);
 
 #endif // ASSEMBLER_H
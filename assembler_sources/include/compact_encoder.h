@@ -0,0 +1,25 @@
+#ifndef COMPACT_ENCODER_H
+#define COMPACT_ENCODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "assembler.h"
+
+typedef struct CompactProgram
+{
+    uint8_t* code;
+    size_t   code_size;
+    uint8_t* constants;             // 8-byte constants, deduplicated by bit pattern
+    size_t   number_of_constants;
+    size_t   constant_index_size;   // 1 byte up to 256 constants, 2 bytes up to 65536
+} CompactProgram;
+
+// re-encodes code in the raw layout (unaligned 8-byte constants and absolute targets)
+// into the compact encoding of program_format.h
+AssemblerErrorHandler encodeCompact(const uint8_t*        raw_code,
+                                    size_t                raw_size,
+                                    CompactProgram* const compact);
+void compactProgramDtor(CompactProgram* const compact);
+
+#endif // COMPACT_ENCODER_H
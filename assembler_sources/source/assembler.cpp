@@ -8,14 +8,15 @@
 
 #include "helpful_functions.h"
 #include "command_handler.h"
+#include "program_format.h"
+#include "value_type.h"
+#include "compact_encoder.h"
 
 #include "logger.h"
 
 
 // static --------------------------------------------------------------------------------------------------------------
 
-typedef double arguments_type;
-
 typedef struct Mark
 {
     char*  mark_name;
@@ -29,8 +30,45 @@ typedef struct Jmp
     bool   flag_seen;
 } Jmp;
 
+// NAME proc ... NAME endp block, pure if nothing in it or in what it calls has side effects
+typedef struct Procedure
+{
+    char* name;
+    bool  is_annotated;        // NAME proc pure
+    bool  has_side_effects;    // RAM, in, out, draw, vector commands, hlt or calldepth in its own body
+    bool  is_pure;
+} Procedure;
+
+typedef struct CallSite
+{
+    char*  target_name;
+    size_t code_pointer;       // opcode of the call
+    size_t caller;             // procedure the call is made from, NO_PROCEDURE outside of them
+} CallSite;
+
+static const size_t NO_PROCEDURE = (size_t)-1;
+
+typedef struct EmittedLine
+{
+    size_t     code_pointer;   // start of the instruction
+    SourceLine source_line;
+} EmittedLine;
+
+static const size_t SUPERINSTRUCTION_WINDOW = 4;
+static const size_t MAX_INSTRUCTION_SIZE    = 64;   // longest instruction with all of its padding
+
+typedef struct FusionStatistics
+{
+    size_t push_sub;
+    size_t inc;
+    size_t cmp_jmp;
+    size_t tailcall;
+} FusionStatistics;
+
 typedef struct Assembler
 {
+    AssemblerOptions options;
+
     const char* input_file_path;
     size_t      input_file_size;
     char*       input_data;
@@ -47,9 +85,30 @@ typedef struct Assembler
     Mark*       mark_list;
     size_t      mark_list_size;
     size_t      mark_list_max_size;
+
+    Procedure*  procedure_list;
+    size_t      procedure_list_size;
+    size_t      procedure_list_max_size;
+    size_t      current_procedure;
+
+    CallSite*   call_site_list;
+    size_t      call_site_list_size;
+    size_t      call_site_list_max_size;
+    size_t      pure_calls;    // calls turned into pure calls by markPureCalls
+
+    EmittedLine* source_lines; // one per emitted instruction, filled only for options.source_map
+    size_t       source_lines_size;
+    size_t       source_lines_max_size;
+    const char*  line_counted; // input_data up to here is counted into current_line
+    uint32_t     current_line;
+
+    size_t           recent_instructions[SUPERINSTRUCTION_WINDOW]; // starts of the last emitted instructions
+    size_t           recent_instructions_count;                    // no label between any of them
+    FusionStatistics fusion_statistics;
 } Assembler;
 
 static MachineCommands convertCommandToMachineCode(const char* const command);
+static uint8_t convertVectorCommandToMachineCode(const char* const command);
 static Registers convertRegisterToMachineCode(const char* const register_given);
 static AssemblerErrorHandler convertFileToMachineCode(Assembler* const assembler);
 static void saveMarkToMarkList(Assembler* const assembler, char* mark, size_t mark_size);
@@ -57,8 +116,35 @@ static void saveMarkToJmpList(Assembler* const assembler, char* mark, size_t mar
 static AssemblerErrorHandler parseArgument(Assembler* const assembler, char* argument);
 static bool checkIfMark(char* command_buffer);
 static bool checkRegisterValidity(char* buffer);
+static int scanNumber(const char* buffer, arguments_type* number);
 static AssemblerErrorHandler processJmpCommand(Assembler* const assembler,
                                                char*            argument);
+static void saveProcedure(Assembler* const assembler, const char* name, const char* annotation);
+static void saveCallSite(Assembler* const assembler, const char* argument, size_t instruction_start);
+static void noteSideEffects(Assembler* const assembler, MachineCommands command, size_t instruction_start);
+static size_t findProcedure(const Assembler* const assembler, const char* name);
+static void saveSourceLine(Assembler* const assembler, const char* line_start, size_t instruction_start);
+static void dropFusedSourceLines(Assembler* const assembler);
+static void markPureCalls(Assembler* const assembler);
+static void rememberInstruction(Assembler* const assembler, size_t instruction_start);
+static void fuseSuperinstructions(Assembler* const assembler);
+static bool getPlainPushOperand(const Assembler* const assembler,
+                                size_t                 instruction_start,
+                                bool*                  is_register,
+                                const uint8_t**        operand,
+                                size_t*                operand_size);
+static size_t writePairOperands(uint8_t*               fused,
+                                size_t                 fused_start,
+                                size_t                 fused_size,
+                                const Assembler* const assembler,
+                                size_t                 first_push,
+                                size_t                 second_push);
+static size_t alignOperand(const Assembler* const assembler, size_t offset);
+static void alignOutput(Assembler* const assembler);
+static AssemblerErrorHandler writeOutputFile(const Assembler* const assembler);
+static uint8_t* makeSourceMap(const Assembler* const assembler, size_t* size);
+static bool writeSection(FILE* output_file, const uint8_t* section, size_t size, size_t section_size);
+static size_t alignSection(size_t size);
 
 static AssemblerErrorHandler readDataFromAsmFile(Assembler* const assembler);
 static AssemblerErrorHandler callocAssemblerStructArrays(Assembler* const assembler);
@@ -74,19 +160,29 @@ static const size_t SCALE_FACTOR      = 2;
 // public --------------------------------------------------------------------------------------------------------------
 
 
-AssemblerErrorHandler assembleFile(const char* input_file_path,
-                                   const char* output_file_path)
+AssemblerErrorHandler assembleFile(const char*                    input_file_path,
+                                   const char*                    output_file_path,
+                                   const AssemblerOptions* const options)
 {
     assert(input_file_path  != NULL);
     assert(output_file_path != NULL);
+    assert(options          != NULL);
 
     Assembler assembler = {};
 
+    assembler.options          = *options;
     assembler.input_file_path  = input_file_path;
     assembler.output_file_path = output_file_path;
 
     assemblerCtor(&assembler);
     convertFileToMachineCode(&assembler);
+    markPureCalls(&assembler);
+
+    Log(LogLevel_INFO, "Superinstructions: push_sub %zu, inc %zu, cmp_jmp %zu, tailcall %zu",
+        assembler.fusion_statistics.push_sub, assembler.fusion_statistics.inc, assembler.fusion_statistics.cmp_jmp,
+        assembler.fusion_statistics.tailcall);
+    Log(LogLevel_INFO, "Pure calls: %zu", assembler.pure_calls);
+
     assemblerDtor(&assembler);
 
     return AssemblerErrorHandler_OK;
@@ -105,9 +201,17 @@ static AssemblerErrorHandler assemblerCtor(Assembler* const assembler)
     assembler->jmp_list    = NULL;
     assembler->output_data = NULL;
 
+    assembler->procedure_list    = NULL;
+    assembler->call_site_list    = NULL;
+    assembler->current_procedure = NO_PROCEDURE;
+    assembler->source_lines      = NULL;
+
     readDataFromAsmFile(assembler);
     callocAssemblerStructArrays(assembler);
 
+    assembler->line_counted = assembler->input_data;
+    assembler->current_line = 1;
+
     return AssemblerErrorHandler_OK;
 }
 
@@ -123,12 +227,12 @@ static AssemblerErrorHandler callocAssemblerStructArrays(Assembler* const assemb
         assembler->input_data[len] = '\0';
     }
 
-    assembler->output_data = (uint8_t*)calloc(assembler->input_file_size, sizeof(uint8_t));
+    assembler->output_data = (uint8_t*)calloc(assembler->input_file_size + MAX_INSTRUCTION_SIZE, sizeof(uint8_t));
     if (!assembler->output_data)
     {
         return AssemblerErrorHandler_ERROR;
     }
-    assembler->output_file_max_size = assembler->input_file_size;
+    assembler->output_file_max_size = assembler->input_file_size + MAX_INSTRUCTION_SIZE;
     assembler->output_file_size     = 0;
 
     assembler->jmp_list = (Jmp*)calloc(SIZE_OF_MARK_LIST, sizeof(Jmp));
@@ -147,6 +251,30 @@ static AssemblerErrorHandler callocAssemblerStructArrays(Assembler* const assemb
     assembler->mark_list_max_size = SIZE_OF_MARK_LIST;
     assembler->mark_list_size     = 0;
 
+    assembler->procedure_list = (Procedure*)calloc(SIZE_OF_MARK_LIST, sizeof(Procedure));
+    if (!assembler->procedure_list)
+    {
+        return AssemblerErrorHandler_ERROR;
+    }
+    assembler->procedure_list_max_size = SIZE_OF_MARK_LIST;
+    assembler->procedure_list_size     = 0;
+
+    assembler->call_site_list = (CallSite*)calloc(SIZE_OF_MARK_LIST, sizeof(CallSite));
+    if (!assembler->call_site_list)
+    {
+        return AssemblerErrorHandler_ERROR;
+    }
+    assembler->call_site_list_max_size = SIZE_OF_MARK_LIST;
+    assembler->call_site_list_size     = 0;
+
+    assembler->source_lines = (EmittedLine*)calloc(SIZE_OF_MARK_LIST, sizeof(EmittedLine));
+    if (!assembler->source_lines)
+    {
+        return AssemblerErrorHandler_ERROR;
+    }
+    assembler->source_lines_max_size = SIZE_OF_MARK_LIST;
+    assembler->source_lines_size     = 0;
+
     return AssemblerErrorHandler_OK;
 }
 
@@ -155,7 +283,7 @@ static AssemblerErrorHandler reallocArrays(Assembler* const assembler)
 {
     assert(assembler != NULL);
 
-    if (assembler->output_file_size >= assembler->output_file_max_size - sizeof(arguments_type) - 1)
+    if (assembler->output_file_size + MAX_INSTRUCTION_SIZE >= assembler->output_file_max_size)
     {
         assembler->output_file_max_size *= SCALE_FACTOR;
 
@@ -191,6 +319,42 @@ static AssemblerErrorHandler reallocArrays(Assembler* const assembler)
         }
     }
 
+    if (assembler->procedure_list_size >= assembler->procedure_list_max_size - 1)
+    {
+        assembler->procedure_list_max_size *= SCALE_FACTOR;
+
+        assembler->procedure_list = (Procedure*)realloc(assembler->procedure_list,
+                                                        assembler->procedure_list_max_size * sizeof(Procedure));
+        if (!assembler->procedure_list)
+        {
+            return AssemblerErrorHandler_ERROR;
+        }
+    }
+
+    if (assembler->call_site_list_size >= assembler->call_site_list_max_size - 1)
+    {
+        assembler->call_site_list_max_size *= SCALE_FACTOR;
+
+        assembler->call_site_list = (CallSite*)realloc(assembler->call_site_list,
+                                                       assembler->call_site_list_max_size * sizeof(CallSite));
+        if (!assembler->call_site_list)
+        {
+            return AssemblerErrorHandler_ERROR;
+        }
+    }
+
+    if (assembler->source_lines_size >= assembler->source_lines_max_size - 1)
+    {
+        assembler->source_lines_max_size *= SCALE_FACTOR;
+
+        assembler->source_lines = (EmittedLine*)realloc(assembler->source_lines,
+                                                        assembler->source_lines_max_size * sizeof(EmittedLine));
+        if (!assembler->source_lines)
+        {
+            return AssemblerErrorHandler_ERROR;
+        }
+    }
+
     return AssemblerErrorHandler_OK;
 }
 
@@ -234,6 +398,9 @@ static AssemblerErrorHandler assemblerDtor(Assembler* const assembler)
 {
     assert(assembler != NULL);
 
+    // the source map takes the names of the procedures, the lists are freed only after it is written
+    AssemblerErrorHandler return_code = writeOutputFile(assembler);
+
     FREE_NULL(assembler->input_data);
 
     for (size_t current_mark = 0; current_mark < assembler->mark_list_size; current_mark++)
@@ -246,31 +413,223 @@ static AssemblerErrorHandler assemblerDtor(Assembler* const assembler)
         FREE_NULL(assembler->jmp_list[current_jmp].jmp_mark_name);
     }
 
+    for (size_t current_procedure = 0; current_procedure < assembler->procedure_list_size; current_procedure++)
+    {
+        FREE_NULL(assembler->procedure_list[current_procedure].name);
+    }
+
+    for (size_t current_call = 0; current_call < assembler->call_site_list_size; current_call++)
+    {
+        FREE_NULL(assembler->call_site_list[current_call].target_name);
+    }
+
     FREE_NULL(assembler->mark_list);
     FREE_NULL(assembler->jmp_list);
+    FREE_NULL(assembler->procedure_list);
+    FREE_NULL(assembler->call_site_list);
+    FREE_NULL(assembler->source_lines);
+    FREE_NULL(assembler->output_data);
 
-    FILE* output_file = fopen(assembler->output_file_path, "wb");
-    if (!output_file)
+    return return_code;
+}
+
+
+// Sections go right behind the header: code, data, constants and the source map, each padded to PROGRAM_ALIGNMENT.
+// The assembler has no data directives, so the data section is empty.
+static AssemblerErrorHandler writeOutputFile(const Assembler* const assembler)
+{
+    assert(assembler != NULL);
+
+    CompactProgram compact = {};
+
+    if (assembler->options.compact_output)
+    {
+        if (encodeCompact(assembler->output_data, assembler->output_file_size, &compact) != AssemblerErrorHandler_OK)
+        {
+            return AssemblerErrorHandler_ERROR;
+        }
+
+        Log(LogLevel_INFO, "Compact encoding: %zu bytes of code and %zu constants instead of %zu bytes of code",
+            compact.code_size, compact.number_of_constants, assembler->output_file_size);
+    }
+    else
     {
-        FREE_NULL(assembler->output_data);
+        compact.code      = assembler->output_data;
+        compact.code_size = assembler->output_file_size;
+    }
+
+    size_t code_section_size = alignSection(compact.code_size);
+    size_t constants_size    = compact.number_of_constants * sizeof(arguments_type);
+    size_t constants_offset  = sizeof(ProgramHeader) + code_section_size;
+
+    bool raw_output = assembler->options.raw_output && !assembler->options.compact_output;
+
+    size_t   source_map_size = 0;
+    uint8_t* source_map      = NULL;
+    if (assembler->options.source_map && !raw_output)
+    {
+        source_map = makeSourceMap(assembler, &source_map_size);
+        if (!source_map)
+        {
+            if (assembler->options.compact_output)
+            {
+                compactProgramDtor(&compact);
+            }
+
+            return AssemblerErrorHandler_ERROR;
+        }
+    }
+
+    ProgramHeader header = {
+        .magic               = PROGRAM_MAGIC,
+        .version             = PROGRAM_VERSION,
+        .header_size         = sizeof(ProgramHeader),
+        .code_offset         = sizeof(ProgramHeader),
+        .code_size           = compact.code_size,
+        .data_offset         = sizeof(ProgramHeader) + code_section_size,
+        .data_size           = 0,
+        .entry_point         = 0,
+        .ram_size            = TARGET_RAM_SIZE,
+        .stack_size          = TARGET_STACK_SIZE,
+        .encoding            = assembler->options.compact_output ? ProgramEncoding_COMPACT : ProgramEncoding_ALIGNED,
+        .constant_index_size = (uint32_t)compact.constant_index_size,
+        .constants_offset    = constants_offset,
+        .constants_size      = constants_size,
+        .value_type          = VALUE_TYPE,
+        .reserved            = 0,
+        .source_map_offset   = source_map ? constants_offset + alignSection(constants_size) : 0,
+        .source_map_size     = source_map_size,
+    };
+
+    if (raw_output && VALUE_TYPE != ValueType_F64)
+    {
+        Log(LogLevel_INFO, "Raw files have no header to record the value type in, they hold doubles only");
         return AssemblerErrorHandler_ERROR;
     }
 
-    size_t size_writed = fwrite(assembler->output_data,
-                                sizeof(assembler->output_data[0]),
-                                assembler->output_file_size,
-                                output_file);
-    if (size_writed != assembler->output_file_size)
+    FILE* output_file = fopen(assembler->output_file_path, "wb");
+
+    bool written = output_file != NULL;
+    if (raw_output)
+    {
+        written = written && writeSection(output_file, compact.code, compact.code_size, compact.code_size);
+    }
+    else
+    {
+        written = written && writeSection(output_file, (const uint8_t*)&header, sizeof(header), sizeof(header))
+                          && writeSection(output_file, compact.code, compact.code_size, code_section_size)
+                          && writeSection(output_file, compact.constants, constants_size, alignSection(constants_size))
+                          && writeSection(output_file, source_map, source_map_size, source_map_size);
+    }
+
+    if (output_file)
     {
-        FREE_NULL(assembler->output_data);
         FCLOSE_NULL(output_file);
-        return AssemblerErrorHandler_ERROR;
     }
 
-    FREE_NULL(assembler->output_data);
-    FCLOSE_NULL(output_file);
+    FREE_NULL(source_map);
 
-    return AssemblerErrorHandler_OK;
+    if (assembler->options.compact_output)
+    {
+        compactProgramDtor(&compact);
+    }
+
+    return written ? AssemblerErrorHandler_OK : AssemblerErrorHandler_ERROR;
+}
+
+
+// writes size bytes and zeros up to section_size
+static bool writeSection(FILE* output_file, const uint8_t* section, size_t size, size_t section_size)
+{
+    assert(output_file != NULL);
+    assert(section     != NULL || size == 0);
+    assert(size <= section_size);
+
+    static const uint8_t padding[PROGRAM_ALIGNMENT] = {};
+
+    if (size > 0 && fwrite(section, sizeof(section[0]), size, output_file) != size)
+    {
+        return false;
+    }
+
+    for (size_t padding_left = section_size - size; padding_left > 0;)
+    {
+        size_t padding_size = padding_left < PROGRAM_ALIGNMENT ? padding_left : PROGRAM_ALIGNMENT;
+        if (fwrite(padding, sizeof(padding[0]), padding_size, output_file) != padding_size)
+        {
+            return false;
+        }
+
+        padding_left -= padding_size;
+    }
+
+    return true;
+}
+
+
+// header, lines and names of the source map section, see program_format.h
+static uint8_t* makeSourceMap(const Assembler* const assembler, size_t* size)
+{
+    assert(assembler != NULL);
+    assert(size      != NULL);
+
+    // the processor may run in another directory than the one the program was assembled in
+    char*       resolved_path = realpath(assembler->input_file_path, NULL);
+    const char* source_path   = resolved_path ? resolved_path : assembler->input_file_path;
+
+    size_t names_size = strlen(source_path) + 1;
+    for (size_t current_procedure = 0; current_procedure < assembler->procedure_list_size; current_procedure++)
+    {
+        names_size += strlen(assembler->procedure_list[current_procedure].name) + 1;
+    }
+
+    size_t lines_size = assembler->source_lines_size * sizeof(SourceLine);
+
+    *size = sizeof(SourceMapHeader) + lines_size + names_size;
+
+    uint8_t* source_map = (uint8_t*)calloc(*size, sizeof(uint8_t));
+    if (!source_map)
+    {
+        free(resolved_path);
+        return NULL;
+    }
+
+    SourceMapHeader header = {
+        .number_of_lines      = (uint32_t)assembler->source_lines_size,
+        .number_of_procedures = (uint32_t)assembler->procedure_list_size,
+        .names_size           = names_size,
+    };
+    memcpy(source_map, &header, sizeof(header));
+
+    SourceLine* lines = (SourceLine*)(source_map + sizeof(header));
+    for (size_t current_line = 0; current_line < assembler->source_lines_size; current_line++)
+    {
+        lines[current_line] = assembler->source_lines[current_line].source_line;
+    }
+
+    char* names = (char*)(source_map + sizeof(header) + lines_size);
+
+    strcpy(names, source_path);
+    names += strlen(source_path) + 1;
+
+    for (size_t current_procedure = 0; current_procedure < assembler->procedure_list_size; current_procedure++)
+    {
+        strcpy(names, assembler->procedure_list[current_procedure].name);
+        names += strlen(assembler->procedure_list[current_procedure].name) + 1;
+    }
+
+    Log(LogLevel_INFO, "Source map: %zu instructions, %zu procedures", assembler->source_lines_size,
+        assembler->procedure_list_size);
+
+    free(resolved_path);
+
+    return source_map;
+}
+
+
+static size_t alignSection(size_t size)
+{
+    return (size + PROGRAM_ALIGNMENT - 1) & ~(PROGRAM_ALIGNMENT - 1);
 }
 
 
@@ -302,12 +661,36 @@ static MachineCommands convertCommandToMachineCode(const char* const command)
     RETURN_MACHINE_CODE_(CALL);
     RETURN_MACHINE_CODE_(SQRT);
     RETURN_MACHINE_CODE_(DRAW);
+    RETURN_MACHINE_CODE_(TAILCALL);
+    RETURN_MACHINE_CODE_(CALL_DEPTH);
+    RETURN_MACHINE_CODE_(TIMESTAMP);
 
 #undef  RETURN_MACHINE_CODE_
 
+    if (convertVectorCommandToMachineCode(command) != NUMBER_OF_VECTOR_COMMANDS)
+    {
+        return MachineCommands_VEC;
+    }
+
     return MachineCommands_UNKNOWN;
 }
 
+
+static uint8_t convertVectorCommandToMachineCode(const char* const command)
+{
+    assert(command != NULL);
+
+    for (uint8_t vector_command = 0; vector_command < NUMBER_OF_VECTOR_COMMANDS; vector_command++)
+    {
+        if (!strcmp(command, VECTOR_COMMANDS[vector_command].name))
+        {
+            return vector_command;
+        }
+    }
+
+    return NUMBER_OF_VECTOR_COMMANDS;
+}
+
 static Registers convertRegisterToMachineCode(const char* const register_given)
 {
     assert(register_given != NULL);
@@ -344,6 +727,8 @@ static AssemblerErrorHandler convertFileToMachineCode(Assembler* const assembler
 
         sscanf(ptr_of_string, "%s %s%[^;]", command_buffer, string_argument, after_line);
 
+        size_t instruction_start = assembler->output_file_size;
+
         // NOTE добавить обработку комментов
 
         if (command_buffer[0] == '\0')
@@ -369,10 +754,11 @@ static AssemblerErrorHandler convertFileToMachineCode(Assembler* const assembler
         else if(!strcmp(string_argument, FUNC_START_COMMAND))
         {
             saveMarkToMarkList(assembler, command_buffer, strlen(command_buffer));
+            saveProcedure(assembler, command_buffer, after_line);
         }
         else if(!strcmp(string_argument, FUNC_END_COMMAND))
         {
-            // NOTE пмргите
+            assembler->current_procedure = NO_PROCEDURE;
         }
         else if (COMPARE_RETURNED_COMMAND_(PUSH)
               || COMPARE_RETURNED_COMMAND_(POP))
@@ -388,10 +774,18 @@ static AssemblerErrorHandler convertFileToMachineCode(Assembler* const assembler
               || COMPARE_RETURNED_COMMAND_(HLT)
               || COMPARE_RETURNED_COMMAND_(RET)
               || COMPARE_RETURNED_COMMAND_(SQRT)
-              || COMPARE_RETURNED_COMMAND_(DRAW))
+              || COMPARE_RETURNED_COMMAND_(DRAW)
+              || COMPARE_RETURNED_COMMAND_(CALL_DEPTH)
+              || COMPARE_RETURNED_COMMAND_(TIMESTAMP))
         {
             assembler->output_file_size++;
         }
+        else if (COMPARE_RETURNED_COMMAND_(VEC))
+        {
+            // operands are pushed before, the command itself is the opcode and the vector command
+            assembler->output_data[assembler->output_file_size + 1] = convertVectorCommandToMachineCode(command_buffer);
+            assembler->output_file_size += 2;
+        }
         else if (COMPARE_RETURNED_COMMAND_(JMP)
               || COMPARE_RETURNED_COMMAND_(JA)
               || COMPARE_RETURNED_COMMAND_(JAE)
@@ -399,8 +793,14 @@ static AssemblerErrorHandler convertFileToMachineCode(Assembler* const assembler
               || COMPARE_RETURNED_COMMAND_(JBE)
               || COMPARE_RETURNED_COMMAND_(JE)
               || COMPARE_RETURNED_COMMAND_(JNE)
-              || COMPARE_RETURNED_COMMAND_(CALL))
+              || COMPARE_RETURNED_COMMAND_(CALL)
+              || COMPARE_RETURNED_COMMAND_(TAILCALL))
         {
+            if (COMPARE_RETURNED_COMMAND_(CALL) || COMPARE_RETURNED_COMMAND_(TAILCALL))
+            {
+                saveCallSite(assembler, string_argument, instruction_start);
+            }
+
             processJmpCommand(assembler, string_argument);
         }
         else
@@ -411,6 +811,19 @@ static AssemblerErrorHandler convertFileToMachineCode(Assembler* const assembler
             return AssemblerErrorHandler_ERROR;
         }
 
+        if (assembler->output_file_size > instruction_start)
+        {
+            noteSideEffects(assembler, returned_command, instruction_start);
+            saveSourceLine(assembler, ptr_of_string, instruction_start);
+            rememberInstruction(assembler, instruction_start);
+
+            if (assembler->options.fuse_superinstructions)
+            {
+                fuseSuperinstructions(assembler);
+                dropFusedSourceLines(assembler);
+            }
+        }
+
         reallocArrays(assembler);
     }
     while ((ptr_of_string = strtok(NULL, "\n")) != NULL);
@@ -432,10 +845,11 @@ static AssemblerErrorHandler processJmpCommand(Assembler* const assembler, char*
     sscanf(argument, "%s%n", mark, &mark_size);
 
     assembler->output_file_size++;
+    alignOutput(assembler);
 
     saveMarkToJmpList(assembler, mark, (size_t)mark_size);
 
-    assembler->output_file_size += sizeof(arguments_type);
+    assembler->output_file_size += TARGET_SIZE;
 
     return AssemblerErrorHandler_OK;
 }
@@ -467,7 +881,7 @@ static AssemblerErrorHandler parseArgument(Assembler* const assembler, char* arg
 
     if (return_number == 2)
     {
-        return_number = sscanf(first_buffer, "%lg", &number);
+        return_number = scanNumber(first_buffer, &number);
         if (return_number == 1)
         {
             sscanf(second_buffer, "%s", first_buffer);
@@ -479,7 +893,7 @@ static AssemblerErrorHandler parseArgument(Assembler* const assembler, char* arg
         }
         else
         {
-            return_number = sscanf(second_buffer, "%lg", &number);
+            return_number = scanNumber(second_buffer, &number);
             if (return_number == 0)
             {
                 return AssemblerErrorHandler_ERROR;
@@ -496,7 +910,7 @@ static AssemblerErrorHandler parseArgument(Assembler* const assembler, char* arg
     }
     else if (return_number == 1)
     {
-        return_number = sscanf(first_buffer, "%lg", &number);
+        return_number = scanNumber(first_buffer, &number);
         if (return_number == 1)
         {
             machine_code |= CONST_FLAG;
@@ -529,6 +943,8 @@ static AssemblerErrorHandler parseArgument(Assembler* const assembler, char* arg
 
     if (machine_code & CONST_FLAG)
     {
+        alignOutput(assembler);
+
         memcpy(assembler->output_data + assembler->output_file_size,
                &number,
                sizeof(arguments_type));
@@ -540,6 +956,31 @@ static AssemblerErrorHandler parseArgument(Assembler* const assembler, char* arg
 }
 
 
+// what sscanf with %lg returns, for the value type of this build: 1 if buffer starts with a number
+static int scanNumber(const char* buffer, arguments_type* number)
+{
+    assert(buffer != NULL);
+    assert(number != NULL);
+
+    char*          end   = NULL;
+    arguments_type value = parseValue(buffer, &end);
+    if (end == buffer)
+    {
+        return 0;
+    }
+
+    if (VALUE_TYPE == ValueType_I64 && (*end == '.' || *end == 'e' || *end == 'E'))
+    {
+        Log(LogLevel_INFO, "%s is not an integer, the program is assembled for %s", buffer,
+            VALUE_TYPE_NAMES[VALUE_TYPE]);
+        return 0;
+    }
+
+    *number = value;
+    return 1;
+}
+
+
 static bool checkRegisterValidity(char* buffer)
 {
     assert(buffer != NULL);
@@ -570,7 +1011,7 @@ static void saveMarkToJmpList(Assembler* const assembler, char* mark, size_t mar
         {
             memcpy(assembler->output_data + assembler->output_file_size,
                    &assembler->mark_list[current_mark].code_pointer,
-                   sizeof(arguments_type));
+                   TARGET_SIZE);
 
             flag_mark_met = true;
         }
@@ -605,6 +1046,9 @@ static void saveMarkToMarkList(Assembler* const assembler, char* mark, size_t ma
 
     assembler->mark_list_size++;
 
+    // a jump may land here, so nothing before this point can be fused with what follows
+    assembler->recent_instructions_count = 0;
+
     for (size_t current_jmp = 0; current_jmp < assembler->jmp_list_size; current_jmp++)
     {
         if (assembler->jmp_list[current_jmp].flag_seen == false)
@@ -613,7 +1057,7 @@ static void saveMarkToMarkList(Assembler* const assembler, char* mark, size_t ma
             {
                 memcpy(assembler->output_data + assembler->jmp_list[current_jmp].code_pointer,
                        &assembler->output_file_size,
-                       sizeof(arguments_type));
+                       TARGET_SIZE);
 
                 assembler->jmp_list[current_jmp].flag_seen = true;
             }
@@ -622,9 +1066,456 @@ static void saveMarkToMarkList(Assembler* const assembler, char* mark, size_t ma
 }
 
 
+static void saveProcedure(Assembler* const assembler, const char* name, const char* annotation)
+{
+    assert(assembler  != NULL);
+    assert(name       != NULL);
+    assert(annotation != NULL);
+
+    char annotation_word[SIZE_OF_BUFFER] = {};
+    sscanf(annotation, "%s", annotation_word);
+
+    assembler->procedure_list[assembler->procedure_list_size] = {
+        .name             = (char*)calloc(strlen(name) + 1, sizeof(char)),
+        .is_annotated     = !strcmp(annotation_word, PURE_ANNOTATION),
+        .has_side_effects = false,
+        .is_pure          = false,
+    };
+
+    strcpy(assembler->procedure_list[assembler->procedure_list_size].name, name);
+
+    assembler->current_procedure = assembler->procedure_list_size;
+    assembler->procedure_list_size++;
+}
+
+
+static void saveCallSite(Assembler* const assembler, const char* argument, size_t instruction_start)
+{
+    assert(assembler != NULL);
+    assert(argument  != NULL);
+
+    char target_name[SIZE_OF_BUFFER] = {};
+    sscanf(argument, "%s", target_name);
+
+    assembler->call_site_list[assembler->call_site_list_size] = {
+        .target_name  = (char*)calloc(strlen(target_name) + 1, sizeof(char)),
+        .code_pointer = instruction_start,
+        .caller       = assembler->current_procedure,
+    };
+
+    strcpy(assembler->call_site_list[assembler->call_site_list_size].target_name, target_name);
+
+    assembler->call_site_list_size++;
+}
+
+
+static void noteSideEffects(Assembler* const assembler, MachineCommands command, size_t instruction_start)
+{
+    assert(assembler != NULL);
+
+    if (assembler->current_procedure == NO_PROCEDURE)
+    {
+        return;
+    }
+
+    bool uses_ram = (command == MachineCommands_PUSH || command == MachineCommands_POP)
+                 && (assembler->output_data[instruction_start] & RAM_FLAG);
+
+    if (uses_ram
+     || command == MachineCommands_IN
+     || command == MachineCommands_OUT
+     || command == MachineCommands_DRAW
+     || command == MachineCommands_HLT
+     || command == MachineCommands_VEC
+     || command == MachineCommands_CALL_DEPTH
+     || command == MachineCommands_TIMESTAMP)
+    {
+        assembler->procedure_list[assembler->current_procedure].has_side_effects = true;
+    }
+}
+
+
+static size_t findProcedure(const Assembler* const assembler, const char* name)
+{
+    assert(assembler != NULL);
+    assert(name      != NULL);
+
+    for (size_t current_procedure = 0; current_procedure < assembler->procedure_list_size; current_procedure++)
+    {
+        if (!strcmp(name, assembler->procedure_list[current_procedure].name))
+        {
+            return current_procedure;
+        }
+    }
+
+    return NO_PROCEDURE;
+}
+
+
+// strtok skips empty lines and puts '\0' in place of the newline it stops at, so both end a line
+static void saveSourceLine(Assembler* const assembler, const char* line_start, size_t instruction_start)
+{
+    assert(assembler  != NULL);
+    assert(line_start != NULL);
+
+    if (!assembler->options.source_map)
+    {
+        return;
+    }
+
+    for (; assembler->line_counted < line_start; assembler->line_counted++)
+    {
+        if (*assembler->line_counted == '\n' || *assembler->line_counted == '\0')
+        {
+            assembler->current_line++;
+        }
+    }
+
+    assembler->source_lines[assembler->source_lines_size] = {
+        .code_pointer = instruction_start,
+        .source_line  = {
+            .line      = assembler->current_line,
+            .procedure = assembler->current_procedure == NO_PROCEDURE ? NO_SOURCE_PROCEDURE
+                                                                       : (uint32_t)assembler->current_procedure,
+        },
+    };
+
+    assembler->source_lines_size++;
+}
+
+
+// a superinstruction keeps the line of the first instruction it was made of
+static void dropFusedSourceLines(Assembler* const assembler)
+{
+    assert(assembler != NULL);
+
+    if (!assembler->options.source_map)
+    {
+        return;
+    }
+
+    size_t last_instruction = assembler->recent_instructions[assembler->recent_instructions_count - 1];
+
+    while (assembler->source_lines_size > 0
+        && assembler->source_lines[assembler->source_lines_size - 1].code_pointer > last_instruction)
+    {
+        assembler->source_lines_size--;
+    }
+}
+
+
+// A procedure is pure if its own body has no side effects and everything it calls is pure, a call to
+// a plain label is taken as impure unless the procedure is annotated. Every procedure starts out pure
+// and loses it until nothing changes, so procedures that call each other stay pure together.
+// The processor proves it again on the decoded program before it caches anything.
+static void markPureCalls(Assembler* const assembler)
+{
+    assert(assembler != NULL);
+
+    Procedure* procedures = assembler->procedure_list;
+
+    for (size_t current_procedure = 0; current_procedure < assembler->procedure_list_size; current_procedure++)
+    {
+        procedures[current_procedure].is_pure = !procedures[current_procedure].has_side_effects;
+
+        if (procedures[current_procedure].is_annotated && procedures[current_procedure].has_side_effects)
+        {
+            Log(LogLevel_INFO, "Procedure %s is annotated pure but has side effects, its results are not cached",
+                procedures[current_procedure].name);
+        }
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        for (size_t current_call = 0; current_call < assembler->call_site_list_size; current_call++)
+        {
+            const CallSite* call = assembler->call_site_list + current_call;
+            if (call->caller == NO_PROCEDURE || !procedures[call->caller].is_pure)
+            {
+                continue;
+            }
+
+            size_t callee = findProcedure(assembler, call->target_name);
+
+            bool callee_is_pure = callee != NO_PROCEDURE ? procedures[callee].is_pure
+                                                         : procedures[call->caller].is_annotated;
+            if (!callee_is_pure)
+            {
+                procedures[call->caller].is_pure = false;
+                changed = true;
+            }
+        }
+    }
+
+    // tail calls stay as they are, the pure call they are made from caches what they return
+    for (size_t current_call = 0; current_call < assembler->call_site_list_size; current_call++)
+    {
+        const CallSite* call   = assembler->call_site_list + current_call;
+        size_t          callee = findProcedure(assembler, call->target_name);
+
+        if (callee != NO_PROCEDURE
+         && procedures[callee].is_pure
+         && assembler->output_data[call->code_pointer] == MachineCommands_CALL)
+        {
+            assembler->output_data[call->code_pointer] = MachineCommands_PURE_CALL;
+            assembler->pure_calls++;
+        }
+    }
+}
+
+
 static bool checkIfMark(char* buffer)
 {
     assert(buffer != NULL);
 
     return strchr(buffer, ':') != NULL;
 }
+
+
+static void rememberInstruction(Assembler* const assembler, size_t instruction_start)
+{
+    assert(assembler != NULL);
+
+    if (assembler->recent_instructions_count == SUPERINSTRUCTION_WINDOW)
+    {
+        memmove(assembler->recent_instructions,
+                assembler->recent_instructions + 1,
+                (SUPERINSTRUCTION_WINDOW - 1) * sizeof(size_t));
+
+        assembler->recent_instructions_count--;
+    }
+
+    assembler->recent_instructions[assembler->recent_instructions_count] = instruction_start;
+    assembler->recent_instructions_count++;
+}
+
+
+// Peephole over the bytes already emitted: rewrites the tail of the output into one superinstruction.
+static void fuseSuperinstructions(Assembler* const assembler)
+{
+    assert(assembler != NULL);
+
+    size_t        count   = assembler->recent_instructions_count;
+    const size_t* recent  = assembler->recent_instructions;
+    uint8_t*      output  = assembler->output_data;
+
+    // call X; ret: X can return straight to our caller, the target stays where it is, so only the opcode changes.
+    // Outside of a procedure there is no caller: the ret after the call is whatever the program does at depth 0,
+    // which a tail call would move into X.
+    if (count >= 2
+     && assembler->current_procedure != NO_PROCEDURE
+     && output[recent[count - 1]] == MachineCommands_RET
+     && output[recent[count - 2]] == MachineCommands_CALL)
+    {
+        output[recent[count - 2]]   = MachineCommands_TAILCALL;
+        assembler->output_file_size = recent[count - 1];
+
+        assembler->recent_instructions[0]    = recent[count - 2];
+        assembler->recent_instructions_count = 1;
+
+        assembler->fusion_statistics.tailcall++;
+        return;
+    }
+
+    if (count < 3)
+    {
+        return;
+    }
+
+    uint8_t fused[SIZE_OF_BUFFER] = {};
+    size_t  fused_size            = 0;
+    size_t  fused_start           = 0;
+
+    size_t  last         = recent[count - 1];
+    uint8_t last_command = output[last];
+
+    if (count >= 4
+     && last_command == (MachineCommands_POP | REGISTER_FLAG)
+     && output[recent[count - 2]] == MachineCommands_ADD)
+    {
+        bool           first_is_register  = false;
+        bool           second_is_register = false;
+        const uint8_t* first_operand      = NULL;
+        const uint8_t* second_operand     = NULL;
+        size_t         operand_size       = 0;
+
+        if (getPlainPushOperand(assembler, recent[count - 4], &first_is_register,  &first_operand,  &operand_size)
+         && getPlainPushOperand(assembler, recent[count - 3], &second_is_register, &second_operand, &operand_size)
+         && first_is_register != second_is_register)
+        {
+            const uint8_t* register_operand = first_is_register ? first_operand  : second_operand;
+            const uint8_t* const_operand    = first_is_register ? second_operand : first_operand;
+
+            if (*register_operand == output[last + 1])
+            {
+                fused_start = recent[count - 4];
+
+                fused[fused_size++] = MachineCommands_INC;
+                fused[fused_size++] = *register_operand;
+
+                fused_size = alignOperand(assembler, fused_start + fused_size) - fused_start;
+                memcpy(fused + fused_size, const_operand, sizeof(arguments_type));
+                fused_size += sizeof(arguments_type);
+
+                assembler->fusion_statistics.inc++;
+            }
+        }
+    }
+    else if (last_command == MachineCommands_SUB)
+    {
+        fused_start = recent[count - 3];
+        fused[0]    = MachineCommands_PUSH_SUB;
+        fused_size  = writePairOperands(fused, fused_start, 1, assembler, recent[count - 3], recent[count - 2]);
+        if (fused_size > 0)
+        {
+            assembler->fusion_statistics.push_sub++;
+        }
+    }
+    else if (last_command >= MachineCommands_JA && last_command <= MachineCommands_JNE)
+    {
+        fused_start = recent[count - 3];
+        fused[0]    = MachineCommands_CMP_JMP;
+        fused[1]    = last_command;
+        fused_size  = writePairOperands(fused, fused_start, 2, assembler, recent[count - 3], recent[count - 2]);
+        if (fused_size > 0)
+        {
+            fused_size = alignOperand(assembler, fused_start + fused_size) - fused_start;
+
+            size_t old_target = alignOperand(assembler, last + 1);
+            size_t new_target = fused_start + fused_size;
+
+            memcpy(fused + fused_size, output + old_target, TARGET_SIZE);
+            fused_size += TARGET_SIZE;
+
+            // an unresolved forward jump has to be patched at the new place of its operand
+            for (size_t current_jmp = 0; current_jmp < assembler->jmp_list_size; current_jmp++)
+            {
+                if (assembler->jmp_list[current_jmp].code_pointer == old_target)
+                {
+                    assembler->jmp_list[current_jmp].code_pointer = new_target;
+                }
+            }
+
+            assembler->fusion_statistics.cmp_jmp++;
+        }
+    }
+
+    if (fused_size == 0)
+    {
+        return;
+    }
+
+    memcpy(output + fused_start, fused, fused_size);
+    assembler->output_file_size = fused_start + fused_size;
+
+    assembler->recent_instructions[0]    = fused_start;
+    assembler->recent_instructions_count = 1;
+}
+
+
+// push of a single register or a single constant, the only operands superinstructions can take
+static bool getPlainPushOperand(const Assembler* const assembler,
+                                size_t                 instruction_start,
+                                bool*                  is_register,
+                                const uint8_t**        operand,
+                                size_t*                operand_size)
+{
+    assert(assembler    != NULL);
+    assert(is_register  != NULL);
+    assert(operand      != NULL);
+    assert(operand_size != NULL);
+
+    uint8_t command = assembler->output_data[instruction_start];
+
+    if (command == (MachineCommands_PUSH | REGISTER_FLAG))
+    {
+        *is_register  = true;
+        *operand_size = 1;
+    }
+    else if (command == (MachineCommands_PUSH | CONST_FLAG))
+    {
+        *is_register  = false;
+        *operand_size = sizeof(arguments_type);
+    }
+    else
+    {
+        return false;
+    }
+
+    *operand = assembler->output_data + (*is_register ? instruction_start + 1
+                                                      : alignOperand(assembler, instruction_start + 1));
+
+    return true;
+}
+
+
+// appends the pair flags and both operands to fused, which is going to be written at fused_start,
+// returns the new size of fused or 0 if the pushes can not be fused
+static size_t writePairOperands(uint8_t*               fused,
+                                size_t                 fused_start,
+                                size_t                 fused_size,
+                                const Assembler* const assembler,
+                                size_t                 first_push,
+                                size_t                 second_push)
+{
+    assert(fused     != NULL);
+    assert(assembler != NULL);
+
+    bool           first_is_register  = false;
+    bool           second_is_register = false;
+    const uint8_t* first_operand      = NULL;
+    const uint8_t* second_operand     = NULL;
+    size_t         first_size         = 0;
+    size_t         second_size        = 0;
+
+    if (!getPlainPushOperand(assembler, first_push,  &first_is_register,  &first_operand,  &first_size)
+     || !getPlainPushOperand(assembler, second_push, &second_is_register, &second_operand, &second_size))
+    {
+        return 0;
+    }
+
+    uint8_t pair_flags = 0;
+    pair_flags |= first_is_register  ? PAIR_FIRST_REGISTER_FLAG  : 0;
+    pair_flags |= second_is_register ? PAIR_SECOND_REGISTER_FLAG : 0;
+
+    fused[fused_size++] = pair_flags;
+
+    fused_size = first_is_register ? fused_size : alignOperand(assembler, fused_start + fused_size) - fused_start;
+    memcpy(fused + fused_size, first_operand, first_size);
+    fused_size += first_size;
+
+    fused_size = second_is_register ? fused_size : alignOperand(assembler, fused_start + fused_size) - fused_start;
+    memcpy(fused + fused_size, second_operand, second_size);
+    fused_size += second_size;
+
+    return fused_size;
+}
+
+
+// offset of an immediate that would be written at offset, the gap stays zero;
+// the compact encoding is made from the unaligned layout
+static size_t alignOperand(const Assembler* const assembler, size_t offset)
+{
+    assert(assembler != NULL);
+
+    if (assembler->options.raw_output || assembler->options.compact_output)
+    {
+        return offset;
+    }
+
+    return alignSection(offset);
+}
+
+
+static void alignOutput(Assembler* const assembler)
+{
+    assert(assembler != NULL);
+
+    size_t aligned_size = alignOperand(assembler, assembler->output_file_size);
+
+    memset(assembler->output_data + assembler->output_file_size, 0, aligned_size - assembler->output_file_size);
+    assembler->output_file_size = aligned_size;
+}
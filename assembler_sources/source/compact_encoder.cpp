@@ -0,0 +1,574 @@
+#include "compact_encoder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "helpful_functions.h"
+#include "command_handler.h"
+#include "program_format.h"
+#include "value_type.h"
+#include "logger.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const uint8_t COMMAND_MASK       = 0b0001'1111;
+static const size_t  MAX_OPERANDS       = 6;      // cmp_jmp: command, condition, pair flags, pair, target
+static const size_t  MAX_CONSTANTS      = 1 << 16;
+static const size_t  SHORT_INDEX_LIMIT  = 1 << 8;
+static const size_t  START_CAPACITY     = 64;
+static const size_t  NO_INSTRUCTION     = (size_t)-1;
+
+typedef enum OperandKind
+{
+    OperandKind_BYTE     = 0,   // command, register, condition or pair flags, copied as is
+    OperandKind_CONSTANT = 1,   // value is an index into the constant pool
+    OperandKind_TARGET   = 2,   // value is an offset in the raw code until the targets are resolved
+} OperandKind;
+
+typedef struct Operand
+{
+    OperandKind kind;
+    size_t      value;
+} Operand;
+
+typedef struct EncodedInstruction
+{
+    size_t  raw_start;
+    Operand operands[MAX_OPERANDS];   // operands[0] is the command byte
+    size_t  operands_size;
+    bool    has_target;
+    size_t  target_index;             // number_of_instructions for a target right behind the code
+    bool    short_target;
+    size_t  start;                    // offset in the compact code
+} EncodedInstruction;
+
+typedef struct Encoder
+{
+    const uint8_t*      raw_code;
+    size_t              raw_size;
+
+    EncodedInstruction* instructions;
+    size_t              number_of_instructions;
+    size_t              instructions_capacity;
+
+    uint8_t*            constants;
+    size_t              number_of_constants;
+    size_t              constants_capacity;
+    size_t              constant_index_size;
+
+    size_t              code_size;
+} Encoder;
+
+static AssemblerErrorHandler parseInstructions(Encoder* const encoder);
+static AssemblerErrorHandler parseInstruction(Encoder* const encoder, size_t* ip, EncodedInstruction* instruction);
+static bool parsePair(Encoder* const encoder, size_t* ip, EncodedInstruction* instruction);
+static bool addOperand(Encoder* const           encoder,
+                       size_t*                  ip,
+                       EncodedInstruction*      instruction,
+                       OperandKind              kind);
+static bool addConstant(Encoder* const encoder, const uint8_t* constant, size_t* index);
+static AssemblerErrorHandler resolveTargets(Encoder* const encoder);
+static void layoutInstructions(Encoder* const encoder);
+static size_t getOperandSize(const Encoder* const encoder, const EncodedInstruction* instruction, OperandKind kind);
+static void writeCode(const Encoder* const encoder, uint8_t* code);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+AssemblerErrorHandler encodeCompact(const uint8_t*        raw_code,
+                                    size_t                raw_size,
+                                    CompactProgram* const compact)
+{
+    assert(raw_code != NULL);
+    assert(compact  != NULL);
+
+    Encoder encoder = {
+        .raw_code = raw_code,
+        .raw_size = raw_size,
+    };
+
+    AssemblerErrorHandler return_code = parseInstructions(&encoder);
+    if (return_code == AssemblerErrorHandler_OK)
+    {
+        return_code = resolveTargets(&encoder);
+    }
+
+    if (return_code == AssemblerErrorHandler_OK && encoder.number_of_constants > MAX_CONSTANTS)
+    {
+        Log(LogLevel_INFO, "%zu constants do not fit into the compact encoding", encoder.number_of_constants);
+        return_code = AssemblerErrorHandler_ERROR;
+    }
+
+    uint8_t* code = NULL;
+    if (return_code == AssemblerErrorHandler_OK)
+    {
+        encoder.constant_index_size = encoder.number_of_constants <= SHORT_INDEX_LIMIT ? 1 : 2;
+
+        layoutInstructions(&encoder);
+
+        // at least one byte, so an empty program still gets a buffer of its own
+        code = (uint8_t*)calloc(encoder.code_size + 1, sizeof(uint8_t));
+        return_code = code ? AssemblerErrorHandler_OK : AssemblerErrorHandler_ERROR;
+    }
+
+    if (return_code != AssemblerErrorHandler_OK)
+    {
+        FREE_NULL(encoder.instructions);
+        FREE_NULL(encoder.constants);
+        return return_code;
+    }
+
+    writeCode(&encoder, code);
+
+    *compact = {
+        .code                = code,
+        .code_size           = encoder.code_size,
+        .constants           = encoder.constants,
+        .number_of_constants = encoder.number_of_constants,
+        .constant_index_size = encoder.constant_index_size,
+    };
+
+    FREE_NULL(encoder.instructions);
+
+    return AssemblerErrorHandler_OK;
+}
+
+
+void compactProgramDtor(CompactProgram* const compact)
+{
+    assert(compact != NULL);
+
+    FREE_NULL(compact->code);
+    FREE_NULL(compact->constants);
+
+    *compact = {};
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static AssemblerErrorHandler parseInstructions(Encoder* const encoder)
+{
+    assert(encoder != NULL);
+
+    for (size_t ip = 0; ip < encoder->raw_size;)
+    {
+        if (encoder->number_of_instructions == encoder->instructions_capacity)
+        {
+            size_t new_capacity = encoder->instructions_capacity ? 2 * encoder->instructions_capacity
+                                                                 : START_CAPACITY;
+
+            EncodedInstruction* new_instructions =
+                (EncodedInstruction*)realloc(encoder->instructions, new_capacity * sizeof(EncodedInstruction));
+            if (!new_instructions)
+            {
+                return AssemblerErrorHandler_ERROR;
+            }
+
+            encoder->instructions          = new_instructions;
+            encoder->instructions_capacity = new_capacity;
+        }
+
+        EncodedInstruction* instruction = encoder->instructions + encoder->number_of_instructions;
+
+        AssemblerErrorHandler return_code = parseInstruction(encoder, &ip, instruction);
+        if (return_code != AssemblerErrorHandler_OK)
+        {
+            Log(LogLevel_INFO, "Can not re-encode instruction at offset %zu", instruction->raw_start);
+            return return_code;
+        }
+
+        encoder->number_of_instructions++;
+    }
+
+    return AssemblerErrorHandler_OK;
+}
+
+
+// the operands are the ones decodeProgram reads, in the same order
+static AssemblerErrorHandler parseInstruction(Encoder* const encoder, size_t* ip, EncodedInstruction* instruction)
+{
+    assert(encoder     != NULL);
+    assert(ip          != NULL);
+    assert(instruction != NULL);
+
+    *instruction = {
+        .raw_start = *ip,
+    };
+
+    uint8_t command_byte = encoder->raw_code[*ip];
+    bool    parsed       = addOperand(encoder, ip, instruction, OperandKind_BYTE);
+
+    switch (command_byte & COMMAND_MASK)
+    {
+        case MachineCommands_PUSH:
+        case MachineCommands_POP:
+            if (command_byte & REGISTER_FLAG)
+            {
+                parsed = parsed && addOperand(encoder, ip, instruction, OperandKind_BYTE);
+            }
+
+            if (command_byte & CONST_FLAG)
+            {
+                parsed = parsed && addOperand(encoder, ip, instruction, OperandKind_CONSTANT);
+            }
+            break;
+
+        case MachineCommands_JMP:
+        case MachineCommands_JA:
+        case MachineCommands_JAE:
+        case MachineCommands_JB:
+        case MachineCommands_JBE:
+        case MachineCommands_JE:
+        case MachineCommands_JNE:
+        case MachineCommands_CALL:
+        case MachineCommands_TAILCALL:
+        case MachineCommands_PURE_CALL:
+            parsed = parsed && addOperand(encoder, ip, instruction, OperandKind_TARGET);
+            break;
+
+        case MachineCommands_PUSH_SUB:
+            parsed = parsed && parsePair(encoder, ip, instruction);
+            break;
+
+        case MachineCommands_INC:
+            parsed = parsed && addOperand(encoder, ip, instruction, OperandKind_BYTE)
+                            && addOperand(encoder, ip, instruction, OperandKind_CONSTANT);
+            break;
+
+        case MachineCommands_CMP_JMP:
+            parsed = parsed && addOperand(encoder, ip, instruction, OperandKind_BYTE)
+                            && parsePair(encoder, ip, instruction)
+                            && addOperand(encoder, ip, instruction, OperandKind_TARGET);
+            break;
+
+        case MachineCommands_VEC:
+            parsed = parsed && addOperand(encoder, ip, instruction, OperandKind_BYTE);
+            break;
+
+        case MachineCommands_HLT:
+        case MachineCommands_ADD:
+        case MachineCommands_MUL:
+        case MachineCommands_SUB:
+        case MachineCommands_DIV:
+        case MachineCommands_SQRT:
+        case MachineCommands_OUT:
+        case MachineCommands_IN:
+        case MachineCommands_RET:
+        case MachineCommands_DRAW:
+        case MachineCommands_CALL_DEPTH:
+        case MachineCommands_TIMESTAMP:
+            break;
+
+        case MachineCommands_UNKNOWN:
+        default:
+            parsed = false;
+            break;
+    }
+
+    return parsed ? AssemblerErrorHandler_OK : AssemblerErrorHandler_ERROR;
+}
+
+
+// pair flags and the two operands they describe
+static bool parsePair(Encoder* const encoder, size_t* ip, EncodedInstruction* instruction)
+{
+    assert(encoder     != NULL);
+    assert(ip          != NULL);
+    assert(instruction != NULL);
+
+    if (*ip >= encoder->raw_size)
+    {
+        return false;
+    }
+
+    uint8_t pair_flags = encoder->raw_code[*ip];
+
+    return addOperand(encoder, ip, instruction, OperandKind_BYTE)
+        && addOperand(encoder, ip, instruction, (pair_flags & PAIR_FIRST_REGISTER_FLAG)  ? OperandKind_BYTE
+                                                                                         : OperandKind_CONSTANT)
+        && addOperand(encoder, ip, instruction, (pair_flags & PAIR_SECOND_REGISTER_FLAG) ? OperandKind_BYTE
+                                                                                         : OperandKind_CONSTANT);
+}
+
+
+static bool addOperand(Encoder* const           encoder,
+                       size_t*                  ip,
+                       EncodedInstruction*      instruction,
+                       OperandKind              kind)
+{
+    assert(encoder     != NULL);
+    assert(ip          != NULL);
+    assert(instruction != NULL);
+    assert(instruction->operands_size < MAX_OPERANDS);
+
+    size_t raw_size = kind == OperandKind_BYTE     ? 1
+                    : kind == OperandKind_CONSTANT ? sizeof(arguments_type)
+                                                   : TARGET_SIZE;
+    if (*ip + raw_size > encoder->raw_size)
+    {
+        return false;
+    }
+
+    const uint8_t* raw   = encoder->raw_code + *ip;
+    size_t         value = 0;
+
+    switch (kind)
+    {
+        case OperandKind_BYTE:
+            value = *raw;
+            break;
+
+        case OperandKind_CONSTANT:
+            if (!addConstant(encoder, raw, &value))
+            {
+                return false;
+            }
+            break;
+
+        case OperandKind_TARGET:
+            memcpy(&value, raw, TARGET_SIZE);
+            instruction->has_target = true;
+            break;
+
+        default:
+            return false;
+    }
+
+    instruction->operands[instruction->operands_size++] = {
+        .kind  = kind,
+        .value = value,
+    };
+
+    *ip += raw_size;
+
+    return true;
+}
+
+
+// the same constant written in several places gets one pool entry
+static bool addConstant(Encoder* const encoder, const uint8_t* constant, size_t* index)
+{
+    assert(encoder  != NULL);
+    assert(constant != NULL);
+    assert(index    != NULL);
+
+    for (size_t current = 0; current < encoder->number_of_constants; current++)
+    {
+        if (!memcmp(encoder->constants + current * sizeof(arguments_type), constant, sizeof(arguments_type)))
+        {
+            *index = current;
+            return true;
+        }
+    }
+
+    if (encoder->number_of_constants == encoder->constants_capacity)
+    {
+        size_t   new_capacity  = encoder->constants_capacity ? 2 * encoder->constants_capacity : START_CAPACITY;
+        uint8_t* new_constants = (uint8_t*)realloc(encoder->constants, new_capacity * sizeof(arguments_type));
+        if (!new_constants)
+        {
+            return false;
+        }
+
+        encoder->constants          = new_constants;
+        encoder->constants_capacity = new_capacity;
+    }
+
+    memcpy(encoder->constants + encoder->number_of_constants * sizeof(arguments_type),
+           constant,
+           sizeof(arguments_type));
+
+    *index = encoder->number_of_constants++;
+
+    return true;
+}
+
+
+static AssemblerErrorHandler resolveTargets(Encoder* const encoder)
+{
+    assert(encoder != NULL);
+
+    size_t* offset_to_index = (size_t*)calloc(encoder->raw_size + 1, sizeof(size_t));
+    if (!offset_to_index)
+    {
+        return AssemblerErrorHandler_ERROR;
+    }
+
+    for (size_t offset = 0; offset <= encoder->raw_size; offset++)
+    {
+        offset_to_index[offset] = NO_INSTRUCTION;
+    }
+
+    for (size_t index = 0; index < encoder->number_of_instructions; index++)
+    {
+        offset_to_index[encoder->instructions[index].raw_start] = index;
+    }
+    offset_to_index[encoder->raw_size] = encoder->number_of_instructions;
+
+    for (size_t index = 0; index < encoder->number_of_instructions; index++)
+    {
+        EncodedInstruction* instruction = encoder->instructions + index;
+        if (!instruction->has_target)
+        {
+            continue;
+        }
+
+        size_t target = instruction->operands[instruction->operands_size - 1].value;
+        if (target > encoder->raw_size || offset_to_index[target] == NO_INSTRUCTION)
+        {
+            Log(LogLevel_INFO, "Jump at offset %zu does not lead to an instruction", instruction->raw_start);
+            FREE_NULL(offset_to_index);
+            return AssemblerErrorHandler_ERROR;
+        }
+
+        instruction->target_index = offset_to_index[target];
+        instruction->short_target = true;
+    }
+
+    FREE_NULL(offset_to_index);
+
+    return AssemblerErrorHandler_OK;
+}
+
+
+// Every target starts short and is made long once its offset does not fit. Instructions only
+// ever grow, so this stops after at most one pass per jump.
+static void layoutInstructions(Encoder* const encoder)
+{
+    assert(encoder != NULL);
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        size_t offset = 0;
+        for (size_t index = 0; index < encoder->number_of_instructions; index++)
+        {
+            EncodedInstruction* instruction = encoder->instructions + index;
+
+            instruction->start = offset;
+            for (size_t operand = 0; operand < instruction->operands_size; operand++)
+            {
+                offset += getOperandSize(encoder, instruction, instruction->operands[operand].kind);
+            }
+        }
+        encoder->code_size = offset;
+
+        for (size_t index = 0; index < encoder->number_of_instructions; index++)
+        {
+            EncodedInstruction* instruction = encoder->instructions + index;
+            if (!instruction->has_target || !instruction->short_target)
+            {
+                continue;
+            }
+
+            size_t end    = index + 1 < encoder->number_of_instructions ? instruction[1].start : encoder->code_size;
+            size_t target = instruction->target_index < encoder->number_of_instructions
+                          ? encoder->instructions[instruction->target_index].start
+                          : encoder->code_size;
+
+            int64_t relative = (int64_t)target - (int64_t)end;
+            if (relative < INT16_MIN || relative > INT16_MAX)
+            {
+                instruction->short_target = false;
+                changed                   = true;
+            }
+        }
+    }
+}
+
+
+static size_t getOperandSize(const Encoder* const encoder, const EncodedInstruction* instruction, OperandKind kind)
+{
+    assert(encoder     != NULL);
+    assert(instruction != NULL);
+
+    switch (kind)
+    {
+        case OperandKind_BYTE:
+            return 1;
+
+        case OperandKind_CONSTANT:
+            return encoder->constant_index_size;
+
+        case OperandKind_TARGET:
+            return instruction->short_target ? sizeof(int16_t) : sizeof(int32_t);
+
+        default:
+            assert(0 && "Unknown operand kind");
+            return 0;
+    }
+}
+
+
+static void writeCode(const Encoder* const encoder, uint8_t* code)
+{
+    assert(encoder != NULL);
+    assert(code    != NULL);
+
+    for (size_t index = 0; index < encoder->number_of_instructions; index++)
+    {
+        const EncodedInstruction* instruction = encoder->instructions + index;
+
+        uint8_t* output = code + instruction->start;
+        size_t   end    = index + 1 < encoder->number_of_instructions ? instruction[1].start : encoder->code_size;
+
+        for (size_t operand = 0; operand < instruction->operands_size; operand++)
+        {
+            size_t value = instruction->operands[operand].value;
+
+            switch (instruction->operands[operand].kind)
+            {
+                case OperandKind_BYTE:
+                    *output++ = (uint8_t)value;
+                    break;
+
+                case OperandKind_CONSTANT:
+                    for (size_t byte = 0; byte < encoder->constant_index_size; byte++)
+                    {
+                        *output++ = (uint8_t)(value >> (8 * byte));
+                    }
+                    break;
+
+                case OperandKind_TARGET:
+                {
+                    size_t target = instruction->target_index < encoder->number_of_instructions
+                                  ? encoder->instructions[instruction->target_index].start
+                                  : encoder->code_size;
+
+                    int64_t relative = (int64_t)target - (int64_t)end;
+                    if (instruction->short_target)
+                    {
+                        int16_t short_relative = (int16_t)relative;
+                        memcpy(output, &short_relative, sizeof(short_relative));
+                        output += sizeof(short_relative);
+                    }
+                    else
+                    {
+                        int32_t long_relative = (int32_t)relative;
+                        memcpy(output, &long_relative, sizeof(long_relative));
+                        output += sizeof(long_relative);
+                    }
+                    break;
+                }
+
+                default:
+                    assert(0 && "Unknown operand kind");
+                    break;
+            }
+        }
+
+        if (instruction->short_target)
+        {
+            code[instruction->start] |= SHORT_TARGET_FLAG;
+        }
+    }
+}
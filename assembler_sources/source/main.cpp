@@ -1,20 +1,62 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "assembler.h"
 #include "logger.h"
 
+
+static const char* NO_FUSE_OPTION = "--no-fuse";
+static const char* RAW_OPTION     = "--raw";
+static const char* COMPACT_OPTION = "--compact";
+static const char* MAP_OPTION     = "--source-map";
+
+
 int main(const int argc, const char** argv)
 {
     openLogFile("log.txt");
 
-    if (argc <= 1)
+    AssemblerOptions options = {
+        .fuse_superinstructions = true,
+        .raw_output             = false,
+        .compact_output         = false,
+        .source_map             = false,
+    };
+
+    const char* files[2]        = {};
+    int         number_of_files = 0;
+
+    for (int current_arg = 1; current_arg < argc; current_arg++)
+    {
+        if (!strcmp(argv[current_arg], NO_FUSE_OPTION))
+        {
+            options.fuse_superinstructions = false;
+        }
+        else if (!strcmp(argv[current_arg], RAW_OPTION))
+        {
+            options.raw_output = true;
+        }
+        else if (!strcmp(argv[current_arg], COMPACT_OPTION))
+        {
+            options.compact_output = true;
+        }
+        else if (!strcmp(argv[current_arg], MAP_OPTION))
+        {
+            options.source_map = true;
+        }
+        else if (number_of_files < 2)
+        {
+            files[number_of_files++] = argv[current_arg];
+        }
+    }
+
+    if (number_of_files == 0)
     {
         printf("No arguments given\n");
     }
 
-    if (argc == 3)
+    if (number_of_files == 2)
     {
-        assembleFile(argv[1], argv[2]);
+        assembleFile(files[0], files[1], &options);
     }
 
     return 0;
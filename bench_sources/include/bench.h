@@ -0,0 +1,38 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+
+#include "processor.h"
+
+static const size_t DEFAULT_BENCH_RUNS      = 15;
+static const size_t DEFAULT_BENCH_WARMUP    = 3;
+static const double DEFAULT_BENCH_THRESHOLD = 10;    // percent the median may grow over the baseline
+
+typedef enum BenchErrorHandler
+{
+    BenchErrorHandler_OK              = 0,
+    BenchErrorHandler_ERROR           = 1,
+    BenchErrorHandler_OPEN_FILE_ERROR = 2,
+    BenchErrorHandler_REGRESSION      = 3,
+    BenchErrorHandler_NO_BASELINE     = 4,
+} BenchErrorHandler;
+
+typedef struct BenchOptions
+{
+    const char* programs_directory;    // NAME.bin of every benchmark, assembled from bench_sources/programs
+    const char* report_path;
+    const char* baseline_path;         // report of an earlier run, NULL compares nothing, a missing file fails
+    double      threshold;
+    size_t      runs;
+    size_t      warmup;                // runs of every context before the measured ones
+    bool        engines[NUMBER_OF_ENGINES];
+} BenchOptions;
+
+// Every benchmark is loaded once and run on every chosen engine from one context per engine, without the
+// cache of pure procedure results so that every run does the same work. A counting run on the switch engine
+// gives the guest instructions the times are divided by. The report is written as JSON with one benchmark
+// per line; a median more than threshold percent above the one of the baseline is a regression.
+BenchErrorHandler runBenchmarks(const BenchOptions* const options);
+
+#endif // BENCH_H
@@ -0,0 +1,49 @@
+push 2
+pop ax
+push 3
+pop bx
+
+push 0
+pop cx
+
+LOOP:
+    push ax
+    push bx
+    add
+    push bx
+    mul
+    push bx
+    div
+    sqrt
+    pop dx
+
+    push ax
+    push bx
+    sub
+    pop ex
+
+    push ax
+    push bx
+    add
+    push bx
+    mul
+    push bx
+    div
+    sqrt
+    pop dx
+
+    push ax
+    push bx
+    sub
+    pop ex
+
+    push 1
+    push cx
+    add
+    pop cx
+
+    push 100000
+    push cx
+    jb LOOP
+
+hlt
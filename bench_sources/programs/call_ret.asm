@@ -0,0 +1,26 @@
+push 0
+pop cx
+
+LOOP:
+    call EMPTY
+    call EMPTY
+    call EMPTY
+    call EMPTY
+    call EMPTY
+    call EMPTY
+    call EMPTY
+    call EMPTY
+
+    push 1
+    push cx
+    add
+    pop cx
+
+    push 100000
+    push cx
+    jb LOOP
+
+hlt
+
+EMPTY:
+    ret
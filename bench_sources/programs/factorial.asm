@@ -0,0 +1,41 @@
+push 0
+pop cx
+
+LOOP:
+    push 400
+    pop ax
+    call FACTORIAL
+    pop ex
+
+    push 1
+    push cx
+    add
+    pop cx
+
+    push 500
+    push cx
+    jb LOOP
+
+hlt
+
+FACTORIAL proc
+    push 0
+    push ax
+
+    jne ML
+        push 1
+        ret
+    ML:
+    push ax
+
+    push 1
+    push ax
+    sub
+    pop ax
+
+    call FACTORIAL
+
+    mul
+
+    ret
+FACTORIAL endp
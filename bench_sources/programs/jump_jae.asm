@@ -0,0 +1,59 @@
+push 2
+pop ax
+push 3
+pop bx
+
+push 0
+pop cx
+
+LOOP:
+    push ax
+    push bx
+    jae FIRST_1
+    FIRST_1:
+
+    push bx
+    push ax
+    jae SECOND_1
+    SECOND_1:
+
+    push ax
+    push bx
+    jae FIRST_2
+    FIRST_2:
+
+    push bx
+    push ax
+    jae SECOND_2
+    SECOND_2:
+
+    push ax
+    push bx
+    jae FIRST_3
+    FIRST_3:
+
+    push bx
+    push ax
+    jae SECOND_3
+    SECOND_3:
+
+    push ax
+    push bx
+    jae FIRST_4
+    FIRST_4:
+
+    push bx
+    push ax
+    jae SECOND_4
+    SECOND_4:
+
+    push 1
+    push cx
+    add
+    pop cx
+
+    push 100000
+    push cx
+    jb LOOP
+
+hlt
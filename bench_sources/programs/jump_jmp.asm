@@ -0,0 +1,38 @@
+push 0
+pop cx
+
+LOOP:
+    jmp JUMP_1
+    JUMP_1:
+
+    jmp JUMP_2
+    JUMP_2:
+
+    jmp JUMP_3
+    JUMP_3:
+
+    jmp JUMP_4
+    JUMP_4:
+
+    jmp JUMP_5
+    JUMP_5:
+
+    jmp JUMP_6
+    JUMP_6:
+
+    jmp JUMP_7
+    JUMP_7:
+
+    jmp JUMP_8
+    JUMP_8:
+
+    push 1
+    push cx
+    add
+    pop cx
+
+    push 100000
+    push cx
+    jb LOOP
+
+hlt
@@ -0,0 +1,32 @@
+push 0
+pop cx
+
+LOOP:
+    push 1
+    push 2
+    push 3
+    push 4
+    pop ax
+    pop bx
+    pop dx
+    pop ex
+
+    push 1
+    push 2
+    push 3
+    push 4
+    pop ax
+    pop bx
+    pop dx
+    pop ex
+
+    push 1
+    push cx
+    add
+    pop cx
+
+    push 100000
+    push cx
+    jb LOOP
+
+hlt
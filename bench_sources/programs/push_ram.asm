@@ -0,0 +1,33 @@
+push 10
+pop ax
+push 20
+pop bx
+
+push 0
+pop cx
+
+LOOP:
+    push [5]
+    push [ax]
+    push [ax+8]
+    pop [6]
+    pop [bx]
+    pop [bx+8]
+
+    push [5]
+    push [ax]
+    push [ax+8]
+    pop [6]
+    pop [bx]
+    pop [bx+8]
+
+    push 1
+    push cx
+    add
+    pop cx
+
+    push 100000
+    push cx
+    jb LOOP
+
+hlt
@@ -0,0 +1,37 @@
+push 2
+pop ax
+push 3
+pop bx
+
+push 0
+pop cx
+
+LOOP:
+    push ax
+    push bx
+    push ax+1
+    push bx+2
+    pop dx
+    pop ex
+    pop dx
+    pop ex
+
+    push ax
+    push bx
+    push ax+1
+    push bx+2
+    pop dx
+    pop ex
+    pop dx
+    pop ex
+
+    push 1
+    push cx
+    add
+    pop cx
+
+    push 100000
+    push cx
+    jb LOOP
+
+hlt
@@ -0,0 +1,578 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "helpful_functions.h"
+#include "value_type.h"
+#include "spu.h"
+#include "monotonic_clock.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const size_t   MAX_BENCH_PATH      = 512;
+static const size_t   MAX_BASELINE_KEY    = 128;
+static const double   PERCENT             = 100;
+static const double   P99_FRACTION        = 0.99;
+static const size_t   QUADRATIC_EQUATIONS = 50000;
+static const uint64_t INPUT_SEED          = 2024;
+static const char*    MEDIAN_KEY          = "\"median_ns_per_instruction\": ";
+
+typedef enum BenchInput
+{
+    BenchInput_NONE      = 0,
+    BenchInput_QUADRATIC = 1,    // count of equations and their coefficients for quadratic.asm
+} BenchInput;
+
+typedef struct BenchProgram
+{
+    const char* name;            // of NAME.asm in bench_sources/programs and NAME.bin in the programs directory
+    BenchInput  input;
+} BenchProgram;
+
+// every command family first, assembled without fusion, then the fused families and whole programs
+static const BenchProgram BENCH_PROGRAMS[] = {
+    {"arith",         BenchInput_NONE},
+    {"push_const",    BenchInput_NONE},
+    {"push_register", BenchInput_NONE},
+    {"push_ram",      BenchInput_NONE},
+    {"jump_jmp",      BenchInput_NONE},
+    {"jump_ja",       BenchInput_NONE},
+    {"jump_jae",      BenchInput_NONE},
+    {"jump_jb",       BenchInput_NONE},
+    {"jump_jbe",      BenchInput_NONE},
+    {"jump_je",       BenchInput_NONE},
+    {"jump_jne",      BenchInput_NONE},
+    {"call_ret",      BenchInput_NONE},
+    {"arith_fused",   BenchInput_NONE},
+    {"jump_je_fused", BenchInput_NONE},
+    {"circle",        BenchInput_NONE},
+    {"factorial",     BenchInput_NONE},
+    {"quadratic",     BenchInput_QUADRATIC},
+};
+
+static const size_t NUMBER_OF_BENCH_PROGRAMS = sizeof(BENCH_PROGRAMS) / sizeof(BENCH_PROGRAMS[0]);
+
+// what in reads, the same values from the start of every run
+typedef struct BenchStream
+{
+    arguments_type* values;
+    size_t          size;
+    size_t          position;
+} BenchStream;
+
+typedef struct BenchResult
+{
+    const char*     name;
+    ProcessorEngine engine;
+    uint64_t        guest_instructions;
+    double          median;          // ns of one run
+    double          p99;
+} BenchResult;
+
+static BenchErrorHandler benchProgram(const BenchOptions* const  options,
+                                      const BenchProgram* const  bench_program,
+                                      BenchResult* const         results,
+                                      size_t* const              results_size);
+static BenchErrorHandler countGuestInstructions(const LoadedProgram* const program,
+                                                BenchStream* const         stream,
+                                                uint64_t* const            guest_instructions);
+static BenchErrorHandler measureEngine(const LoadedProgram* const program,
+                                       const BenchOptions* const  options,
+                                       BenchStream* const         stream,
+                                       BenchResult* const         result);
+static ProcessorOptions getProcessorOptions(ProcessorEngine engine, BenchStream* const stream);
+static BenchErrorHandler makeInput(BenchInput input, BenchStream* const stream);
+static arguments_type readBenchValue(void* io_context);
+static void dropBenchValue(void* io_context, arguments_type value);
+
+static int compareSamples(const void* first, const void* second);
+static double getMedian(const double* sorted_samples, size_t size);
+static double getPercentile(const double* sorted_samples, size_t size, double fraction);
+
+static BenchErrorHandler writeReport(const BenchOptions* const options, const BenchResult* results, size_t size);
+static BenchErrorHandler compareWithBaseline(const BenchOptions* const options,
+                                             const BenchResult*        results,
+                                             size_t                    size);
+static bool findBaselineMedian(const char* baseline, const BenchResult* const result, double* const median);
+static char* readTextFile(const char* path);
+static double getNanosecondsPerInstruction(double nanoseconds, uint64_t guest_instructions);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+BenchErrorHandler runBenchmarks(const BenchOptions* const options)
+{
+    assert(options                     != NULL);
+    assert(options->programs_directory != NULL);
+    assert(options->report_path        != NULL);
+    assert(options->runs                > 0);
+
+    BenchResult* results = (BenchResult*)calloc(NUMBER_OF_BENCH_PROGRAMS * NUMBER_OF_ENGINES, sizeof(BenchResult));
+    if (!results)
+    {
+        return BenchErrorHandler_ERROR;
+    }
+
+    size_t results_size = 0;
+
+    printf("%-14s %-9s %12s %18s %15s\n", "benchmark", "engine", "instructions", "median ns/instr", "p99 ns/instr");
+
+    BenchErrorHandler return_code = BenchErrorHandler_OK;
+    for (size_t index = 0; index < NUMBER_OF_BENCH_PROGRAMS && return_code == BenchErrorHandler_OK; index++)
+    {
+        return_code = benchProgram(options, BENCH_PROGRAMS + index, results, &results_size);
+    }
+
+    if (return_code == BenchErrorHandler_OK)
+    {
+        return_code = writeReport(options, results, results_size);
+    }
+
+    if (return_code == BenchErrorHandler_OK)
+    {
+        return_code = compareWithBaseline(options, results, results_size);
+    }
+
+    FREE_NULL(results);
+
+    return return_code;
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static BenchErrorHandler benchProgram(const BenchOptions* const  options,
+                                      const BenchProgram* const  bench_program,
+                                      BenchResult* const         results,
+                                      size_t* const              results_size)
+{
+    assert(options       != NULL);
+    assert(bench_program != NULL);
+    assert(results       != NULL);
+    assert(results_size  != NULL);
+
+    char path[MAX_BENCH_PATH] = {};
+    snprintf(path, sizeof(path), "%s/%s.bin", options->programs_directory, bench_program->name);
+
+    LoadedProgram* program = NULL;
+
+    ProcessorErrorHandler load_code = loadProgram(path, &program);
+    if (load_code != ProcessorErrorHandler_OK)
+    {
+        printf("Failed to load %s (error %d)\n", path, load_code);
+        return BenchErrorHandler_OPEN_FILE_ERROR;
+    }
+
+    BenchStream stream = {};
+
+    BenchErrorHandler return_code = makeInput(bench_program->input, &stream);
+
+    uint64_t guest_instructions = 0;
+    if (return_code == BenchErrorHandler_OK)
+    {
+        return_code = countGuestInstructions(program, &stream, &guest_instructions);
+    }
+
+    for (size_t engine = 0; engine < NUMBER_OF_ENGINES && return_code == BenchErrorHandler_OK; engine++)
+    {
+        if (!options->engines[engine])
+        {
+            continue;
+        }
+
+        BenchResult* result = results + *results_size;
+        *result = {
+            .name               = bench_program->name,
+            .engine             = (ProcessorEngine)engine,
+            .guest_instructions = guest_instructions,
+            .median             = 0,
+            .p99                = 0,
+        };
+
+        return_code = measureEngine(program, options, &stream, result);
+        if (return_code == BenchErrorHandler_OK)
+        {
+            (*results_size)++;
+
+            printf("%-14s %-9s %12llu %18.3f %15.3f\n", result->name, ENGINE_NAMES[engine],
+                   (unsigned long long)guest_instructions,
+                   getNanosecondsPerInstruction(result->median, guest_instructions),
+                   getNanosecondsPerInstruction(result->p99,    guest_instructions));
+        }
+    }
+
+    FREE_NULL(stream.values);
+    unloadProgram(program);
+
+    return return_code;
+}
+
+
+// Decoded instructions the switch engine dispatches in one run. Every engine runs the same decoded
+// program, so the count is what all of them are divided by, register and native code included.
+static BenchErrorHandler countGuestInstructions(const LoadedProgram* const program,
+                                                BenchStream* const         stream,
+                                                uint64_t* const            guest_instructions)
+{
+    assert(program            != NULL);
+    assert(stream             != NULL);
+    assert(guest_instructions != NULL);
+
+    ProcessorOptions processor_options = getProcessorOptions(ProcessorEngine_SWITCH, stream);
+    processor_options.perf_counters    = true;
+
+    SpuContext* context = NULL;
+
+    ProcessorErrorHandler processor_code = spuContextCtor(program, &processor_options, &context);
+    if (processor_code == ProcessorErrorHandler_OK)
+    {
+        stream->position = 0;
+        processor_code   = runSpuContext(context);
+    }
+
+    PerfStatistics statistics = {};
+    if (processor_code == ProcessorErrorHandler_OK)
+    {
+        getSpuContextPerfStatistics(context, &statistics);
+    }
+
+    spuContextDtor(context);
+
+    if (processor_code != ProcessorErrorHandler_OK || !statistics.guest_counted
+     || statistics.guest_instructions == 0)
+    {
+        return BenchErrorHandler_ERROR;
+    }
+
+    *guest_instructions = statistics.guest_instructions;
+
+    return BenchErrorHandler_OK;
+}
+
+
+// warmup runs fill the caches and the branch predictor, the measured ones are sorted for the percentiles
+static BenchErrorHandler measureEngine(const LoadedProgram* const program,
+                                       const BenchOptions* const  options,
+                                       BenchStream* const         stream,
+                                       BenchResult* const         result)
+{
+    assert(program != NULL);
+    assert(options != NULL);
+    assert(stream  != NULL);
+    assert(result  != NULL);
+
+    double* samples = (double*)calloc(options->runs, sizeof(double));
+    if (!samples)
+    {
+        return BenchErrorHandler_ERROR;
+    }
+
+    ProcessorOptions processor_options = getProcessorOptions(result->engine, stream);
+
+    SpuContext* context = NULL;
+
+    ProcessorErrorHandler processor_code = spuContextCtor(program, &processor_options, &context);
+
+    for (size_t run = 0; run < options->warmup + options->runs && processor_code == ProcessorErrorHandler_OK; run++)
+    {
+        stream->position = 0;
+
+        uint64_t start = getNanoseconds();
+        processor_code = runSpuContext(context);
+        uint64_t end   = getNanoseconds();
+
+        if (run >= options->warmup)
+        {
+            samples[run - options->warmup] = (double)(end - start);
+        }
+    }
+
+    spuContextDtor(context);
+
+    if (processor_code == ProcessorErrorHandler_OK)
+    {
+        qsort(samples, options->runs, sizeof(double), compareSamples);
+
+        result->median = getMedian(samples, options->runs);
+        result->p99    = getPercentile(samples, options->runs, P99_FRACTION);
+    }
+
+    FREE_NULL(samples);
+
+    return processor_code == ProcessorErrorHandler_OK ? BenchErrorHandler_OK : BenchErrorHandler_ERROR;
+}
+
+
+// no memo cache and nothing printed: every run does the same work and spends no time on the terminal
+static ProcessorOptions getProcessorOptions(ProcessorEngine engine, BenchStream* const stream)
+{
+    assert(stream != NULL);
+
+    ProcessorOptions processor_options = {
+        .engine          = engine,
+        .force_checks    = false,
+        .memo_cache_size = 0,
+        .profile         = false,
+        .perf_counters   = false,
+        .snapshot        = {},
+        .streams         = {
+            .input         = NULL,
+            .output        = NULL,
+            .read_value    = readBenchValue,
+            .write_value   = dropBenchValue,
+            .input_ready   = NULL,
+            .io_context    = stream,
+            .mode          = SpuIoMode_BUFFERED,
+            .output_format = SpuOutputFormat_TEXT,
+        },
+    };
+
+    return processor_options;
+}
+
+
+// coefficients from a fixed linear congruential sequence, a few of them give linear equations
+static BenchErrorHandler makeInput(BenchInput input, BenchStream* const stream)
+{
+    assert(stream != NULL);
+
+    *stream = {};
+
+    if (input != BenchInput_QUADRATIC)
+    {
+        return BenchErrorHandler_OK;
+    }
+
+    stream->size   = 1 + 3 * QUADRATIC_EQUATIONS;
+    stream->values = (arguments_type*)calloc(stream->size, sizeof(arguments_type));
+    if (!stream->values)
+    {
+        return BenchErrorHandler_ERROR;
+    }
+
+    stream->values[0] = (arguments_type)QUADRATIC_EQUATIONS;
+
+    uint64_t state = INPUT_SEED;
+    for (size_t index = 1; index < stream->size; index++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+
+        stream->values[index] = (arguments_type)((int64_t)(state >> 33) % 21 - 10);
+    }
+
+    return BenchErrorHandler_OK;
+}
+
+
+static arguments_type readBenchValue(void* io_context)
+{
+    assert(io_context != NULL);
+
+    BenchStream* stream = (BenchStream*)io_context;
+
+    return stream->position < stream->size ? stream->values[stream->position++] : 0;
+}
+
+
+static void dropBenchValue(void* io_context, arguments_type value)
+{
+    (void)io_context;
+    (void)value;
+}
+
+
+static int compareSamples(const void* first, const void* second)
+{
+    assert(first  != NULL);
+    assert(second != NULL);
+
+    double first_sample  = *(const double*)first;
+    double second_sample = *(const double*)second;
+
+    return (first_sample > second_sample) - (first_sample < second_sample);
+}
+
+
+// of an even number of samples it is the mean of the middle two
+static double getMedian(const double* sorted_samples, size_t size)
+{
+    assert(sorted_samples != NULL);
+    assert(size            > 0);
+
+    return (sorted_samples[(size - 1) / 2] + sorted_samples[size / 2]) / 2;
+}
+
+
+// nearest rank
+static double getPercentile(const double* sorted_samples, size_t size, double fraction)
+{
+    assert(sorted_samples != NULL);
+    assert(size            > 0);
+
+    size_t rank = (size_t)ceil(fraction * (double)size);
+
+    return sorted_samples[rank > 0 ? rank - 1 : 0];
+}
+
+
+static BenchErrorHandler writeReport(const BenchOptions* const options, const BenchResult* results, size_t size)
+{
+    assert(options != NULL);
+    assert(results != NULL);
+
+    FILE* report = fopen(options->report_path, "w");
+    if (!report)
+    {
+        printf("Failed to open %s\n", options->report_path);
+        return BenchErrorHandler_OPEN_FILE_ERROR;
+    }
+
+    fprintf(report, "{\n");
+    fprintf(report, "  \"value_type\": \"%s\",\n", VALUE_TYPE_NAMES[VALUE_TYPE]);
+    fprintf(report, "  \"runs\": %zu,\n", options->runs);
+    fprintf(report, "  \"warmup\": %zu,\n", options->warmup);
+    fprintf(report, "  \"benchmarks\": [\n");
+
+    for (size_t index = 0; index < size; index++)
+    {
+        const BenchResult* result = results + index;
+
+        fprintf(report, "    {\"name\": \"%s\", \"engine\": \"%s\", \"guest_instructions\": %llu, "
+                        "\"median_ns\": %.0f, \"p99_ns\": %.0f, %s%.4f, \"p99_ns_per_instruction\": %.4f}%s\n",
+                result->name, ENGINE_NAMES[result->engine], (unsigned long long)result->guest_instructions,
+                result->median, result->p99, MEDIAN_KEY,
+                getNanosecondsPerInstruction(result->median, result->guest_instructions),
+                getNanosecondsPerInstruction(result->p99,    result->guest_instructions),
+                index + 1 < size ? "," : "");
+    }
+
+    fprintf(report, "  ]\n");
+    fprintf(report, "}\n");
+
+    FCLOSE_NULL(report);
+
+    printf("Report written to %s\n", options->report_path);
+
+    return BenchErrorHandler_OK;
+}
+
+
+// benchmarks the baseline does not have are new and pass
+static BenchErrorHandler compareWithBaseline(const BenchOptions* const options,
+                                             const BenchResult*        results,
+                                             size_t                    size)
+{
+    assert(options != NULL);
+    assert(results != NULL);
+
+    if (!options->baseline_path)
+    {
+        printf("No baseline given, nothing compared\n");
+        return BenchErrorHandler_OK;
+    }
+
+    char* baseline = readTextFile(options->baseline_path);
+    if (!baseline)
+    {
+        printf("Cannot read baseline %s: record one with make bench_baseline, "
+               "or skip comparing with make bench BASELINE=\n", options->baseline_path);
+        return BenchErrorHandler_NO_BASELINE;
+    }
+
+    size_t regressions = 0;
+
+    for (size_t index = 0; index < size; index++)
+    {
+        const BenchResult* result = results + index;
+
+        double baseline_median = 0;
+        if (!findBaselineMedian(baseline, result, &baseline_median) || baseline_median <= 0)
+        {
+            continue;
+        }
+
+        double median = getNanosecondsPerInstruction(result->median, result->guest_instructions);
+        double change = (median - baseline_median) / baseline_median * PERCENT;
+
+        if (change > options->threshold)
+        {
+            printf("Regression: %s on %s engine takes %.3f ns per instruction, baseline %.3f (%+.1f%%)\n",
+                   result->name, ENGINE_NAMES[result->engine], median, baseline_median, change);
+            regressions++;
+        }
+    }
+
+    FREE_NULL(baseline);
+
+    printf("Compared with %s: %zu regressions over %.1f%%\n", options->baseline_path, regressions, options->threshold);
+
+    return regressions == 0 ? BenchErrorHandler_OK : BenchErrorHandler_REGRESSION;
+}
+
+
+// reads reports of writeReport only, one benchmark per line with the median right after name and engine
+static bool findBaselineMedian(const char* baseline, const BenchResult* const result, double* const median)
+{
+    assert(baseline != NULL);
+    assert(result   != NULL);
+    assert(median   != NULL);
+
+    char key[MAX_BASELINE_KEY] = {};
+    snprintf(key, sizeof(key), "{\"name\": \"%s\", \"engine\": \"%s\",", result->name, ENGINE_NAMES[result->engine]);
+
+    const char* line = strstr(baseline, key);
+    if (!line)
+    {
+        return false;
+    }
+
+    const char* line_end = strchr(line, '\n');
+    const char* value    = strstr(line, MEDIAN_KEY);
+    if (!value || (line_end && value > line_end))
+    {
+        return false;
+    }
+
+    *median = strtod(value + strlen(MEDIAN_KEY), NULL);
+
+    return true;
+}
+
+
+static char* readTextFile(const char* path)
+{
+    assert(path != NULL);
+
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        return NULL;
+    }
+
+    size_t size = getFileSize(file);
+
+    char* text = (char*)calloc(size + 1, sizeof(char));
+    if (text && fread(text, sizeof(char), size, file) != size)
+    {
+        FREE_NULL(text);
+    }
+
+    FCLOSE_NULL(file);
+
+    return text;
+}
+
+
+static double getNanosecondsPerInstruction(double nanoseconds, uint64_t guest_instructions)
+{
+    return guest_instructions != 0 ? nanoseconds / (double)guest_instructions : 0;
+}
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "processor.h"
+#include "bench.h"
+
+
+static const char* HELP_OPTION      = "--help";
+static const char* PROGRAMS_OPTION  = "--programs";
+static const char* REPORT_OPTION    = "--report";
+static const char* BASELINE_OPTION  = "--baseline";
+static const char* THRESHOLD_OPTION = "--threshold";
+static const char* RUNS_OPTION      = "--runs";
+static const char* WARMUP_OPTION    = "--warmup";
+static const char* ENGINE_OPTION    = "--engine";
+
+static const char* DEFAULT_PROGRAMS = "build_bench";
+static const char* DEFAULT_REPORT   = "bench_report.json";
+
+
+static void printHelp(void);
+
+
+int main(const int argc, const char** argv)
+{
+    openLogFile("log.txt");
+
+    BenchOptions options = {
+        .programs_directory = DEFAULT_PROGRAMS,
+        .report_path        = DEFAULT_REPORT,
+        .baseline_path      = NULL,
+        .threshold          = DEFAULT_BENCH_THRESHOLD,
+        .runs               = DEFAULT_BENCH_RUNS,
+        .warmup             = DEFAULT_BENCH_WARMUP,
+        .engines            = {},
+    };
+
+    bool engine_chosen = false;
+
+    for (int current_arg = 1; current_arg < argc; current_arg++)
+    {
+        if (!strcmp(argv[current_arg], HELP_OPTION))
+        {
+            printHelp();
+            return 0;
+        }
+        else if (!strcmp(argv[current_arg], PROGRAMS_OPTION) && current_arg + 1 < argc)
+        {
+            options.programs_directory = argv[++current_arg];
+        }
+        else if (!strcmp(argv[current_arg], REPORT_OPTION) && current_arg + 1 < argc)
+        {
+            options.report_path = argv[++current_arg];
+        }
+        else if (!strcmp(argv[current_arg], BASELINE_OPTION) && current_arg + 1 < argc)
+        {
+            options.baseline_path = argv[++current_arg];
+        }
+        else if (!strcmp(argv[current_arg], THRESHOLD_OPTION) && current_arg + 1 < argc)
+        {
+            options.threshold = strtod(argv[++current_arg], NULL);
+        }
+        else if (!strcmp(argv[current_arg], RUNS_OPTION) && current_arg + 1 < argc)
+        {
+            options.runs = strtoul(argv[++current_arg], NULL, 10);
+        }
+        else if (!strcmp(argv[current_arg], WARMUP_OPTION) && current_arg + 1 < argc)
+        {
+            options.warmup = strtoul(argv[++current_arg], NULL, 10);
+        }
+        else if (!strcmp(argv[current_arg], ENGINE_OPTION) && current_arg + 1 < argc)
+        {
+            const char* name = argv[++current_arg];
+
+            size_t engine = 0;
+            while (engine < NUMBER_OF_ENGINES && strcmp(name, ENGINE_NAMES[engine]))
+            {
+                engine++;
+            }
+
+            if (engine == NUMBER_OF_ENGINES)
+            {
+                printf("Unknown engine %s\n", name);
+                return 1;
+            }
+
+            options.engines[engine] = true;
+            engine_chosen           = true;
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[current_arg]);
+            printHelp();
+            return 1;
+        }
+    }
+
+    if (options.runs == 0)
+    {
+        printf("%s needs at least one run\n", RUNS_OPTION);
+        return 1;
+    }
+
+    if (!engine_chosen)
+    {
+        for (size_t engine = 0; engine < NUMBER_OF_ENGINES; engine++)
+        {
+            options.engines[engine] = true;
+        }
+    }
+
+    BenchErrorHandler return_code = runBenchmarks(&options);
+    if (return_code == BenchErrorHandler_REGRESSION || return_code == BenchErrorHandler_NO_BASELINE)
+    {
+        return 1;
+    }
+
+    if (return_code != BenchErrorHandler_OK)
+    {
+        printf("Failed to run benchmarks (error %d)\n", return_code);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static void printHelp(void)
+{
+    printf("Usage: ./bench [options]\n"
+           "  %-12s directory with the assembled benchmarks, %s by default\n"
+           "  %-12s where the JSON report goes, %s by default\n"
+           "  %-12s report of an earlier run to compare with, fail on regressions or if it cannot be read\n"
+           "  %-12s percent the median per instruction may grow over the baseline, %.0f by default\n"
+           "  %-12s measured runs of every benchmark on every engine, %zu by default\n"
+           "  %-12s runs before the measured ones, %zu by default\n"
+           "  %-12s switch, threaded, register, jit or tracing, may be repeated, all of them by default\n"
+           "  %-12s show this message\n",
+           PROGRAMS_OPTION, DEFAULT_PROGRAMS, REPORT_OPTION, DEFAULT_REPORT, BASELINE_OPTION, THRESHOLD_OPTION,
+           DEFAULT_BENCH_THRESHOLD, RUNS_OPTION, DEFAULT_BENCH_RUNS, WARMUP_OPTION, DEFAULT_BENCH_WARMUP,
+           ENGINE_OPTION, HELP_OPTION);
+}
@@ -7,6 +7,10 @@ static const uint8_t RAM_FLAG      = 0b1000'0000;
 static const uint8_t REGISTER_FLAG = 0b0100'0000;
 static const uint8_t CONST_FLAG    = 0b0010'0000;
 
+// operand kinds of superinstructions that take two operands, a register byte or a constant each
+static const uint8_t PAIR_FIRST_REGISTER_FLAG  = 0b0000'0001;
+static const uint8_t PAIR_SECOND_REGISTER_FLAG = 0b0000'0010;
+
 // FIXME attribute лучшн обвернуть в макрос который по разному разворачивыается в зависимости от компилятора
 __attribute__((unused)) static const char* HLT_COMMAND        = "hlt";
 __attribute__((unused)) static const char* PUSH_COMMAND       = "push";
@@ -30,6 +34,12 @@ __attribute__((unused)) static const char* RET_COMMAND        = "ret";
 __attribute__((unused)) static const char* FUNC_START_COMMAND = "proc";
 __attribute__((unused)) static const char* FUNC_END_COMMAND   = "endp";
 __attribute__((unused)) static const char* DRAW_COMMAND       = "draw";
+__attribute__((unused)) static const char* TAILCALL_COMMAND   = "tailcall";
+__attribute__((unused)) static const char* CALL_DEPTH_COMMAND = "calldepth";
+__attribute__((unused)) static const char* TIMESTAMP_COMMAND  = "timestamp";
+
+// NAME proc pure asks for the results of the procedure to be cached by its arguments
+__attribute__((unused)) static const char* PURE_ANNOTATION    = "pure";
 
 typedef enum MachineCommands
 {
@@ -54,8 +64,61 @@ typedef enum MachineCommands
     MachineCommands_CALL    =  17,
     MachineCommands_RET     =  18,
     MachineCommands_DRAW    =  19,
+    // superinstructions, only emitted by the assembler peephole
+    MachineCommands_PUSH_SUB =  20, // push a; push b; sub
+    MachineCommands_INC      =  21, // push const; push reg; add; pop reg
+    MachineCommands_CMP_JMP  =  22, // push a; push b; j<condition> label
+    // one byte of VectorCommands follows, operands are taken from the stack
+    MachineCommands_VEC      =  23,
+    // call that reuses the return address of the current procedure, the assembler makes it from call X; ret
+    MachineCommands_TAILCALL   =  24,
+    // pushes the number of procedures the program is inside of
+    MachineCommands_CALL_DEPTH =  25,
+    // call of a procedure the assembler found pure, the processor may take its results from a cache
+    MachineCommands_PURE_CALL  =  26,
+    // pushes the nanoseconds since the run started, from a monotonic clock
+    MachineCommands_TIMESTAMP  =  27,
 } MachineCommands;
 
+// Commands over ranges of RAM cells. Addresses and counts are pushed in the order they are listed,
+// element-wise commands write dst[i] = a[i] OP b[i] for i < count.
+typedef enum VectorCommands
+{
+    VectorCommands_ADD        = 0,  // dst, a, b, count
+    VectorCommands_SUB        = 1,  // dst, a, b, count
+    VectorCommands_MUL        = 2,  // dst, a, b, count
+    VectorCommands_DIV        = 3,  // dst, a, b, count
+    VectorCommands_SCALE      = 4,  // dst, a, scalar, count: dst[i] = a[i] * scalar
+    VectorCommands_FILL       = 5,  // dst, value, count
+    VectorCommands_COPY       = 6,  // dst, src, count, overlapping ranges are copied as by memmove
+    VectorCommands_SUM        = 7,  // a, count, pushes the sum
+    VectorCommands_DOT        = 8,  // a, b, count, pushes the dot product
+    VectorCommands_LESS       = 9,  // dst, a, b, count: dst[i] = a[i] < b[i] ? 1 : 0
+    NUMBER_OF_VECTOR_COMMANDS = 10,
+} VectorCommands;
+
+static const uint8_t MAX_VECTOR_OPERANDS = 4;
+
+typedef struct VectorCommandInfo
+{
+    const char* name;
+    uint8_t     operands;   // taken from the stack
+    uint8_t     results;    // pushed back
+} VectorCommandInfo;
+
+__attribute__((unused)) static const VectorCommandInfo VECTOR_COMMANDS[NUMBER_OF_VECTOR_COMMANDS] = {
+    {"vadd",   4, 0},
+    {"vsub",   4, 0},
+    {"vmul",   4, 0},
+    {"vdiv",   4, 0},
+    {"vscale", 4, 0},
+    {"vfill",  3, 0},
+    {"vcopy",  3, 0},
+    {"vsum",   2, 1},
+    {"vdot",   3, 1},
+    {"vless",  4, 0},
+};
+
 __attribute__((unused)) static const char* AX_REGISTER = "ax";
 __attribute__((unused)) static const char* BX_REGISTER = "bx";
 __attribute__((unused)) static const char* CX_REGISTER = "cx";
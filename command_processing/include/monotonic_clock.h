@@ -0,0 +1,9 @@
+#ifndef MONOTONIC_CLOCK_H
+#define MONOTONIC_CLOCK_H
+
+#include <stdint.h>
+
+// nanoseconds of CLOCK_MONOTONIC, only differences of two readings mean anything
+uint64_t getNanoseconds(void);
+
+#endif // MONOTONIC_CLOCK_H
@@ -0,0 +1,87 @@
+#ifndef PROGRAM_FORMAT_H
+#define PROGRAM_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "value_type.h"
+
+// "\x7FSPU" read as little-endian, its first byte is not a valid opcode,
+// so a file in the old raw format can never be taken for a container
+static const uint32_t PROGRAM_MAGIC      = 0x5550537F;
+static const uint16_t PROGRAM_VERSION    = 4;     // 2 added the encoding and the constant pool, 3 the value type,
+                                                  // 4 the source map
+static const uint16_t OLDEST_VERSION     = 1;
+static const uint16_t VALUE_TYPE_VERSION = 3;     // first version with value_type in the header
+static const uint16_t SOURCE_MAP_VERSION = 4;     // first version with the source map section in the header
+static const size_t   PROGRAM_ALIGNMENT  = 8;     // sections and immediates in the code section
+static const size_t   TARGET_SIZE        = sizeof(uint64_t);   // absolute jump targets, whatever the value type is
+static const uint64_t TARGET_RAM_SIZE    = 4096;  // cells of RAM and operand stack the assembler asks for
+static const uint64_t TARGET_STACK_SIZE  = 512;
+
+static const uint8_t  SHORT_TARGET_FLAG  = 0b0010'0000;   // compact jumps: 16-bit target instead of 32-bit
+
+typedef enum ProgramEncoding
+{
+    ProgramEncoding_ALIGNED = 0,   // constants and 8-byte absolute targets at aligned offsets
+    ProgramEncoding_COMPACT = 1,   // constants are pool indices, targets are offsets from the end of the jump
+    ProgramEncoding_RAW     = 2,   // headerless files of doubles, unaligned operands, never written into a header
+} ProgramEncoding;
+
+// Program file: this header, then the code, data and constant sections, all at aligned offsets.
+// In the aligned encoding every immediate inside the code section (constants and jump targets)
+// starts at an offset aligned to PROGRAM_ALIGNMENT relative to the start of the section, the gaps
+// are zero bytes. In the compact encoding a constant is a little-endian index of constant_index_size
+// bytes into the constant section, a target is an int16_t if the opcode byte has SHORT_TARGET_FLAG
+// and an int32_t otherwise. Version 1 headers end before encoding and are always aligned, version 2 headers
+// end before value_type and always hold doubles, version 3 headers end before the source map.
+typedef struct ProgramHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint64_t code_offset;
+    uint64_t code_size;
+    uint64_t data_offset;
+    uint64_t data_size;      // initial contents of the first RAM cells
+    uint64_t entry_point;    // offset of the first instruction inside the code section
+    uint64_t ram_size;       // cells of RAM the program needs
+    uint64_t stack_size;     // cells of operand stack the program needs
+
+    uint32_t encoding;             // ProgramEncoding
+    uint32_t constant_index_size;
+    uint64_t constants_offset;
+    uint64_t constants_size;
+
+    uint32_t value_type;           // ValueType of immediates, data and constants
+    uint32_t reserved;
+
+    uint64_t source_map_offset;    // both 0 if the program was assembled without a source map
+    uint64_t source_map_size;
+} ProgramHeader;
+
+static const size_t FIRST_VERSION_HEADER_SIZE  = offsetof(ProgramHeader, encoding);
+static const size_t SECOND_VERSION_HEADER_SIZE = offsetof(ProgramHeader, value_type);
+static const size_t THIRD_VERSION_HEADER_SIZE  = offsetof(ProgramHeader, source_map_offset);
+
+static const uint32_t NO_SOURCE_PROCEDURE = UINT32_MAX;
+
+// Source map section: this header, one SourceLine per instruction of the code section in code order,
+// then number_of_procedures + 1 NUL-terminated names, the .asm file first and the procedures after it.
+// Lines go by instruction and not by offset, so the same map fits the aligned and the compact encoding.
+typedef struct SourceMapHeader
+{
+    uint32_t number_of_lines;
+    uint32_t number_of_procedures;
+    uint64_t names_size;
+} SourceMapHeader;
+
+typedef struct SourceLine
+{
+    uint32_t line;         // counted from 1
+    uint32_t procedure;    // index of its name, NO_SOURCE_PROCEDURE outside of procedures
+} SourceLine;
+
+static_assert(sizeof(ProgramHeader) % PROGRAM_ALIGNMENT == 0, "code section right behind the header is aligned");
+
+#endif // PROGRAM_FORMAT_H
@@ -0,0 +1,29 @@
+#ifndef RUNTIME_ERROR_H
+#define RUNTIME_ERROR_H
+
+#include <setjmp.h>
+
+// Errors of a running program: stack overflows, division by zero and the like. Without a trap they end
+// the process through abortWithMessage, a trap set on the thread that makes one gets the message instead:
+//
+//     RuntimeErrorTrap trap = {};
+//     if (setjmp(trap.jump) != 0) { ... trap.message ... }
+//     setRuntimeErrorTrap(&trap);
+//     ...
+//     removeRuntimeErrorTrap(&trap);
+//
+// The jump goes over the frames in between, so nothing between the two calls may own memory or locks.
+typedef struct RuntimeErrorTrap
+{
+    jmp_buf                  jump;
+    const char*              message;   // set right before the jump
+    struct RuntimeErrorTrap* outer;     // the trap that was set before, it is set again by the jump
+} RuntimeErrorTrap;
+
+// traps nest, the last one set gets the error
+void setRuntimeErrorTrap(RuntimeErrorTrap* const trap);
+void removeRuntimeErrorTrap(RuntimeErrorTrap* const trap);
+
+[[noreturn]] void raiseRuntimeError(const char* message);
+
+#endif // RUNTIME_ERROR_H
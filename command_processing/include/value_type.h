@@ -0,0 +1,57 @@
+#ifndef VALUE_TYPE_H
+#define VALUE_TYPE_H
+
+#include <stdint.h>
+#include <inttypes.h>
+
+// Type of registers, RAM cells, stack cells and immediates. The assembler and the processor are built
+// for one of them: double by default, float with -DSPU_VALUE_F32, int64_t with -DSPU_VALUE_I64.
+// The type a program was assembled for is written into its header and other builds refuse to run it.
+typedef enum ValueType
+{
+    ValueType_F64         = 0,   // the only type of programs older than version 3
+    ValueType_F32         = 1,
+    ValueType_I64         = 2,
+    NUMBER_OF_VALUE_TYPES = 3,
+} ValueType;
+
+__attribute__((unused)) static const char* VALUE_TYPE_NAMES[NUMBER_OF_VALUE_TYPES] = {"f64", "f32", "i64"};
+
+#if defined(SPU_VALUE_F32)
+
+typedef float arguments_type;
+static const ValueType VALUE_TYPE = ValueType_F32;
+#define VALUE_PRINT_FORMAT "%g"
+#define VALUE_SCAN_FORMAT  "%g"
+
+#elif defined(SPU_VALUE_I64)
+
+typedef int64_t arguments_type;
+static const ValueType VALUE_TYPE = ValueType_I64;
+#define VALUE_PRINT_FORMAT "%" PRId64
+#define VALUE_SCAN_FORMAT  "%" SCNd64
+
+#else
+
+#define SPU_VALUE_F64
+typedef double arguments_type;
+static const ValueType VALUE_TYPE = ValueType_F64;
+#define VALUE_PRINT_FORMAT "%lg"
+#define VALUE_SCAN_FORMAT  "%lg"
+
+#endif
+
+// equatTwoDoubles for the floating point types, plain == for integers
+bool valuesAreEqual(arguments_type first, arguments_type second);
+
+// integer square root rounds down, a negative value is a runtime error, see runtime_error.h
+arguments_type getValueSqrt(arguments_type value);
+
+// integer division by zero is a runtime error instead of a trap
+arguments_type divideValues(arguments_type dividend, arguments_type divisor);
+
+// Works like strtod for every type, an integer build takes no fraction or exponent,
+// so "2.5" stops at the point and end is left there.
+arguments_type parseValue(const char* text, char** end);
+
+#endif // VALUE_TYPE_H
@@ -0,0 +1,21 @@
+#include "monotonic_clock.h"
+
+#include <time.h>
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const uint64_t NANOSECONDS_IN_SECOND = 1'000'000'000;
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+uint64_t getNanoseconds(void)
+{
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * NANOSECONDS_IN_SECOND + (uint64_t)now.tv_nsec;
+}
@@ -0,0 +1,51 @@
+#include "runtime_error.h"
+
+#include <assert.h>
+
+#include "helpful_functions.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+// every thread has traps of its own, so a batch job can fail without the other ones
+static thread_local RuntimeErrorTrap* current_trap = NULL;
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+void setRuntimeErrorTrap(RuntimeErrorTrap* const trap)
+{
+    assert(trap != NULL);
+
+    trap->message = NULL;
+    trap->outer   = current_trap;
+    current_trap  = trap;
+}
+
+
+void removeRuntimeErrorTrap(RuntimeErrorTrap* const trap)
+{
+    assert(trap != NULL);
+    assert(trap == current_trap);
+
+    current_trap = trap->outer;
+}
+
+
+void raiseRuntimeError(const char* message)
+{
+    assert(message != NULL);
+
+    RuntimeErrorTrap* trap = current_trap;
+    if (!trap)
+    {
+        abortWithMessage(message);
+    }
+
+    current_trap  = trap->outer;
+    trap->message = message;
+
+    longjmp(trap->jump, 1);
+}
@@ -0,0 +1,101 @@
+#include "value_type.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "helpful_functions.h"
+#include "work_with_doubles.h"
+#include "runtime_error.h"
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+#if defined(SPU_VALUE_I64)
+
+bool valuesAreEqual(arguments_type first, arguments_type second)
+{
+    return first == second;
+}
+
+
+arguments_type getValueSqrt(arguments_type value)
+{
+    if (value < 0)
+    {
+        raiseRuntimeError("Square root of a negative number");
+    }
+
+    if (value == 0)
+    {
+        return 0;
+    }
+
+    // the double root may be one off for values above 2^53
+    arguments_type root = (arguments_type)sqrt((double)value);
+    while (root > value / root)
+    {
+        root--;
+    }
+
+    while (root + 1 <= value / (root + 1))
+    {
+        root++;
+    }
+
+    return root;
+}
+
+
+arguments_type divideValues(arguments_type dividend, arguments_type divisor)
+{
+    if (divisor == 0)
+    {
+        raiseRuntimeError("Division by zero");
+    }
+
+    // INT64_MIN / -1 traps on x86 as well, its quotient is taken modulo 2^64 instead
+    if (divisor == -1)
+    {
+        return (arguments_type)(0 - (uint64_t)dividend);
+    }
+
+    return dividend / divisor;
+}
+
+
+arguments_type parseValue(const char* text, char** end)
+{
+    return (arguments_type)strtoll(text, end, 10);
+}
+
+#else
+
+bool valuesAreEqual(arguments_type first, arguments_type second)
+{
+    return equatTwoDoubles(first, second);
+}
+
+
+arguments_type getValueSqrt(arguments_type value)
+{
+    return (arguments_type)sqrt(value);
+}
+
+
+arguments_type divideValues(arguments_type dividend, arguments_type divisor)
+{
+    return dividend / divisor;
+}
+
+
+arguments_type parseValue(const char* text, char** end)
+{
+#if defined(SPU_VALUE_F32)
+    return strtof(text, end);
+#else
+    return strtod(text, end);
+#endif
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+
+#include "processor.h"
+
+static const char* const DEFAULT_BATCH_OUTPUT = "batch_output";
+
+typedef struct BatchOptions
+{
+    size_t      number_of_workers;   // 0 runs one worker per online CPU
+    bool        pin_workers;         // worker i is bound to CPU i modulo the number of CPUs
+    const char* output_directory;    // job i writes out, draw and the end message into job_i.out here
+    size_t      quantum;             // nonzero runs every job as a green thread with slices of quantum instructions
+} BatchOptions;
+
+// Manifest: one job per line, "program.bin input.txt", "-" instead of the input means the job reads nothing,
+// empty lines and lines starting with '#' are skipped. Every distinct binary is loaded once and shared
+// by all workers, the timing of every job is printed to stdout after all of them are done.
+// With a quantum the jobs are green threads of one scheduler instead, see scheduler.h: their output is kept
+// in memory until all of them halted and in gets the values of the input file, without prompts.
+ProcessorErrorHandler runBatch(const char*                   path_to_manifest,
+                               const ProcessorOptions* const options,
+                               const BatchOptions* const     batch_options);
+
+#endif // BATCH_H
@@ -0,0 +1,9 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include "processor.h"
+#include "spu.h"
+
+ProcessorErrorHandler decodeProgram(SPU* const spu);
+
+#endif // DECODER_H
@@ -0,0 +1,31 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "processor.h"
+#include "spu.h"
+
+typedef struct JitProgram
+{
+    uint8_t* code;
+    size_t   size;
+    size_t   entry;   // offset of the prologue inside code
+} JitProgram;
+
+// ProcessorErrorHandler_NOT_TRANSLATABLE when this build or system can not run native code
+ProcessorErrorHandler compileProgram(const SPU* const spu, bool checked, JitProgram* const jit_program);
+// runs until hlt, after that registers and stack_top of spu hold the final state
+void runJitProgram(SPU* const spu, const JitProgram* const jit_program);
+void jitProgramDtor(JitProgram* const jit_program);
+
+struct TraceTree;
+
+// compiles a loop with all its side traces into one piece of code, number_of_exits gets how many guards it has
+ProcessorErrorHandler compileTrace(const SPU* const       spu,
+                                   const TraceTree* const tree,
+                                   bool                   checked,
+                                   JitProgram* const      jit_program,
+                                   size_t* const          number_of_exits);
+// runs a compiled loop until a guard fails, returns the number of that guard and sets spu->ip to where it leads
+size_t runJitTrace(SPU* const spu, const JitProgram* const jit_program);
+
+#endif // JIT_H
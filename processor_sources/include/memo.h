@@ -0,0 +1,57 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "processor.h"
+#include "spu.h"
+
+static const size_t MAX_MEMO_VALUES         = 8;      // registers and stack values in one key or one result
+static const size_t DEFAULT_MEMO_CACHE_SIZE = 1024;   // entries, rounded up to a power of two
+static const size_t MAX_MEMO_CACHE_SIZE     = 1 << 24;
+static const size_t NO_PURE_PROCEDURE       = SIZE_MAX;
+
+// A procedure the assembler marked pure, with what it takes and gives back found again from the decoded
+// program. Every register it reads or writes is part of the key, so a path that leaves one of them alone
+// gets it back unchanged. The stack depth has to be the same on every path to every ret.
+typedef struct PureProcedure
+{
+    size_t  entry;
+    uint8_t registers;    // bit per register
+    size_t  arguments;    // stack values under the depth of the call the procedure may read
+    size_t  results;      // stack values it leaves in their place
+} PureProcedure;
+
+// made once by loadProgram and shared by every context the way the decoded program is
+typedef struct MemoProgram
+{
+    PureProcedure* procedures;
+    size_t         number_of_procedures;
+    size_t*        procedure_of_entry;     // by instruction, NO_PURE_PROCEDURE for the rest
+} MemoProgram;
+
+// Proves the procedures that pure calls go to free of RAM, io, draw, vector commands, hlt and calldepth
+// on every path and finds their keys and results. Calls of procedures that fail are turned back into
+// plain calls, so every engine can run the program whether it caches results or not.
+ProcessorErrorHandler analysePureProcedures(SPU* const spu, MemoProgram* const memo_program);
+void memoProgramDtor(MemoProgram* const memo_program);
+
+// Direct-mapped cache of one context, kept for all of its runs. capacity 0 or a program without
+// pure procedures leaves cache NULL.
+ProcessorErrorHandler memoCacheCtor(const MemoProgram* const memo_program, size_t capacity, MemoCache** const cache);
+void memoCacheDtor(MemoCache* const cache);
+
+// calls that were still running when the last run stopped never return
+void resetMemoCalls(MemoCache* const cache);
+
+// Called before a pure call: a hit replaces the arguments on the stack and the registers with the cached
+// results and returns true, the call is then skipped. A miss returns false and the ret of the call fills
+// the entry in through finishMemoCall.
+bool findMemoResult(MemoCache* const cache, SPU* const spu, size_t entry, arguments_type** const stack_top);
+void finishMemoCall(MemoCache* const cache, const SPU* const spu);
+
+void getMemoStatistics(const MemoCache* const cache, MemoStatistics* const statistics);
+void writeMemoStatsLog(const MemoCache* const cache);
+
+#endif // MEMO_H
@@ -0,0 +1,29 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+
+#include "processor.h"
+
+static const int NO_PERF_COUNTER = -1;
+
+// One perf_event_open file per event of the thread that made them, user space only. They are not a group,
+// so an event the CPU lacks does not take the others with it; the kernel may multiplex them and their
+// values are scaled back up by the time they ran.
+typedef struct PerfCounters
+{
+    int files[NUMBER_OF_PERF_COUNTERS];    // NO_PERF_COUNTER where the event could not be opened
+} PerfCounters;
+
+// events that can not be opened are logged and left out, a machine without any of them is not an error
+void perfCountersCtor(PerfCounters* const counters);
+void perfCountersDtor(PerfCounters* const counters);
+
+void startPerfCounters(const PerfCounters* const counters);
+// stops the counters and fills in the counters and available fields of statistics
+void stopPerfCounters(const PerfCounters* const counters, PerfStatistics* const statistics);
+
+// host cycles and instructions per guest instruction and mispredicts per dispatch when the engine counted them
+void writePerfStatsLog(const PerfStatistics* const statistics, ProcessorEngine engine);
+
+#endif // PERF_COUNTERS_H
@@ -1,13 +1,154 @@
 #ifndef PROCESSOR_H
 #define PROCESSOR_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "spu.h"
+
 typedef enum ProcessorErrorHandler
 {
-    ProcessorErrorHandler_OK              = 0,
-    ProcessorErrorHandler_ERROR           = 1,
-    ProcessorErrorHandler_OPEN_FILE_ERROR = 2,
+    ProcessorErrorHandler_OK               = 0,
+    ProcessorErrorHandler_ERROR            = 1,
+    ProcessorErrorHandler_OPEN_FILE_ERROR  = 2,
+    ProcessorErrorHandler_INVALID_PROGRAM  = 3,
+    ProcessorErrorHandler_NOT_TRANSLATABLE = 4,
+    ProcessorErrorHandler_INVALID_SNAPSHOT = 5,
+    ProcessorErrorHandler_RUNTIME_ERROR    = 6,   // the program itself failed, a stack overflow for one
 } ProcessorErrorHandler;
 
-ProcessorErrorHandler executeProgram(const char* path_to_program);
+typedef enum ProcessorEngine
+{
+    ProcessorEngine_SWITCH   = 0,
+    ProcessorEngine_THREADED = 1,
+    ProcessorEngine_REGISTER = 2,
+    ProcessorEngine_JIT      = 3,
+    ProcessorEngine_TRACING  = 4,
+    NUMBER_OF_ENGINES        = 5,
+} ProcessorEngine;
+
+__attribute__((unused)) static const char* ENGINE_NAMES[NUMBER_OF_ENGINES] = {
+    "switch", "threaded", "register", "jit", "tracing",
+};
+
+#ifdef THREADED_DISPATCH
+static const ProcessorEngine DEFAULT_ENGINE = ProcessorEngine_THREADED;
+#else
+static const ProcessorEngine DEFAULT_ENGINE = ProcessorEngine_SWITCH;
+#endif
+
+// what the cache of pure procedure results did over all runs of one context
+typedef struct MemoStatistics
+{
+    size_t hits;
+    size_t misses;
+    size_t evictions;      // misses that took the place of a cached result
+    size_t entries_used;
+    size_t capacity;
+} MemoStatistics;
+
+typedef enum PerfCounter
+{
+    PerfCounter_CYCLES        = 0,
+    PerfCounter_INSTRUCTIONS  = 1,
+    PerfCounter_BRANCH_MISSES = 2,
+    PerfCounter_L1D_MISSES    = 3,
+    PerfCounter_ITLB_MISSES   = 4,
+    NUMBER_OF_PERF_COUNTERS   = 5,
+} PerfCounter;
+
+// host events of the last run of one context, user space only, next to the guest instructions it dispatched
+typedef struct PerfStatistics
+{
+    uint64_t counters[NUMBER_OF_PERF_COUNTERS];
+    bool     available[NUMBER_OF_PERF_COUNTERS];   // false where the kernel or the CPU does not count the event
+    uint64_t guest_instructions;
+    bool     guest_counted;                        // only the switch and threaded engines count what they dispatch
+} PerfStatistics;
+
+// Where a run writes a snapshot of its SPU, see snapshot.h: right before the first instruction with opcode,
+// or after instructions instructions if there is no opcode. A run that halts before that writes nothing.
+typedef struct SnapshotPoint
+{
+    const char* path;            // NULL takes no snapshot
+    int         opcode;          // see findSnapshotOpcode, MachineCommands_UNKNOWN goes by instructions
+    uint64_t    instructions;
+} SnapshotPoint;
+
+typedef struct ProcessorOptions
+{
+    ProcessorEngine engine;
+    bool            force_checks;     // keep stack checks even if the verifier proved them redundant
+    size_t          memo_cache_size;  // entries of the cache of pure procedure results, 0 turns it off
+    bool            profile;          // time every instruction on the switch engine, see profiler.h
+    bool            perf_counters;    // count host cycles, instructions and misses of every run, see perf_counters.h
+    SnapshotPoint   snapshot;         // every run of a context writes it, register and JIT runs go threaded
+    SpuStreams      streams;          // NULL files are stdin and stdout unless a callback takes their place
+} ProcessorOptions;
+
+// Program read, decoded and verified once. Nothing in it changes while it runs, so any
+// number of threads can run the same loaded program at once, each on an SPU of its own.
+typedef struct LoadedProgram LoadedProgram;
+
+ProcessorErrorHandler executeProgram(const char*                    path_to_program,
+                                     const ProcessorOptions* const options);
+
+// runs the program from a snapshot of it instead of from the start, see restoreSpuContext
+ProcessorErrorHandler resumeProgram(const char*                   path_to_program,
+                                    const char*                   path_to_snapshot,
+                                    const ProcessorOptions* const options);
+
+ProcessorErrorHandler loadProgram(const char* path_to_program, LoadedProgram** const program);
+ProcessorErrorHandler runLoadedProgram(const LoadedProgram* const    program,
+                                       const ProcessorOptions* const options);
+void unloadProgram(LoadedProgram* const program);
+
+// SPU with stacks, RAM and compiled engine code of its own, made for one loaded program and run
+// any number of times. Register code and native code are made once, in the constructor; every run
+// after the first starts from the same state as the first one. One context runs on one thread at a time.
+typedef struct SpuContext SpuContext;
+
+ProcessorErrorHandler spuContextCtor(const LoadedProgram* const    program,
+                                     const ProcessorOptions* const options,
+                                     SpuContext** const            context);
+void spuContextDtor(SpuContext* const context);
+void setSpuContextStreams(SpuContext* const context, const SpuStreams* const streams);
+// A runtime error of the program stops only this run: it gives RUNTIME_ERROR, the message goes to the log
+// and after the output of the run, and the context can be run again.
+ProcessorErrorHandler runSpuContext(SpuContext* const context);
+// Puts the SPU of the context where a snapshot of the same program left it, RAM mapped copy-on-write from the file.
+// The next run goes on from there, the runs after it start from the beginning again. Register and JIT contexts
+// start their code at the beginning of the program only and can not be restored.
+ProcessorErrorHandler restoreSpuContext(SpuContext* const context, const char* path_to_snapshot);
+
+typedef enum SpuSliceEnd
+{
+    SpuSliceEnd_HALTED        = 0,
+    SpuSliceEnd_PREEMPTED     = 1,   // the quantum ran out, the next slice goes on from there
+    SpuSliceEnd_WAITING_INPUT = 2,   // stopped right before an in that input_ready of the streams said has to wait
+    SpuSliceEnd_FAILED        = 3,   // stopped by a runtime error the way runSpuContext is, no slice goes on
+} SpuSliceEnd;
+
+// The program of a context in slices of at most quantum instructions for schedulers of many contexts,
+// see scheduler.h. Slices run on the switch engine whatever engine the context was made for, each one goes on
+// where the last one stopped. startSpuContextSlices puts the context back at the start like runSpuContext does.
+ProcessorErrorHandler startSpuContextSlices(SpuContext* const context);
+SpuSliceEnd runSpuContextSlice(SpuContext* const context, size_t quantum, uint64_t* const executed);
+
+// all zeros if the context runs without the cache
+void getSpuContextMemoStatistics(const SpuContext* const context, MemoStatistics* const statistics);
+// all zeros if the context runs without perf counters
+void getSpuContextPerfStatistics(const SpuContext* const context, PerfStatistics* const statistics);
+
+// Contexts for one loaded program kept between runs: released contexts are handed out again
+// instead of being made anew. A pool is not locked, every thread that runs programs needs its own.
+typedef struct SpuContextPool SpuContextPool;
+
+ProcessorErrorHandler spuContextPoolCtor(const LoadedProgram* const    program,
+                                         const ProcessorOptions* const options,
+                                         SpuContextPool** const        pool);
+void spuContextPoolDtor(SpuContextPool* const pool);
+ProcessorErrorHandler acquireSpuContext(SpuContextPool* const pool, SpuContext** const context);
+void releaseSpuContext(SpuContextPool* const pool, SpuContext* const context);
 
 #endif // PROCESSOR_H
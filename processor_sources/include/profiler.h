@@ -0,0 +1,66 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "processor.h"
+#include "spu.h"
+
+static const char* const PROFILE_REPORT_PATH = "profile.txt";
+static const char* const PROFILE_FOLDED_PATH = "profile.folded";
+static const size_t      MAX_PROFILE_DEPTH   = 256;        // deeper calls are counted into the frame at this depth
+static const size_t      MAIN_PROGRAM_ENTRY  = SIZE_MAX;   // entry of the root, the code outside of any call
+
+// Line and procedure of every decoded instruction, taken from the source map section of the program file.
+// Without the section lines are all 0 and procedures are named after their entry instruction.
+typedef struct SourceMap
+{
+    uint32_t*    lines;                  // by instruction, 0 where there is none
+    uint32_t*    procedures;             // by instruction, NO_SOURCE_PROCEDURE outside of procedures
+    char*        names;                  // copy of the names of the section
+    const char*  source_path;
+    const char** procedure_names;
+    size_t       number_of_procedures;
+} SourceMap;
+
+// One call path: the main program is the root, every procedure called on the path of a node is a child of it.
+typedef struct ProfileNode
+{
+    size_t   parent;
+    size_t   first_child;
+    size_t   next_sibling;
+    size_t   entry;          // first instruction of the procedure, MAIN_PROGRAM_ENTRY for the root
+    uint64_t calls;
+    uint64_t cycles;         // spent in the procedure itself on this path, without what it called
+} ProfileNode;
+
+typedef struct Profiler
+{
+    size_t       program_size;
+    uint64_t*    executions;        // by instruction
+    uint64_t*    cycles;            // by instruction
+    uint64_t     last_counter;      // cycle counter when the last instruction ended
+    SourceMap    source_map;
+
+    ProfileNode* nodes;
+    size_t       nodes_size;
+    size_t       nodes_capacity;
+    size_t       current_node;
+    size_t       depth;             // of current_node
+    size_t       hidden_depth;      // calls below MAX_PROFILE_DEPTH that are not returned from yet
+} Profiler;
+
+// reads the source map of the program if it has one, a map that does not fit the program is left out
+ProcessorErrorHandler profilerCtor(Profiler* const profiler, const SPU* const spu);
+void profilerDtor(Profiler* const profiler);
+
+void startProfile(Profiler* const profiler);
+// called after every instruction with the call depth it started at and the instruction it went to
+void profileInstruction(Profiler* const profiler, const SPU* const spu, size_t index, size_t call_depth, size_t next);
+
+// PROFILE_REPORT_PATH gets procedures and instructions sorted by cycles with their source lines,
+// PROFILE_FOLDED_PATH one "main;caller;callee cycles" line per call path for flame graph tools
+ProcessorErrorHandler writeProfile(const Profiler* const profiler);
+
+#endif // PROFILER_H
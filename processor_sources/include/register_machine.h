@@ -0,0 +1,86 @@
+#ifndef REGISTER_MACHINE_H
+#define REGISTER_MACHINE_H
+
+#include "processor.h"
+#include "spu.h"
+
+// Where an operand of a register instruction lives. Slots are operand stack cells addressed
+// relative to the frame of the current procedure, so recursion just moves the frame.
+typedef enum OperandSpace
+{
+    OperandSpace_SLOT        = 0,
+    OperandSpace_REGISTER    = 1,
+    OperandSpace_CONSTANT    = 2,
+    NUMBER_OF_OPERAND_SPACES = 3,
+} OperandSpace;
+
+typedef struct RegisterOperand
+{
+    uint8_t space;
+    int32_t index;
+} RegisterOperand;
+
+typedef enum RegisterCommands
+{
+    RegisterCommands_HLT   = 0,
+    RegisterCommands_MOV   = 1,
+    RegisterCommands_ADD   = 2,
+    RegisterCommands_SUB   = 3,
+    RegisterCommands_MUL   = 4,
+    RegisterCommands_DIV   = 5,
+    RegisterCommands_SQRT  = 6,
+    RegisterCommands_LOAD  = 7,
+    RegisterCommands_STORE = 8,
+    RegisterCommands_OUT   = 9,
+    RegisterCommands_IN    = 10,
+    RegisterCommands_JMP   = 11,
+    RegisterCommands_JA    = 12,
+    RegisterCommands_JAE   = 13,
+    RegisterCommands_JB    = 14,
+    RegisterCommands_JBE   = 15,
+    RegisterCommands_JE    = 16,
+    RegisterCommands_JNE   = 17,
+    RegisterCommands_CALL  = 18,
+    RegisterCommands_RET   = 19,
+    RegisterCommands_DRAW  = 20,
+    RegisterCommands_VEC   = 21,
+    RegisterCommands_TAILCALL   = 22,
+    RegisterCommands_CALL_DEPTH = 23,
+    RegisterCommands_TIMESTAMP  = 24,
+    NUMBER_OF_REGISTER_COMMANDS = 25,
+} RegisterCommands;
+
+// three-address instruction: destination = first OP second, jumps compare first with second,
+// vec takes its operands from consecutive slots starting at first
+typedef struct RegisterInstruction
+{
+    uint8_t         command;
+    uint8_t         vector_command;
+    RegisterOperand destination;
+    RegisterOperand first;
+    RegisterOperand second;
+    int32_t         frame_shift;  // call, tailcall: depth of the caller that becomes the callee frame, hlt: final depth
+    int32_t         frame_min;    // lowest and highest slot used by the callee, relative to the caller frame
+    int32_t         frame_max;
+    size_t          target;       // index of register instruction
+    arguments_type  immediate;    // constant part of a ram address
+} RegisterInstruction;
+
+typedef struct RegisterProgram
+{
+    RegisterInstruction* code;
+    size_t               size;
+    size_t               capacity;
+
+    arguments_type*      constants;
+    size_t               constants_size;
+    size_t               constants_capacity;
+} RegisterProgram;
+
+// ProcessorErrorHandler_NOT_TRANSLATABLE means the stack depth is not known exactly
+// at some instruction, such programs have to run on a stack engine
+ProcessorErrorHandler translateToRegisterMachine(const SPU* const spu, RegisterProgram* const register_program);
+void processRegisterProgram(SPU* const spu, const RegisterProgram* const register_program);
+void registerProgramDtor(RegisterProgram* const register_program);
+
+#endif // REGISTER_MACHINE_H
@@ -0,0 +1,56 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "processor.h"
+
+static const size_t DEFAULT_QUANTUM = 10000;   // instructions of one slice
+
+typedef struct SchedulerOptions
+{
+    size_t number_of_workers;   // 0 runs one worker per online CPU
+    bool   pin_workers;         // worker i is bound to CPU i modulo the number of CPUs
+    size_t quantum;             // instructions a green thread runs before its worker goes on, 0 is DEFAULT_QUANTUM
+} SchedulerOptions;
+
+// what one green thread did over all of its slices
+typedef struct GreenThreadStatistics
+{
+    bool     halted;
+    bool     failed;          // halted by a runtime error, see runSpuContext
+    uint64_t instructions;
+    uint64_t nanoseconds;     // spent running, time in a run queue or parked is left out
+    uint64_t slices;
+    uint64_t waits;           // times it was parked at an in with no value yet
+    uint64_t steals;          // slices it ran on a worker that took it from the queue of another one
+    size_t   last_worker;
+} GreenThreadStatistics;
+
+// Many SPU contexts in one process, run by a few worker threads in slices of a quantum of instructions.
+// Every worker has a run queue of its own: a preempted thread goes to the back of the queue of its worker,
+// a worker with an empty queue steals from the others and sleeps when there is nothing to steal. A thread
+// that reaches an in before its next value was sent is parked, in no queue at all, until a value comes
+// or its input is closed.
+typedef struct Scheduler Scheduler;
+
+ProcessorErrorHandler schedulerCtor(const SchedulerOptions* const options, Scheduler** const scheduler);
+// stops the workers and destroys every green thread, halted or not
+void schedulerDtor(Scheduler* const scheduler);
+
+// The thread gets a context of its own made with options on the switch engine and starts right away.
+// Its in reads only what is sent to it; out, draw and the end message go where options->streams says.
+ProcessorErrorHandler spawnGreenThread(Scheduler* const              scheduler,
+                                       const LoadedProgram* const    program,
+                                       const ProcessorOptions* const options,
+                                       size_t* const                 thread);
+ProcessorErrorHandler sendGreenThreadInput(Scheduler* const scheduler, size_t thread, arguments_type value);
+// in reads 0 after the last value, the way it does at the end of an input file
+void closeGreenThreadInput(Scheduler* const scheduler, size_t thread);
+
+// returns when every spawned thread halted, a thread parked on input that is never closed keeps it waiting
+void waitForGreenThreads(Scheduler* const scheduler);
+void getGreenThreadStatistics(Scheduler* const scheduler, size_t thread, GreenThreadStatistics* const statistics);
+
+#endif // SCHEDULER_H
@@ -0,0 +1,52 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "processor.h"
+#include "spu.h"
+
+// "\x7FSNP" read as little-endian, so a snapshot is never taken for a program file and the other way round
+static const uint32_t SNAPSHOT_MAGIC     = 0x504E537F;
+static const uint16_t SNAPSHOT_VERSION   = 1;
+static const size_t   SNAPSHOT_PAGE_SIZE = 4096;   // RAM starts at a multiple of it, so it can be mapped
+
+// Snapshot file: this header, the operand stack cells in use, the return stack entries in use, then RAM at
+// ram_offset. Values and call frames are written as they are in memory, a snapshot is only read back by
+// a processor with the same value type on the same kind of machine.
+typedef struct SnapshotHeader
+{
+    uint32_t       magic;
+    uint16_t       version;
+    uint16_t       header_size;
+    uint32_t       value_type;      // ValueType
+    uint32_t       reserved;
+    uint64_t       program_hash;    // of the program file, a snapshot fits only the program it was taken of
+    uint64_t       program_size;    // decoded instructions
+    uint64_t       ip;
+    uint64_t       stack_depth;
+    uint64_t       call_depth;
+    uint64_t       executed;        // instructions run before the snapshot was taken
+    uint64_t       ram_offset;
+    uint64_t       ram_size;        // cells
+    arguments_type registers[NUMBER_OF_REGISTERS + 1];
+} SnapshotHeader;
+
+// FNV-1a of the whole program file
+uint64_t hashProgramCode(const uint8_t* code, size_t size_of_code);
+// MachineCommands of an assembler name such as "in", DecodedCommands of a vector command such as "vadd",
+// MachineCommands_UNKNOWN if there is none
+int findSnapshotOpcode(const char* name);
+// Whether a decoded instruction runs the command of opcode. A superinstruction runs every command it was fused
+// from, so a snapshot at any of them is taken in front of the whole superinstruction.
+bool runsSnapshotOpcode(uint8_t command, int opcode);
+
+ProcessorErrorHandler writeSnapshot(const char* path, const SPU* const spu, uint64_t program_hash, uint64_t executed);
+// Registers, ip and both stacks are read into the SPU, RAM is replaced by a private mapping of the file.
+// Anything that does not fit the program of the SPU leaves it as it was and gives INVALID_SNAPSHOT.
+ProcessorErrorHandler readSnapshot(const char* path, SPU* const spu, uint64_t program_hash);
+// frees RAM of an SPU whether it was allocated or mapped from a snapshot
+void releaseSpuRam(SPU* const spu);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,164 @@
+#ifndef SPU_H
+#define SPU_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stack.h"
+#include "program_format.h"
+#include "value_type.h"
+
+
+static const size_t  NUMBER_OF_REGISTERS = 6;
+static const size_t  SIZE_OF_RAM         = 4096;
+static const size_t  SIZE_OF_STACK       = 512;
+static const size_t  ROWS                = 64;
+static const size_t  COLUMNS             = 64;
+static const uint8_t COMMAND_MASK        = 0b0001'1111;
+static const uint8_t FLAG_MOVED_MASK     = 0b1110'0000;
+static const size_t  CALL_STACK_SIZE     = 1 << 16;
+
+// Commands that exist only in decoded programs: CMP_JMP is split by its condition and VEC by its
+// vector command, so every compare-and-branch and every vector command gets a dispatch site of its own.
+typedef enum DecodedCommands
+{
+    DecodedCommands_JA_PAIR    = 32,
+    DecodedCommands_JAE_PAIR   = 33,
+    DecodedCommands_JB_PAIR    = 34,
+    DecodedCommands_JBE_PAIR   = 35,
+    DecodedCommands_JE_PAIR    = 36,
+    DecodedCommands_JNE_PAIR   = 37,
+    DecodedCommands_VADD       = 38,   // DecodedCommands_VADD + VectorCommands
+    DecodedCommands_VSUB       = 39,
+    DecodedCommands_VMUL       = 40,
+    DecodedCommands_VDIV       = 41,
+    DecodedCommands_VSCALE     = 42,
+    DecodedCommands_VFILL      = 43,
+    DecodedCommands_VCOPY      = 44,
+    DecodedCommands_VSUM       = 45,
+    DecodedCommands_VDOT       = 46,
+    DecodedCommands_VLESS      = 47,
+    NUMBER_OF_DECODED_COMMANDS = 48,
+} DecodedCommands;
+
+// one decoded instruction, operands are already pulled out of the byte stream
+typedef struct Instruction
+{
+    uint8_t        command;               // MachineCommands or DecodedCommands
+    uint8_t        flags;                 // RAM_FLAG | REGISTER_FLAG | CONST_FLAG, PAIR_* for superinstructions
+    uint8_t        register_index;
+    uint8_t        second_register_index; // second operand of superinstructions
+    size_t         target;                // index of decoded jump/call destination
+    arguments_type immediate;
+    arguments_type second_immediate;
+} Instruction;
+
+// sections of the loaded program file, all of them point into SPU::code
+typedef struct ProgramImage
+{
+    ProgramEncoding encoding;
+    const uint8_t*  code;
+    size_t          code_size;
+    const uint8_t*  data;                  // initial contents of the first RAM cells
+    size_t          data_size;
+    const uint8_t*  constants;             // pool the compact encoding refers to
+    size_t          number_of_constants;
+    size_t          constant_index_size;
+    size_t          entry_point;           // offset inside code
+    const uint8_t*  source_map;            // NULL if the program has none
+    size_t          source_map_size;
+} ProgramImage;
+
+// Entry of the return stack. frame is the slot base the register engine restores on ret,
+// the stack engines leave it zero.
+typedef struct CallFrame
+{
+    size_t return_ip;
+    long   frame;
+} CallFrame;
+
+typedef arguments_type (*SpuInputCallback)(void* io_context);
+typedef void (*SpuOutputCallback)(void* io_context, arguments_type value);
+typedef bool (*SpuInputReadyCallback)(void* io_context);
+
+// Where in reads from and out, draw and the end message go, every SPU has its own.
+// A callback takes the place of the file for in or out, output with neither a file
+// nor a callback is dropped.
+typedef enum SpuIoMode
+{
+    SpuIoMode_INTERACTIVE = 0,   // prompt before every in, every out is printed right away
+    SpuIoMode_BUFFERED    = 1,   // no prompts, input is read in bulk, output is flushed at hlt or when full
+} SpuIoMode;
+
+typedef enum SpuOutputFormat
+{
+    SpuOutputFormat_TEXT   = 0,
+    SpuOutputFormat_BINARY = 1,  // out writes the bytes of the value, prompts, draw and the end message are dropped
+} SpuOutputFormat;
+
+typedef struct SpuStreams
+{
+    FILE*                 input;
+    FILE*                 output;
+    SpuInputCallback      read_value;
+    SpuOutputCallback     write_value;
+    SpuInputReadyCallback input_ready;   // NULL if in never has to wait, see runSpuContextSlice
+    void*                 io_context;    // first argument of the callbacks
+    SpuIoMode             mode;
+    SpuOutputFormat       output_format;
+} SpuStreams;
+
+// Streams of one SPU together with the buffers of the buffered mode and of draw, all of them
+// are allocated on first use. frame keeps the bytes of the video memory cells as they were
+// last drawn, so a terminal only gets the rows that changed since then.
+typedef struct SpuIo
+{
+    SpuStreams streams;
+    char*      output_buffer;
+    size_t     output_size;
+    char*      input_buffer;
+    size_t     input_size;
+    size_t     input_position;      // first character not parsed yet
+    bool       input_ended;
+
+    char*      frame;               // ROWS * COLUMNS bytes
+    char*      frame_text;          // whole text of one draw, written at once
+    bool       output_is_terminal;
+    bool       frame_on_screen;     // nothing but draw wrote to the terminal since frame was drawn
+
+    uint64_t   clock_origin;        // monotonic nanoseconds timestamp counts from
+} SpuIo;
+
+typedef struct MemoCache MemoCache;
+
+typedef struct SPU
+{
+    uint8_t*        code;
+    size_t          size_of_code;
+    bool            code_is_mapped;   // code is a read-only mapping of the program file, not a heap copy
+    ProgramImage    image;
+
+    Instruction*    program;
+    size_t          program_size;
+    size_t          ip;
+
+    arguments_type  operand_stack[SIZE_OF_STACK];
+    arguments_type* stack_top;        // first free cell of operand_stack
+#ifdef USE_STACK_LIBRARY
+    Stack*          program_stack;
+#endif
+    CallFrame*      call_stack;       // CALL_STACK_SIZE entries
+    size_t          call_depth;       // entries in use, what calldepth pushes
+
+    arguments_type  registers[NUMBER_OF_REGISTERS + 1];
+    arguments_type* ram;
+    bool            ram_is_mapped;    // ram is a private mapping of a snapshot file, not a heap block
+    SpuIo           io;
+    MemoCache*      memo;             // results of pure procedures, NULL if they are not cached
+    uint64_t        executed;         // instructions dispatched by the last run of a counting engine instance or slice
+
+    bool            end_flag;
+} SPU;
+
+#endif // SPU_H
@@ -0,0 +1,28 @@
+#ifndef SPU_IO_H
+#define SPU_IO_H
+
+#include "spu.h"
+
+// Side effects of out/in/draw, shared by every engine so they all print the same way.
+
+void spuIoCtor(SpuIo* const io, const SpuStreams* const streams);
+void spuIoDtor(SpuIo* const io);
+
+void printProgramOut(SpuIo* const io, arguments_type value);
+arguments_type scanProgramIn(SpuIo* const io);
+void drawRam(SpuIo* const io, const arguments_type* const ram);
+// hlt: writes the end message and flushes everything the buffered mode kept
+void printProgramEnd(SpuIo* const io);
+// what a runtime error writes in place of the end message
+void printProgramError(SpuIo* const io, const char* message);
+void flushProgramOut(SpuIo* const io);
+// timestamp pushes the nanoseconds since the clock was started, spuIoCtor starts it as well
+void startProgramClock(SpuIo* const io);
+arguments_type readProgramClock(SpuIo* const io);
+
+// The log is shared by all contexts of the process. Blocks of lines about one run, such as the final stack,
+// are written between these two, so runs on other threads do not cut into them.
+void lockSpuLog(void);
+void unlockSpuLog(void);
+
+#endif // SPU_IO_H
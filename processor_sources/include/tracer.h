@@ -0,0 +1,84 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "processor.h"
+#include "spu.h"
+#include "jit.h"
+
+static const uint32_t HOT_LOOP_THRESHOLD = 64;     // taken backward jumps before a loop is recorded
+static const uint32_t HOT_EXIT_THRESHOLD = 16;     // failed guards before a side trace is recorded
+static const size_t   MAX_TRACE_LENGTH   = 1024;   // instructions in one root or side trace
+static const size_t   MAX_SIDE_TRACES    = 32;     // per loop, every side trace recompiles the whole loop
+static const size_t   NO_PARENT_EXIT     = SIZE_MAX;
+
+// one recorded instruction and the instruction the interpreter went to after it
+typedef struct TraceStep
+{
+    size_t index;
+    size_t next;
+} TraceStep;
+
+typedef struct TraceFragment
+{
+    size_t first_step;
+    size_t steps_size;
+    size_t parent_exit;   // guard this side trace starts from, NO_PARENT_EXIT for the root trace
+} TraceFragment;
+
+// A hot loop: the root trace goes from head around to head again, every side trace starts
+// at a guard that kept failing and also ends at head. All of them are compiled together.
+typedef struct TraceTree
+{
+    size_t         head;
+
+    TraceStep*     steps;
+    size_t         steps_size;
+    size_t         steps_capacity;
+
+    TraceFragment  fragments[MAX_SIDE_TRACES + 1];
+    size_t         fragments_size;
+
+    uint32_t*      exit_counters;     // failures of every guard, numbered in compilation order
+    size_t         number_of_exits;
+
+    JitProgram     native;
+} TraceTree;
+
+typedef struct TraceStats
+{
+    size_t   traces_compiled;     // root and side traces
+    size_t   traces_aborted;
+    size_t   trace_entries;
+    size_t   side_exits;
+    uint64_t nanoseconds_in_traces;
+} TraceStats;
+
+typedef struct Tracer
+{
+    uint32_t*   loop_counters;   // taken backward jumps per target instruction
+    TraceTree** trees;           // per head instruction, NULL until its loop is compiled
+    size_t      program_size;
+    bool        checked;
+    bool        enabled;         // false once it turned out native code can not run here
+
+    bool        recording;
+    TraceTree*  recording_tree;  // new loop or the one a side trace is recorded for
+
+    TraceStats  stats;
+} Tracer;
+
+ProcessorErrorHandler tracerCtor(Tracer* const tracer, const SPU* const spu, bool checked);
+void tracerDtor(Tracer* const tracer);
+
+// called with spu->ip at the destination of every ip-decreasing instruction, counts hot loops and
+// runs the compiled ones; spu->ip and spu->stack_top are where the interpreter has to continue
+void enterHotLoop(Tracer* const tracer, SPU* const spu, uint8_t command);
+// called after every instruction while tracer->recording
+void recordTraceStep(Tracer* const tracer, const SPU* const spu, size_t index, size_t next);
+
+void writeTraceStatsLog(const Tracer* const tracer);
+
+#endif // TRACER_H
@@ -0,0 +1,16 @@
+#ifndef VECTOR_KERNELS_H
+#define VECTOR_KERNELS_H
+
+#include <stdint.h>
+
+#include "spu.h"
+
+// Runs one of VectorCommands over RAM, shared by every engine the way spu_io is. operands are the values
+// the command took from the stack in the order they were pushed, the result is what vsum and vdot push
+// (0 for the rest). Ranges outside of RAM abort the program.
+arguments_type executeVectorCommand(uint8_t vector_command, arguments_type* ram, const arguments_type* operands);
+
+// "avx2" or "scalar", picked by CPUID when the program starts
+const char* getVectorKernelsName(void);
+
+#endif // VECTOR_KERNELS_H
@@ -0,0 +1,19 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include "processor.h"
+#include "spu.h"
+
+typedef struct VerifierReport
+{
+    size_t max_stack_depth;
+    size_t max_call_depth;
+    bool   bounded;         // no underflow on any path and both depths are finite and fit the SPU
+} VerifierReport;
+
+ProcessorErrorHandler verifyProgram(const SPU* const spu, VerifierReport* const report);
+
+// how many operands a decoded command takes from the stack and puts back, calls and returns count as zero
+void getStackEffect(uint8_t command, long* const pops, long* const pushes);
+
+#endif // VERIFIER_H
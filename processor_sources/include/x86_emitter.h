@@ -0,0 +1,113 @@
+#ifndef X86_EMITTER_H
+#define X86_EMITTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Just enough of the x86-64 encoding for the JIT: 64-bit general purpose moves and arithmetic,
+// scalar double SSE2 and relative jumps that are patched once their targets are known.
+
+typedef enum X86Register
+{
+    X86Register_RAX = 0,
+    X86Register_RCX = 1,
+    X86Register_RDX = 2,
+    X86Register_RBX = 3,
+    X86Register_RSP = 4,
+    X86Register_RBP = 5,
+    X86Register_RSI = 6,
+    X86Register_RDI = 7,
+    X86Register_R8  = 8,
+    X86Register_R9  = 9,
+    X86Register_R10 = 10,
+    X86Register_R11 = 11,
+    X86Register_R12 = 12,
+    X86Register_R13 = 13,
+    X86Register_R14 = 14,
+    X86Register_R15 = 15,
+} X86Register;
+
+// second byte of the 0F 8x jcc encoding, unsigned conditions are the ones ucomisd sets
+typedef enum X86Condition
+{
+    X86Condition_B  = 0x2,
+    X86Condition_AE = 0x3,
+    X86Condition_E  = 0x4,
+    X86Condition_NE = 0x5,
+    X86Condition_BE = 0x6,
+    X86Condition_A  = 0x7,
+} X86Condition;
+
+// opcode byte of F2 0F xx scalar double instructions
+typedef enum SseOperation
+{
+    SseOperation_SQRT = 0x51,
+    SseOperation_ADD  = 0x58,
+    SseOperation_MUL  = 0x59,
+    SseOperation_SUB  = 0x5C,
+    SseOperation_DIV  = 0x5E,
+} SseOperation;
+
+typedef struct CodeBuffer
+{
+    uint8_t* bytes;
+    size_t   size;
+    size_t   capacity;
+    bool     failed;    // set when growing the buffer failed, everything emitted after that is dropped
+} CodeBuffer;
+
+void codeBufferDtor(CodeBuffer* const buffer);
+void emitByte(CodeBuffer* const buffer, uint8_t byte);
+void emit32(CodeBuffer* const buffer, uint32_t value);
+void emit64(CodeBuffer* const buffer, uint64_t value);
+void patchRelative(CodeBuffer* const buffer, size_t position, size_t target);
+
+void emitMoveImmediate(CodeBuffer* const buffer, X86Register destination, uint64_t value);
+void emitMoveRegister(CodeBuffer* const buffer, X86Register destination, X86Register source);
+void emitLoad(CodeBuffer* const buffer, X86Register destination, X86Register base, int32_t displacement);
+void emitStore(CodeBuffer* const buffer, X86Register base, int32_t displacement, X86Register source);
+void emitStoreImmediate32(CodeBuffer* const buffer, X86Register base, int32_t displacement, int32_t value);
+void emitAddImmediate(CodeBuffer* const buffer, X86Register destination, int32_t value);
+void emitAddImmediate32(CodeBuffer* const buffer, X86Register destination, int32_t value);
+void emitSubRegister(CodeBuffer* const buffer, X86Register destination, X86Register source);
+void emitAndImmediate(CodeBuffer* const buffer, X86Register destination, int8_t value);
+void emitCompareImmediate(CodeBuffer* const buffer, X86Register first, int32_t value);
+void emitCompareMemory(CodeBuffer* const buffer, X86Register first, X86Register base, int32_t displacement);
+void emitTest(CodeBuffer* const buffer, X86Register first, X86Register second);
+void emitTestByte(CodeBuffer* const buffer, X86Register first);
+void emitSignExtend32(CodeBuffer* const buffer, X86Register destination, X86Register source);
+void emitIncrement(CodeBuffer* const buffer, X86Register destination);
+void emitDecrement(CodeBuffer* const buffer, X86Register destination);
+void emitPush(CodeBuffer* const buffer, X86Register source);
+void emitPop(CodeBuffer* const buffer, X86Register destination);
+void emitCallRegister(CodeBuffer* const buffer, X86Register target);
+void emitReturn(CodeBuffer* const buffer);
+
+// the returned position is the rel32 field to pass to patchRelative
+size_t emitCallRelative(CodeBuffer* const buffer);
+size_t emitJumpRelative(CodeBuffer* const buffer);
+size_t emitJumpConditional(CodeBuffer* const buffer, X86Condition condition);
+// conditions come in pairs that differ only in the lowest bit
+X86Condition invertCondition(X86Condition condition);
+
+void emitSseLoad(CodeBuffer* const buffer, uint8_t destination, X86Register base, int32_t displacement);
+void emitSseStore(CodeBuffer* const buffer, X86Register base, int32_t displacement, uint8_t source);
+void emitSseLoadIndexed(CodeBuffer* const buffer, uint8_t destination, X86Register base, X86Register index);
+void emitSseStoreIndexed(CodeBuffer* const buffer, X86Register base, X86Register index, uint8_t source);
+void emitSseMove(CodeBuffer* const buffer, uint8_t destination, uint8_t source);
+void emitSseOperation(CodeBuffer* const buffer, SseOperation operation, uint8_t destination, uint8_t source);
+void emitSseOperationMemory(CodeBuffer* const buffer,
+                            SseOperation      operation,
+                            uint8_t           destination,
+                            X86Register       base,
+                            int32_t           displacement);
+void emitSseCompare(CodeBuffer* const buffer, uint8_t first, uint8_t second);
+void emitSseFromRegister(CodeBuffer* const buffer, uint8_t destination, X86Register source);
+void emitSseFromInteger(CodeBuffer* const buffer, uint8_t destination, X86Register source);
+void emitSseTruncate(CodeBuffer* const buffer, X86Register destination, uint8_t source);
+
+// copies the code into a fresh read+execute mapping, NULL if the system refuses
+uint8_t* makeExecutable(const CodeBuffer* const buffer);
+void freeExecutable(uint8_t* code, size_t size);
+
+#endif // X86_EMITTER_H
@@ -0,0 +1,581 @@
+#include "batch.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "helpful_functions.h"
+#include "logger.h"
+#include "scheduler.h"
+#include "monotonic_clock.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const size_t MAX_MANIFEST_LINE    = 1024;
+static const size_t MAX_JOB_PATH         = 512;
+static const size_t START_JOBS_CAPACITY  = 64;
+static const char*  NO_INPUT             = "-";
+static const char*  EMPTY_INPUT_PATH     = "/dev/null";
+static const double NANOSECONDS_IN_MILLI = 1e6;
+
+typedef struct BatchJob
+{
+    char                  program_path[MAX_JOB_PATH];
+    char                  input_path[MAX_JOB_PATH];
+    LoadedProgram*        program;
+    bool                  owns_program;   // first job of its binary, unloads it at the end
+    ProcessorErrorHandler result;
+    uint64_t              nanoseconds;
+    size_t                worker;
+
+    // green jobs only
+    size_t                thread;
+    FILE*                 output;         // a memory stream, written to job_N.out after all jobs halted
+    char*                 output_text;
+    size_t                output_length;
+    uint64_t              instructions;
+    uint64_t              slices;
+    uint64_t              waits;
+} BatchJob;
+
+typedef struct Batch
+{
+    BatchJob*               jobs;
+    size_t                  jobs_size;
+    size_t                  jobs_capacity;
+    size_t                  next_job;       // taken by workers with an atomic increment
+    const ProcessorOptions* options;
+    const BatchOptions*     batch_options;
+} Batch;
+
+typedef struct BatchWorker
+{
+    Batch*    batch;
+    size_t    index;
+    pthread_t thread;
+    bool      started;
+} BatchWorker;
+
+static ProcessorErrorHandler readManifest(const char* path_to_manifest, Batch* const batch);
+static ProcessorErrorHandler addJob(Batch* const batch, const char* program_path, const char* input_path);
+static ProcessorErrorHandler loadJobPrograms(Batch* const batch);
+static ProcessorErrorHandler runWorkers(Batch* const batch);
+static void* workerMain(void* argument);
+static void pinWorker(size_t index);
+static void runJob(Batch* const batch, size_t job_index, size_t worker);
+static ProcessorErrorHandler runGreenJobs(Batch* const batch);
+static ProcessorErrorHandler spawnGreenJob(Batch* const batch, Scheduler* const scheduler, size_t job_index);
+static void writeGreenJobOutput(Batch* const batch, size_t job_index);
+static void printBatchReport(const Batch* const batch);
+static void batchDtor(Batch* const batch);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+ProcessorErrorHandler runBatch(const char*                   path_to_manifest,
+                               const ProcessorOptions* const options,
+                               const BatchOptions* const     batch_options)
+{
+    assert(path_to_manifest != NULL);
+    assert(options          != NULL);
+    assert(batch_options    != NULL);
+
+    Batch batch = {
+        .jobs          = NULL,
+        .jobs_size     = 0,
+        .jobs_capacity = 0,
+        .next_job      = 0,
+        .options       = options,
+        .batch_options = batch_options,
+    };
+
+    ProcessorErrorHandler return_code = readManifest(path_to_manifest, &batch);
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = loadJobPrograms(&batch);
+    }
+
+    if (return_code == ProcessorErrorHandler_OK
+        && mkdir(batch_options->output_directory, 0755) != 0 && errno != EEXIST)
+    {
+        return_code = ProcessorErrorHandler_OPEN_FILE_ERROR;
+    }
+
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = batch_options->quantum ? runGreenJobs(&batch) : runWorkers(&batch);
+    }
+
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        printBatchReport(&batch);
+    }
+
+    batchDtor(&batch);
+
+    return return_code;
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static ProcessorErrorHandler readManifest(const char* path_to_manifest, Batch* const batch)
+{
+    assert(path_to_manifest != NULL);
+    assert(batch            != NULL);
+
+    FILE* manifest = fopen(path_to_manifest, "r");
+    if (!manifest)
+    {
+        return ProcessorErrorHandler_OPEN_FILE_ERROR;
+    }
+
+    ProcessorErrorHandler return_code = ProcessorErrorHandler_OK;
+
+    char line[MAX_MANIFEST_LINE]    = {};
+    char program_path[MAX_JOB_PATH] = {};
+    char input_path[MAX_JOB_PATH]   = {};
+
+    while (return_code == ProcessorErrorHandler_OK && fgets(line, (int)sizeof(line), manifest))
+    {
+        int fields = sscanf(line, "%511s %511s", program_path, input_path);
+        if (fields <= 0 || program_path[0] == '#')
+        {
+            continue;
+        }
+
+        return_code = addJob(batch, program_path, fields == 2 ? input_path : NO_INPUT);
+    }
+
+    FCLOSE_NULL(manifest);
+
+    if (return_code == ProcessorErrorHandler_OK && batch->jobs_size == 0)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    return return_code;
+}
+
+
+static ProcessorErrorHandler addJob(Batch* const batch, const char* program_path, const char* input_path)
+{
+    assert(batch        != NULL);
+    assert(program_path != NULL);
+    assert(input_path   != NULL);
+
+    if (batch->jobs_size == batch->jobs_capacity)
+    {
+        size_t    new_capacity = batch->jobs_capacity ? batch->jobs_capacity * 2 : START_JOBS_CAPACITY;
+        BatchJob* new_jobs     = (BatchJob*)realloc(batch->jobs, new_capacity * sizeof(BatchJob));
+        if (!new_jobs)
+        {
+            return ProcessorErrorHandler_ERROR;
+        }
+
+        batch->jobs          = new_jobs;
+        batch->jobs_capacity = new_capacity;
+    }
+
+    BatchJob* job = batch->jobs + batch->jobs_size++;
+    memset(job, 0, sizeof(BatchJob));
+
+    strncpy(job->program_path, program_path, MAX_JOB_PATH - 1);
+    strncpy(job->input_path,   input_path,   MAX_JOB_PATH - 1);
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// before any worker starts, so loading (and its logging) stays on one thread
+static ProcessorErrorHandler loadJobPrograms(Batch* const batch)
+{
+    assert(batch != NULL);
+
+    for (size_t job_index = 0; job_index < batch->jobs_size; job_index++)
+    {
+        BatchJob* job = batch->jobs + job_index;
+
+        for (size_t previous = 0; previous < job_index; previous++)
+        {
+            if (!strcmp(batch->jobs[previous].program_path, job->program_path))
+            {
+                job->program = batch->jobs[previous].program;
+                break;
+            }
+        }
+
+        if (job->program)
+        {
+            continue;
+        }
+
+        ProcessorErrorHandler return_code = loadProgram(job->program_path, &job->program);
+        if (return_code != ProcessorErrorHandler_OK)
+        {
+            printf("Failed to load %s (error %d)\n", job->program_path, return_code);
+            return return_code;
+        }
+
+        job->owns_program = true;
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static ProcessorErrorHandler runWorkers(Batch* const batch)
+{
+    assert(batch != NULL);
+
+    size_t number_of_workers = batch->batch_options->number_of_workers;
+    if (number_of_workers == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        number_of_workers = online > 0 ? (size_t)online : 1;
+    }
+
+    if (number_of_workers > batch->jobs_size)
+    {
+        number_of_workers = batch->jobs_size;
+    }
+
+    BatchWorker* workers = (BatchWorker*)calloc(number_of_workers, sizeof(BatchWorker));
+    if (!workers)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    Log(LogLevel_INFO, "Running %zu jobs on %zu workers", batch->jobs_size, number_of_workers);
+
+    ProcessorErrorHandler return_code = ProcessorErrorHandler_OK;
+
+    for (size_t index = 0; index < number_of_workers; index++)
+    {
+        workers[index].batch   = batch;
+        workers[index].index   = index;
+        workers[index].started = pthread_create(&workers[index].thread, NULL, workerMain, workers + index) == 0;
+        if (!workers[index].started)
+        {
+            return_code = ProcessorErrorHandler_ERROR;
+            break;
+        }
+    }
+
+    // jobs are taken from a shared counter, so the workers that did start still finish all of them
+    for (size_t index = 0; index < number_of_workers; index++)
+    {
+        if (workers[index].started)
+        {
+            pthread_join(workers[index].thread, NULL);
+        }
+    }
+
+    FREE_NULL(workers);
+
+    return return_code;
+}
+
+
+static void* workerMain(void* argument)
+{
+    assert(argument != NULL);
+
+    BatchWorker* worker = (BatchWorker*)argument;
+    Batch*       batch  = worker->batch;
+
+    if (batch->batch_options->pin_workers)
+    {
+        pinWorker(worker->index);
+    }
+
+    while (true)
+    {
+        size_t job_index = __atomic_fetch_add(&batch->next_job, 1, __ATOMIC_RELAXED);
+        if (job_index >= batch->jobs_size)
+        {
+            break;
+        }
+
+        runJob(batch, job_index, worker->index);
+    }
+
+    return NULL;
+}
+
+
+static void pinWorker(size_t index)
+{
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online <= 0)
+    {
+        return;
+    }
+
+    cpu_set_t cpus = {};
+    CPU_ZERO(&cpus);
+    CPU_SET(index % (size_t)online, &cpus);
+
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+
+// Every job has its own input and output files, only the job slot itself is written by the worker,
+// the loaded program is read by all workers running the same binary.
+static void runJob(Batch* const batch, size_t job_index, size_t worker)
+{
+    assert(batch != NULL);
+
+    BatchJob* job = batch->jobs + job_index;
+    job->worker   = worker;
+
+    char output_path[MAX_JOB_PATH + 32] = {};
+    snprintf(output_path, sizeof(output_path), "%s/job_%zu.out", batch->batch_options->output_directory, job_index);
+
+    const char* input_path = strcmp(job->input_path, NO_INPUT) ? job->input_path : EMPTY_INPUT_PATH;
+
+    FILE* input  = fopen(input_path, "r");
+    FILE* output = fopen(output_path, "w");
+
+    if (!input || !output)
+    {
+        job->result = ProcessorErrorHandler_OPEN_FILE_ERROR;
+    }
+    else
+    {
+        ProcessorOptions options = *batch->options;
+        options.streams.input  = input;
+        options.streams.output = output;
+
+        uint64_t start   = getNanoseconds();
+        job->result      = runLoadedProgram(job->program, &options);
+        job->nanoseconds = getNanoseconds() - start;
+    }
+
+    if (input)
+    {
+        FCLOSE_NULL(input);
+    }
+
+    if (output)
+    {
+        FCLOSE_NULL(output);
+    }
+}
+
+
+// Every job is a green thread of one scheduler and gets the values of its input file right after it is spawned.
+// The output stays in a memory stream until the end, so thousands of jobs need no thousands of open files.
+static ProcessorErrorHandler runGreenJobs(Batch* const batch)
+{
+    assert(batch != NULL);
+
+    SchedulerOptions scheduler_options = {
+        .number_of_workers = batch->batch_options->number_of_workers,
+        .pin_workers       = batch->batch_options->pin_workers,
+        .quantum           = batch->batch_options->quantum,
+    };
+
+    Scheduler*            scheduler   = NULL;
+    ProcessorErrorHandler return_code = schedulerCtor(&scheduler_options, &scheduler);
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        return return_code;
+    }
+
+    Log(LogLevel_INFO, "Running %zu jobs as green threads", batch->jobs_size);
+
+    size_t spawned_jobs = 0;
+    while (return_code == ProcessorErrorHandler_OK && spawned_jobs < batch->jobs_size)
+    {
+        return_code = spawnGreenJob(batch, scheduler, spawned_jobs++);
+    }
+
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        waitForGreenThreads(scheduler);
+    }
+
+    for (size_t job_index = 0; job_index < spawned_jobs; job_index++)
+    {
+        BatchJob* job = batch->jobs + job_index;
+        if (!job->output || job->result != ProcessorErrorHandler_OK)
+        {
+            continue;
+        }
+
+        GreenThreadStatistics statistics = {};
+        getGreenThreadStatistics(scheduler, job->thread, &statistics);
+
+        job->result       = statistics.failed ? ProcessorErrorHandler_RUNTIME_ERROR : ProcessorErrorHandler_OK;
+        job->worker       = statistics.last_worker;
+        job->nanoseconds  = statistics.nanoseconds;
+        job->instructions = statistics.instructions;
+        job->slices       = statistics.slices;
+        job->waits        = statistics.waits;
+    }
+
+    // destroying the contexts flushes their output into the memory streams
+    schedulerDtor(scheduler);
+
+    for (size_t job_index = 0; job_index < spawned_jobs; job_index++)
+    {
+        writeGreenJobOutput(batch, job_index);
+    }
+
+    return return_code;
+}
+
+
+// a job whose input can not be read is not spawned and only fails itself
+static ProcessorErrorHandler spawnGreenJob(Batch* const batch, Scheduler* const scheduler, size_t job_index)
+{
+    assert(batch     != NULL);
+    assert(scheduler != NULL);
+
+    BatchJob* job = batch->jobs + job_index;
+
+    const char* input_path = strcmp(job->input_path, NO_INPUT) ? job->input_path : EMPTY_INPUT_PATH;
+
+    FILE* input = fopen(input_path, "r");
+    if (!input)
+    {
+        job->result = ProcessorErrorHandler_OPEN_FILE_ERROR;
+        return ProcessorErrorHandler_OK;
+    }
+
+    job->output = open_memstream(&job->output_text, &job->output_length);
+    if (!job->output)
+    {
+        FCLOSE_NULL(input);
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    // draw of the interactive mode writes to the file descriptor, which a memory stream does not have
+    ProcessorOptions options = *batch->options;
+    options.streams.output = job->output;
+    options.streams.mode   = SpuIoMode_BUFFERED;
+
+    ProcessorErrorHandler return_code = spawnGreenThread(scheduler, job->program, &options, &job->thread);
+
+    arguments_type value = 0;
+    while (return_code == ProcessorErrorHandler_OK && fscanf(input, VALUE_SCAN_FORMAT, &value) == 1)
+    {
+        return_code = sendGreenThreadInput(scheduler, job->thread, value);
+    }
+
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        closeGreenThreadInput(scheduler, job->thread);
+    }
+
+    FCLOSE_NULL(input);
+
+    return return_code;
+}
+
+
+static void writeGreenJobOutput(Batch* const batch, size_t job_index)
+{
+    assert(batch != NULL);
+
+    BatchJob* job = batch->jobs + job_index;
+    if (!job->output)
+    {
+        return;
+    }
+
+    FCLOSE_NULL(job->output);
+
+    char output_path[MAX_JOB_PATH + 32] = {};
+    snprintf(output_path, sizeof(output_path), "%s/job_%zu.out", batch->batch_options->output_directory, job_index);
+
+    FILE* output = fopen(output_path, "w");
+    if (!output)
+    {
+        job->result = ProcessorErrorHandler_OPEN_FILE_ERROR;
+    }
+    else
+    {
+        fwrite(job->output_text, sizeof(char), job->output_length, output);
+        FCLOSE_NULL(output);
+    }
+
+    FREE_NULL(job->output_text);
+}
+
+
+static void printBatchReport(const Batch* const batch)
+{
+    assert(batch != NULL);
+
+    uint64_t total_nanoseconds = 0;
+    size_t   failed_jobs       = 0;
+
+    // green jobs also show their guest instructions, slices and how often they were parked waiting for input
+    bool green = batch->batch_options->quantum != 0;
+
+    if (green)
+    {
+        printf("%-6s %-6s %-6s %12s %14s %8s %6s  %s\n",
+               "job", "worker", "status", "time, ms", "instructions", "slices", "waits", "program < input");
+    }
+    else
+    {
+        printf("%-6s %-6s %-6s %12s  %s\n", "job", "worker", "status", "time, ms", "program < input");
+    }
+
+    for (size_t job_index = 0; job_index < batch->jobs_size; job_index++)
+    {
+        const BatchJob* job = batch->jobs + job_index;
+
+        if (green)
+        {
+            printf("%-6zu %-6zu %-6d %12.3lf %14llu %8llu %6llu  %s < %s\n",
+                   job_index, job->worker, job->result, (double)job->nanoseconds / NANOSECONDS_IN_MILLI,
+                   (unsigned long long)job->instructions, (unsigned long long)job->slices,
+                   (unsigned long long)job->waits, job->program_path, job->input_path);
+        }
+        else
+        {
+            printf("%-6zu %-6zu %-6d %12.3lf  %s < %s\n",
+                   job_index, job->worker, job->result, (double)job->nanoseconds / NANOSECONDS_IN_MILLI,
+                   job->program_path, job->input_path);
+        }
+
+        total_nanoseconds += job->nanoseconds;
+        failed_jobs       += job->result != ProcessorErrorHandler_OK;
+    }
+
+    printf("%zu jobs, %zu failed, %.3lf ms of running in total\n",
+           batch->jobs_size, failed_jobs, (double)total_nanoseconds / NANOSECONDS_IN_MILLI);
+}
+
+
+static void batchDtor(Batch* const batch)
+{
+    assert(batch != NULL);
+
+    for (size_t job_index = 0; job_index < batch->jobs_size; job_index++)
+    {
+        if (batch->jobs[job_index].owns_program)
+        {
+            unloadProgram(batch->jobs[job_index].program);
+        }
+    }
+
+    FREE_NULL(batch->jobs);
+
+    memset(batch, 0, sizeof(Batch));
+}
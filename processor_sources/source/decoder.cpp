@@ -0,0 +1,636 @@
+#include "decoder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "helpful_functions.h"
+#include "command_handler.h"
+#include "program_format.h"
+#include "logger.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const size_t NO_INSTRUCTION = (size_t)-1;
+
+static ProcessorErrorHandler readProgramImage(SPU* const spu);
+static ProcessorErrorHandler checkProgramHeader(const ProgramHeader* const header, size_t size_of_file);
+static size_t getHeaderSize(uint16_t version);
+static bool checkSection(uint64_t offset, uint64_t size, size_t size_of_file);
+static size_t getInstructionEnd(const ProgramImage* const image, size_t ip);
+static size_t getPairEnd(const ProgramImage* const image, uint8_t pair_flags, size_t offset);
+static size_t getImmediateEnd(const ProgramImage* const image, size_t offset);
+static size_t getTargetEnd(const ProgramImage* const image, uint8_t command_byte, size_t offset);
+static size_t alignOperand(const ProgramImage* const image, size_t offset);
+static size_t decodePair(const ProgramImage* const image,
+                         size_t                    offset,
+                         Instruction* const        instruction,
+                         bool*                     valid);
+static bool readImmediate(const ProgramImage* const image, size_t offset, arguments_type* immediate);
+static bool readTarget(const ProgramImage* const image, uint8_t command_byte, size_t offset, size_t* target);
+static ProcessorErrorHandler decodeInstruction(const ProgramImage* const image,
+                                               const size_t*             offset_to_index,
+                                               size_t                    ip,
+                                               Instruction*              instruction);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+ProcessorErrorHandler decodeProgram(SPU* const spu)
+{
+    assert(spu       != NULL);
+    assert(spu->code != NULL);
+
+    ProcessorErrorHandler return_code = readProgramImage(spu);
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        return return_code;
+    }
+
+    const ProgramImage* const image = &spu->image;
+
+    size_t* offset_to_index = (size_t*)calloc(image->code_size + 1, sizeof(size_t));
+    if (!offset_to_index)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    for (size_t offset = 0; offset <= image->code_size; offset++)
+    {
+        offset_to_index[offset] = NO_INSTRUCTION;
+    }
+
+    // every engine starts at the first instruction, so a program with another entry point gets a jump there
+    size_t first_index = image->entry_point != 0 ? 1 : 0;
+
+    size_t number_of_instructions = first_index;
+    for (size_t ip = 0; ip < image->code_size; number_of_instructions++)
+    {
+        size_t end = getInstructionEnd(image, ip);
+        if (end == 0)
+        {
+            Log(LogLevel_INFO, "Undecodable instruction at offset %zu", ip);
+            FREE_NULL(offset_to_index);
+            return ProcessorErrorHandler_INVALID_PROGRAM;
+        }
+
+        offset_to_index[ip] = number_of_instructions;
+        ip = end;
+    }
+
+    // jumping right behind the last instruction lands on the implicit hlt
+    offset_to_index[image->code_size] = number_of_instructions;
+
+    if (offset_to_index[image->entry_point] == NO_INSTRUCTION)
+    {
+        Log(LogLevel_INFO, "Entry point %zu is not an instruction", image->entry_point);
+        FREE_NULL(offset_to_index);
+        return ProcessorErrorHandler_INVALID_PROGRAM;
+    }
+
+    spu->program = (Instruction*)calloc(number_of_instructions + 1, sizeof(Instruction));
+    if (!spu->program)
+    {
+        FREE_NULL(offset_to_index);
+        return ProcessorErrorHandler_ERROR;
+    }
+    spu->program_size = number_of_instructions;
+
+    if (first_index != 0)
+    {
+        spu->program[0].command = MachineCommands_JMP;
+        spu->program[0].target  = offset_to_index[image->entry_point];
+    }
+
+    for (size_t ip = 0, index = first_index; ip < image->code_size; index++)
+    {
+        return_code = decodeInstruction(image, offset_to_index, ip, spu->program + index);
+        if (return_code != ProcessorErrorHandler_OK)
+        {
+            Log(LogLevel_INFO, "Instruction at offset %zu refers to a missing constant or instruction", ip);
+            FREE_NULL(spu->program);
+            FREE_NULL(offset_to_index);
+            return return_code;
+        }
+
+        ip = getInstructionEnd(image, ip);
+    }
+
+    // falling off the end of the code stops the program instead of running past the buffer
+    spu->program[number_of_instructions].command = MachineCommands_HLT;
+
+    FREE_NULL(offset_to_index);
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+// Files that start with the container magic are checked and split into sections,
+// anything else is a program in the old raw format: code only, starting at offset 0.
+static ProcessorErrorHandler readProgramImage(SPU* const spu)
+{
+    assert(spu       != NULL);
+    assert(spu->code != NULL);
+
+    ProgramHeader header = {};
+    if (spu->size_of_code >= sizeof(header.magic))
+    {
+        memcpy(&header.magic, spu->code, sizeof(header.magic));
+    }
+
+    if (header.magic != PROGRAM_MAGIC)
+    {
+        if (VALUE_TYPE != ValueType_F64)
+        {
+            Log(LogLevel_INFO, "Program has no header, raw code holds doubles and this processor runs %s",
+                VALUE_TYPE_NAMES[VALUE_TYPE]);
+            return ProcessorErrorHandler_INVALID_PROGRAM;
+        }
+
+        spu->image = {
+            .encoding    = ProgramEncoding_RAW,
+            .code        = spu->code,
+            .code_size   = spu->size_of_code,
+            .entry_point = 0,
+        };
+
+        Log(LogLevel_INFO, "Program has no header, loading %zu bytes of raw code", spu->size_of_code);
+        return ProcessorErrorHandler_OK;
+    }
+
+    if (spu->size_of_code < FIRST_VERSION_HEADER_SIZE)
+    {
+        Log(LogLevel_INFO, "Program header is truncated");
+        return ProcessorErrorHandler_INVALID_PROGRAM;
+    }
+
+    // fields an older header does not have stay zero: the aligned encoding without constants, holding doubles
+    memcpy(&header, spu->code, FIRST_VERSION_HEADER_SIZE);
+    if (header.version > OLDEST_VERSION)
+    {
+        size_t header_size = getHeaderSize(header.version);
+        if (spu->size_of_code < header_size)
+        {
+            Log(LogLevel_INFO, "Program header is truncated");
+            return ProcessorErrorHandler_INVALID_PROGRAM;
+        }
+
+        memcpy(&header, spu->code, header_size);
+    }
+
+    ProcessorErrorHandler return_code = checkProgramHeader(&header, spu->size_of_code);
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        return return_code;
+    }
+
+    spu->image = {
+        .encoding            = (ProgramEncoding)header.encoding,
+        .code                = spu->code + header.code_offset,
+        .code_size           = (size_t)header.code_size,
+        .data                = spu->code + header.data_offset,
+        .data_size           = (size_t)header.data_size,
+        .constants           = spu->code + header.constants_offset,
+        .number_of_constants = (size_t)(header.constants_size / sizeof(arguments_type)),
+        .constant_index_size = header.constant_index_size,
+        .entry_point         = (size_t)header.entry_point,
+        .source_map          = header.source_map_size != 0 ? spu->code + header.source_map_offset : NULL,
+        .source_map_size     = (size_t)header.source_map_size,
+    };
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static ProcessorErrorHandler checkProgramHeader(const ProgramHeader* const header, size_t size_of_file)
+{
+    assert(header != NULL);
+
+    if (header->version < OLDEST_VERSION || header->version > PROGRAM_VERSION
+        || header->header_size < getHeaderSize(header->version))
+    {
+        Log(LogLevel_INFO, "Program format version %u is not supported, expected %u to %u",
+            (unsigned)header->version, (unsigned)OLDEST_VERSION, (unsigned)PROGRAM_VERSION);
+        return ProcessorErrorHandler_INVALID_PROGRAM;
+    }
+
+    if (header->value_type != VALUE_TYPE)
+    {
+        Log(LogLevel_INFO, "Program is assembled for %s values, this processor runs %s",
+            header->value_type < NUMBER_OF_VALUE_TYPES ? VALUE_TYPE_NAMES[header->value_type] : "unknown",
+            VALUE_TYPE_NAMES[VALUE_TYPE]);
+        return ProcessorErrorHandler_INVALID_PROGRAM;
+    }
+
+    if (header->encoding != ProgramEncoding_ALIGNED
+        && !(header->encoding == ProgramEncoding_COMPACT
+             && header->constant_index_size >= 1 && header->constant_index_size <= sizeof(uint16_t)))
+    {
+        Log(LogLevel_INFO, "Program encoding %u is not supported", (unsigned)header->encoding);
+        return ProcessorErrorHandler_INVALID_PROGRAM;
+    }
+
+    if (!checkSection(header->code_offset, header->code_size, size_of_file)
+        || !checkSection(header->data_offset, header->data_size, size_of_file)
+        || !checkSection(header->constants_offset, header->constants_size, size_of_file)
+        || !checkSection(header->source_map_offset, header->source_map_size, size_of_file)
+        || header->data_size      % sizeof(arguments_type) != 0
+        || header->constants_size % sizeof(arguments_type) != 0
+        || header->entry_point > header->code_size)
+    {
+        Log(LogLevel_INFO, "Program sections do not fit into the file");
+        return ProcessorErrorHandler_INVALID_PROGRAM;
+    }
+
+    if (header->ram_size > SIZE_OF_RAM || header->stack_size > SIZE_OF_STACK
+        || header->data_size / sizeof(arguments_type) > header->ram_size)
+    {
+        Log(LogLevel_INFO, "Program needs %llu RAM cells and %llu stack cells, there are %zu and %zu",
+            (unsigned long long)header->ram_size, (unsigned long long)header->stack_size, SIZE_OF_RAM, SIZE_OF_STACK);
+        return ProcessorErrorHandler_INVALID_PROGRAM;
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static size_t getHeaderSize(uint16_t version)
+{
+    if (version == OLDEST_VERSION)
+    {
+        return FIRST_VERSION_HEADER_SIZE;
+    }
+
+    if (version < VALUE_TYPE_VERSION)
+    {
+        return SECOND_VERSION_HEADER_SIZE;
+    }
+
+    return version < SOURCE_MAP_VERSION ? THIRD_VERSION_HEADER_SIZE : sizeof(ProgramHeader);
+}
+
+
+static bool checkSection(uint64_t offset, uint64_t size, size_t size_of_file)
+{
+    return offset % PROGRAM_ALIGNMENT == 0 && offset <= size_of_file && size <= size_of_file - offset;
+}
+
+
+// returns the offset right behind the instruction at ip, 0 if it can not be decoded
+static size_t getInstructionEnd(const ProgramImage* const image, size_t ip)
+{
+    assert(image != NULL);
+
+    const uint8_t* code  = image->code;
+    uint8_t        flags = code[ip] & FLAG_MOVED_MASK;
+    size_t         end   = ip + 1;
+
+    switch (code[ip] & COMMAND_MASK)
+    {
+        case MachineCommands_PUSH:
+            if (!(flags & (REGISTER_FLAG | CONST_FLAG)))
+            {
+                return 0;
+            }
+
+            end += (flags & REGISTER_FLAG) ? 1 : 0;
+            end  = (flags & CONST_FLAG)    ? getImmediateEnd(image, end) : end;
+            break;
+
+        case MachineCommands_POP:
+            if (flags & RAM_FLAG)
+            {
+                if (!(flags & (REGISTER_FLAG | CONST_FLAG)))
+                {
+                    return 0;
+                }
+
+                end += (flags & REGISTER_FLAG) ? 1 : 0;
+                end  = (flags & CONST_FLAG)    ? getImmediateEnd(image, end) : end;
+            }
+            else
+            {
+                if (flags != REGISTER_FLAG)
+                {
+                    return 0;
+                }
+
+                end += 1;
+            }
+            break;
+
+        case MachineCommands_JMP:
+        case MachineCommands_JA:
+        case MachineCommands_JAE:
+        case MachineCommands_JB:
+        case MachineCommands_JBE:
+        case MachineCommands_JE:
+        case MachineCommands_JNE:
+        case MachineCommands_CALL:
+        case MachineCommands_TAILCALL:
+        case MachineCommands_PURE_CALL:
+            end = getTargetEnd(image, code[ip], end);
+            break;
+
+        case MachineCommands_PUSH_SUB:
+            if (end >= image->code_size)
+            {
+                return 0;
+            }
+
+            end = getPairEnd(image, code[end], end + 1);
+            break;
+
+        case MachineCommands_INC:
+            end = getImmediateEnd(image, end + 1);
+            break;
+
+        case MachineCommands_CMP_JMP:
+            if (ip + 2 >= image->code_size || code[ip + 1] < MachineCommands_JA || code[ip + 1] > MachineCommands_JNE)
+            {
+                return 0;
+            }
+
+            end = getTargetEnd(image, code[ip], getPairEnd(image, code[ip + 2], ip + 3));
+            break;
+
+        case MachineCommands_VEC:
+            if (end >= image->code_size || code[end] >= NUMBER_OF_VECTOR_COMMANDS)
+            {
+                return 0;
+            }
+
+            end += 1;
+            break;
+
+        case MachineCommands_HLT:
+        case MachineCommands_ADD:
+        case MachineCommands_MUL:
+        case MachineCommands_SUB:
+        case MachineCommands_DIV:
+        case MachineCommands_SQRT:
+        case MachineCommands_OUT:
+        case MachineCommands_IN:
+        case MachineCommands_RET:
+        case MachineCommands_DRAW:
+        case MachineCommands_CALL_DEPTH:
+        case MachineCommands_TIMESTAMP:
+            break;
+
+        case MachineCommands_UNKNOWN:
+        default:
+            return 0;
+    }
+
+    return end <= image->code_size ? end : 0;
+}
+
+
+static ProcessorErrorHandler decodeInstruction(const ProgramImage* const image,
+                                               const size_t*             offset_to_index,
+                                               size_t                    ip,
+                                               Instruction*              instruction)
+{
+    assert(image           != NULL);
+    assert(offset_to_index != NULL);
+    assert(instruction     != NULL);
+
+    const uint8_t* code    = image->code;
+    size_t         operand = ip + 1;
+    bool           valid   = true;
+
+    instruction->command = code[ip] & COMMAND_MASK;
+    instruction->flags   = code[ip] & FLAG_MOVED_MASK;
+
+    switch (instruction->command)
+    {
+        case MachineCommands_PUSH:
+        case MachineCommands_POP:
+            if (instruction->flags & REGISTER_FLAG)
+            {
+                instruction->register_index = code[operand];
+                operand++;
+            }
+
+            if (instruction->flags & CONST_FLAG)
+            {
+                valid = readImmediate(image, operand, &instruction->immediate);
+            }
+            break;
+
+        case MachineCommands_PUSH_SUB:
+            instruction->flags = code[operand];
+            decodePair(image, operand + 1, instruction, &valid);
+            break;
+
+        case MachineCommands_INC:
+            instruction->register_index = code[operand];
+            valid = readImmediate(image, operand + 1, &instruction->immediate);
+            break;
+
+        case MachineCommands_VEC:
+            instruction->command = (uint8_t)(DecodedCommands_VADD + code[operand]);
+            instruction->flags   = 0;
+            break;
+
+        case MachineCommands_CMP_JMP:
+        case MachineCommands_JMP:
+        case MachineCommands_JA:
+        case MachineCommands_JAE:
+        case MachineCommands_JB:
+        case MachineCommands_JBE:
+        case MachineCommands_JE:
+        case MachineCommands_JNE:
+        case MachineCommands_CALL:
+        case MachineCommands_TAILCALL:
+        case MachineCommands_PURE_CALL:
+        {
+            // plain jumps have no operand flags, the compact encoding keeps only the target size there
+            instruction->flags = 0;
+
+            if (instruction->command == MachineCommands_CMP_JMP)
+            {
+                instruction->command = (uint8_t)(DecodedCommands_JA_PAIR + (code[operand] - MachineCommands_JA));
+                instruction->flags   = code[operand + 1];
+
+                operand = decodePair(image, operand + 2, instruction, &valid);
+            }
+
+            size_t offset = 0;
+            if (!readTarget(image, code[ip], operand, &offset) || offset_to_index[offset] == NO_INSTRUCTION)
+            {
+                return ProcessorErrorHandler_INVALID_PROGRAM;
+            }
+
+            instruction->target = offset_to_index[offset];
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    return valid ? ProcessorErrorHandler_OK : ProcessorErrorHandler_INVALID_PROGRAM;
+}
+
+
+static size_t getPairEnd(const ProgramImage* const image, uint8_t pair_flags, size_t offset)
+{
+    assert(image != NULL);
+
+    const uint8_t register_flags[] = {PAIR_FIRST_REGISTER_FLAG, PAIR_SECOND_REGISTER_FLAG};
+
+    for (size_t operand = 0; operand < 2; operand++)
+    {
+        offset = (pair_flags & register_flags[operand]) ? offset + 1 : getImmediateEnd(image, offset);
+    }
+
+    return offset;
+}
+
+
+static size_t getImmediateEnd(const ProgramImage* const image, size_t offset)
+{
+    assert(image != NULL);
+
+    if (image->encoding == ProgramEncoding_COMPACT)
+    {
+        return offset + image->constant_index_size;
+    }
+
+    return alignOperand(image, offset) + sizeof(arguments_type);
+}
+
+
+static size_t getTargetEnd(const ProgramImage* const image, uint8_t command_byte, size_t offset)
+{
+    assert(image != NULL);
+
+    if (image->encoding == ProgramEncoding_COMPACT)
+    {
+        return offset + ((command_byte & SHORT_TARGET_FLAG) ? sizeof(int16_t) : sizeof(int32_t));
+    }
+
+    return alignOperand(image, offset) + TARGET_SIZE;
+}
+
+
+static size_t alignOperand(const ProgramImage* const image, size_t offset)
+{
+    assert(image != NULL);
+
+    if (image->encoding != ProgramEncoding_ALIGNED)
+    {
+        return offset;
+    }
+
+    return (offset + PROGRAM_ALIGNMENT - 1) & ~(PROGRAM_ALIGNMENT - 1);
+}
+
+
+// returns the offset right behind the pair, valid becomes false if a constant is missing
+static size_t decodePair(const ProgramImage* const image,
+                         size_t                    offset,
+                         Instruction* const        instruction,
+                         bool*                     valid)
+{
+    assert(image       != NULL);
+    assert(instruction != NULL);
+    assert(valid       != NULL);
+
+    if (instruction->flags & PAIR_FIRST_REGISTER_FLAG)
+    {
+        instruction->register_index = image->code[offset];
+        offset++;
+    }
+    else
+    {
+        *valid = readImmediate(image, offset, &instruction->immediate) && *valid;
+        offset = getImmediateEnd(image, offset);
+    }
+
+    if (instruction->flags & PAIR_SECOND_REGISTER_FLAG)
+    {
+        instruction->second_register_index = image->code[offset];
+        offset++;
+    }
+    else
+    {
+        *valid = readImmediate(image, offset, &instruction->second_immediate) && *valid;
+        offset = getImmediateEnd(image, offset);
+    }
+
+    return offset;
+}
+
+
+// offset is right behind the previous operand, the padding of the aligned encoding is skipped here
+static bool readImmediate(const ProgramImage* const image, size_t offset, arguments_type* immediate)
+{
+    assert(image     != NULL);
+    assert(immediate != NULL);
+
+    if (image->encoding != ProgramEncoding_COMPACT)
+    {
+        memcpy(immediate, image->code + alignOperand(image, offset), sizeof(arguments_type));
+        return true;
+    }
+
+    size_t index = 0;
+    for (size_t byte = 0; byte < image->constant_index_size; byte++)
+    {
+        index |= (size_t)image->code[offset + byte] << (8 * byte);
+    }
+
+    if (index >= image->number_of_constants)
+    {
+        return false;
+    }
+
+    memcpy(immediate, image->constants + index * sizeof(arguments_type), sizeof(arguments_type));
+    return true;
+}
+
+
+// target is an offset inside the code section, it may point right behind the last instruction
+static bool readTarget(const ProgramImage* const image, uint8_t command_byte, size_t offset, size_t* target)
+{
+    assert(image  != NULL);
+    assert(target != NULL);
+
+    if (image->encoding != ProgramEncoding_COMPACT)
+    {
+        memcpy(target, image->code + alignOperand(image, offset), TARGET_SIZE);
+        return *target <= image->code_size;
+    }
+
+    int64_t relative = 0;
+    if (command_byte & SHORT_TARGET_FLAG)
+    {
+        int16_t short_relative = 0;
+        memcpy(&short_relative, image->code + offset, sizeof(short_relative));
+        relative = short_relative;
+    }
+    else
+    {
+        int32_t long_relative = 0;
+        memcpy(&long_relative, image->code + offset, sizeof(long_relative));
+        relative = long_relative;
+    }
+
+    int64_t end = (int64_t)getTargetEnd(image, command_byte, offset);
+    if (relative < -end || relative > (int64_t)image->code_size - end)
+    {
+        return false;
+    }
+
+    *target = (size_t)(end + relative);
+    return true;
+}
@@ -0,0 +1,1000 @@
+#include "jit.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+
+#include "helpful_functions.h"
+#include "command_handler.h"
+#include "runtime_error.h"
+#include "work_with_doubles.h"
+#include "logger.h"
+#include "spu_io.h"
+#include "tracer.h"
+#include "vector_kernels.h"
+#include "x86_emitter.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+// Everything native code needs from SPU, rbx points to it while the program runs.
+typedef struct JitContext
+{
+    arguments_type  registers[NUMBER_OF_REGISTERS + 1];
+    arguments_type* stack_top;
+    arguments_type* stack_base;
+    arguments_type* stack_limit;
+    arguments_type* ram;
+    SpuIo*          io;                    // first argument of every io callback
+    void*           saved_stack_pointer;   // rsp of the prologue, hlt in any procedure returns through it
+    int32_t         status;
+    int32_t         exit_number;           // guard a trace left through
+    size_t          exit_ip;               // instruction the interpreter continues from after a trace
+} JitContext;
+
+typedef enum JitStatus
+{
+    JitStatus_OK                  = 0,
+    JitStatus_STACK_OVERFLOW      = 1,
+    JitStatus_STACK_UNDERFLOW     = 2,
+    JitStatus_CALL_OVERFLOW       = 3,
+    JitStatus_RETURN_WITHOUT_CALL = 4,
+    NUMBER_OF_JIT_STATUSES        = 5,
+} JitStatus;
+
+typedef void (*JitEntry)(JitContext* context);
+
+typedef struct JumpPatch
+{
+    size_t position;
+    size_t target;     // decoded instruction index
+} JumpPatch;
+
+typedef struct TraceGuard
+{
+    size_t position;
+    size_t exit_ip;    // the way the recorded run did not go
+} TraceGuard;
+
+typedef struct JitCompiler
+{
+    const Instruction* program;
+    size_t             number_of_instructions;
+    bool               checked;
+    bool               counts_calls;          // checked code and calldepth need the depth kept in CALL_DEPTH
+
+    CodeBuffer         buffer;
+    size_t*            native_offsets;
+    JumpPatch*         patches;
+    size_t             patches_size;
+    TraceGuard*        guards;
+    size_t             guards_size;
+
+    size_t             exit_offset;
+    size_t             error_offsets[NUMBER_OF_JIT_STATUSES];
+} JitCompiler;
+
+// rbx, rbp and r12-r15 survive calls into C, so only xmm registers have to be saved around callbacks
+static const X86Register CONTEXT       = X86Register_RBX;
+static const X86Register SAVED_RSP     = X86Register_RBP;
+static const X86Register STACK_TOP     = X86Register_R12;
+static const X86Register RAM           = X86Register_R13;
+static const X86Register CALL_DEPTH    = X86Register_R14;
+static const X86Register STACK_BASE    = X86Register_R15;
+static const X86Register SCRATCH       = X86Register_RAX;
+static const uint8_t     FIRST_XMM     = 0;
+static const uint8_t     SECOND_XMM    = 1;
+static const uint8_t     REGISTERS_XMM = 8;       // ax..fx live in xmm8..xmm13
+static const int32_t     CELL          = (int32_t)sizeof(arguments_type);
+static const int32_t     MAX_CALL_DEPTH = (int32_t)CALL_STACK_SIZE;
+
+// the emitted code is x86-64 only, it keeps the operand stack in SPU so the Stack library build can not use it,
+// and it computes with scalar doubles, so builds for the other value types interpret instead
+#if defined(__x86_64__) && !defined(USE_STACK_LIBRARY) && defined(SPU_VALUE_F64)
+static const bool NATIVE_CODE_AVAILABLE = true;
+#else
+static const bool NATIVE_CODE_AVAILABLE = false;
+#endif
+
+static const X86Register SAVED_REGISTERS[] = {
+    X86Register_RBX, X86Register_RBP, X86Register_R12, X86Register_R13, X86Register_R14, X86Register_R15,
+};
+static const size_t NUMBER_OF_SAVED_REGISTERS = sizeof(SAVED_REGISTERS) / sizeof(SAVED_REGISTERS[0]);
+
+static void emitExit(JitCompiler* const compiler);
+static void emitPrologue(JitCompiler* const compiler);
+static void compileInstruction(JitCompiler* const compiler, size_t index);
+static void resolveJumps(JitCompiler* const compiler);
+static void compileTraceStep(JitCompiler* const compiler, const TraceStep* const step);
+static void resolveGuards(JitCompiler* const  compiler,
+                          const TraceTree* const tree,
+                          const size_t* const    fragment_offsets);
+static void runNativeCode(SPU* const spu, const JitProgram* const jit_program, JitContext* const context);
+
+static uint8_t getRegisterXmm(uint8_t register_index);
+static void emitLoadConstant(JitCompiler* const compiler, uint8_t xmm, arguments_type value);
+static void emitLoadPairOperands(JitCompiler* const compiler, const Instruction* const instruction);
+static void emitSaveRegisters(JitCompiler* const compiler);
+static void emitRestoreRegisters(JitCompiler* const compiler);
+static void emitCallback(JitCompiler* const compiler, uint64_t function);
+static void emitJumpToError(JitCompiler* const compiler, X86Condition condition, JitStatus status);
+static void emitOverflowCheck(JitCompiler* const compiler);
+static void emitUnderflowCheck(JitCompiler* const compiler, int32_t count);
+static void emitOperandPush(JitCompiler* const compiler, uint8_t xmm);
+static void emitOperandPop(JitCompiler* const compiler, uint8_t xmm);
+static void emitBinaryOperation(JitCompiler* const compiler, SseOperation operation);
+static X86Condition emitJumpTest(JitCompiler* const compiler, const Instruction* const instruction);
+static void addJumpPatch(JitCompiler* const compiler, size_t position, size_t target);
+static bool usesCallDepth(const SPU* const spu);
+
+static const char* getStatusMessage(int32_t status);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+ProcessorErrorHandler compileProgram(const SPU* const spu, bool checked, JitProgram* const jit_program)
+{
+    assert(spu          != NULL);
+    assert(spu->program != NULL);
+    assert(jit_program  != NULL);
+
+    *jit_program = {};
+
+    if (!NATIVE_CODE_AVAILABLE)
+    {
+        return ProcessorErrorHandler_NOT_TRANSLATABLE;
+    }
+
+    JitCompiler compiler = {
+        .program                = spu->program,
+        .number_of_instructions = spu->program_size + 1,
+        .checked                = checked,
+        .counts_calls           = checked || usesCallDepth(spu),
+    };
+
+    compiler.native_offsets = (size_t*)calloc(compiler.number_of_instructions, sizeof(size_t));
+    compiler.patches        = (JumpPatch*)calloc(compiler.number_of_instructions, sizeof(JumpPatch));
+    if (!compiler.native_offsets || !compiler.patches)
+    {
+        FREE_NULL(compiler.native_offsets);
+        FREE_NULL(compiler.patches);
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    // stubs come first so every jump into them is backward and can be encoded right away
+    emitExit(&compiler);
+    jit_program->entry = compiler.buffer.size;
+    emitPrologue(&compiler);
+
+    for (size_t index = 0; index < compiler.number_of_instructions; index++)
+    {
+        compiler.native_offsets[index] = compiler.buffer.size;
+        compileInstruction(&compiler, index);
+    }
+
+    resolveJumps(&compiler);
+
+    ProcessorErrorHandler return_code = ProcessorErrorHandler_OK;
+
+    jit_program->code = makeExecutable(&compiler.buffer);
+    jit_program->size = compiler.buffer.size;
+    if (!jit_program->code)
+    {
+        return_code = ProcessorErrorHandler_NOT_TRANSLATABLE;
+    }
+    else
+    {
+        Log(LogLevel_INFO, "JIT: %zu instructions compiled into %zu bytes of native code",
+            spu->program_size, jit_program->size);
+    }
+
+    codeBufferDtor(&compiler.buffer);
+    FREE_NULL(compiler.native_offsets);
+    FREE_NULL(compiler.patches);
+
+    return return_code;
+}
+
+
+void runJitProgram(SPU* const spu, const JitProgram* const jit_program)
+{
+    assert(spu         != NULL);
+    assert(jit_program != NULL);
+
+    JitContext context = {};
+    runNativeCode(spu, jit_program, &context);
+}
+
+
+ProcessorErrorHandler compileTrace(const SPU* const       spu,
+                                   const TraceTree* const tree,
+                                   bool                   checked,
+                                   JitProgram* const      jit_program,
+                                   size_t* const          number_of_exits)
+{
+    assert(spu             != NULL);
+    assert(tree            != NULL);
+    assert(jit_program     != NULL);
+    assert(number_of_exits != NULL);
+
+    *jit_program = {};
+
+    if (!NATIVE_CODE_AVAILABLE)
+    {
+        return ProcessorErrorHandler_NOT_TRANSLATABLE;
+    }
+
+    JitCompiler compiler = {
+        .program                = spu->program,
+        .number_of_instructions = spu->program_size + 1,
+        .checked                = checked,
+    };
+
+    size_t* fragment_offsets = (size_t*)calloc(tree->fragments_size, sizeof(size_t));
+    compiler.guards          = (TraceGuard*)calloc(tree->steps_size + 1, sizeof(TraceGuard));
+    if (!fragment_offsets || !compiler.guards)
+    {
+        FREE_NULL(fragment_offsets);
+        FREE_NULL(compiler.guards);
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    emitExit(&compiler);
+    jit_program->entry = compiler.buffer.size;
+    emitPrologue(&compiler);
+
+    // the root trace comes first, every trace ends by jumping back to its start
+    for (size_t fragment = 0; fragment < tree->fragments_size; fragment++)
+    {
+        fragment_offsets[fragment] = compiler.buffer.size;
+
+        const TraceFragment* const current = tree->fragments + fragment;
+        for (size_t step = current->first_step; step < current->first_step + current->steps_size; step++)
+        {
+            compileTraceStep(&compiler, tree->steps + step);
+        }
+
+        patchRelative(&compiler.buffer, emitJumpRelative(&compiler.buffer), fragment_offsets[0]);
+    }
+
+    resolveGuards(&compiler, tree, fragment_offsets);
+
+    ProcessorErrorHandler return_code = ProcessorErrorHandler_OK;
+
+    jit_program->code = makeExecutable(&compiler.buffer);
+    jit_program->size = compiler.buffer.size;
+    *number_of_exits  = compiler.guards_size;
+    if (!jit_program->code)
+    {
+        return_code = ProcessorErrorHandler_NOT_TRANSLATABLE;
+    }
+
+    codeBufferDtor(&compiler.buffer);
+    FREE_NULL(fragment_offsets);
+    FREE_NULL(compiler.guards);
+
+    return return_code;
+}
+
+
+size_t runJitTrace(SPU* const spu, const JitProgram* const jit_program)
+{
+    assert(spu         != NULL);
+    assert(jit_program != NULL);
+
+    JitContext context = {};
+    runNativeCode(spu, jit_program, &context);
+
+    spu->ip = context.exit_ip;
+
+    return (size_t)context.exit_number;
+}
+
+
+void jitProgramDtor(JitProgram* const jit_program)
+{
+    assert(jit_program != NULL);
+
+    freeExecutable(jit_program->code, jit_program->size);
+
+    *jit_program = {};
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static void emitExit(JitCompiler* const compiler)
+{
+    assert(compiler != NULL);
+
+    CodeBuffer* buffer = &compiler->buffer;
+
+    compiler->exit_offset = buffer->size;
+
+    emitLoad(buffer, X86Register_RSP, CONTEXT, offsetof(JitContext, saved_stack_pointer));
+    emitSaveRegisters(compiler);
+    emitStore(buffer, CONTEXT, offsetof(JitContext, stack_top), STACK_TOP);
+
+    emitAddImmediate(buffer, X86Register_RSP, CELL);
+    for (size_t saved = NUMBER_OF_SAVED_REGISTERS; saved > 0; saved--)
+    {
+        emitPop(buffer, SAVED_REGISTERS[saved - 1]);
+    }
+    emitReturn(buffer);
+
+    for (int32_t status = JitStatus_OK + 1; status < NUMBER_OF_JIT_STATUSES; status++)
+    {
+        compiler->error_offsets[status] = buffer->size;
+
+        emitStoreImmediate32(buffer, CONTEXT, offsetof(JitContext, status), status);
+        patchRelative(buffer, emitJumpRelative(buffer), compiler->exit_offset);
+    }
+}
+
+
+static void emitPrologue(JitCompiler* const compiler)
+{
+    assert(compiler != NULL);
+
+    CodeBuffer* buffer = &compiler->buffer;
+
+    for (size_t saved = 0; saved < NUMBER_OF_SAVED_REGISTERS; saved++)
+    {
+        emitPush(buffer, SAVED_REGISTERS[saved]);
+    }
+
+    // six pushes over the return address leave rsp 8 bytes off the 16-byte alignment
+    emitAddImmediate(buffer, X86Register_RSP, -CELL);
+
+    emitMoveRegister(buffer, CONTEXT, X86Register_RDI);
+    emitStore(buffer, CONTEXT, offsetof(JitContext, saved_stack_pointer), X86Register_RSP);
+
+    emitLoad(buffer, STACK_TOP,  CONTEXT, offsetof(JitContext, stack_top));
+    emitLoad(buffer, STACK_BASE, CONTEXT, offsetof(JitContext, stack_base));
+    emitLoad(buffer, RAM,        CONTEXT, offsetof(JitContext, ram));
+    emitMoveImmediate(buffer, CALL_DEPTH, 0);
+
+    emitRestoreRegisters(compiler);
+}
+
+
+static void compileInstruction(JitCompiler* const compiler, size_t index)
+{
+    assert(compiler != NULL);
+
+    CodeBuffer*              buffer      = &compiler->buffer;
+    const Instruction* const instruction = compiler->program + index;
+
+    switch (instruction->command)
+    {
+        case MachineCommands_PUSH:
+        {
+            bool has_register = instruction->flags & REGISTER_FLAG;
+            bool has_constant = instruction->flags & CONST_FLAG;
+
+            if (has_register && !has_constant && !(instruction->flags & RAM_FLAG))
+            {
+                emitOperandPush(compiler, getRegisterXmm(instruction->register_index));
+                break;
+            }
+
+            if (has_register)
+            {
+                emitSseMove(buffer, FIRST_XMM, getRegisterXmm(instruction->register_index));
+
+                if (has_constant)
+                {
+                    emitLoadConstant(compiler, SECOND_XMM, instruction->immediate);
+                    emitSseOperation(buffer, SseOperation_ADD, FIRST_XMM, SECOND_XMM);
+                }
+            }
+            else
+            {
+                // folded here exactly the way pushArgument adds it to zero
+                arguments_type argument = 0;
+                if (has_constant)
+                {
+                    argument += instruction->immediate;
+                }
+
+                emitLoadConstant(compiler, FIRST_XMM, argument);
+            }
+
+            if (instruction->flags & RAM_FLAG)
+            {
+                emitSseTruncate(buffer, SCRATCH, FIRST_XMM);
+                emitSignExtend32(buffer, SCRATCH, SCRATCH);
+                emitSseLoadIndexed(buffer, FIRST_XMM, RAM, SCRATCH);
+            }
+
+            emitOperandPush(compiler, FIRST_XMM);
+            break;
+        }
+
+        case MachineCommands_POP:
+            if (instruction->flags & RAM_FLAG)
+            {
+                emitUnderflowCheck(compiler, 1);
+
+                if (instruction->flags & REGISTER_FLAG)
+                {
+                    emitSseTruncate(buffer, SCRATCH, getRegisterXmm(instruction->register_index));
+                }
+                else
+                {
+                    emitMoveImmediate(buffer, SCRATCH, 0);
+                }
+
+                if (instruction->flags & CONST_FLAG)
+                {
+                    emitAddImmediate32(buffer, SCRATCH, (int)instruction->immediate);
+                }
+
+                emitSignExtend32(buffer, SCRATCH, SCRATCH);
+                emitAddImmediate(buffer, STACK_TOP, -CELL);
+                emitSseLoad(buffer, FIRST_XMM, STACK_TOP, 0);
+                emitSseStoreIndexed(buffer, RAM, SCRATCH, FIRST_XMM);
+            }
+            else
+            {
+                emitOperandPop(compiler, getRegisterXmm(instruction->register_index));
+            }
+            break;
+
+        case MachineCommands_ADD:  emitBinaryOperation(compiler, SseOperation_ADD); break;
+        case MachineCommands_SUB:  emitBinaryOperation(compiler, SseOperation_SUB); break;
+        case MachineCommands_MUL:  emitBinaryOperation(compiler, SseOperation_MUL); break;
+        case MachineCommands_DIV:  emitBinaryOperation(compiler, SseOperation_DIV); break;
+
+        case MachineCommands_SQRT:
+            emitUnderflowCheck(compiler, 1);
+            emitSseOperationMemory(buffer, SseOperation_SQRT, FIRST_XMM, STACK_TOP, -CELL);
+            emitSseStore(buffer, STACK_TOP, -CELL, FIRST_XMM);
+            break;
+
+        case MachineCommands_OUT:
+            emitOperandPop(compiler, FIRST_XMM);
+            emitLoad(buffer, X86Register_RDI, CONTEXT, offsetof(JitContext, io));
+            emitCallback(compiler, (uint64_t)(uintptr_t)&printProgramOut);
+            break;
+
+        case MachineCommands_IN:
+            emitLoad(buffer, X86Register_RDI, CONTEXT, offsetof(JitContext, io));
+            emitCallback(compiler, (uint64_t)(uintptr_t)&scanProgramIn);
+            emitOperandPush(compiler, FIRST_XMM);
+            break;
+
+        case MachineCommands_TIMESTAMP:
+            emitLoad(buffer, X86Register_RDI, CONTEXT, offsetof(JitContext, io));
+            emitCallback(compiler, (uint64_t)(uintptr_t)&readProgramClock);
+            emitOperandPush(compiler, FIRST_XMM);
+            break;
+
+        case MachineCommands_JMP:
+            addJumpPatch(compiler, emitJumpRelative(buffer), instruction->target);
+            break;
+
+        case MachineCommands_JA:
+        case MachineCommands_JAE:
+        case MachineCommands_JB:
+        case MachineCommands_JBE:
+        case MachineCommands_JE:
+        case MachineCommands_JNE:
+        case DecodedCommands_JA_PAIR:
+        case DecodedCommands_JAE_PAIR:
+        case DecodedCommands_JB_PAIR:
+        case DecodedCommands_JBE_PAIR:
+        case DecodedCommands_JE_PAIR:
+        case DecodedCommands_JNE_PAIR:
+            addJumpPatch(compiler, emitJumpConditional(buffer, emitJumpTest(compiler, instruction)),
+                         instruction->target);
+            break;
+
+        case MachineCommands_CALL:
+        case MachineCommands_PURE_CALL:
+            if (compiler->checked)
+            {
+                emitCompareImmediate(buffer, CALL_DEPTH, MAX_CALL_DEPTH);
+                emitJumpToError(compiler, X86Condition_AE, JitStatus_CALL_OVERFLOW);
+            }
+
+            if (compiler->counts_calls)
+            {
+                emitIncrement(buffer, CALL_DEPTH);
+            }
+
+            // the return address of call goes onto the native stack
+            addJumpPatch(compiler, emitCallRelative(buffer), instruction->target);
+            break;
+
+        case MachineCommands_RET:
+            if (compiler->checked)
+            {
+                emitTest(buffer, CALL_DEPTH, CALL_DEPTH);
+                emitJumpToError(compiler, X86Condition_E, JitStatus_RETURN_WITHOUT_CALL);
+            }
+
+            if (compiler->counts_calls)
+            {
+                emitDecrement(buffer, CALL_DEPTH);
+            }
+
+            emitReturn(buffer);
+            break;
+
+        // the return address of the current procedure stays on top of the native stack for the callee
+        case MachineCommands_TAILCALL:
+            addJumpPatch(compiler, emitJumpRelative(buffer), instruction->target);
+            break;
+
+        case MachineCommands_CALL_DEPTH:
+            assert(compiler->counts_calls);
+            emitSseFromInteger(buffer, FIRST_XMM, CALL_DEPTH);
+            emitOperandPush(compiler, FIRST_XMM);
+            break;
+
+        case MachineCommands_DRAW:
+            emitLoad(buffer, X86Register_RDI, CONTEXT, offsetof(JitContext, io));
+            emitMoveRegister(buffer, X86Register_RSI, RAM);
+            emitCallback(compiler, (uint64_t)(uintptr_t)&drawRam);
+            break;
+
+        case MachineCommands_HLT:
+            patchRelative(buffer, emitJumpRelative(buffer), compiler->exit_offset);
+            break;
+
+        case MachineCommands_PUSH_SUB:
+            emitLoadPairOperands(compiler, instruction);
+            emitSseOperation(buffer, SseOperation_SUB, FIRST_XMM, SECOND_XMM);
+            emitOperandPush(compiler, FIRST_XMM);
+            break;
+
+        case MachineCommands_INC:
+            emitLoadConstant(compiler, SECOND_XMM, instruction->immediate);
+            emitSseOperation(buffer, SseOperation_ADD, getRegisterXmm(instruction->register_index), SECOND_XMM);
+            break;
+
+        case DecodedCommands_VADD:
+        case DecodedCommands_VSUB:
+        case DecodedCommands_VMUL:
+        case DecodedCommands_VDIV:
+        case DecodedCommands_VSCALE:
+        case DecodedCommands_VFILL:
+        case DecodedCommands_VCOPY:
+        case DecodedCommands_VSUM:
+        case DecodedCommands_VDOT:
+        case DecodedCommands_VLESS:
+        {
+            uint8_t                  vector_command = (uint8_t)(instruction->command - DecodedCommands_VADD);
+            const VectorCommandInfo* info           = VECTOR_COMMANDS + vector_command;
+
+            // the operands are passed where they lie on the operand stack, lowest first
+            emitUnderflowCheck(compiler, info->operands);
+            emitAddImmediate(buffer, STACK_TOP, -info->operands * CELL);
+            emitMoveImmediate(buffer, X86Register_RDI, vector_command);
+            emitMoveRegister(buffer, X86Register_RSI, RAM);
+            emitMoveRegister(buffer, X86Register_RDX, STACK_TOP);
+            emitCallback(compiler, (uint64_t)(uintptr_t)&executeVectorCommand);
+
+            if (info->results)
+            {
+                emitOperandPush(compiler, FIRST_XMM);
+            }
+            break;
+        }
+
+        default:
+            assert(0 && "Decoder let through an unknown command");
+            break;
+    }
+}
+
+
+static void resolveJumps(JitCompiler* const compiler)
+{
+    assert(compiler != NULL);
+
+    for (size_t patch = 0; patch < compiler->patches_size; patch++)
+    {
+        patchRelative(&compiler->buffer, compiler->patches[patch].position,
+                      compiler->native_offsets[compiler->patches[patch].target]);
+    }
+}
+
+
+// Plain instructions compile the same way as in the whole program, conditional jumps become guards
+// that leave the trace when the condition goes the other way than it did while recording.
+static void compileTraceStep(JitCompiler* const compiler, const TraceStep* const step)
+{
+    assert(compiler != NULL);
+    assert(step     != NULL);
+
+    const Instruction* const instruction = compiler->program + step->index;
+
+    switch (instruction->command)
+    {
+        case MachineCommands_JMP:
+        case MachineCommands_TAILCALL:
+            break;
+
+        case MachineCommands_JA:
+        case MachineCommands_JAE:
+        case MachineCommands_JB:
+        case MachineCommands_JBE:
+        case MachineCommands_JE:
+        case MachineCommands_JNE:
+        case DecodedCommands_JA_PAIR:
+        case DecodedCommands_JAE_PAIR:
+        case DecodedCommands_JB_PAIR:
+        case DecodedCommands_JBE_PAIR:
+        case DecodedCommands_JE_PAIR:
+        case DecodedCommands_JNE_PAIR:
+        {
+            X86Condition taken_if  = emitJumpTest(compiler, instruction);
+            bool         was_taken = step->next == instruction->target;
+            X86Condition exit_if   = was_taken ? invertCondition(taken_if) : taken_if;
+
+            compiler->guards[compiler->guards_size++] = {
+                .position = emitJumpConditional(&compiler->buffer, exit_if),
+                .exit_ip  = was_taken ? step->index + 1 : instruction->target,
+            };
+            break;
+        }
+
+        case MachineCommands_CALL:
+        case MachineCommands_PURE_CALL:
+        case MachineCommands_RET:
+        case MachineCommands_HLT:
+        case MachineCommands_CALL_DEPTH:
+            assert(0 && "Recorder let a call, ret, calldepth or hlt into a trace");
+            break;
+
+        default:
+            compileInstruction(compiler, step->index);
+            break;
+    }
+}
+
+
+// A guard some side trace starts from jumps into it, the rest get an exit that tells the interpreter where to go.
+static void resolveGuards(JitCompiler* const  compiler,
+                          const TraceTree* const tree,
+                          const size_t* const    fragment_offsets)
+{
+    assert(compiler         != NULL);
+    assert(tree             != NULL);
+    assert(fragment_offsets != NULL);
+
+    CodeBuffer* buffer = &compiler->buffer;
+
+    for (size_t guard = 0; guard < compiler->guards_size; guard++)
+    {
+        size_t side_trace = 0;
+        while (side_trace < tree->fragments_size && tree->fragments[side_trace].parent_exit != guard)
+        {
+            side_trace++;
+        }
+
+        if (side_trace < tree->fragments_size)
+        {
+            patchRelative(buffer, compiler->guards[guard].position, fragment_offsets[side_trace]);
+            continue;
+        }
+
+        patchRelative(buffer, compiler->guards[guard].position, buffer->size);
+
+        emitMoveImmediate(buffer, SCRATCH, compiler->guards[guard].exit_ip);
+        emitStore(buffer, CONTEXT, offsetof(JitContext, exit_ip), SCRATCH);
+        emitStoreImmediate32(buffer, CONTEXT, offsetof(JitContext, exit_number), (int32_t)guard);
+        patchRelative(buffer, emitJumpRelative(buffer), compiler->exit_offset);
+    }
+}
+
+
+static void runNativeCode(SPU* const spu, const JitProgram* const jit_program, JitContext* const context)
+{
+    assert(spu               != NULL);
+    assert(jit_program       != NULL);
+    assert(jit_program->code != NULL);
+    assert(context           != NULL);
+
+    *context = {
+        .stack_top   = spu->stack_top,
+        .stack_base  = spu->operand_stack,
+        .stack_limit = spu->operand_stack + SIZE_OF_STACK,
+        .ram         = spu->ram,
+        .io          = &spu->io,
+    };
+    memcpy(context->registers, spu->registers, sizeof(context->registers));
+
+    JitEntry entry   = NULL;
+    void*    address = jit_program->code + jit_program->entry;
+    memcpy(&entry, &address, sizeof(entry));
+
+    entry(context);
+
+    memcpy(spu->registers, context->registers, sizeof(context->registers));
+    spu->stack_top = context->stack_top;
+
+    if (context->status != JitStatus_OK)
+    {
+        raiseRuntimeError(getStatusMessage(context->status));
+    }
+}
+
+
+static uint8_t getRegisterXmm(uint8_t register_index)
+{
+    assert(register_index >= 1 && register_index <= NUMBER_OF_REGISTERS);
+
+    return (uint8_t)(REGISTERS_XMM + register_index - 1);
+}
+
+
+static void emitLoadConstant(JitCompiler* const compiler, uint8_t xmm, arguments_type value)
+{
+    assert(compiler != NULL);
+
+    uint64_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+
+    emitMoveImmediate(&compiler->buffer, SCRATCH, bits);
+    emitSseFromRegister(&compiler->buffer, xmm, SCRATCH);
+}
+
+
+// same order as loadPairOperands: the operand that would be on top goes to the first xmm
+static void emitLoadPairOperands(JitCompiler* const compiler, const Instruction* const instruction)
+{
+    assert(compiler    != NULL);
+    assert(instruction != NULL);
+
+    if (instruction->flags & PAIR_SECOND_REGISTER_FLAG)
+    {
+        emitSseMove(&compiler->buffer, FIRST_XMM, getRegisterXmm(instruction->second_register_index));
+    }
+    else
+    {
+        emitLoadConstant(compiler, FIRST_XMM, instruction->second_immediate);
+    }
+
+    if (instruction->flags & PAIR_FIRST_REGISTER_FLAG)
+    {
+        emitSseMove(&compiler->buffer, SECOND_XMM, getRegisterXmm(instruction->register_index));
+    }
+    else
+    {
+        emitLoadConstant(compiler, SECOND_XMM, instruction->immediate);
+    }
+}
+
+
+static void emitSaveRegisters(JitCompiler* const compiler)
+{
+    assert(compiler != NULL);
+
+    for (uint8_t register_index = 1; register_index <= NUMBER_OF_REGISTERS; register_index++)
+    {
+        emitSseStore(&compiler->buffer, CONTEXT,
+                     (int32_t)(offsetof(JitContext, registers) + register_index * sizeof(arguments_type)),
+                     getRegisterXmm(register_index));
+    }
+}
+
+
+static void emitRestoreRegisters(JitCompiler* const compiler)
+{
+    assert(compiler != NULL);
+
+    for (uint8_t register_index = 1; register_index <= NUMBER_OF_REGISTERS; register_index++)
+    {
+        emitSseLoad(&compiler->buffer, getRegisterXmm(register_index), CONTEXT,
+                    (int32_t)(offsetof(JitContext, registers) + register_index * sizeof(arguments_type)));
+    }
+}
+
+
+// Calls a C function with arguments already in place. Every xmm register is clobbered by the
+// callee, and the native stack is aligned by hand since procedures may have left it off by 8.
+static void emitCallback(JitCompiler* const compiler, uint64_t function)
+{
+    assert(compiler != NULL);
+
+    CodeBuffer* buffer = &compiler->buffer;
+
+    emitSaveRegisters(compiler);
+
+    emitMoveRegister(buffer, SAVED_RSP, X86Register_RSP);
+    emitAndImmediate(buffer, X86Register_RSP, -16);
+    emitMoveImmediate(buffer, SCRATCH, function);
+    emitCallRegister(buffer, SCRATCH);
+    emitMoveRegister(buffer, X86Register_RSP, SAVED_RSP);
+
+    emitRestoreRegisters(compiler);
+}
+
+
+static void emitJumpToError(JitCompiler* const compiler, X86Condition condition, JitStatus status)
+{
+    assert(compiler != NULL);
+
+    patchRelative(&compiler->buffer, emitJumpConditional(&compiler->buffer, condition),
+                  compiler->error_offsets[status]);
+}
+
+
+static void emitOverflowCheck(JitCompiler* const compiler)
+{
+    assert(compiler != NULL);
+
+    if (!compiler->checked)
+    {
+        return;
+    }
+
+    emitCompareMemory(&compiler->buffer, STACK_TOP, CONTEXT, offsetof(JitContext, stack_limit));
+    emitJumpToError(compiler, X86Condition_AE, JitStatus_STACK_OVERFLOW);
+}
+
+
+static void emitUnderflowCheck(JitCompiler* const compiler, int32_t count)
+{
+    assert(compiler != NULL);
+
+    if (!compiler->checked)
+    {
+        return;
+    }
+
+    emitMoveRegister(&compiler->buffer, SCRATCH, STACK_TOP);
+    emitSubRegister(&compiler->buffer, SCRATCH, STACK_BASE);
+    emitCompareImmediate(&compiler->buffer, SCRATCH, count * CELL);
+    emitJumpToError(compiler, X86Condition_B, JitStatus_STACK_UNDERFLOW);
+}
+
+
+static void emitOperandPush(JitCompiler* const compiler, uint8_t xmm)
+{
+    assert(compiler != NULL);
+
+    emitOverflowCheck(compiler);
+    emitSseStore(&compiler->buffer, STACK_TOP, 0, xmm);
+    emitAddImmediate(&compiler->buffer, STACK_TOP, CELL);
+}
+
+
+static void emitOperandPop(JitCompiler* const compiler, uint8_t xmm)
+{
+    assert(compiler != NULL);
+
+    emitUnderflowCheck(compiler, 1);
+    emitAddImmediate(&compiler->buffer, STACK_TOP, -CELL);
+    emitSseLoad(&compiler->buffer, xmm, STACK_TOP, 0);
+}
+
+
+// first = top of the stack, second = the one below, result = first OP second replaces both
+static void emitBinaryOperation(JitCompiler* const compiler, SseOperation operation)
+{
+    assert(compiler != NULL);
+
+    CodeBuffer* buffer = &compiler->buffer;
+
+    emitUnderflowCheck(compiler, 2);
+    emitSseLoad(buffer, FIRST_XMM, STACK_TOP, -CELL);
+    emitSseOperationMemory(buffer, operation, FIRST_XMM, STACK_TOP, -2 * CELL);
+    emitSseStore(buffer, STACK_TOP, -2 * CELL, FIRST_XMM);
+    emitAddImmediate(buffer, STACK_TOP, -CELL);
+}
+
+
+// Loads the operands of a conditional jump into xmm0 (first) and xmm1 (second), compares them and
+// returns the condition the jump is taken on. ucomisd reports unordered as below-or-equal, so
+// "less" conditions swap operands and use above: every comparison with NaN is false, as in C.
+static X86Condition emitJumpTest(JitCompiler* const compiler, const Instruction* const instruction)
+{
+    assert(compiler    != NULL);
+    assert(instruction != NULL);
+
+    CodeBuffer* buffer    = &compiler->buffer;
+    uint8_t     condition = 0;
+
+    if (instruction->command >= DecodedCommands_JA_PAIR)
+    {
+        emitLoadPairOperands(compiler, instruction);
+        condition = (uint8_t)(instruction->command - DecodedCommands_JA_PAIR);
+    }
+    else
+    {
+        emitUnderflowCheck(compiler, 2);
+        emitSseLoad(buffer, FIRST_XMM,  STACK_TOP, -CELL);
+        emitSseLoad(buffer, SECOND_XMM, STACK_TOP, -2 * CELL);
+        emitAddImmediate(buffer, STACK_TOP, -2 * CELL);
+        condition = (uint8_t)(instruction->command - MachineCommands_JA);
+    }
+
+    X86Condition jump_if = X86Condition_A;
+
+    switch (condition + MachineCommands_JA)
+    {
+        case MachineCommands_JA:
+            emitSseCompare(buffer, FIRST_XMM, SECOND_XMM);
+            jump_if = X86Condition_A;
+            break;
+
+        case MachineCommands_JAE:
+            emitSseCompare(buffer, FIRST_XMM, SECOND_XMM);
+            jump_if = X86Condition_AE;
+            break;
+
+        case MachineCommands_JB:
+            emitSseCompare(buffer, SECOND_XMM, FIRST_XMM);
+            jump_if = X86Condition_A;
+            break;
+
+        case MachineCommands_JBE:
+            emitSseCompare(buffer, SECOND_XMM, FIRST_XMM);
+            jump_if = X86Condition_AE;
+            break;
+
+        // equality goes through the same epsilon comparison the interpreter uses
+        case MachineCommands_JE:
+        case MachineCommands_JNE:
+            emitCallback(compiler, (uint64_t)(uintptr_t)&equatTwoDoubles);
+            emitTestByte(buffer, X86Register_RAX);
+            jump_if = condition + MachineCommands_JA == MachineCommands_JE ? X86Condition_NE : X86Condition_E;
+            break;
+
+        default:
+            assert(0 && "Unknown jump condition");
+            break;
+    }
+
+    return jump_if;
+}
+
+
+static void addJumpPatch(JitCompiler* const compiler, size_t position, size_t target)
+{
+    assert(compiler != NULL);
+    assert(compiler->patches_size < compiler->number_of_instructions);
+
+    compiler->patches[compiler->patches_size++] = {
+        .position = position,
+        .target   = target,
+    };
+}
+
+
+static bool usesCallDepth(const SPU* const spu)
+{
+    assert(spu != NULL);
+
+    for (size_t index = 0; index < spu->program_size; index++)
+    {
+        if (spu->program[index].command == MachineCommands_CALL_DEPTH)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static const char* getStatusMessage(int32_t status)
+{
+    switch (status)
+    {
+        case JitStatus_STACK_OVERFLOW:      return "Operand stack overflow";
+        case JitStatus_STACK_UNDERFLOW:     return "Operand stack underflow";
+        case JitStatus_CALL_OVERFLOW:       return "Call stack overflow";
+        case JitStatus_RETURN_WITHOUT_CALL: return "Return without call";
+        default:                            return "Unknown error in native code";
+    }
+}
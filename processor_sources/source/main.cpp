@@ -1,20 +1,299 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 
+#include "helpful_functions.h"
 #include "logger.h"
 #include "processor.h"
+#include "batch.h"
+#include "memo.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "command_handler.h"
+
+
+static const char* HELP_OPTION     = "--help";
+static const char* SWITCH_OPTION   = "--switch";
+static const char* THREADED_OPTION = "--threaded";
+static const char* REGISTER_OPTION = "--register";
+static const char* JIT_OPTION      = "--jit";
+static const char* TRACE_OPTION    = "--trace";
+static const char* CHECKED_OPTION  = "--checked";
+static const char* BATCH_OPTION    = "--batch";
+static const char* JOBS_OPTION     = "--jobs";
+static const char* PIN_OPTION      = "--pin";
+static const char* OUTPUT_OPTION   = "--batch-output";
+static const char* QUANTUM_OPTION  = "--quantum";
+static const char* BUFFERED_OPTION = "--buffered";
+static const char* INPUT_OPTION    = "--input";
+static const char* BINARY_OPTION   = "--binary";
+static const char* MEMO_OPTION     = "--memo-cache";
+static const char* PROFILE_OPTION  = "--profile";
+static const char* PERF_OPTION     = "--perf";
+static const char* SNAPSHOT_OPTION = "--snapshot";
+static const char* AT_OPTION       = "--snapshot-at";
+static const char* RESTORE_OPTION  = "--restore";
+
+
+static bool parseSnapshotPoint(const char* where, SnapshotPoint* const point);
+static void printHelp(void);
 
 
 int main(const int argc, const char** argv)
-{ // NOTE сделать минимальный обработчик опция (типо --help)
+{
     openLogFile("log.txt");
 
-    if (argc <= 1)
+    ProcessorOptions options = {
+        .engine          = DEFAULT_ENGINE,
+        .force_checks    = false,
+        .memo_cache_size = DEFAULT_MEMO_CACHE_SIZE,
+        .profile         = false,
+        .perf_counters   = false,
+        .snapshot        = {
+            .path         = NULL,
+            .opcode       = MachineCommands_UNKNOWN,
+            .instructions = 0,
+        },
+        .streams         = {},
+    };
+
+    BatchOptions batch_options = {
+        .number_of_workers = 0,
+        .pin_workers       = false,
+        .output_directory  = DEFAULT_BATCH_OUTPUT,
+        .quantum           = 0,
+    };
+
+    const char* path_to_program  = NULL;
+    const char* path_to_manifest = NULL;
+    const char* path_to_input    = NULL;
+    const char* path_to_snapshot = NULL;    // to restore
+    const char* snapshot_at      = NULL;
+
+    for (int current_arg = 1; current_arg < argc; current_arg++)
+    {
+        if (!strcmp(argv[current_arg], HELP_OPTION))
+        {
+            printHelp();
+            return 0;
+        }
+        else if (!strcmp(argv[current_arg], SWITCH_OPTION))
+        {
+            options.engine = ProcessorEngine_SWITCH;
+        }
+        else if (!strcmp(argv[current_arg], THREADED_OPTION))
+        {
+            options.engine = ProcessorEngine_THREADED;
+        }
+        else if (!strcmp(argv[current_arg], REGISTER_OPTION))
+        {
+            options.engine = ProcessorEngine_REGISTER;
+        }
+        else if (!strcmp(argv[current_arg], JIT_OPTION))
+        {
+            options.engine = ProcessorEngine_JIT;
+        }
+        else if (!strcmp(argv[current_arg], TRACE_OPTION))
+        {
+            options.engine = ProcessorEngine_TRACING;
+        }
+        else if (!strcmp(argv[current_arg], CHECKED_OPTION))
+        {
+            options.force_checks = true;
+        }
+        else if (!strcmp(argv[current_arg], BATCH_OPTION) && current_arg + 1 < argc)
+        {
+            path_to_manifest = argv[++current_arg];
+        }
+        else if (!strcmp(argv[current_arg], JOBS_OPTION) && current_arg + 1 < argc)
+        {
+            batch_options.number_of_workers = strtoul(argv[++current_arg], NULL, 10);
+        }
+        else if (!strcmp(argv[current_arg], PIN_OPTION))
+        {
+            batch_options.pin_workers = true;
+        }
+        else if (!strcmp(argv[current_arg], OUTPUT_OPTION) && current_arg + 1 < argc)
+        {
+            batch_options.output_directory = argv[++current_arg];
+        }
+        else if (!strcmp(argv[current_arg], QUANTUM_OPTION) && current_arg + 1 < argc)
+        {
+            batch_options.quantum = strtoul(argv[++current_arg], NULL, 10);
+        }
+        else if (!strcmp(argv[current_arg], BUFFERED_OPTION))
+        {
+            options.streams.mode = SpuIoMode_BUFFERED;
+        }
+        else if (!strcmp(argv[current_arg], INPUT_OPTION) && current_arg + 1 < argc)
+        {
+            path_to_input = argv[++current_arg];
+        }
+        else if (!strcmp(argv[current_arg], BINARY_OPTION))
+        {
+            options.streams.output_format = SpuOutputFormat_BINARY;
+        }
+        else if (!strcmp(argv[current_arg], MEMO_OPTION) && current_arg + 1 < argc)
+        {
+            options.memo_cache_size = strtoul(argv[++current_arg], NULL, 10);
+        }
+        else if (!strcmp(argv[current_arg], PROFILE_OPTION))
+        {
+            options.profile = true;
+        }
+        else if (!strcmp(argv[current_arg], PERF_OPTION))
+        {
+            options.perf_counters = true;
+        }
+        else if (!strcmp(argv[current_arg], SNAPSHOT_OPTION) && current_arg + 1 < argc)
+        {
+            options.snapshot.path = argv[++current_arg];
+        }
+        else if (!strcmp(argv[current_arg], AT_OPTION) && current_arg + 1 < argc)
+        {
+            snapshot_at = argv[++current_arg];
+        }
+        else if (!strcmp(argv[current_arg], RESTORE_OPTION) && current_arg + 1 < argc)
+        {
+            path_to_snapshot = argv[++current_arg];
+        }
+        else
+        {
+            path_to_program = argv[current_arg];
+        }
+    }
+
+    if ((options.snapshot.path == NULL) != (snapshot_at == NULL))
+    {
+        printf("%s and %s go together\n", SNAPSHOT_OPTION, AT_OPTION);
+        return 1;
+    }
+
+    if (snapshot_at && !parseSnapshotPoint(snapshot_at, &options.snapshot))
+    {
+        printf("Unknown snapshot point %s, expected a command name or a number of instructions\n", snapshot_at);
+        return 1;
+    }
+
+    if (options.snapshot.path && options.profile)
+    {
+        printf("%s and %s can not be combined\n", SNAPSHOT_OPTION, PROFILE_OPTION);
+        return 1;
+    }
+
+    if (path_to_manifest)
+    {
+        if (options.profile)
+        {
+            printf("%s profiles a single program, not a batch\n", PROFILE_OPTION);
+            return 1;
+        }
+
+        if (options.perf_counters)
+        {
+            printf("%s counts a single program, not a batch\n", PERF_OPTION);
+            return 1;
+        }
+
+        if (options.snapshot.path || path_to_snapshot)
+        {
+            printf("%s and %s work with a single program, not a batch\n", SNAPSHOT_OPTION, RESTORE_OPTION);
+            return 1;
+        }
+
+        ProcessorErrorHandler return_code = runBatch(path_to_manifest, &options, &batch_options);
+        if (return_code != ProcessorErrorHandler_OK)
+        {
+            printf("Failed to run batch %s (error %d)\n", path_to_manifest, return_code);
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (!path_to_program)
     {
         printf("No arguments to compile");
         return 0;
     }
 
-    executeProgram(argv[1]);
+    if (path_to_input)
+    {
+        options.streams.input = fopen(path_to_input, "r");
+        if (!options.streams.input)
+        {
+            printf("Failed to open %s\n", path_to_input);
+            return 1;
+        }
+    }
+
+    ProcessorErrorHandler return_code = path_to_snapshot
+                                      ? resumeProgram(path_to_program, path_to_snapshot, &options)
+                                      : executeProgram(path_to_program, &options);
+
+    if (options.streams.input)
+    {
+        FCLOSE_NULL(options.streams.input);
+    }
+
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        printf("Failed to run %s (error %d)\n", path_to_program, return_code);
+        return 1;
+    }
 
     return 0;
 }
+
+
+// a command name stops in front of the first command of that kind, a number after that many instructions
+static bool parseSnapshotPoint(const char* where, SnapshotPoint* const point)
+{
+    assert(where != NULL);
+    assert(point != NULL);
+
+    point->opcode = findSnapshotOpcode(where);
+    if (point->opcode != MachineCommands_UNKNOWN)
+    {
+        return true;
+    }
+
+    char* end = NULL;
+    point->instructions = strtoull(where, &end, 10);
+
+    return end != where && *end == '\0' && where[0] != '-';
+}
+
+
+static void printHelp(void)
+{
+    printf("Usage: ./processor [options] program_code.bin\n"
+           "       ./processor [options] %s manifest.txt\n"
+           "  %-12s use switch dispatch loop\n"
+           "  %-12s use direct-threaded dispatch (computed goto)\n"
+           "  %-12s translate into register code and run that\n"
+           "  %-12s compile into native x86-64 code and run that\n"
+           "  %-12s interpret and compile only hot loops into native code\n"
+           "  %-12s keep stack checks even for verified programs\n"
+           "  %-12s run every \"program.bin input.txt\" line of the manifest on a pool of workers\n"
+           "  %-12s number of workers, one per CPU by default\n"
+           "  %-12s bind every worker to a CPU of its own\n"
+           "  %-12s directory for the job_N.out files, %s by default\n"
+           "  %-12s run the batch as green threads switched every N instructions, %zu suits most programs\n"
+           "  %-12s no prompts, read input in bulk and write output only at hlt or when the buffer is full\n"
+           "  %-12s read the values of in from a file instead of stdin\n"
+           "  %-12s write every out as the raw bytes of its value, nothing else is written\n"
+           "  %-12s entries of the cache of pure procedure results, %zu by default, 0 turns it off\n"
+           "  %-12s time every instruction, write %s and %s for flame graph tools\n"
+           "  %-12s log host cycles, instructions, branch, L1d and iTLB misses of the run (Linux perf_event_open)\n"
+           "  %-12s write the state of the SPU into a file at the point given by %s\n"
+           "  %-12s a command name such as in, taken right before the first one, or a number of instructions\n"
+           "  %-12s go on from a snapshot of the same program instead of starting from the beginning\n"
+           "  %-12s show this message\n",
+           BATCH_OPTION, SWITCH_OPTION, THREADED_OPTION, REGISTER_OPTION, JIT_OPTION, TRACE_OPTION, CHECKED_OPTION,
+           BATCH_OPTION, JOBS_OPTION, PIN_OPTION, OUTPUT_OPTION, DEFAULT_BATCH_OUTPUT, QUANTUM_OPTION,
+           DEFAULT_QUANTUM, BUFFERED_OPTION, INPUT_OPTION, BINARY_OPTION, MEMO_OPTION, DEFAULT_MEMO_CACHE_SIZE,
+           PROFILE_OPTION, PROFILE_REPORT_PATH, PROFILE_FOLDED_PATH, PERF_OPTION, SNAPSHOT_OPTION, AT_OPTION, AT_OPTION, RESTORE_OPTION, HELP_OPTION);
+}
@@ -0,0 +1,789 @@
+#include "memo.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+#include "helpful_functions.h"
+#include "command_handler.h"
+#include "logger.h"
+#include "verifier.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const long UNKNOWN_DEPTH = LONG_MIN;
+static const long DEPTH_LIMIT   = (long)SIZE_OF_STACK;
+
+// the library stack has no cells the arguments could be read from and the results written to
+#ifdef USE_STACK_LIBRARY
+static const bool MEMO_AVAILABLE = false;
+#else
+static const bool MEMO_AVAILABLE = true;
+#endif
+
+// What a procedure does to the stack below the depth of its call and to the registers. Every pass
+// starts from what the last one found and can only make it worse, so the passes come to an end.
+typedef struct ProcedureEffect
+{
+    bool    listed;           // entry is in PurityAnalysis::entries
+    bool    called_pure;      // some pure call goes to it
+    bool    pure;
+    bool    exact;            // one depth at every instruction and at every ret
+    bool    returns;
+    long    return_depth;
+    long    min_depth;
+    uint8_t registers;
+} ProcedureEffect;
+
+typedef struct PurityAnalysis
+{
+    const Instruction* program;
+    size_t             number_of_instructions;   // decoded program with its closing hlt
+    ProcedureEffect*   effects;                  // by entry
+    size_t*            entries;
+    size_t             number_of_entries;
+    long*              depths;
+    size_t*            worklist;
+    size_t             worklist_size;
+} PurityAnalysis;
+
+typedef struct MemoEntry
+{
+    bool           valid;             // results are filled in
+    size_t         procedure;
+    uint64_t       stamp;             // call that claimed the entry last
+    arguments_type key[MAX_MEMO_VALUES];
+    arguments_type results[MAX_MEMO_VALUES];
+} MemoEntry;
+
+// A missed call that is still running. Its ret fills the entry in, unless a call made
+// in the meantime claimed the same entry.
+typedef struct PendingMemoCall
+{
+    size_t          call_depth;       // depth the ret of the call runs at
+    size_t          slot;
+    uint64_t        stamp;
+    arguments_type* base;             // first argument, the results start there as well
+} PendingMemoCall;
+
+struct MemoCache
+{
+    const MemoProgram* program;
+    MemoEntry*         entries;
+    size_t             mask;
+    PendingMemoCall*   pending;       // CALL_STACK_SIZE entries
+    size_t             pending_size;
+    uint64_t           last_stamp;
+    MemoStatistics     statistics;
+};
+
+static ProcedureEffect* listProcedure(PurityAnalysis* const analysis, size_t entry);
+static bool analyseEffect(PurityAnalysis* const analysis, size_t entry);
+static void visitInstruction(PurityAnalysis* const  analysis,
+                             ProcedureEffect* const effect,
+                             size_t                 index,
+                             long                   depth);
+static void addReturn(ProcedureEffect* const effect, long depth);
+static ProcessorErrorHandler collectPureProcedures(SPU* const                  spu,
+                                                   const PurityAnalysis* const analysis,
+                                                   MemoProgram* const          memo_program);
+static const char* checkPureProcedure(const ProcedureEffect* const effect, PureProcedure* const procedure);
+static bool hasSideEffects(const Instruction* const instruction);
+static uint8_t getUsedRegisters(const Instruction* const instruction);
+static bool isConditionalJump(uint8_t command);
+
+static size_t makeMemoKey(const PureProcedure* const  procedure,
+                          const arguments_type* const registers,
+                          const arguments_type* const base,
+                          arguments_type* const       key);
+static size_t hashMemoKey(size_t procedure, const arguments_type* const key, size_t key_size);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+ProcessorErrorHandler analysePureProcedures(SPU* const spu, MemoProgram* const memo_program)
+{
+    assert(spu          != NULL);
+    assert(memo_program != NULL);
+
+    *memo_program = {};
+
+    size_t number_of_instructions = spu->program_size + 1;
+
+    bool has_pure_calls = false;
+    for (size_t index = 0; index < number_of_instructions; index++)
+    {
+        has_pure_calls = has_pure_calls || spu->program[index].command == MachineCommands_PURE_CALL;
+    }
+
+    if (!has_pure_calls)
+    {
+        return ProcessorErrorHandler_OK;
+    }
+
+    PurityAnalysis analysis = {
+        .program                = spu->program,
+        .number_of_instructions = number_of_instructions,
+        .effects                = (ProcedureEffect*)calloc(number_of_instructions, sizeof(ProcedureEffect)),
+        .entries                = (size_t*)calloc(number_of_instructions, sizeof(size_t)),
+        .number_of_entries      = 0,
+        .depths                 = (long*)calloc(number_of_instructions, sizeof(long)),
+        .worklist               = (size_t*)calloc(number_of_instructions, sizeof(size_t)),
+        .worklist_size          = 0,
+    };
+
+    ProcessorErrorHandler return_code = ProcessorErrorHandler_ERROR;
+
+    if (analysis.effects && analysis.entries && analysis.depths && analysis.worklist)
+    {
+        for (size_t index = 0; index < number_of_instructions; index++)
+        {
+            if (spu->program[index].command == MachineCommands_PURE_CALL)
+            {
+                listProcedure(&analysis, spu->program[index].target)->called_pure = true;
+            }
+        }
+
+        // callees are listed while their callers are analysed, recursion needs the passes repeated
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+
+            for (size_t index = 0; index < analysis.number_of_entries; index++)
+            {
+                changed = analyseEffect(&analysis, analysis.entries[index]) || changed;
+            }
+        }
+
+        return_code = collectPureProcedures(spu, &analysis, memo_program);
+    }
+
+    FREE_NULL(analysis.effects);
+    FREE_NULL(analysis.entries);
+    FREE_NULL(analysis.depths);
+    FREE_NULL(analysis.worklist);
+
+    return return_code;
+}
+
+
+void memoProgramDtor(MemoProgram* const memo_program)
+{
+    assert(memo_program != NULL);
+
+    FREE_NULL(memo_program->procedures);
+    FREE_NULL(memo_program->procedure_of_entry);
+    memo_program->number_of_procedures = 0;
+}
+
+
+ProcessorErrorHandler memoCacheCtor(const MemoProgram* const memo_program, size_t capacity, MemoCache** const cache)
+{
+    assert(memo_program != NULL);
+    assert(cache        != NULL);
+
+    *cache = NULL;
+
+    if (!MEMO_AVAILABLE || capacity == 0 || memo_program->number_of_procedures == 0)
+    {
+        return ProcessorErrorHandler_OK;
+    }
+
+    size_t rounded_capacity = 1;
+    while (rounded_capacity < capacity && rounded_capacity < MAX_MEMO_CACHE_SIZE)
+    {
+        rounded_capacity <<= 1;
+    }
+
+    MemoCache* new_cache = (MemoCache*)calloc(1, sizeof(MemoCache));
+    if (!new_cache)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    new_cache->program = memo_program;
+    new_cache->mask    = rounded_capacity - 1;
+    new_cache->entries = (MemoEntry*)calloc(rounded_capacity, sizeof(MemoEntry));
+    new_cache->pending = (PendingMemoCall*)calloc(CALL_STACK_SIZE, sizeof(PendingMemoCall));
+
+    new_cache->statistics.capacity = rounded_capacity;
+
+    if (!new_cache->entries || !new_cache->pending)
+    {
+        memoCacheDtor(new_cache);
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    *cache = new_cache;
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+void memoCacheDtor(MemoCache* const cache)
+{
+    if (!cache)
+    {
+        return;
+    }
+
+    FREE_NULL(cache->entries);
+    FREE_NULL(cache->pending);
+    free(cache);
+}
+
+
+void resetMemoCalls(MemoCache* const cache)
+{
+    assert(cache != NULL);
+
+    cache->pending_size = 0;
+}
+
+
+bool findMemoResult(MemoCache* const cache, SPU* const spu, size_t entry, arguments_type** const stack_top)
+{
+    assert(cache     != NULL);
+    assert(spu       != NULL);
+    assert(stack_top != NULL);
+
+    size_t procedure_index = cache->program->procedure_of_entry[entry];
+    assert(procedure_index != NO_PURE_PROCEDURE);
+
+    const PureProcedure* const procedure = cache->program->procedures + procedure_index;
+
+    // the call itself reports a stack that is too short or too full
+    size_t depth = (size_t)(*stack_top - spu->operand_stack);
+    if (depth < procedure->arguments || SIZE_OF_STACK - depth + procedure->arguments < procedure->results)
+    {
+        return false;
+    }
+
+    arguments_type* base = *stack_top - procedure->arguments;
+
+    arguments_type key[MAX_MEMO_VALUES] = {};
+    size_t key_size = makeMemoKey(procedure, spu->registers, base, key);
+
+    size_t     slot       = hashMemoKey(procedure_index, key, key_size) & cache->mask;
+    MemoEntry* memo_entry = cache->entries + slot;
+
+    if (memo_entry->valid
+     && memo_entry->procedure == procedure_index
+     && !memcmp(memo_entry->key, key, key_size * sizeof(arguments_type)))
+    {
+        cache->statistics.hits++;
+
+        memcpy(base, memo_entry->results, procedure->results * sizeof(arguments_type));
+        *stack_top = base + procedure->results;
+
+        const arguments_type* registers = memo_entry->results + procedure->results;
+        for (size_t index = Registers_AX; index <= NUMBER_OF_REGISTERS; index++)
+        {
+            if (procedure->registers & (1u << index))
+            {
+                spu->registers[index] = *registers++;
+            }
+        }
+
+        return true;
+    }
+
+    cache->statistics.misses++;
+
+    if (memo_entry->valid)
+    {
+        cache->statistics.evictions++;
+        cache->statistics.entries_used--;
+        memo_entry->valid = false;
+    }
+
+    if (cache->pending_size == CALL_STACK_SIZE)
+    {
+        return false;
+    }
+
+    memo_entry->procedure = procedure_index;
+    memo_entry->stamp     = ++cache->last_stamp;
+    memcpy(memo_entry->key, key, key_size * sizeof(arguments_type));
+
+    cache->pending[cache->pending_size++] = {
+        .call_depth = spu->call_depth + 1,
+        .slot       = slot,
+        .stamp      = memo_entry->stamp,
+        .base       = base,
+    };
+
+    return false;
+}
+
+
+// runs on every ret before the return stack is popped
+void finishMemoCall(MemoCache* const cache, const SPU* const spu)
+{
+    assert(cache != NULL);
+    assert(spu   != NULL);
+
+    if (cache->pending_size == 0 || cache->pending[cache->pending_size - 1].call_depth != spu->call_depth)
+    {
+        return;
+    }
+
+    const PendingMemoCall* const call = cache->pending + --cache->pending_size;
+
+    MemoEntry* memo_entry = cache->entries + call->slot;
+    if (memo_entry->stamp != call->stamp)
+    {
+        return;
+    }
+
+    const PureProcedure* const procedure = cache->program->procedures + memo_entry->procedure;
+
+    memcpy(memo_entry->results, call->base, procedure->results * sizeof(arguments_type));
+
+    arguments_type* registers = memo_entry->results + procedure->results;
+    for (size_t index = Registers_AX; index <= NUMBER_OF_REGISTERS; index++)
+    {
+        if (procedure->registers & (1u << index))
+        {
+            *registers++ = spu->registers[index];
+        }
+    }
+
+    memo_entry->valid = true;
+    cache->statistics.entries_used++;
+}
+
+
+void getMemoStatistics(const MemoCache* const cache, MemoStatistics* const statistics)
+{
+    assert(cache      != NULL);
+    assert(statistics != NULL);
+
+    *statistics = cache->statistics;
+}
+
+
+void writeMemoStatsLog(const MemoCache* const cache)
+{
+    assert(cache != NULL);
+
+    const MemoStatistics* const statistics = &cache->statistics;
+
+    Log(LogLevel_INFO, "Memo cache: %zu hits, %zu misses, %zu evictions, %zu of %zu entries used",
+        statistics->hits, statistics->misses, statistics->evictions, statistics->entries_used, statistics->capacity);
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static ProcedureEffect* listProcedure(PurityAnalysis* const analysis, size_t entry)
+{
+    assert(analysis != NULL);
+    assert(entry < analysis->number_of_instructions);
+
+    ProcedureEffect* effect = analysis->effects + entry;
+
+    if (!effect->listed)
+    {
+        *effect = {
+            .listed       = true,
+            .called_pure  = false,
+            .pure         = true,
+            .exact        = true,
+            .returns      = false,
+            .return_depth = 0,
+            .min_depth    = 0,
+            .registers    = 0,
+        };
+
+        analysis->entries[analysis->number_of_entries++] = entry;
+    }
+
+    return effect;
+}
+
+
+// one pass over the procedure at entry with what its callees are known to do so far, true if its effect changed
+static bool analyseEffect(PurityAnalysis* const analysis, size_t entry)
+{
+    assert(analysis != NULL);
+
+    ProcedureEffect* const effect = analysis->effects + entry;
+    if (!effect->pure || !effect->exact)
+    {
+        return false;
+    }
+
+    ProcedureEffect result = *effect;
+
+    for (size_t index = 0; index < analysis->number_of_instructions; index++)
+    {
+        analysis->depths[index] = UNKNOWN_DEPTH;
+    }
+
+    analysis->worklist_size = 0;
+    visitInstruction(analysis, &result, entry, 0);
+
+    while (analysis->worklist_size > 0 && result.pure && result.exact)
+    {
+        size_t                   index       = analysis->worklist[--analysis->worklist_size];
+        const Instruction* const instruction = analysis->program + index;
+
+        long pops   = 0;
+        long pushes = 0;
+        getStackEffect(instruction->command, &pops, &pushes);
+
+        long low   = analysis->depths[index] - pops;
+        long after = low + pushes;
+
+        if (low < -DEPTH_LIMIT || after > DEPTH_LIMIT)
+        {
+            result.exact = false;
+            break;
+        }
+
+        result.min_depth  = low < result.min_depth ? low : result.min_depth;
+        result.registers |= getUsedRegisters(instruction);
+        result.pure       = result.pure && !hasSideEffects(instruction);
+
+        switch (instruction->command)
+        {
+            case MachineCommands_HLT:
+                break;
+
+            case MachineCommands_RET:
+                addReturn(&result, after);
+                break;
+
+            case MachineCommands_JMP:
+                visitInstruction(analysis, &result, instruction->target, after);
+                break;
+
+            case MachineCommands_CALL:
+            case MachineCommands_PURE_CALL:
+            case MachineCommands_TAILCALL:
+            {
+                const ProcedureEffect* const callee = listProcedure(analysis, instruction->target);
+
+                result.pure       = result.pure  && callee->pure;
+                result.exact      = result.exact && callee->exact;
+                result.registers |= callee->registers;
+
+                if (after + callee->min_depth < result.min_depth)
+                {
+                    result.min_depth = after + callee->min_depth;
+                }
+
+                if (!callee->returns)
+                {
+                    break;
+                }
+
+                // a tail call returns for the procedure it was made from
+                if (instruction->command == MachineCommands_TAILCALL)
+                {
+                    addReturn(&result, after + callee->return_depth);
+                }
+                else
+                {
+                    visitInstruction(analysis, &result, index + 1, after + callee->return_depth);
+                }
+                break;
+            }
+
+            default:
+                if (isConditionalJump(instruction->command))
+                {
+                    visitInstruction(analysis, &result, instruction->target, after);
+                }
+
+                visitInstruction(analysis, &result, index + 1, after);
+                break;
+        }
+    }
+
+    bool changed = result.pure         != effect->pure
+                || result.exact        != effect->exact
+                || result.returns      != effect->returns
+                || result.return_depth != effect->return_depth
+                || result.min_depth    != effect->min_depth
+                || result.registers    != effect->registers;
+
+    *effect = result;
+
+    return changed;
+}
+
+
+static void visitInstruction(PurityAnalysis* const  analysis,
+                             ProcedureEffect* const effect,
+                             size_t                 index,
+                             long                   depth)
+{
+    assert(analysis != NULL);
+    assert(effect   != NULL);
+
+    if (index >= analysis->number_of_instructions)
+    {
+        effect->exact = false;
+        return;
+    }
+
+    if (analysis->depths[index] == UNKNOWN_DEPTH)
+    {
+        analysis->depths[index] = depth;
+        analysis->worklist[analysis->worklist_size++] = index;
+    }
+    else if (analysis->depths[index] != depth)
+    {
+        effect->exact = false;
+    }
+}
+
+
+static void addReturn(ProcedureEffect* const effect, long depth)
+{
+    assert(effect != NULL);
+
+    if (!effect->returns)
+    {
+        effect->returns      = true;
+        effect->return_depth = depth;
+    }
+    else if (effect->return_depth != depth)
+    {
+        effect->exact = false;
+    }
+}
+
+
+// procedures that passed get their keys, calls of the rest become plain calls again
+static ProcessorErrorHandler collectPureProcedures(SPU* const                  spu,
+                                                   const PurityAnalysis* const analysis,
+                                                   MemoProgram* const          memo_program)
+{
+    assert(spu          != NULL);
+    assert(analysis     != NULL);
+    assert(memo_program != NULL);
+
+    memo_program->procedures         = (PureProcedure*)calloc(analysis->number_of_entries, sizeof(PureProcedure));
+    memo_program->procedure_of_entry = (size_t*)calloc(analysis->number_of_instructions, sizeof(size_t));
+    if (!memo_program->procedures || !memo_program->procedure_of_entry)
+    {
+        memoProgramDtor(memo_program);
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    for (size_t index = 0; index < analysis->number_of_instructions; index++)
+    {
+        memo_program->procedure_of_entry[index] = NO_PURE_PROCEDURE;
+    }
+
+    for (size_t index = 0; index < analysis->number_of_entries; index++)
+    {
+        size_t                       entry  = analysis->entries[index];
+        const ProcedureEffect* const effect = analysis->effects + entry;
+
+        if (!effect->called_pure)
+        {
+            continue;
+        }
+
+        PureProcedure procedure = {};
+
+        const char* reason = checkPureProcedure(effect, &procedure);
+        if (reason)
+        {
+            Log(LogLevel_INFO, "Procedure at instruction %zu is not memoized: %s", entry, reason);
+            continue;
+        }
+
+        procedure.entry = entry;
+
+        memo_program->procedure_of_entry[entry]                        = memo_program->number_of_procedures;
+        memo_program->procedures[memo_program->number_of_procedures++] = procedure;
+    }
+
+    for (size_t index = 0; index < analysis->number_of_instructions; index++)
+    {
+        Instruction* instruction = spu->program + index;
+
+        if (instruction->command == MachineCommands_PURE_CALL
+         && memo_program->procedure_of_entry[instruction->target] == NO_PURE_PROCEDURE)
+        {
+            instruction->command = MachineCommands_CALL;
+        }
+    }
+
+    Log(LogLevel_INFO, "Memo: %zu pure procedures", memo_program->number_of_procedures);
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// NULL if the procedure can be memoized, otherwise why not
+static const char* checkPureProcedure(const ProcedureEffect* const effect, PureProcedure* const procedure)
+{
+    assert(effect    != NULL);
+    assert(procedure != NULL);
+
+    if (!effect->pure)
+    {
+        return "it reaches RAM, io, draw, a vector command, hlt or calldepth";
+    }
+
+    if (!effect->exact)
+    {
+        return "its stack depth depends on the path";
+    }
+
+    if (!effect->returns)
+    {
+        return "it never returns";
+    }
+
+    size_t number_of_registers = (size_t)__builtin_popcount(effect->registers);
+
+    procedure->registers = effect->registers;
+    procedure->arguments = (size_t)-effect->min_depth;
+    procedure->results   = (size_t)(effect->return_depth - effect->min_depth);
+
+    if (number_of_registers + procedure->arguments > MAX_MEMO_VALUES
+     || number_of_registers + procedure->results   > MAX_MEMO_VALUES)
+    {
+        return "it takes or gives back too many values";
+    }
+
+    return NULL;
+}
+
+
+static bool hasSideEffects(const Instruction* const instruction)
+{
+    assert(instruction != NULL);
+
+    switch (instruction->command)
+    {
+        case MachineCommands_PUSH:
+        case MachineCommands_POP:
+            return instruction->flags & RAM_FLAG;
+
+        case MachineCommands_IN:
+        case MachineCommands_OUT:
+        case MachineCommands_DRAW:
+        case MachineCommands_HLT:
+        case MachineCommands_CALL_DEPTH:
+        case MachineCommands_TIMESTAMP:
+            return true;
+
+        default:
+            return instruction->command >= DecodedCommands_VADD && instruction->command <= DecodedCommands_VLESS;
+    }
+}
+
+
+static uint8_t getUsedRegisters(const Instruction* const instruction)
+{
+    assert(instruction != NULL);
+
+    uint8_t registers = 0;
+
+    switch (instruction->command)
+    {
+        case MachineCommands_PUSH:
+        case MachineCommands_POP:
+            if (instruction->flags & REGISTER_FLAG)
+            {
+                registers |= (uint8_t)(1u << instruction->register_index);
+            }
+            break;
+
+        case MachineCommands_INC:
+            registers |= (uint8_t)(1u << instruction->register_index);
+            break;
+
+        case MachineCommands_PUSH_SUB:
+        case DecodedCommands_JA_PAIR:
+        case DecodedCommands_JAE_PAIR:
+        case DecodedCommands_JB_PAIR:
+        case DecodedCommands_JBE_PAIR:
+        case DecodedCommands_JE_PAIR:
+        case DecodedCommands_JNE_PAIR:
+            if (instruction->flags & PAIR_FIRST_REGISTER_FLAG)
+            {
+                registers |= (uint8_t)(1u << instruction->register_index);
+            }
+
+            if (instruction->flags & PAIR_SECOND_REGISTER_FLAG)
+            {
+                registers |= (uint8_t)(1u << instruction->second_register_index);
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return registers;
+}
+
+
+static bool isConditionalJump(uint8_t command)
+{
+    return (command >= MachineCommands_JA      && command <= MachineCommands_JNE)
+        || (command >= DecodedCommands_JA_PAIR && command <= DecodedCommands_JNE_PAIR);
+}
+
+
+// registers in the order of their numbers, then the arguments from the bottom of the stack up
+static size_t makeMemoKey(const PureProcedure* const  procedure,
+                          const arguments_type* const registers,
+                          const arguments_type* const base,
+                          arguments_type* const       key)
+{
+    assert(procedure != NULL);
+    assert(registers != NULL);
+    assert(base      != NULL);
+    assert(key       != NULL);
+
+    size_t key_size = 0;
+
+    for (size_t index = Registers_AX; index <= NUMBER_OF_REGISTERS; index++)
+    {
+        if (procedure->registers & (1u << index))
+        {
+            key[key_size++] = registers[index];
+        }
+    }
+
+    for (size_t index = 0; index < procedure->arguments; index++)
+    {
+        key[key_size++] = base[index];
+    }
+
+    return key_size;
+}
+
+
+// FNV-1a over the bytes of the key, keys are compared bit for bit as well
+static size_t hashMemoKey(size_t procedure, const arguments_type* const key, size_t key_size)
+{
+    assert(key != NULL);
+
+    uint64_t hash = 0xCBF29CE484222325ull ^ procedure;
+
+    const uint8_t* bytes = (const uint8_t*)key;
+    for (size_t index = 0; index < key_size * sizeof(arguments_type); index++)
+    {
+        hash ^= bytes[index];
+        hash *= 0x100000001B3ull;
+    }
+
+    return (size_t)(hash ^ (hash >> 32));
+}
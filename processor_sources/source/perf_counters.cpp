@@ -0,0 +1,231 @@
+#include "perf_counters.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "logger.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const char* const PERF_COUNTER_NAMES[NUMBER_OF_PERF_COUNTERS] = {
+    "cycles", "instructions", "branch-misses", "L1d misses", "iTLB misses",
+};
+
+#ifdef __linux__
+typedef struct PerfEvent
+{
+    uint32_t type;
+    uint64_t config;
+} PerfEvent;
+
+#define CACHE_READ_MISS_(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const PerfEvent PERF_EVENTS[NUMBER_OF_PERF_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, CACHE_READ_MISS_(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HW_CACHE, CACHE_READ_MISS_(PERF_COUNT_HW_CACHE_ITLB)},
+};
+
+#undef CACHE_READ_MISS_
+
+// what read gives back with TOTAL_TIME_ENABLED and TOTAL_TIME_RUNNING in read_format
+typedef struct PerfReading
+{
+    uint64_t value;
+    uint64_t time_enabled;
+    uint64_t time_running;
+} PerfReading;
+
+static int openPerfEvent(const PerfEvent* const event);
+static bool readPerfCounter(int file, uint64_t* const value);
+#endif
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+void perfCountersCtor(PerfCounters* const counters)
+{
+    assert(counters != NULL);
+
+    for (size_t counter = 0; counter < NUMBER_OF_PERF_COUNTERS; counter++)
+    {
+        counters->files[counter] = NO_PERF_COUNTER;
+    }
+
+#ifdef __linux__
+    for (size_t counter = 0; counter < NUMBER_OF_PERF_COUNTERS; counter++)
+    {
+        counters->files[counter] = openPerfEvent(PERF_EVENTS + counter);
+        if (counters->files[counter] == NO_PERF_COUNTER)
+        {
+            Log(LogLevel_INFO, "Perf counter %s is not available: %s", PERF_COUNTER_NAMES[counter], strerror(errno));
+        }
+    }
+#else
+    Log(LogLevel_INFO, "Perf counters need Linux perf_event_open, running without them");
+#endif
+}
+
+
+void perfCountersDtor(PerfCounters* const counters)
+{
+    assert(counters != NULL);
+
+    for (size_t counter = 0; counter < NUMBER_OF_PERF_COUNTERS; counter++)
+    {
+#ifdef __linux__
+        if (counters->files[counter] != NO_PERF_COUNTER)
+        {
+            close(counters->files[counter]);
+        }
+#endif
+        counters->files[counter] = NO_PERF_COUNTER;
+    }
+}
+
+
+void startPerfCounters(const PerfCounters* const counters)
+{
+    assert(counters != NULL);
+
+#ifdef __linux__
+    for (size_t counter = 0; counter < NUMBER_OF_PERF_COUNTERS; counter++)
+    {
+        if (counters->files[counter] != NO_PERF_COUNTER)
+        {
+            ioctl(counters->files[counter], PERF_EVENT_IOC_RESET,  0);
+            ioctl(counters->files[counter], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+
+void stopPerfCounters(const PerfCounters* const counters, PerfStatistics* const statistics)
+{
+    assert(counters   != NULL);
+    assert(statistics != NULL);
+
+#ifdef __linux__
+    for (size_t counter = 0; counter < NUMBER_OF_PERF_COUNTERS; counter++)
+    {
+        if (counters->files[counter] != NO_PERF_COUNTER)
+        {
+            ioctl(counters->files[counter], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+#endif
+
+    for (size_t counter = 0; counter < NUMBER_OF_PERF_COUNTERS; counter++)
+    {
+        statistics->counters[counter]  = 0;
+        statistics->available[counter] = false;
+
+#ifdef __linux__
+        if (counters->files[counter] != NO_PERF_COUNTER)
+        {
+            statistics->available[counter] = readPerfCounter(counters->files[counter],
+                                                             statistics->counters + counter);
+        }
+#endif
+    }
+}
+
+
+void writePerfStatsLog(const PerfStatistics* const statistics, ProcessorEngine engine)
+{
+    assert(statistics != NULL);
+
+    const char* engine_name = engine < NUMBER_OF_ENGINES ? ENGINE_NAMES[engine] : "unknown";
+
+    if (statistics->guest_counted)
+    {
+        Log(LogLevel_INFO, "Perf counters of %s engine: %llu guest instructions",
+            engine_name, (unsigned long long)statistics->guest_instructions);
+    }
+    else
+    {
+        Log(LogLevel_INFO, "Perf counters of %s engine: guest instructions are not counted by it", engine_name);
+    }
+
+    for (size_t counter = 0; counter < NUMBER_OF_PERF_COUNTERS; counter++)
+    {
+        if (!statistics->available[counter])
+        {
+            Log(LogLevel_INFO, "  %-14s not counted", PERF_COUNTER_NAMES[counter]);
+        }
+        else if (statistics->guest_counted && statistics->guest_instructions > 0)
+        {
+            Log(LogLevel_INFO, "  %-14s %llu, %.3f per guest instruction", PERF_COUNTER_NAMES[counter],
+                (unsigned long long)statistics->counters[counter],
+                (double)statistics->counters[counter] / (double)statistics->guest_instructions);
+        }
+        else
+        {
+            Log(LogLevel_INFO, "  %-14s %llu", PERF_COUNTER_NAMES[counter],
+                (unsigned long long)statistics->counters[counter]);
+        }
+    }
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+#ifdef __linux__
+static int openPerfEvent(const PerfEvent* const event)
+{
+    assert(event != NULL);
+
+    struct perf_event_attr attributes = {};
+
+    attributes.size           = sizeof(attributes);
+    attributes.type           = event->type;
+    attributes.config         = event->config;
+    attributes.disabled       = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv     = 1;
+    attributes.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    // this thread on any CPU
+    long file = syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+
+    return file < 0 ? NO_PERF_COUNTER : (int)file;
+}
+
+
+// an event the kernel never got to schedule next to the others counted nothing and is not available
+static bool readPerfCounter(int file, uint64_t* const value)
+{
+    assert(value != NULL);
+
+    PerfReading reading = {};
+
+    if (read(file, &reading, sizeof(reading)) != (ssize_t)sizeof(reading) || reading.time_running == 0)
+    {
+        return false;
+    }
+
+    *value = reading.value;
+    if (reading.time_running < reading.time_enabled)
+    {
+        *value = (uint64_t)((double)reading.value * (double)reading.time_enabled / (double)reading.time_running);
+    }
+
+    return true;
+}
+#endif
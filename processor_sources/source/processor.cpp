@@ -2,224 +2,1584 @@
 
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "helpful_functions.h"
 #include "command_handler.h"
-#include "work_with_doubles.h"
+#include "value_type.h"
+#include "runtime_error.h"
 #include "stack.h"
 #include "dump.h"
+#include "logger.h"
+#include "spu.h"
+#include "decoder.h"
+#include "verifier.h"
+#include "spu_io.h"
+#include "register_machine.h"
+#include "jit.h"
+#include "tracer.h"
+#include "vector_kernels.h"
+#include "memo.h"
+#include "profiler.h"
+#include "perf_counters.h"
+#include "snapshot.h"
+
+#if defined(USE_STACK_LIBRARY) && !defined(SPU_VALUE_F64)
+#error "the Stack library holds doubles, USE_STACK_LIBRARY builds need the f64 value type"
+#endif
 
 
 // static --------------------------------------------------------------------------------------------------------------
 
 
-typedef double arguments_type;
+static const char   SPACE               = ' ';
+static const size_t START_CODE_CAPACITY = 4096;
 
-static const size_t NUMBER_OF_REGISTERS = 6;
-static const size_t SIZE_OF_RAM = 4096;
-static const size_t ROWS = 64;
-static const size_t COLUMNS = 64;
-static const uint8_t COMMAND_MASK = 0b0001'1111;
-static const uint8_t FLAG_MOVED_MASK = 0b1110'0000;
-static const char SPACE = ' ';
+// handlers are pasted into every dispatch site of the threaded engine
+#define HANDLER_INLINE_ static inline __attribute__((always_inline))
 
-typedef struct SPU
+struct LoadedProgram
+{
+    uint8_t*       code;
+    size_t         size_of_code;
+    bool           code_is_mapped;
+    ProgramImage   image;
+    Instruction*    program;
+    size_t          program_size;
+    VerifierReport  report;
+    MemoProgram     memo;
+    arguments_type* initial_ram;    // what every run starts with, spaces and the data section
+    uint64_t        hash;           // of the whole file, snapshots of the program are checked against it
+};
+
+struct SpuContext
+{
+    SPU                  spu;
+    const LoadedProgram* program;
+    ProcessorEngine      engine;             // what is left after the fallbacks, its code is made once
+    bool                 checked;            // the verifier could not bound the stacks, or force_checks
+    bool                 run_checked;        // of the current run: checked, or it goes on from a snapshot
+    bool                 restored;           // the next run goes on from a snapshot
+    bool                 profiled;           // runs on the switch engine with the profiler watching it
+    bool                 perf_counted;       // perf_counters are open, switch and threaded engines count dispatches
+    PerfCounters         perf_counters;
+    PerfStatistics       perf_statistics;    // of the last run
+    SnapshotPoint        snapshot;           // written by every run that gets there
+    RegisterProgram      register_program;
+    JitProgram           jit_program;
+    bool                 is_dirty;           // ran since it was made or reset
+    SpuContext*          next_free;          // list of released contexts of a pool
+};
+
+struct SpuContextPool
+{
+    const LoadedProgram* program;
+    ProcessorOptions     options;
+    SpuContext*          free_contexts;
+};
+
+// registers of the interpreter itself, engines keep them in a local and store them back into SPU on exit
+typedef struct Cursor
 {
-    uint8_t*        code;
     size_t          ip;
-    size_t          size_of_code;
+    arguments_type* stack_top;
+    bool            checked;    // compile-time constant of the engine instance, folds the stack checks away
+    uint64_t        executed;   // instructions dispatched, only instances with COUNTED set add to it
+} Cursor;
 
-    Stack*          program_stack;
-    Stack*          function_stack;
+static ProcessorErrorHandler readProgramCode(const char* path_to_program, SPU* const spu);
+static ProcessorErrorHandler mapProgramCode(FILE* const program_file, size_t size_of_code, SPU* const spu);
+static ProcessorErrorHandler readProgramStream(FILE* const program_file, SPU* const spu);
+static void releaseProgramCode(uint8_t* code, size_t size_of_code, bool code_is_mapped);
+static ProcessorErrorHandler makeInitialRam(LoadedProgram* const program);
+
+static ProcessorErrorHandler spuCtor(const LoadedProgram* const program,
+                                     const SpuStreams* const    streams,
+                                     SPU* const                 spu);
+static ProcessorErrorHandler spuStacksCtor(SPU* const spu);
+static void spuStacksDtor(SPU* const spu);
+static void spuReset(const LoadedProgram* const program, SPU* const spu);
+static ProcessorErrorHandler spuDtor(SPU* const spu);
+static SpuStreams getRunStreams(const SpuStreams* const streams);
+
+static ProcessorErrorHandler prepareEngine(SpuContext* const context, ProcessorEngine engine);
+static ProcessorErrorHandler prepareRun(SpuContext* const context);
+static ProcessorErrorHandler runEngineTrapped(SpuContext* const context);
+static ProcessorErrorHandler runEngine(SpuContext* const context);
+static void reportRuntimeError(SPU* const spu, const char* message);
+static ProcessorErrorHandler runToSnapshot(SpuContext* const context);
+static ProcessorErrorHandler runTracing(SPU* const spu, bool checked);
+static ProcessorErrorHandler runProfiled(SPU* const spu, bool checked);
+static void finishProgram(SPU* const spu);
+
+template <bool CHECKED, bool COUNTED = false> static void processMachineCode(SPU* const spu);
+template <bool CHECKED, bool COUNTED = false> static void processMachineCodeThreaded(SPU* const spu);
+template <bool CHECKED> static void processMachineCodeTracing(SPU* const spu, Tracer* const tracer);
+template <bool CHECKED> static void processMachineCodeProfiled(SPU* const spu, Profiler* const profiler);
+template <bool CHECKED> static SpuSliceEnd processMachineCodeSlice(SPU* const spu, size_t quantum);
+template <bool CHECKED> static bool processMachineCodeToSnapshot(SPU* const spu, const SnapshotPoint* const point);
+
+HANDLER_INLINE_ void executeInstruction(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+
+HANDLER_INLINE_ void operandPush(SPU* const spu, Cursor* const cursor, arguments_type value);
+HANDLER_INLINE_ void operandPop(SPU* const spu, Cursor* const cursor, arguments_type* const value);
+static void writeOperandStackDumpLog(const SPU* const spu);
+
+HANDLER_INLINE_ void pushArgument(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void popRegister(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void addCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void mulCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void subCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void divCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void sqrtCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void outCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void inCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void hltCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jmpCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jaCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jaeCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jbCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jbeCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jeCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jneCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void retCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void callCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void tailcallCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void pureCallCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void callDepthCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void timestampCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void drawCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void pushSubCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void incCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jaPairCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jaePairCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jbPairCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jbePairCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jePairCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void jnePairCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void vectorCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction);
+HANDLER_INLINE_ void loadPairOperands(const SPU* const         spu,
+                                      const Instruction* const instruction,
+                                      arguments_type* const    first_element,
+                                      arguments_type* const    second_element);
 
-    arguments_type  registers[NUMBER_OF_REGISTERS + 1];
-    arguments_type* ram;
 
-    bool            end_flag;
-} SPU;
+// public --------------------------------------------------------------------------------------------------------------
 
-static ProcessorErrorHandler readProgramCode(const char* path_to_program, SPU* const spu);
-static ProcessorErrorHandler spuInit(const char* path_to_program, SPU* const spu);
-static ProcessorErrorHandler spuDtor(SPU* const spu);
 
-static void processMachineCode(SPU* const spu);
-
-static void pushArgument(SPU* const spu);
-static void popRegister(SPU* const spu);
-static void addCommand(SPU* const spu);
-static void mulCommand(SPU* const spu);
-static void subCommand(SPU* const spu);
-static void divCommand(SPU* const spu);
-static void sqrtCommand(SPU* const spu);
-static void outCommand(SPU* const spu);
-static void inCommand(SPU* const spu);
-static void hltCommand(SPU* const spu);
-static void jmpCommand(SPU* const spu);
-static void jaCommand(SPU* const spu);
-static void jaeCommand(SPU* const spu);
-static void jbCommand(SPU* const spu);
-static void jbeCommand(SPU* const spu);
-static void jeCommand(SPU* const spu);
-static void jneCommand(SPU* const spu);
-static void retCommand(SPU* const spu);
-static void callCommand(SPU* const spu);
-static void drawCommand(SPU* const spu);
+ProcessorErrorHandler executeProgram(const char*                    path_to_program,
+                                     const ProcessorOptions* const options)
+{
+    assert(path_to_program != NULL);
+    assert(options         != NULL);
 
+    LoadedProgram* program = NULL;
 
-// public --------------------------------------------------------------------------------------------------------------
+    ProcessorErrorHandler return_code = loadProgram(path_to_program, &program);
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = runLoadedProgram(program, options);
+    }
+
+    unloadProgram(program);
+
+    return return_code;
+}
+
+
+ProcessorErrorHandler resumeProgram(const char*                   path_to_program,
+                                    const char*                   path_to_snapshot,
+                                    const ProcessorOptions* const options)
+{
+    assert(path_to_program  != NULL);
+    assert(path_to_snapshot != NULL);
+    assert(options          != NULL);
+
+    ProcessorOptions resume_options = *options;
+    if (resume_options.engine == ProcessorEngine_REGISTER || resume_options.engine == ProcessorEngine_JIT)
+    {
+        Log(LogLevel_INFO, "Register and native code start at the beginning only, resuming on the threaded engine");
+        resume_options.engine = ProcessorEngine_THREADED;
+    }
+
+    LoadedProgram* program = NULL;
+    SpuContext*    context = NULL;
+
+    ProcessorErrorHandler return_code = loadProgram(path_to_program, &program);
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = spuContextCtor(program, &resume_options, &context);
+    }
+
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = restoreSpuContext(context, path_to_snapshot);
+    }
+
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = runSpuContext(context);
+    }
+
+    spuContextDtor(context);
+    unloadProgram(program);
+
+    return return_code;
+}
 
 
-ProcessorErrorHandler executeProgram(const char* path_to_program)
+ProcessorErrorHandler loadProgram(const char* path_to_program, LoadedProgram** const program)
 {
     assert(path_to_program != NULL);
+    assert(program         != NULL);
+
+    *program = NULL;
 
     SPU spu = {};
-    spuInit(path_to_program, &spu);
 
-    processMachineCode(&spu);
+    ProcessorErrorHandler return_code = readProgramCode(path_to_program, &spu);
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = decodeProgram(&spu);
+    }
+
+    VerifierReport report = {};
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = verifyProgram(&spu, &report);
+    }
+
+    MemoProgram memo = {};
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = analysePureProcedures(&spu, &memo);
+    }
+
+    LoadedProgram* loaded = NULL;
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        loaded = (LoadedProgram*)calloc(1, sizeof(LoadedProgram));
+        return_code = loaded ? ProcessorErrorHandler_OK : ProcessorErrorHandler_ERROR;
+    }
+
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        releaseProgramCode(spu.code, spu.size_of_code, spu.code_is_mapped);
+        free(spu.program);
+        memoProgramDtor(&memo);
+        return return_code;
+    }
+
+    if (report.bounded)
+    {
+        Log(LogLevel_INFO, "Program verified: max stack depth %zu, max call depth %zu",
+            report.max_stack_depth, report.max_call_depth);
+    }
+    else
+    {
+        Log(LogLevel_INFO, "Stack depth of program is not bounded statically, running with checks");
+    }
+
+    Log(LogLevel_INFO, "Vector commands run on %s kernels", getVectorKernelsName());
+
+    *loaded = {
+        .code           = spu.code,
+        .size_of_code   = spu.size_of_code,
+        .code_is_mapped = spu.code_is_mapped,
+        .image          = spu.image,
+        .program        = spu.program,
+        .program_size   = spu.program_size,
+        .report         = report,
+        .memo           = memo,
+        .initial_ram    = NULL,
+        .hash           = hashProgramCode(spu.code, spu.size_of_code),
+    };
+
+    return_code = makeInitialRam(loaded);
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        unloadProgram(loaded);
+        return return_code;
+    }
+
+    *program = loaded;
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+ProcessorErrorHandler runLoadedProgram(const LoadedProgram* const    program,
+                                       const ProcessorOptions* const options)
+{
+    assert(program != NULL);
+    assert(options != NULL);
+
+    SpuContext* context = NULL;
+
+    ProcessorErrorHandler return_code = spuContextCtor(program, options, &context);
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = runSpuContext(context);
+    }
+
+    spuContextDtor(context);
+
+    return return_code;
+}
+
+
+void unloadProgram(LoadedProgram* const program)
+{
+    if (!program)
+    {
+        return;
+    }
+
+    releaseProgramCode(program->code, program->size_of_code, program->code_is_mapped);
+    free(program->program);
+    free(program->initial_ram);
+    memoProgramDtor(&program->memo);
+    free(program);
+}
+
+
+ProcessorErrorHandler spuContextCtor(const LoadedProgram* const    program,
+                                     const ProcessorOptions* const options,
+                                     SpuContext** const            context)
+{
+    assert(program != NULL);
+    assert(options != NULL);
+    assert(context != NULL);
+
+    *context = (SpuContext*)calloc(1, sizeof(SpuContext));
+    if (!*context)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    (*context)->program  = program;
+    (*context)->checked  = options->force_checks || !program->report.bounded;
+    (*context)->profiled = options->profile;
+    (*context)->snapshot = options->snapshot;
+
+    if (options->perf_counters)
+    {
+        perfCountersCtor(&(*context)->perf_counters);
+        (*context)->perf_counted = true;
+    }
+
+    ProcessorEngine engine = options->engine;
+    if (options->profile && engine != ProcessorEngine_SWITCH)
+    {
+        Log(LogLevel_INFO, "Profiling runs on the switch engine only");
+        engine = ProcessorEngine_SWITCH;
+    }
+
+    if (options->snapshot.path && (engine == ProcessorEngine_REGISTER || engine == ProcessorEngine_JIT))
+    {
+        Log(LogLevel_INFO, "Register and native code start at the beginning only, runs with a snapshot go threaded");
+        engine = ProcessorEngine_THREADED;
+    }
+
+    ProcessorErrorHandler return_code = spuCtor(program, &options->streams, &(*context)->spu);
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = prepareEngine(*context, engine);
+    }
+
+    // register and native code keep the stack where the cache can not reach it and make plain calls
+    if (return_code == ProcessorErrorHandler_OK
+     && (*context)->engine != ProcessorEngine_REGISTER
+     && (*context)->engine != ProcessorEngine_JIT)
+    {
+        return_code = memoCacheCtor(&program->memo, options->memo_cache_size, &(*context)->spu.memo);
+    }
+
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        spuContextDtor(*context);
+        *context = NULL;
+    }
+
+    return return_code;
+}
+
+
+void spuContextDtor(SpuContext* const context)
+{
+    if (!context)
+    {
+        return;
+    }
+
+    if (context->spu.memo)
+    {
+        lockSpuLog();
+        writeMemoStatsLog(context->spu.memo);
+        unlockSpuLog();
+    }
+
+    registerProgramDtor(&context->register_program);
+    jitProgramDtor(&context->jit_program);
+    memoCacheDtor(context->spu.memo);
+    spuDtor(&context->spu);
+
+    if (context->perf_counted)
+    {
+        perfCountersDtor(&context->perf_counters);
+    }
+
+    free(context);
+}
+
+
+void setSpuContextStreams(SpuContext* const context, const SpuStreams* const streams)
+{
+    assert(context != NULL);
+    assert(streams != NULL);
+
+    SpuStreams run_streams = getRunStreams(streams);
+
+    spuIoDtor(&context->spu.io);
+    spuIoCtor(&context->spu.io, &run_streams);
+}
+
+
+ProcessorErrorHandler runSpuContext(SpuContext* const context)
+{
+    assert(context != NULL);
+
+    ProcessorErrorHandler return_code = prepareRun(context);
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        return return_code;
+    }
+
+    if (!context->perf_counted)
+    {
+        return runEngineTrapped(context);
+    }
+
+    startPerfCounters(&context->perf_counters);
+    return_code = runEngineTrapped(context);
+    stopPerfCounters(&context->perf_counters, &context->perf_statistics);
+
+    context->perf_statistics.guest_counted      = !context->profiled
+                                               && (context->engine == ProcessorEngine_SWITCH
+                                                || context->engine == ProcessorEngine_THREADED);
+    context->perf_statistics.guest_instructions = context->perf_statistics.guest_counted ? context->spu.executed : 0;
+
+    lockSpuLog();
+    writePerfStatsLog(&context->perf_statistics, context->engine);
+    unlockSpuLog();
+
+    return return_code;
+}
+
+
+ProcessorErrorHandler restoreSpuContext(SpuContext* const context, const char* path_to_snapshot)
+{
+    assert(context          != NULL);
+    assert(path_to_snapshot != NULL);
+
+    if (context->engine == ProcessorEngine_REGISTER || context->engine == ProcessorEngine_JIT)
+    {
+        Log(LogLevel_INFO, "Register and native code start at the beginning only, the context can not be restored");
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    SPU* spu = &context->spu;
+
+    ProcessorErrorHandler return_code = readSnapshot(path_to_snapshot, spu, context->program->hash);
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        return return_code;
+    }
+
+    spu->end_flag = true;
+
+    // the cache does not know the pure calls that were running when the snapshot was taken
+    if (spu->memo)
+    {
+        resetMemoCalls(spu->memo);
+    }
+
+    // so that the next run goes on from the snapshot instead of starting over. The bounds the verifier proved
+    // hold for runs from the start; stacks read from a file may be anything, so that run checks them.
+    context->is_dirty = false;
+    context->restored = true;
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+ProcessorErrorHandler startSpuContextSlices(SpuContext* const context)
+{
+    assert(context != NULL);
+
+    return prepareRun(context);
+}
+
+
+SpuSliceEnd runSpuContextSlice(SpuContext* const context, size_t quantum, uint64_t* const executed)
+{
+    assert(context  != NULL);
+    assert(executed != NULL);
+
+    SPU* spu = &context->spu;
+
+    RuntimeErrorTrap trap = {};
+    if (setjmp(trap.jump) != 0)
+    {
+        reportRuntimeError(spu, trap.message);
+        *executed = spu->executed;
+        return SpuSliceEnd_FAILED;
+    }
+
+    setRuntimeErrorTrap(&trap);
+
+    SpuSliceEnd end = context->run_checked ? processMachineCodeSlice<true>(spu, quantum)
+                                           : processMachineCodeSlice<false>(spu, quantum);
+
+    removeRuntimeErrorTrap(&trap);
+
+    *executed = spu->executed;
+
+    return end;
+}
+
+
+void getSpuContextMemoStatistics(const SpuContext* const context, MemoStatistics* const statistics)
+{
+    assert(context    != NULL);
+    assert(statistics != NULL);
+
+    if (!context->spu.memo)
+    {
+        *statistics = {};
+        return;
+    }
+
+    getMemoStatistics(context->spu.memo, statistics);
+}
+
+
+void getSpuContextPerfStatistics(const SpuContext* const context, PerfStatistics* const statistics)
+{
+    assert(context    != NULL);
+    assert(statistics != NULL);
+
+    *statistics = context->perf_counted ? context->perf_statistics : PerfStatistics{};
+}
+
+
+ProcessorErrorHandler spuContextPoolCtor(const LoadedProgram* const    program,
+                                         const ProcessorOptions* const options,
+                                         SpuContextPool** const        pool)
+{
+    assert(program != NULL);
+    assert(options != NULL);
+    assert(pool    != NULL);
+
+    *pool = (SpuContextPool*)calloc(1, sizeof(SpuContextPool));
+    if (!*pool)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    (*pool)->program = program;
+    (*pool)->options = *options;
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// contexts that are still acquired are not freed, they have to be released first
+void spuContextPoolDtor(SpuContextPool* const pool)
+{
+    if (!pool)
+    {
+        return;
+    }
+
+    while (pool->free_contexts)
+    {
+        SpuContext* context = pool->free_contexts;
+        pool->free_contexts = context->next_free;
+
+        spuContextDtor(context);
+    }
+
+    free(pool);
+}
+
+
+ProcessorErrorHandler acquireSpuContext(SpuContextPool* const pool, SpuContext** const context)
+{
+    assert(pool    != NULL);
+    assert(context != NULL);
+
+    if (!pool->free_contexts)
+    {
+        return spuContextCtor(pool->program, &pool->options, context);
+    }
+
+    *context            = pool->free_contexts;
+    pool->free_contexts = (*context)->next_free;
+    (*context)->next_free = NULL;
+
+    setSpuContextStreams(*context, &pool->options.streams);
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+void releaseSpuContext(SpuContextPool* const pool, SpuContext* const context)
+{
+    assert(pool    != NULL);
+    assert(context != NULL);
+    assert(context->program == pool->program);
+
+    context->next_free  = pool->free_contexts;
+    pool->free_contexts = context;
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+// Register code and native code depend only on the program, so they are made here once for all runs
+// of the context. Engines that can not take the program leave it to the threaded engine.
+static ProcessorErrorHandler prepareEngine(SpuContext* const context, ProcessorEngine engine)
+{
+    assert(context != NULL);
+
+    if (engine == ProcessorEngine_REGISTER)
+    {
+        ProcessorErrorHandler return_code = translateToRegisterMachine(&context->spu, &context->register_program);
+        if (return_code != ProcessorErrorHandler_NOT_TRANSLATABLE)
+        {
+            context->engine = engine;
+            return return_code;
+        }
+
+        registerProgramDtor(&context->register_program);
+
+        Log(LogLevel_INFO, "Stack depth is not fixed at every instruction, running on threaded engine instead");
+        engine = ProcessorEngine_THREADED;
+    }
+
+    if (engine == ProcessorEngine_JIT)
+    {
+        ProcessorErrorHandler return_code = compileProgram(&context->spu, context->checked, &context->jit_program);
+        if (return_code != ProcessorErrorHandler_NOT_TRANSLATABLE)
+        {
+            context->engine = engine;
+            return return_code;
+        }
+
+        jitProgramDtor(&context->jit_program);
+
+        Log(LogLevel_INFO, "Native code is not available in this build, running on threaded engine instead");
+        engine = ProcessorEngine_THREADED;
+    }
+
+    context->engine = engine;
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// every run after the first starts from the initial RAM and registers again
+static ProcessorErrorHandler prepareRun(SpuContext* const context)
+{
+    assert(context != NULL);
+
+    if (context->is_dirty)
+    {
+        spuReset(context->program, &context->spu);
+
+#ifdef USE_STACK_LIBRARY
+        // a library stack can not be emptied in place
+        spuStacksDtor(&context->spu);
+
+        ProcessorErrorHandler return_code = spuStacksCtor(&context->spu);
+        if (return_code != ProcessorErrorHandler_OK)
+        {
+            return return_code;
+        }
+#endif
+    }
+
+    context->is_dirty    = true;
+    context->run_checked = context->checked || context->restored;
+    context->restored    = false;
+
+    startProgramClock(&context->spu.io);
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// Engines own nothing but the SPU, so a runtime error can leave them at any point. The SPU is left
+// where the error happened and is put back at the start by the next run.
+static ProcessorErrorHandler runEngineTrapped(SpuContext* const context)
+{
+    assert(context != NULL);
+
+    RuntimeErrorTrap trap = {};
+    if (setjmp(trap.jump) != 0)
+    {
+        reportRuntimeError(&context->spu, trap.message);
+        return ProcessorErrorHandler_RUNTIME_ERROR;
+    }
+
+    setRuntimeErrorTrap(&trap);
+
+    ProcessorErrorHandler return_code = runEngine(context);
+
+    removeRuntimeErrorTrap(&trap);
+
+    return return_code;
+}
+
+
+static ProcessorErrorHandler runEngine(SpuContext* const context)
+{
+    assert(context != NULL);
+
+    SPU* spu     = &context->spu;
+    bool checked = context->run_checked;
+
+    if (context->snapshot.path)
+    {
+        ProcessorErrorHandler return_code = runToSnapshot(context);
+        if (return_code != ProcessorErrorHandler_OK || !spu->end_flag)
+        {
+            return return_code;
+        }
+    }
+
+    if (context->profiled)
+    {
+        return runProfiled(spu, checked);
+    }
+
+    switch (context->engine)
+    {
+        case ProcessorEngine_REGISTER:
+            processRegisterProgram(spu, &context->register_program);
+            break;
+
+        case ProcessorEngine_JIT:
+            runJitProgram(spu, &context->jit_program);
+            finishProgram(spu);
+            break;
+
+        case ProcessorEngine_TRACING:
+            return runTracing(spu, checked);
+
+        case ProcessorEngine_THREADED:
+            if (context->perf_counted)
+            {
+                checked ? processMachineCodeThreaded<true, true>(spu) : processMachineCodeThreaded<false, true>(spu);
+                break;
+            }
+
+            checked ? processMachineCodeThreaded<true>(spu) : processMachineCodeThreaded<false>(spu);
+            break;
+
+        case ProcessorEngine_SWITCH:
+        default:
+            if (context->perf_counted)
+            {
+                checked ? processMachineCode<true, true>(spu) : processMachineCode<false, true>(spu);
+                break;
+            }
+
+            checked ? processMachineCode<true>(spu) : processMachineCode<false>(spu);
+            break;
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// The run up to the snapshot point is interpreted by an instance that looks for it before every instruction,
+// the engine of the context goes on from there. A program that halts before the point leaves nothing to go on with.
+static ProcessorErrorHandler runToSnapshot(SpuContext* const context)
+{
+    assert(context != NULL);
+
+    SPU*                 spu   = &context->spu;
+    const SnapshotPoint* point = &context->snapshot;
+
+    bool reached = context->run_checked ? processMachineCodeToSnapshot<true>(spu, point)
+                                        : processMachineCodeToSnapshot<false>(spu, point);
+    if (!reached)
+    {
+        Log(LogLevel_INFO, "Program halted before the snapshot point, %s is not written", point->path);
+        return ProcessorErrorHandler_OK;
+    }
+
+    return writeSnapshot(point->path, spu, context->program->hash, spu->executed);
+}
+
+
+static ProcessorErrorHandler runTracing(SPU* const spu, bool checked)
+{
+    assert(spu != NULL);
+
+    Tracer tracer = {};
+
+    ProcessorErrorHandler return_code = tracerCtor(&tracer, spu, checked);
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        return return_code;
+    }
+
+    // the traces are freed before the error goes on to the trap of the run
+    RuntimeErrorTrap trap = {};
+    if (setjmp(trap.jump) != 0)
+    {
+        tracerDtor(&tracer);
+        raiseRuntimeError(trap.message);
+    }
+
+    setRuntimeErrorTrap(&trap);
+
+    checked ? processMachineCodeTracing<true>(spu, &tracer) : processMachineCodeTracing<false>(spu, &tracer);
+
+    removeRuntimeErrorTrap(&trap);
+
+    lockSpuLog();
+    writeTraceStatsLog(&tracer);
+    unlockSpuLog();
+
+    tracerDtor(&tracer);
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// the profile of a program stopped by a runtime error is not written
+static ProcessorErrorHandler runProfiled(SPU* const spu, bool checked)
+{
+    assert(spu != NULL);
+
+    Profiler profiler = {};
+
+    ProcessorErrorHandler return_code = profilerCtor(&profiler, spu);
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        return return_code;
+    }
+
+    RuntimeErrorTrap trap = {};
+    if (setjmp(trap.jump) != 0)
+    {
+        profilerDtor(&profiler);
+        raiseRuntimeError(trap.message);
+    }
+
+    setRuntimeErrorTrap(&trap);
+
+    checked ? processMachineCodeProfiled<true>(spu, &profiler) : processMachineCodeProfiled<false>(spu, &profiler);
+
+    removeRuntimeErrorTrap(&trap);
+
+    return_code = writeProfile(&profiler);
+    profilerDtor(&profiler);
+
+    return return_code;
+}
+
+
+// what hlt does after the engine stopped: the final stack goes to the log
+static void finishProgram(SPU* const spu)
+{
+    assert(spu != NULL);
+
+    spu->end_flag = false;
+
+    lockSpuLog();
+    writeOperandStackDumpLog(spu);
+    unlockSpuLog();
+
+    printProgramEnd(&spu->io);
+}
+
+
+// in place of finishProgram, the stack in SPU is not the one the engine had when it stopped
+static void reportRuntimeError(SPU* const spu, const char* message)
+{
+    assert(spu     != NULL);
+    assert(message != NULL);
+
+    spu->end_flag = false;
+
+    Log(LogLevel_ERROR, "Runtime error: %s", message);
+
+    printProgramError(&spu->io, message);
+}
+
+
+template <bool CHECKED, bool COUNTED>
+static void processMachineCode(SPU* const spu)
+{
+    assert(spu != NULL);
+
+    Cursor cursor = {
+        .ip        = spu->ip,
+        .stack_top = spu->stack_top,
+        .checked   = CHECKED,
+        .executed  = 0,
+    };
+
+    while (spu->end_flag)
+    {
+        const Instruction* const instruction = spu->program + cursor.ip;
+        cursor.ip++;
+        cursor.executed += COUNTED;
+
+        executeInstruction(spu, &cursor, instruction);
+    }
+
+    spu->ip        = cursor.ip;
+    spu->stack_top = cursor.stack_top;
+    spu->executed  = cursor.executed;
+}
+
+
+// The switch engine stopped after quantum instructions or in front of an in whose value is not there yet,
+// so that a scheduler can run something else on the thread. The next slice starts at the stored ip.
+template <bool CHECKED>
+static SpuSliceEnd processMachineCodeSlice(SPU* const spu, size_t quantum)
+{
+    assert(spu != NULL);
+
+    const SpuStreams* const streams = &spu->io.streams;
+
+    Cursor cursor = {
+        .ip        = spu->ip,
+        .stack_top = spu->stack_top,
+        .checked   = CHECKED,
+        .executed  = 0,
+    };
+
+    SpuSliceEnd end = SpuSliceEnd_PREEMPTED;
+
+    while (spu->end_flag && cursor.executed < quantum)
+    {
+        const Instruction* const instruction = spu->program + cursor.ip;
+
+        if (instruction->command == MachineCommands_IN && streams->input_ready
+         && !streams->input_ready(streams->io_context))
+        {
+            end = SpuSliceEnd_WAITING_INPUT;
+            break;
+        }
+
+        cursor.ip++;
+        cursor.executed++;
+
+        executeInstruction(spu, &cursor, instruction);
+    }
+
+    spu->ip        = cursor.ip;
+    spu->stack_top = cursor.stack_top;
+    spu->executed  = cursor.executed;
+
+    return spu->end_flag ? end : SpuSliceEnd_HALTED;
+}
+
+
+// The switch engine that stops right before the snapshot point, false if the program halted before it.
+// Opcodes are looked up in a table by decoded command: a superinstruction stops at any command it was fused from,
+// tail and pure calls count as call.
+template <bool CHECKED>
+static bool processMachineCodeToSnapshot(SPU* const spu, const SnapshotPoint* const point)
+{
+    assert(spu   != NULL);
+    assert(point != NULL);
+
+    bool by_opcode                         = point->opcode != MachineCommands_UNKNOWN;
+    bool stops[NUMBER_OF_DECODED_COMMANDS] = {};
+
+    for (size_t command = 0; command < NUMBER_OF_DECODED_COMMANDS; command++)
+    {
+        stops[command] = by_opcode && runsSnapshotOpcode((uint8_t)command, point->opcode);
+    }
+
+    Cursor cursor = {
+        .ip        = spu->ip,
+        .stack_top = spu->stack_top,
+        .checked   = CHECKED,
+        .executed  = 0,
+    };
+
+    while (spu->end_flag)
+    {
+        const Instruction* const instruction = spu->program + cursor.ip;
+
+        if (by_opcode ? stops[instruction->command] : cursor.executed == point->instructions)
+        {
+            break;
+        }
+
+        cursor.ip++;
+        cursor.executed++;
+
+        executeInstruction(spu, &cursor, instruction);
+    }
+
+    spu->ip        = cursor.ip;
+    spu->stack_top = cursor.stack_top;
+    spu->executed  = cursor.executed;
+
+    return spu->end_flag;
+}
+
+
+// The switch engine with a tracer watching it: taken backward jumps count how hot their loops are,
+// hot loops get recorded and compiled, and their native code runs from the next backward jump on.
+template <bool CHECKED>
+static void processMachineCodeTracing(SPU* const spu, Tracer* const tracer)
+{
+    assert(spu    != NULL);
+    assert(tracer != NULL);
+
+    Cursor cursor = {
+        .ip        = spu->ip,
+        .stack_top = spu->stack_top,
+        .checked   = CHECKED,
+    };
+
+    while (spu->end_flag)
+    {
+        size_t                   index       = cursor.ip;
+        const Instruction* const instruction = spu->program + index;
+        cursor.ip++;
+
+        executeInstruction(spu, &cursor, instruction);
+
+        if (tracer->recording)
+        {
+            recordTraceStep(tracer, spu, index, cursor.ip);
+        }
+        else if (cursor.ip <= index)
+        {
+            spu->ip        = cursor.ip;
+            spu->stack_top = cursor.stack_top;
+
+            enterHotLoop(tracer, spu, instruction->command);
+
+            cursor.ip        = spu->ip;
+            cursor.stack_top = spu->stack_top;
+        }
+    }
+
+    spu->ip        = cursor.ip;
+    spu->stack_top = cursor.stack_top;
+}
+
+
+// The switch engine with every instruction timed, a separate instance so the other engines pay nothing for it.
+template <bool CHECKED>
+static void processMachineCodeProfiled(SPU* const spu, Profiler* const profiler)
+{
+    assert(spu      != NULL);
+    assert(profiler != NULL);
+
+    Cursor cursor = {
+        .ip        = spu->ip,
+        .stack_top = spu->stack_top,
+        .checked   = CHECKED,
+    };
+
+    startProfile(profiler);
+
+    while (spu->end_flag)
+    {
+        size_t                   index       = cursor.ip;
+        size_t                   call_depth  = spu->call_depth;
+        const Instruction* const instruction = spu->program + index;
+        cursor.ip++;
+
+        executeInstruction(spu, &cursor, instruction);
+
+        profileInstruction(profiler, spu, index, call_depth, cursor.ip);
+    }
+
+    spu->ip        = cursor.ip;
+    spu->stack_top = cursor.stack_top;
+}
+
+
+HANDLER_INLINE_ void executeInstruction(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
+
+    switch (instruction->command)
+    {
+        case MachineCommands_PUSH:     pushArgument(spu, cursor, instruction);   break;
+
+        case MachineCommands_POP:      popRegister(spu, cursor, instruction);    break;
+
+        case MachineCommands_ADD:      addCommand(spu, cursor, instruction);     break;
+
+        case MachineCommands_MUL:      mulCommand(spu, cursor, instruction);     break;
+
+        case MachineCommands_DIV:      divCommand(spu, cursor, instruction);     break;
+
+        case MachineCommands_SUB:      subCommand(spu, cursor, instruction);     break;
+
+        case MachineCommands_SQRT:     sqrtCommand(spu, cursor, instruction);    break;
+
+        case MachineCommands_OUT:      outCommand(spu, cursor, instruction);     break;
+
+        case MachineCommands_IN:       inCommand(spu, cursor, instruction);      break;
+
+        case MachineCommands_JMP:      jmpCommand(spu, cursor, instruction);     break;
+
+        case MachineCommands_JA:       jaCommand(spu, cursor, instruction);      break;
+
+        case MachineCommands_JAE:      jaeCommand(spu, cursor, instruction);     break;
+
+        case MachineCommands_JB:       jbCommand(spu, cursor, instruction);      break;
+
+        case MachineCommands_JBE:      jbeCommand(spu, cursor, instruction);     break;
+
+        case MachineCommands_JE:       jeCommand(spu, cursor, instruction);      break;
+
+        case MachineCommands_JNE:      jneCommand(spu, cursor, instruction);     break;
+
+        case MachineCommands_RET:      retCommand(spu, cursor, instruction);     break;
+
+        case MachineCommands_CALL:     callCommand(spu, cursor, instruction);    break;
+
+        case MachineCommands_TAILCALL:   tailcallCommand(spu, cursor, instruction);  break;
+
+        case MachineCommands_PURE_CALL:  pureCallCommand(spu, cursor, instruction);  break;
+
+        case MachineCommands_CALL_DEPTH: callDepthCommand(spu, cursor, instruction); break;
+
+        case MachineCommands_TIMESTAMP:  timestampCommand(spu, cursor, instruction);  break;
+
+        case MachineCommands_DRAW:     drawCommand(spu, cursor, instruction);    break;
+
+        case MachineCommands_HLT:      hltCommand(spu, cursor, instruction);     break;
+
+        case MachineCommands_PUSH_SUB: pushSubCommand(spu, cursor, instruction); break;
+
+        case MachineCommands_INC:      incCommand(spu, cursor, instruction);     break;
+
+        case DecodedCommands_JA_PAIR:  jaPairCommand(spu, cursor, instruction);  break;
+
+        case DecodedCommands_JAE_PAIR: jaePairCommand(spu, cursor, instruction); break;
+
+        case DecodedCommands_JB_PAIR:  jbPairCommand(spu, cursor, instruction);  break;
+
+        case DecodedCommands_JBE_PAIR: jbePairCommand(spu, cursor, instruction); break;
+
+        case DecodedCommands_JE_PAIR:  jePairCommand(spu, cursor, instruction);  break;
+
+        case DecodedCommands_JNE_PAIR: jnePairCommand(spu, cursor, instruction); break;
+
+        case DecodedCommands_VADD:
+        case DecodedCommands_VSUB:
+        case DecodedCommands_VMUL:
+        case DecodedCommands_VDIV:
+        case DecodedCommands_VSCALE:
+        case DecodedCommands_VFILL:
+        case DecodedCommands_VCOPY:
+        case DecodedCommands_VSUM:
+        case DecodedCommands_VDOT:
+        case DecodedCommands_VLESS:    vectorCommand(spu, cursor, instruction);  break;
+
+        default:                       abortWithMessage("Unknown command");
+    }
+}
+
+
+// Direct-threaded engine: every handler is inlined into its own label and ends with its own indirect
+// jump, so the branch predictor sees one dispatch site per opcode instead of the single switch above.
+template <bool CHECKED, bool COUNTED>
+static void processMachineCodeThreaded(SPU* const spu)
+{
+    assert(spu != NULL);
+
+#if defined(__GNUC__)
+    static const void* const dispatch_table[NUMBER_OF_DECODED_COMMANDS] = {
+        &&label_HLT,      &&label_PUSH,     &&label_POP,      &&label_ADD,
+        &&label_MUL,      &&label_SUB,      &&label_DIV,      &&label_SQRT,
+        &&label_OUT,      &&label_IN,       &&label_JMP,      &&label_JA,
+        &&label_JAE,      &&label_JB,       &&label_JBE,      &&label_JE,
+        &&label_JNE,      &&label_CALL,     &&label_RET,      &&label_DRAW,
+        &&label_PUSH_SUB, &&label_INC,      &&label_UNKNOWN,  &&label_UNKNOWN,
+        &&label_TAILCALL, &&label_CALL_DEPTH, &&label_PURE_CALL, &&label_TIMESTAMP,
+        &&label_UNKNOWN,  &&label_UNKNOWN,  &&label_UNKNOWN,  &&label_UNKNOWN,
+        &&label_JA_PAIR,  &&label_JAE_PAIR, &&label_JB_PAIR,  &&label_JBE_PAIR,
+        &&label_JE_PAIR,  &&label_JNE_PAIR, &&label_VADD,     &&label_VSUB,
+        &&label_VMUL,     &&label_VDIV,     &&label_VSCALE,   &&label_VFILL,
+        &&label_VCOPY,    &&label_VSUM,     &&label_VDOT,     &&label_VLESS,
+    };
+
+    Cursor cursor = {
+        .ip        = spu->ip,
+        .stack_top = spu->stack_top,
+        .checked   = CHECKED,
+        .executed  = 0,
+    };
+
+    const Instruction* instruction = NULL;
+
+#define DISPATCH_()                              \
+    instruction = spu->program + cursor.ip;      \
+    cursor.ip++;                                 \
+    cursor.executed += COUNTED;                  \
+    goto *dispatch_table[instruction->command]
+
+#define THREADED_HANDLER_(command, handler)  \
+    label_##command:                          \
+        handler(spu, &cursor, instruction);   \
+        DISPATCH_();
+
+    DISPATCH_();
+
+    THREADED_HANDLER_(PUSH, pushArgument);
+    THREADED_HANDLER_(POP,  popRegister);
+    THREADED_HANDLER_(ADD,  addCommand);
+    THREADED_HANDLER_(MUL,  mulCommand);
+    THREADED_HANDLER_(DIV,  divCommand);
+    THREADED_HANDLER_(SUB,  subCommand);
+    THREADED_HANDLER_(SQRT, sqrtCommand);
+    THREADED_HANDLER_(OUT,  outCommand);
+    THREADED_HANDLER_(IN,   inCommand);
+    THREADED_HANDLER_(JMP,  jmpCommand);
+    THREADED_HANDLER_(JA,   jaCommand);
+    THREADED_HANDLER_(JAE,  jaeCommand);
+    THREADED_HANDLER_(JB,   jbCommand);
+    THREADED_HANDLER_(JBE,  jbeCommand);
+    THREADED_HANDLER_(JE,   jeCommand);
+    THREADED_HANDLER_(JNE,  jneCommand);
+    THREADED_HANDLER_(RET,  retCommand);
+    THREADED_HANDLER_(CALL, callCommand);
+    THREADED_HANDLER_(DRAW, drawCommand);
+    THREADED_HANDLER_(TAILCALL,   tailcallCommand);
+    THREADED_HANDLER_(CALL_DEPTH, callDepthCommand);
+    THREADED_HANDLER_(PURE_CALL,  pureCallCommand);
+    THREADED_HANDLER_(TIMESTAMP,  timestampCommand);
+
+    THREADED_HANDLER_(PUSH_SUB, pushSubCommand);
+    THREADED_HANDLER_(INC,      incCommand);
+    THREADED_HANDLER_(JA_PAIR,  jaPairCommand);
+    THREADED_HANDLER_(JAE_PAIR, jaePairCommand);
+    THREADED_HANDLER_(JB_PAIR,  jbPairCommand);
+    THREADED_HANDLER_(JBE_PAIR, jbePairCommand);
+    THREADED_HANDLER_(JE_PAIR,  jePairCommand);
+    THREADED_HANDLER_(JNE_PAIR, jnePairCommand);
+    THREADED_HANDLER_(VADD,     vectorCommand);
+    THREADED_HANDLER_(VSUB,     vectorCommand);
+    THREADED_HANDLER_(VMUL,     vectorCommand);
+    THREADED_HANDLER_(VDIV,     vectorCommand);
+    THREADED_HANDLER_(VSCALE,   vectorCommand);
+    THREADED_HANDLER_(VFILL,    vectorCommand);
+    THREADED_HANDLER_(VCOPY,    vectorCommand);
+    THREADED_HANDLER_(VSUM,     vectorCommand);
+    THREADED_HANDLER_(VDOT,     vectorCommand);
+    THREADED_HANDLER_(VLESS,    vectorCommand);
+
+    label_HLT:
+        hltCommand(spu, &cursor, instruction);
+
+        spu->ip        = cursor.ip;
+        spu->stack_top = cursor.stack_top;
+        spu->executed  = cursor.executed;
+        return;
+
+    label_UNKNOWN:
+        abortWithMessage("Unknown command");
+
+#undef THREADED_HANDLER_
+#undef DISPATCH_
+
+#else
+    processMachineCode<CHECKED, COUNTED>(spu);
+#endif
+}
+
+
+// every context gets its own stacks, RAM and streams, code and decoded program are shared with the loaded program
+static ProcessorErrorHandler spuCtor(const LoadedProgram* const program,
+                                     const SpuStreams* const    streams,
+                                     SPU* const                 spu)
+{
+    assert(program != NULL);
+    assert(streams != NULL);
+    assert(spu     != NULL);
+
+    spu->code           = program->code;
+    spu->size_of_code   = program->size_of_code;
+    spu->code_is_mapped = program->code_is_mapped;
+    spu->image          = program->image;
+    spu->program        = program->program;
+    spu->program_size   = program->program_size;
+
+    SpuStreams run_streams = getRunStreams(streams);
+    spuIoCtor(&spu->io, &run_streams);
+
+    ProcessorErrorHandler return_code = spuStacksCtor(spu);
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        return return_code;
+    }
+
+    spu->ram = (arguments_type*)calloc(SIZE_OF_RAM,
+                                       sizeof(arguments_type));
+    if (!spu->ram)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    spuReset(program, spu);
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static ProcessorErrorHandler spuStacksCtor(SPU* const spu)
+{
+    assert(spu != NULL);
+
+#ifdef USE_STACK_LIBRARY
+    spu->program_stack  = stackCtor();
+    if (!spu->program_stack)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+#endif
+
+    // untouched pages of the return stack are never faulted in, so its size costs nothing until recursion
+    spu->call_stack = (CallFrame*)calloc(CALL_STACK_SIZE, sizeof(CallFrame));
+    if (!spu->call_stack)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static void spuStacksDtor(SPU* const spu)
+{
+    assert(spu != NULL);
 
-    spuDtor(&spu);
+#ifdef USE_STACK_LIBRARY
+    if (spu->program_stack)
+    {
+        stackDtor(spu->program_stack);
+        spu->program_stack = NULL;
+    }
+#endif
 
-    return ProcessorErrorHandler_OK;
+    FREE_NULL(spu->call_stack);
 }
 
 
-// static --------------------------------------------------------------------------------------------------------------
+// the state every run starts from, without allocating anything
+static void spuReset(const LoadedProgram* const program, SPU* const spu)
+{
+    assert(program != NULL);
+    assert(spu     != NULL);
 
+    spu->ip         = 0;
+    spu->stack_top  = spu->operand_stack;
+    spu->call_depth = 0;
+    spu->end_flag   = true;
 
-static void processMachineCode(SPU* const spu)
-{
-    assert(spu != NULL);
+    memset(spu->registers, 0, sizeof(spu->registers));
+    memcpy(spu->ram, program->initial_ram, SIZE_OF_RAM * sizeof(arguments_type));
 
-    while (spu->end_flag)
+    // cached results are kept for the next runs, the calls that were running are not
+    if (spu->memo)
     {
-        switch(spu->code[spu->ip] & COMMAND_MASK)
-        {
-            case MachineCommands_PUSH: pushArgument(spu); break;
-
-            case MachineCommands_POP:  popRegister(spu);  break;
+        resetMemoCalls(spu->memo);
+    }
+}
 
-            case MachineCommands_ADD:  addCommand(spu);   break;
 
-            case MachineCommands_MUL:  mulCommand(spu);   break;
+// code and program belong to the loaded program, only what spuCtor made is freed here
+static ProcessorErrorHandler spuDtor(SPU* spu)
+{
+    assert(spu != NULL);
 
-            case MachineCommands_DIV:  divCommand(spu);   break;
+    spuIoDtor(&spu->io);
+    releaseSpuRam(spu);
+    spuStacksDtor(spu);
 
-            case MachineCommands_SUB:  subCommand(spu);   break;
+    memset(spu, 0, sizeof(SPU));
 
-            case MachineCommands_SQRT: sqrtCommand(spu);  break;
+    return ProcessorErrorHandler_OK;
+}
 
-            case MachineCommands_OUT:  outCommand(spu);   break;
 
-            case MachineCommands_IN:   inCommand(spu);    break;
+static SpuStreams getRunStreams(const SpuStreams* const streams)
+{
+    assert(streams != NULL);
 
-            case MachineCommands_JMP:  jmpCommand(spu);   break;
+    SpuStreams run_streams = *streams;
 
-            case MachineCommands_JA:   jaCommand(spu);    break;
+    if (!run_streams.input && !run_streams.read_value)
+    {
+        run_streams.input = stdin;
+    }
 
-            case MachineCommands_JAE:  jaeCommand(spu);   break;
+    if (!run_streams.output && !run_streams.write_value)
+    {
+        run_streams.output = stdout;
+    }
 
-            case MachineCommands_JB:   jbCommand(spu);    break;
+    return run_streams;
+}
 
-            case MachineCommands_JBE:  jbeCommand(spu);   break;
 
-            case MachineCommands_JE:   jeCommand(spu);    break;
+static ProcessorErrorHandler makeInitialRam(LoadedProgram* const program)
+{
+    assert(program != NULL);
 
-            case MachineCommands_JNE:  jneCommand(spu);   break;
+    program->initial_ram = (arguments_type*)calloc(SIZE_OF_RAM, sizeof(arguments_type));
+    if (!program->initial_ram)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
 
-            case MachineCommands_RET:  retCommand(spu);   break;
+    for (size_t i = 0; i < SIZE_OF_RAM; i++)
+    {
+        program->initial_ram[i] = SPACE;
+    }
 
-            case MachineCommands_CALL: callCommand(spu);  break;
+    if (program->image.data_size > 0)
+    {
+        memcpy(program->initial_ram, program->image.data, program->image.data_size);
+    }
 
-            case MachineCommands_DRAW: drawCommand(spu);  break;
+    return ProcessorErrorHandler_OK;
+}
 
-            case MachineCommands_HLT:  hltCommand(spu);   break;
 
-            default:                   abortWithMessage("Unknown command");
-        }
-        spu->ip++;
+static void releaseProgramCode(uint8_t* code, size_t size_of_code, bool code_is_mapped)
+{
+    if (code_is_mapped)
+    {
+        munmap(code, size_of_code);
+    }
+    else
+    {
+        free(code);
     }
 }
 
 
-static ProcessorErrorHandler spuInit(const char* path_to_program, SPU* const spu)
+// Regular files are mapped and decoded straight from the page cache, pipes and other
+// streams that can not be mapped are copied into memory the old way.
+static ProcessorErrorHandler readProgramCode(const char* path_to_program, SPU* const spu)
 {
     assert(path_to_program != NULL);
     assert(spu             != NULL);
 
-    ProcessorErrorHandler return_code = readProgramCode(path_to_program, spu);
-    if (return_code != ProcessorErrorHandler_OK)
+    FILE* program_file = fopen(path_to_program, "rb");
+    if (!program_file)
     {
-        return ProcessorErrorHandler_ERROR;
+        return ProcessorErrorHandler_OPEN_FILE_ERROR;
     }
 
-    spu->ip             = 0;
-    spu->program_stack  = stackCtor();
-    spu->function_stack = stackCtor();
-    spu->end_flag       = true;
+    struct stat file_info = {};
 
-    spu->ram = (arguments_type*)calloc(SIZE_OF_RAM,
-                                       sizeof(arguments_type));
-    if (!spu->ram)
+    ProcessorErrorHandler return_code = ProcessorErrorHandler_ERROR;
+    if (fstat(fileno(program_file), &file_info) == 0 && S_ISREG(file_info.st_mode) && file_info.st_size > 0)
     {
-        return ProcessorErrorHandler_ERROR;
+        return_code = mapProgramCode(program_file, (size_t)file_info.st_size, spu);
     }
 
-    for (size_t i = 0; i < SIZE_OF_RAM; i++)
+    if (return_code != ProcessorErrorHandler_OK)
     {
-        spu->ram[i] = SPACE;
+        return_code = readProgramStream(program_file, spu);
     }
 
-    return ProcessorErrorHandler_OK;
+    FCLOSE_NULL(program_file);
+
+    return return_code;
 }
 
 
-static ProcessorErrorHandler spuDtor(SPU* spu)
+static ProcessorErrorHandler mapProgramCode(FILE* const program_file, size_t size_of_code, SPU* const spu)
 {
-    assert(spu != NULL);
+    assert(program_file != NULL);
+    assert(spu          != NULL);
 
-    free(spu->code);
-    free(spu->ram);
+    void* mapping = mmap(NULL, size_of_code, PROT_READ, MAP_PRIVATE, fileno(program_file), 0);
+    if (mapping == MAP_FAILED)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
 
-    stackDtor(spu->program_stack);
-    stackDtor(spu->function_stack);
+    // the decoder reads the whole file once from start to end right away
+    madvise(mapping, size_of_code, MADV_SEQUENTIAL);
+    madvise(mapping, size_of_code, MADV_WILLNEED);
 
-    memset(spu, 0, sizeof(SPU));
+    spu->code           = (uint8_t*)mapping;
+    spu->size_of_code   = size_of_code;
+    spu->code_is_mapped = true;
 
     return ProcessorErrorHandler_OK;
 }
 
 
-static ProcessorErrorHandler readProgramCode(const char* path_to_program, SPU* const spu)
+static ProcessorErrorHandler readProgramStream(FILE* const program_file, SPU* const spu)
 {
-    assert(path_to_program != NULL);
-    assert(spu             != NULL);
-
-    FILE* program_file = fopen(path_to_program, "rb");
-    if (!program_file)
-    {
-        return ProcessorErrorHandler_OPEN_FILE_ERROR;
-    }
+    assert(program_file != NULL);
+    assert(spu          != NULL);
 
-    spu->size_of_code = getFileSize(program_file);
+    size_t capacity = START_CODE_CAPACITY;
 
-    spu->code = (uint8_t*)calloc(spu->size_of_code, sizeof(uint8_t));
+    spu->code           = (uint8_t*)calloc(capacity, sizeof(uint8_t));
+    spu->size_of_code   = 0;
+    spu->code_is_mapped = false;
     if (!spu->code)
     {
-        FCLOSE_NULL(program_file);
         return ProcessorErrorHandler_ERROR;
     }
 
-    size_t return_code = fread(spu->code,
-                               sizeof(spu->code[0]),
-                               spu->size_of_code,
-                               program_file);
-    if (return_code != spu->size_of_code)
+    while (true)
+    {
+        spu->size_of_code += fread(spu->code + spu->size_of_code,
+                                   sizeof(spu->code[0]),
+                                   capacity - spu->size_of_code,
+                                   program_file);
+        if (spu->size_of_code < capacity)
+        {
+            break;
+        }
+
+        uint8_t* new_code = (uint8_t*)realloc(spu->code, 2 * capacity);
+        if (!new_code)
+        {
+            FREE_NULL(spu->code);
+            return ProcessorErrorHandler_ERROR;
+        }
+
+        spu->code = new_code;
+        capacity *= 2;
+    }
+
+    if (ferror(program_file))
     {
         FREE_NULL(spu->code);
-        FCLOSE_NULL(program_file);
         return ProcessorErrorHandler_ERROR;
     }
 
@@ -227,392 +1587,630 @@ static ProcessorErrorHandler readProgramCode(const char* path_to_program, SPU* c
 }
 
 
-static void pushArgument(SPU* const spu)
+// The operand stack lives inside SPU and its top is kept in the engine's Cursor.
+// Building with -DUSE_STACK_LIBRARY routes everything through the protected Stack for debugging.
+HANDLER_INLINE_ void operandPush(SPU* const spu, Cursor* const cursor, arguments_type value)
 {
-    assert(spu != NULL);
+    assert(spu    != NULL);
+    assert(cursor != NULL);
+
+#ifdef USE_STACK_LIBRARY
+    (void)cursor;
+    stackPush(spu->program_stack, value);
+#else
+    if (cursor->checked && cursor->stack_top == spu->operand_stack + SIZE_OF_STACK)
+    {
+        raiseRuntimeError("Operand stack overflow");
+    }
 
-    uint8_t flags = spu->code[spu->ip] & FLAG_MOVED_MASK;
+    *cursor->stack_top = value;
+    cursor->stack_top++;
+#endif
+}
 
-    arguments_type argument = 0;
 
-    if (flags & REGISTER_FLAG)
+HANDLER_INLINE_ void operandPop(SPU* const spu, Cursor* const cursor, arguments_type* const value)
+{
+    assert(spu    != NULL);
+    assert(cursor != NULL);
+    assert(value  != NULL);
+
+#ifdef USE_STACK_LIBRARY
+    (void)cursor;
+    stackPop(spu->program_stack, value);
+#else
+    if (cursor->checked && cursor->stack_top == spu->operand_stack)
     {
-        spu->ip++;
-        argument = spu->registers[spu->code[spu->ip]];
+        raiseRuntimeError("Operand stack underflow");
     }
 
-    if (flags & CONST_FLAG)
+    cursor->stack_top--;
+    *value = *cursor->stack_top;
+#endif
+}
+
+
+static void writeOperandStackDumpLog(const SPU* const spu)
+{
+    assert(spu != NULL);
+
+#ifdef USE_STACK_LIBRARY
+    writeStackDumpLog(spu->program_stack);
+#else
+    size_t size = (size_t)(spu->stack_top - spu->operand_stack);
+
+    Log(LogLevel_INFO, "Operand stack: size = %zu, capacity = %zu", size, SIZE_OF_STACK);
+    for (size_t current_element = 0; current_element < size; current_element++)
     {
-        arguments_type const_argument = 0;
+        Log(LogLevel_INFO, "    [%zu] = %lg", current_element, (double)spu->operand_stack[current_element]);
+    }
+#endif
+}
+
+
+HANDLER_INLINE_ void pushArgument(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(instruction != NULL);
 
-        memcpy(&const_argument, spu->code + spu->ip + 1, sizeof(arguments_type));
-        spu->ip += sizeof(arguments_type);
+    arguments_type argument = 0;
 
-        argument += const_argument;
+    if (instruction->flags & REGISTER_FLAG)
+    {
+        argument = spu->registers[instruction->register_index];
     }
 
-    if (flags & RAM_FLAG)
+    if (instruction->flags & CONST_FLAG)
     {
-        argument = spu->ram[(int)argument];
+        argument += instruction->immediate;
     }
-    else
+
+    if (instruction->flags & RAM_FLAG)
     {
-        stackPush(spu->program_stack, argument);
+        argument = spu->ram[(int)argument];
     }
+
+    operandPush(spu, cursor, argument);
 }
 
 
-static void popRegister(SPU* const spu)
+HANDLER_INLINE_ void popRegister(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
-    assert(spu != NULL);
+    assert(spu         != NULL);
+    assert(instruction != NULL);
 
-    uint8_t flags = spu->code[spu->ip] & FLAG_MOVED_MASK;
-
-    if (flags & RAM_FLAG)
+    if (instruction->flags & RAM_FLAG)
     {
         int index = 0;
 
-        if (flags & REGISTER_FLAG)
+        if (instruction->flags & REGISTER_FLAG)
         {
-            spu->ip++;
-            index = (int)(spu->registers[spu->code[spu->ip]]);
+            index = (int)(spu->registers[instruction->register_index]);
         }
 
-        if (flags & CONST_FLAG)
+        if (instruction->flags & CONST_FLAG)
         {
-            arguments_type const_argument = 0;
-
-            memcpy(&const_argument, spu->code + spu->ip + 1, sizeof(arguments_type));
-            spu->ip += sizeof(arguments_type);
-
-            index += (int)const_argument;
+            index += (int)instruction->immediate;
         }
 
-        stackPop(spu->program_stack, spu->ram  + index);
+        operandPop(spu, cursor, spu->ram + index);
     }
     else
     {
-        spu->ip++;
-        stackPop(spu->program_stack, spu->registers + spu->code[spu->ip]);
+        operandPop(spu, cursor, spu->registers + instruction->register_index);
     }
 }
 
-static void addCommand(SPU* const spu)
+
+HANDLER_INLINE_ void addCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
     assert(spu != NULL);
+    (void)instruction;
 
     arguments_type first_element  = 0;
     arguments_type second_element = 0;
 
-    stackPop(spu->program_stack, &first_element);
-    stackPop(spu->program_stack, &second_element);
+    operandPop(spu, cursor, &first_element);
+    operandPop(spu, cursor, &second_element);
 
     arguments_type result = 0;
     result = first_element + second_element;
 
-    stackPush(spu->program_stack, result);
+    operandPush(spu, cursor, result);
 }
 
 
-static void mulCommand(SPU* const spu)
+HANDLER_INLINE_ void mulCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
     assert(spu != NULL);
+    (void)instruction;
 
     arguments_type first_element  = 0;
     arguments_type second_element = 0;
 
-    stackPop(spu->program_stack, &first_element);
-    stackPop(spu->program_stack, &second_element);
+    operandPop(spu, cursor, &first_element);
+    operandPop(spu, cursor, &second_element);
 
     arguments_type result = 0;
     result = first_element * second_element;
 
-    stackPush(spu->program_stack, result);
+    operandPush(spu, cursor, result);
 }
 
 
-static void divCommand(SPU* const spu)
+HANDLER_INLINE_ void divCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
     assert(spu != NULL);
+    (void)instruction;
 
     arguments_type first_element  = 0;
     arguments_type second_element = 0;
 
-    stackPop(spu->program_stack, &first_element);
-    stackPop(spu->program_stack, &second_element);
+    operandPop(spu, cursor, &first_element);
+    operandPop(spu, cursor, &second_element);
 
     arguments_type result = 0;
-    result = first_element / second_element;
+    result = divideValues(first_element, second_element);
 
-    stackPush(spu->program_stack, result);
+    operandPush(spu, cursor, result);
 }
 
 
-static void subCommand(SPU* const spu)
+HANDLER_INLINE_ void subCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
     assert(spu != NULL);
+    (void)instruction;
 
     arguments_type first_element  = 0;
     arguments_type second_element = 0;
 
-    stackPop(spu->program_stack, &first_element);
-    stackPop(spu->program_stack, &second_element);
+    operandPop(spu, cursor, &first_element);
+    operandPop(spu, cursor, &second_element);
 
     arguments_type result = 0;
     result = first_element - second_element;
 
-    stackPush(spu->program_stack, result);
+    operandPush(spu, cursor, result);
 }
 
 
-static void sqrtCommand(SPU* const spu)
+HANDLER_INLINE_ void sqrtCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
     assert(spu != NULL);
+    (void)instruction;
 
     arguments_type element = 0;
 
-    stackPop(spu->program_stack, &element);
+    operandPop(spu, cursor, &element);
 
     arguments_type result = 0;
-    result = sqrt(element);
+    result = getValueSqrt(element);
 
-    stackPush(spu->program_stack, result);
+    operandPush(spu, cursor, result);
 }
 
 
-static void outCommand(SPU* const spu)
+HANDLER_INLINE_ void outCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
     assert(spu != NULL);
+    (void)instruction;
 
     arguments_type element = 0;
-    stackPop(spu->program_stack, &element);
+    operandPop(spu, cursor, &element);
 
-    printf("Program out: %lg\n", element);
+    printProgramOut(&spu->io, element);
 }
 
 
-static void inCommand(SPU* const spu)
+HANDLER_INLINE_ void inCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
     assert(spu != NULL);
+    (void)instruction;
 
-    arguments_type element = 0;
+    operandPush(spu, cursor, scanProgramIn(&spu->io));
+}
 
-    printf("Enter argument: ");
-    scanf("%lg", &element);
 
-    stackPush(spu->program_stack, element);
+HANDLER_INLINE_ void jmpCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
+    (void)spu;
+
+    cursor->ip = instruction->target;
 }
 
 
-static void jmpCommand(SPU* const spu)
+HANDLER_INLINE_ void jaCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
-    assert(spu != NULL);
+    assert(spu         != NULL);
+    assert(instruction != NULL);
+
+    arguments_type first_element  = 0;
+    arguments_type second_element = 0;
 
-    size_t argument = 0;
+    operandPop(spu, cursor, &first_element);
+    operandPop(spu, cursor, &second_element);
 
-    memcpy(&argument, spu->code + spu->ip + 1, sizeof(arguments_type));
-    spu->ip = argument - 1;
+    if (first_element > second_element)
+    {
+        cursor->ip = instruction->target;
+    }
 }
 
 
-static void jaCommand(SPU* const spu)
+HANDLER_INLINE_ void jaeCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
-    assert(spu != NULL);
+    assert(spu         != NULL);
+    assert(instruction != NULL);
 
     arguments_type first_element  = 0;
     arguments_type second_element = 0;
 
-    stackPop(spu->program_stack, &first_element);
-    stackPop(spu->program_stack, &second_element);
+    operandPop(spu, cursor, &first_element);
+    operandPop(spu, cursor, &second_element);
 
-    if (first_element > second_element)
+    if (first_element >= second_element)
     {
-        size_t argument = 0;
-
-        memcpy(&argument, spu->code + spu->ip + 1, sizeof(arguments_type));
-        spu->ip = argument - 1;
+        cursor->ip = instruction->target;
     }
-    else
+}
+
+
+HANDLER_INLINE_ void jbCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(instruction != NULL);
+
+    arguments_type first_element  = 0;
+    arguments_type second_element = 0;
+
+    operandPop(spu, cursor, &first_element);
+    operandPop(spu, cursor, &second_element);
+
+    if (first_element < second_element)
     {
-        spu->ip += sizeof(arguments_type);
+        cursor->ip = instruction->target;
     }
 }
 
 
-static void jaeCommand(SPU* const spu)
+HANDLER_INLINE_ void jbeCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
-    assert(spu != NULL);
+    assert(spu         != NULL);
+    assert(instruction != NULL);
 
     arguments_type first_element  = 0;
     arguments_type second_element = 0;
 
-    stackPop(spu->program_stack, &first_element);
-    stackPop(spu->program_stack, &second_element);
+    operandPop(spu, cursor, &first_element);
+    operandPop(spu, cursor, &second_element);
 
-    if (first_element >= second_element)
+    if (first_element <= second_element)
     {
-        size_t argument = 0;
-
-        memcpy(&argument, spu->code + spu->ip + 1, sizeof(arguments_type));
-        spu->ip = argument - 1;
+        cursor->ip = instruction->target;
     }
-    else
+}
+
+
+HANDLER_INLINE_ void jeCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(instruction != NULL);
+
+    arguments_type first_element  = 0;
+    arguments_type second_element = 0;
+
+    operandPop(spu, cursor, &first_element);
+    operandPop(spu, cursor, &second_element);
+
+    if (valuesAreEqual(first_element, second_element))
     {
-        spu->ip += sizeof(arguments_type);
+        cursor->ip = instruction->target;
     }
 }
 
 
-static void jbCommand(SPU* const spu)
+HANDLER_INLINE_ void jneCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
-    assert(spu != NULL);
+    assert(spu         != NULL);
+    assert(instruction != NULL);
 
     arguments_type first_element  = 0;
     arguments_type second_element = 0;
 
-    stackPop(spu->program_stack, &first_element);
-    stackPop(spu->program_stack, &second_element);
+    operandPop(spu, cursor, &first_element);
+    operandPop(spu, cursor, &second_element);
 
-    if (first_element < second_element)
+    if (!valuesAreEqual(first_element, second_element))
     {
-        size_t argument = 0;
-
-        memcpy(&argument, spu->code + spu->ip + 1, sizeof(arguments_type));
-        spu->ip = argument - 1;
+        cursor->ip = instruction->target;
     }
-    else
+}
+
+
+// push a; push b; sub without touching the stack for a and b
+HANDLER_INLINE_ void pushSubCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(instruction != NULL);
+
+    arguments_type first_element  = 0;
+    arguments_type second_element = 0;
+
+    loadPairOperands(spu, instruction, &first_element, &second_element);
+
+    operandPush(spu, cursor, first_element - second_element);
+}
+
+
+// push const; push reg; add; pop reg
+HANDLER_INLINE_ void incCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(instruction != NULL);
+    (void)cursor;
+
+    spu->registers[instruction->register_index] = spu->registers[instruction->register_index]
+                                                + instruction->immediate;
+}
+
+
+HANDLER_INLINE_ void jaPairCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
+
+    arguments_type first_element  = 0;
+    arguments_type second_element = 0;
+
+    loadPairOperands(spu, instruction, &first_element, &second_element);
+
+    if (first_element > second_element)
     {
-        spu->ip += sizeof(arguments_type);
+        cursor->ip = instruction->target;
     }
 }
 
 
-static void jbeCommand(SPU* const spu)
+HANDLER_INLINE_ void jaePairCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
-    assert(spu != NULL);
+    assert(spu         != NULL);
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
 
     arguments_type first_element  = 0;
     arguments_type second_element = 0;
 
-    stackPop(spu->program_stack, &first_element);
-    stackPop(spu->program_stack, &second_element);
+    loadPairOperands(spu, instruction, &first_element, &second_element);
 
-    if (first_element <= second_element)
+    if (first_element >= second_element)
     {
-        size_t argument = 0;
-
-        memcpy(&argument, spu->code + spu->ip + 1, sizeof(arguments_type));
-        spu->ip = argument - 1;
+        cursor->ip = instruction->target;
     }
-    else
+}
+
+
+HANDLER_INLINE_ void jbPairCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
+
+    arguments_type first_element  = 0;
+    arguments_type second_element = 0;
+
+    loadPairOperands(spu, instruction, &first_element, &second_element);
+
+    if (first_element < second_element)
     {
-        spu->ip += sizeof(arguments_type);
+        cursor->ip = instruction->target;
     }
 }
 
 
-static void jeCommand(SPU* const spu)
+HANDLER_INLINE_ void jbePairCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
-    assert(spu != NULL);
+    assert(spu         != NULL);
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
 
     arguments_type first_element  = 0;
     arguments_type second_element = 0;
 
-    stackPop(spu->program_stack, &first_element);
-    stackPop(spu->program_stack, &second_element);
+    loadPairOperands(spu, instruction, &first_element, &second_element);
 
-    if (equatTwoDoubles(first_element, second_element))
+    if (first_element <= second_element)
     {
-        size_t argument = 0;
-
-        memcpy(&argument, spu->code + spu->ip + 1, sizeof(arguments_type));
-        spu->ip = argument - 1;
+        cursor->ip = instruction->target;
     }
-    else
+}
+
+
+HANDLER_INLINE_ void jePairCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
+
+    arguments_type first_element  = 0;
+    arguments_type second_element = 0;
+
+    loadPairOperands(spu, instruction, &first_element, &second_element);
+
+    if (valuesAreEqual(first_element, second_element))
     {
-        spu->ip += sizeof(arguments_type);
+        cursor->ip = instruction->target;
     }
 }
 
 
-static void jneCommand(SPU* const spu)
+HANDLER_INLINE_ void jnePairCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
-    assert(spu != NULL);
+    assert(spu         != NULL);
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
 
     arguments_type first_element  = 0;
     arguments_type second_element = 0;
 
-    stackPop(spu->program_stack, &first_element);
-    stackPop(spu->program_stack, &second_element);
+    loadPairOperands(spu, instruction, &first_element, &second_element);
 
-    if (!equatTwoDoubles(first_element, second_element))
+    if (!valuesAreEqual(first_element, second_element))
     {
-        size_t argument = 0;
+        cursor->ip = instruction->target;
+    }
+}
+
 
-        memcpy(&argument, spu->code + spu->ip + 1, sizeof(arguments_type));
-        spu->ip = argument - 1;
+// the vector command gets its operands in the order they were pushed
+HANDLER_INLINE_ void vectorCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
+
+    uint8_t                  vector_command = (uint8_t)(instruction->command - DecodedCommands_VADD);
+    const VectorCommandInfo* info           = VECTOR_COMMANDS + vector_command;
+
+    arguments_type operands[MAX_VECTOR_OPERANDS] = {};
+    for (size_t operand = info->operands; operand > 0; operand--)
+    {
+        operandPop(spu, cursor, operands + operand - 1);
     }
-    else
+
+    arguments_type result = executeVectorCommand(vector_command, spu->ram, operands);
+
+    if (info->results)
     {
-        spu->ip += sizeof(arguments_type);
+        operandPush(spu, cursor, result);
     }
 }
 
+// Operands of a superinstruction in the order the plain handlers pop them:
+// for push a; push b the first element is b and the second one is a.
+HANDLER_INLINE_ void loadPairOperands(const SPU* const         spu,
+                                      const Instruction* const instruction,
+                                      arguments_type* const    first_element,
+                                      arguments_type* const    second_element)
+{
+    assert(spu            != NULL);
+    assert(instruction    != NULL);
+    assert(first_element  != NULL);
+    assert(second_element != NULL);
+
+    *second_element = (instruction->flags & PAIR_FIRST_REGISTER_FLAG)
+                    ? spu->registers[instruction->register_index]
+                    : instruction->immediate;
+
+    *first_element  = (instruction->flags & PAIR_SECOND_REGISTER_FLAG)
+                    ? spu->registers[instruction->second_register_index]
+                    : instruction->second_immediate;
+}
+
 
-static void retCommand(SPU* const spu)
+// A verified program never returns from the main program and its call depth fits the return stack,
+// so both checks are folded away the same way as the operand stack ones.
+HANDLER_INLINE_ void retCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
     assert(spu != NULL);
+    (void)instruction;
 
-    arguments_type pointer_double = 0;
-    stackPop(spu->function_stack, &pointer_double);
+    if (cursor->checked && spu->call_depth == 0)
+    {
+        raiseRuntimeError("Return without call");
+    }
 
-    size_t pointer = 0;
-    memcpy(&pointer, &pointer_double, sizeof(arguments_type));
+    if (spu->memo)
+    {
+        finishMemoCall(spu->memo, spu);
+    }
 
-    spu->ip = pointer - 1;
+    spu->call_depth--;
+    cursor->ip = spu->call_stack[spu->call_depth].return_ip;
 }
 
 
-static void callCommand(SPU* const spu)
+HANDLER_INLINE_ void callCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
-    assert(spu != NULL);
+    assert(spu         != NULL);
+    assert(instruction != NULL);
+
+    if (cursor->checked && spu->call_depth == CALL_STACK_SIZE)
+    {
+        raiseRuntimeError("Call stack overflow");
+    }
 
-    size_t pointer = spu->ip + sizeof(arguments_type);
-    arguments_type pointer_double = 0;
+    // ip already points to the instruction after call
+    spu->call_stack[spu->call_depth].return_ip = cursor->ip;
+    spu->call_depth++;
 
-    memcpy(&pointer_double, &pointer, sizeof(arguments_type));
+    cursor->ip = instruction->target;
+}
 
-    stackPush(spu->function_stack, pointer_double);
 
-    size_t argument = 0;
-    memcpy(&argument, spu->code + spu->ip + 1, sizeof(arguments_type));
+// the callee returns straight to the caller of the current procedure, so the return stack stays as it is
+HANDLER_INLINE_ void tailcallCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
+    (void)spu;
 
-    spu->ip = argument - 1;
+    cursor->ip = instruction->target;
 }
 
 
-static void drawCommand(SPU* const spu)
+// a cached result takes the place of the whole call, ip is already past it
+HANDLER_INLINE_ void pureCallCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
-    for (size_t i = 0; i < ROWS; i++)
-    {
-        for (size_t j = 0; j < COLUMNS; j++)
-        {
-            putc((int)spu->ram[ROWS * i + j], stdout);
-            putc(SPACE, stdout);
-        }
+    assert(spu         != NULL);
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
 
-        putc('\n', stdout);
+    if (spu->memo && findMemoResult(spu->memo, spu, instruction->target, &cursor->stack_top))
+    {
+        return;
     }
+
+    callCommand(spu, cursor, instruction);
 }
 
 
-static void hltCommand(SPU* const spu)
+HANDLER_INLINE_ void callDepthCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
 {
     assert(spu != NULL);
+    (void)instruction;
 
-    spu->end_flag = false;
+    operandPush(spu, cursor, (arguments_type)spu->call_depth);
+}
 
-    writeStackDumpLog(spu->program_stack);
 
-    printf("Program end\n");
+HANDLER_INLINE_ void timestampCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu != NULL);
+    (void)instruction;
+
+    operandPush(spu, cursor, readProgramClock(&spu->io));
+}
+
+
+HANDLER_INLINE_ void drawCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu != NULL);
+    (void)cursor;
+    (void)instruction;
+
+    drawRam(&spu->io, spu->ram);
+}
+
+
+HANDLER_INLINE_ void hltCommand(SPU* const spu, Cursor* const cursor, const Instruction* const instruction)
+{
+    assert(spu != NULL);
+    (void)instruction;
+
+    spu->stack_top = cursor->stack_top;
+
+    finishProgram(spu);
 }
@@ -0,0 +1,707 @@
+#include "profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "helpful_functions.h"
+#include "command_handler.h"
+#include "logger.h"
+#include "monotonic_clock.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const size_t START_NODES_CAPACITY = 64;
+static const size_t ROOT_NODE            = 0;
+static const size_t NO_PROFILE_NODE      = SIZE_MAX;
+static const size_t MAX_NAME_SIZE        = 32;     // names made up for procedures the source map does not name
+
+#if defined(__x86_64__) || defined(__i386__)
+static const char* const COUNTER_UNIT = "cycles";
+#else
+static const char* const COUNTER_UNIT = "ns";
+#endif
+
+// one row of the report: a procedure with its calls or an instruction with its executions
+typedef struct ProfileCost
+{
+    size_t   key;        // entry of the procedure or index of the instruction
+    uint64_t count;
+    uint64_t cycles;
+} ProfileCost;
+
+// the .asm file the source map points to, split into lines
+typedef struct SourceText
+{
+    char*  text;
+    char** lines;        // lines[0] is line 1
+    size_t number_of_lines;
+} SourceText;
+
+static bool readSourceMap(const SPU* const spu, SourceMap* const source_map);
+static void sourceMapDtor(SourceMap* const source_map);
+static void readSourceText(const char* path, SourceText* const source_text);
+static void sourceTextDtor(SourceText* const source_text);
+
+static void enterProcedure(Profiler* const profiler, size_t entry);
+static void leaveProcedure(Profiler* const profiler);
+static size_t addNode(Profiler* const profiler, size_t parent, size_t entry);
+
+static void writeReport(const Profiler* const profiler, FILE* report);
+static ProfileCost* getProcedureCosts(const Profiler* const profiler, size_t* number_of_procedures);
+static ProfileCost* getInstructionCosts(const Profiler* const profiler, size_t* number_of_instructions);
+static int compareCosts(const void* first, const void* second);
+static void writeFoldedNode(const Profiler* const profiler, FILE* folded, size_t node, char* path, size_t path_length);
+static const char* getProcedureName(const Profiler* const profiler, size_t entry, char* buffer);
+static uint64_t readCycleCounter(void);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+ProcessorErrorHandler profilerCtor(Profiler* const profiler, const SPU* const spu)
+{
+    assert(profiler     != NULL);
+    assert(spu          != NULL);
+    assert(spu->program != NULL);
+
+    *profiler = {
+        .program_size = spu->program_size + 1,
+    };
+
+    profiler->executions = (uint64_t*)calloc(profiler->program_size, sizeof(uint64_t));
+    profiler->cycles     = (uint64_t*)calloc(profiler->program_size, sizeof(uint64_t));
+    profiler->nodes      = (ProfileNode*)calloc(START_NODES_CAPACITY, sizeof(ProfileNode));
+    if (!profiler->executions || !profiler->cycles || !profiler->nodes)
+    {
+        profilerDtor(profiler);
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    profiler->nodes_capacity = START_NODES_CAPACITY;
+    profiler->current_node   = addNode(profiler, NO_PROFILE_NODE, MAIN_PROGRAM_ENTRY);
+
+    if (!readSourceMap(spu, &profiler->source_map))
+    {
+        sourceMapDtor(&profiler->source_map);
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+void profilerDtor(Profiler* const profiler)
+{
+    assert(profiler != NULL);
+
+    FREE_NULL(profiler->executions);
+    FREE_NULL(profiler->cycles);
+    FREE_NULL(profiler->nodes);
+    sourceMapDtor(&profiler->source_map);
+}
+
+
+void startProfile(Profiler* const profiler)
+{
+    assert(profiler != NULL);
+
+    profiler->last_counter = readCycleCounter();
+}
+
+
+// what an instruction costs is everything from the end of the one before it to its own end,
+// the bookkeeping of the profiler included
+void profileInstruction(Profiler* const profiler, const SPU* const spu, size_t index, size_t call_depth, size_t next)
+{
+    assert(profiler != NULL);
+    assert(spu      != NULL);
+
+    uint64_t now  = readCycleCounter();
+    uint64_t cost = now - profiler->last_counter;
+
+    profiler->last_counter = now;
+
+    profiler->executions[index]++;
+    profiler->cycles[index]                         += cost;
+    profiler->nodes[profiler->current_node].cycles += cost;
+
+    // a pure call answered from the cache does not change the depth and stays in its caller
+    if (spu->call_depth > call_depth)
+    {
+        enterProcedure(profiler, next);
+    }
+    else if (spu->call_depth < call_depth)
+    {
+        leaveProcedure(profiler);
+    }
+    else if (spu->program[index].command == MachineCommands_TAILCALL)
+    {
+        leaveProcedure(profiler);
+        enterProcedure(profiler, next);
+    }
+}
+
+
+ProcessorErrorHandler writeProfile(const Profiler* const profiler)
+{
+    assert(profiler != NULL);
+
+    FILE* report = fopen(PROFILE_REPORT_PATH, "w");
+    FILE* folded = fopen(PROFILE_FOLDED_PATH, "w");
+
+    char*  path      = NULL;
+    size_t path_size = 0;
+
+    if (report && folded)
+    {
+        size_t longest_name = MAX_NAME_SIZE;
+        for (size_t current_name = 0; current_name < profiler->source_map.number_of_procedures; current_name++)
+        {
+            size_t name_size = strlen(profiler->source_map.procedure_names[current_name]) + 1;
+            longest_name     = name_size > longest_name ? name_size : longest_name;
+        }
+
+        path_size = longest_name * (MAX_PROFILE_DEPTH + 1) + 1;
+        path      = (char*)calloc(path_size, sizeof(char));
+    }
+
+    if (!path)
+    {
+        if (report)
+        {
+            FCLOSE_NULL(report);
+        }
+
+        if (folded)
+        {
+            FCLOSE_NULL(folded);
+        }
+
+        return ProcessorErrorHandler_OPEN_FILE_ERROR;
+    }
+
+    writeReport(profiler, report);
+    writeFoldedNode(profiler, folded, ROOT_NODE, path, 0);
+
+    FREE_NULL(path);
+    FCLOSE_NULL(report);
+    FCLOSE_NULL(folded);
+
+    Log(LogLevel_INFO, "Profile written to %s and %s", PROFILE_REPORT_PATH, PROFILE_FOLDED_PATH);
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+// Lines of the section go to the instructions of the code section in order, the jump a program with another
+// entry point gets and the closing hlt have none. Returns false for a section that does not fit the program.
+static bool readSourceMap(const SPU* const spu, SourceMap* const source_map)
+{
+    assert(spu        != NULL);
+    assert(source_map != NULL);
+
+    const ProgramImage* const image = &spu->image;
+
+    if (!image->source_map)
+    {
+        Log(LogLevel_INFO, "Program has no source map, the profile has no lines and no procedure names");
+        return false;
+    }
+
+    SourceMapHeader header = {};
+    if (image->source_map_size < sizeof(header))
+    {
+        Log(LogLevel_INFO, "Source map is truncated");
+        return false;
+    }
+
+    memcpy(&header, image->source_map, sizeof(header));
+
+    size_t first_index = image->entry_point != 0 ? 1 : 0;
+    size_t lines_size  = (size_t)header.number_of_lines * sizeof(SourceLine);
+    if (lines_size > image->source_map_size - sizeof(header)
+     || header.names_size == 0
+     || header.names_size != image->source_map_size - sizeof(header) - lines_size
+     || image->source_map[image->source_map_size - 1] != '\0'
+     || header.number_of_lines != spu->program_size - first_index)
+    {
+        Log(LogLevel_INFO, "Source map does not fit the program");
+        return false;
+    }
+
+    size_t number_of_procedures = header.number_of_procedures;
+
+    source_map->lines           = (uint32_t*)calloc(spu->program_size + 1, sizeof(uint32_t));
+    source_map->procedures      = (uint32_t*)calloc(spu->program_size + 1, sizeof(uint32_t));
+    source_map->names           = (char*)calloc(header.names_size, sizeof(char));
+    source_map->procedure_names = (const char**)calloc(number_of_procedures + 1, sizeof(const char*));
+    if (!source_map->lines || !source_map->procedures || !source_map->names || !source_map->procedure_names)
+    {
+        return false;
+    }
+
+    memcpy(source_map->names, image->source_map + sizeof(header) + lines_size, header.names_size);
+
+    // the .asm file first, then one name per procedure
+    const char* name       = source_map->names;
+    const char* names_end  = source_map->names + header.names_size;
+    source_map->source_path = name;
+    name += strlen(name) + 1;
+
+    for (size_t current_name = 0; current_name < number_of_procedures; current_name++)
+    {
+        if (name >= names_end)
+        {
+            Log(LogLevel_INFO, "Source map does not fit the program");
+            return false;
+        }
+
+        source_map->procedure_names[current_name] = name;
+        name += strlen(name) + 1;
+    }
+
+    source_map->number_of_procedures = number_of_procedures;
+
+    for (size_t index = 0; index <= spu->program_size; index++)
+    {
+        source_map->procedures[index] = NO_SOURCE_PROCEDURE;
+    }
+
+    for (size_t current_line = 0; current_line < header.number_of_lines; current_line++)
+    {
+        SourceLine line = {};
+        memcpy(&line, image->source_map + sizeof(header) + current_line * sizeof(SourceLine), sizeof(line));
+
+        source_map->lines[first_index + current_line]      = line.line;
+        source_map->procedures[first_index + current_line] = line.procedure < number_of_procedures
+                                                           ? line.procedure : NO_SOURCE_PROCEDURE;
+    }
+
+    return true;
+}
+
+
+static void sourceMapDtor(SourceMap* const source_map)
+{
+    assert(source_map != NULL);
+
+    FREE_NULL(source_map->lines);
+    FREE_NULL(source_map->procedures);
+    FREE_NULL(source_map->names);
+    free(source_map->procedure_names);
+
+    *source_map = {};
+}
+
+
+// the report is written without source text if the file is gone
+static void readSourceText(const char* path, SourceText* const source_text)
+{
+    assert(path        != NULL);
+    assert(source_text != NULL);
+
+    *source_text = {};
+
+    FILE* source_file = fopen(path, "rb");
+    if (!source_file)
+    {
+        return;
+    }
+
+    size_t size = getFileSize(source_file);
+
+    source_text->text = (char*)calloc(size + 1, sizeof(char));
+    if (!source_text->text || fread(source_text->text, sizeof(char), size, source_file) != size)
+    {
+        FCLOSE_NULL(source_file);
+        sourceTextDtor(source_text);
+        return;
+    }
+
+    FCLOSE_NULL(source_file);
+
+    size_t number_of_lines = 1;
+    for (size_t current_char = 0; current_char < size; current_char++)
+    {
+        number_of_lines += source_text->text[current_char] == '\n' ? 1 : 0;
+    }
+
+    source_text->lines = (char**)calloc(number_of_lines, sizeof(char*));
+    if (!source_text->lines)
+    {
+        sourceTextDtor(source_text);
+        return;
+    }
+
+    char* line_start = source_text->text;
+    for (size_t current_char = 0; current_char <= size; current_char++)
+    {
+        char* current = source_text->text + current_char;
+        if (*current != '\n' && current_char != size)
+        {
+            continue;
+        }
+
+        *current = '\0';
+        if (current > line_start && current[-1] == '\r')
+        {
+            current[-1] = '\0';
+        }
+
+        source_text->lines[source_text->number_of_lines++] = line_start + strspn(line_start, " \t");
+        line_start = current + 1;
+    }
+}
+
+
+static void sourceTextDtor(SourceText* const source_text)
+{
+    assert(source_text != NULL);
+
+    FREE_NULL(source_text->text);
+    FREE_NULL(source_text->lines);
+    source_text->number_of_lines = 0;
+}
+
+
+// Calls deeper than MAX_PROFILE_DEPTH and calls there is no memory for a node of are counted into the caller,
+// hidden_depth makes sure their rets do not leave it.
+static void enterProcedure(Profiler* const profiler, size_t entry)
+{
+    assert(profiler != NULL);
+
+    if (profiler->hidden_depth > 0 || profiler->depth >= MAX_PROFILE_DEPTH)
+    {
+        profiler->hidden_depth++;
+        return;
+    }
+
+    size_t child = profiler->nodes[profiler->current_node].first_child;
+    while (child != NO_PROFILE_NODE && profiler->nodes[child].entry != entry)
+    {
+        child = profiler->nodes[child].next_sibling;
+    }
+
+    if (child == NO_PROFILE_NODE)
+    {
+        child = addNode(profiler, profiler->current_node, entry);
+        if (child == NO_PROFILE_NODE)
+        {
+            profiler->hidden_depth++;
+            return;
+        }
+    }
+
+    profiler->nodes[child].calls++;
+    profiler->current_node = child;
+    profiler->depth++;
+}
+
+
+static void leaveProcedure(Profiler* const profiler)
+{
+    assert(profiler != NULL);
+
+    if (profiler->hidden_depth > 0)
+    {
+        profiler->hidden_depth--;
+        return;
+    }
+
+    // ret without a call stops the program right after
+    if (profiler->current_node == ROOT_NODE)
+    {
+        return;
+    }
+
+    profiler->current_node = profiler->nodes[profiler->current_node].parent;
+    profiler->depth--;
+}
+
+
+static size_t addNode(Profiler* const profiler, size_t parent, size_t entry)
+{
+    assert(profiler != NULL);
+
+    if (profiler->nodes_size == profiler->nodes_capacity)
+    {
+        ProfileNode* nodes = (ProfileNode*)realloc(profiler->nodes, 2 * profiler->nodes_capacity * sizeof(ProfileNode));
+        if (!nodes)
+        {
+            return NO_PROFILE_NODE;
+        }
+
+        profiler->nodes           = nodes;
+        profiler->nodes_capacity *= 2;
+    }
+
+    size_t node = profiler->nodes_size++;
+
+    profiler->nodes[node] = {
+        .parent       = parent,
+        .first_child  = NO_PROFILE_NODE,
+        .next_sibling = parent != NO_PROFILE_NODE ? profiler->nodes[parent].first_child : NO_PROFILE_NODE,
+        .entry        = entry,
+        .calls        = 0,
+        .cycles       = 0,
+    };
+
+    if (parent != NO_PROFILE_NODE)
+    {
+        profiler->nodes[parent].first_child = node;
+    }
+
+    return node;
+}
+
+
+static void writeReport(const Profiler* const profiler, FILE* report)
+{
+    assert(profiler != NULL);
+    assert(report   != NULL);
+
+    const SourceMap* const source_map = &profiler->source_map;
+
+    uint64_t total_executions = 0;
+    uint64_t total_cycles     = 0;
+    for (size_t index = 0; index < profiler->program_size; index++)
+    {
+        total_executions += profiler->executions[index];
+        total_cycles     += profiler->cycles[index];
+    }
+
+    double percent = total_cycles != 0 ? 100.0 / (double)total_cycles : 0;
+
+    fprintf(report, "Profile: %llu instructions executed, %llu %s\n",
+            (unsigned long long)total_executions, (unsigned long long)total_cycles, COUNTER_UNIT);
+    fprintf(report, "Source: %s\n\n", source_map->source_path ? source_map->source_path
+                                                              : "no source map, assemble with --source-map");
+
+    char name_buffer[MAX_NAME_SIZE] = {};
+
+    size_t       number_of_procedures = 0;
+    ProfileCost* procedures           = getProcedureCosts(profiler, &number_of_procedures);
+
+    fprintf(report, "Procedures by %s spent in their own code:\n", COUNTER_UNIT);
+    fprintf(report, "%15s %7s %14s  %s\n", COUNTER_UNIT, "%", "calls", "procedure");
+
+    for (size_t current_procedure = 0; procedures && current_procedure < number_of_procedures; current_procedure++)
+    {
+        const ProfileCost* const cost = procedures + current_procedure;
+        fprintf(report, "%15llu %6.2f%% %14llu  %s\n", (unsigned long long)cost->cycles, (double)cost->cycles * percent,
+                (unsigned long long)cost->count, getProcedureName(profiler, cost->key, name_buffer));
+    }
+
+    FREE_NULL(procedures);
+
+    SourceText source_text = {};
+    if (source_map->source_path)
+    {
+        readSourceText(source_map->source_path, &source_text);
+    }
+
+    size_t       number_of_instructions = 0;
+    ProfileCost* instructions           = getInstructionCosts(profiler, &number_of_instructions);
+
+    fprintf(report, "\nInstructions by %s:\n", COUNTER_UNIT);
+    fprintf(report, "%15s %7s %14s %11s %6s  %-20s %s\n", COUNTER_UNIT, "%", "executions", "instruction", "line",
+            "procedure", "source");
+
+    for (size_t current_instruction = 0; instructions && current_instruction < number_of_instructions;
+         current_instruction++)
+    {
+        const ProfileCost* const cost = instructions + current_instruction;
+
+        uint32_t    line      = source_map->lines ? source_map->lines[cost->key] : 0;
+        uint32_t    procedure = source_map->procedures ? source_map->procedures[cost->key] : NO_SOURCE_PROCEDURE;
+        const char* text      = line != 0 && line <= source_text.number_of_lines ? source_text.lines[line - 1] : "";
+
+        char line_buffer[MAX_NAME_SIZE] = "-";
+        if (line != 0)
+        {
+            snprintf(line_buffer, sizeof(line_buffer), "%u", line);
+        }
+
+        fprintf(report, "%15llu %6.2f%% %14llu %11zu %6s  %-20s %s\n", (unsigned long long)cost->cycles,
+                (double)cost->cycles * percent, (unsigned long long)cost->count, cost->key, line_buffer,
+                procedure != NO_SOURCE_PROCEDURE ? source_map->procedure_names[procedure] : "-", text);
+    }
+
+    FREE_NULL(instructions);
+    sourceTextDtor(&source_text);
+}
+
+
+// the nodes of every call path that goes to the same entry summed up, sorted by cycles
+static ProfileCost* getProcedureCosts(const Profiler* const profiler, size_t* number_of_procedures)
+{
+    assert(profiler             != NULL);
+    assert(number_of_procedures != NULL);
+
+    *number_of_procedures = 0;
+
+    ProfileCost* costs         = (ProfileCost*)calloc(profiler->nodes_size, sizeof(ProfileCost));
+    size_t*      cost_of_entry = (size_t*)calloc(profiler->program_size, sizeof(size_t));
+    if (!costs || !cost_of_entry)
+    {
+        FREE_NULL(costs);
+        FREE_NULL(cost_of_entry);
+        return NULL;
+    }
+
+    // costs[0] is the main program, entries of procedures are numbered from 1
+    costs[0] = {
+        .key    = MAIN_PROGRAM_ENTRY,
+        .count  = 1,
+        .cycles = profiler->nodes[ROOT_NODE].cycles,
+    };
+    *number_of_procedures = 1;
+
+    for (size_t node = ROOT_NODE + 1; node < profiler->nodes_size; node++)
+    {
+        const ProfileNode* const profile_node = profiler->nodes + node;
+
+        size_t* cost = cost_of_entry + profile_node->entry;
+        if (*cost == 0)
+        {
+            *cost = (*number_of_procedures)++;
+            costs[*cost].key = profile_node->entry;
+        }
+
+        costs[*cost].count  += profile_node->calls;
+        costs[*cost].cycles += profile_node->cycles;
+    }
+
+    FREE_NULL(cost_of_entry);
+
+    qsort(costs, *number_of_procedures, sizeof(ProfileCost), compareCosts);
+
+    return costs;
+}
+
+
+// instructions that ran at least once, sorted by cycles
+static ProfileCost* getInstructionCosts(const Profiler* const profiler, size_t* number_of_instructions)
+{
+    assert(profiler               != NULL);
+    assert(number_of_instructions != NULL);
+
+    *number_of_instructions = 0;
+
+    ProfileCost* costs = (ProfileCost*)calloc(profiler->program_size, sizeof(ProfileCost));
+    if (!costs)
+    {
+        return NULL;
+    }
+
+    for (size_t index = 0; index < profiler->program_size; index++)
+    {
+        if (profiler->executions[index] != 0)
+        {
+            costs[(*number_of_instructions)++] = {
+                .key    = index,
+                .count  = profiler->executions[index],
+                .cycles = profiler->cycles[index],
+            };
+        }
+    }
+
+    qsort(costs, *number_of_instructions, sizeof(ProfileCost), compareCosts);
+
+    return costs;
+}
+
+
+// most cycles first, ties go in the order of keys
+static int compareCosts(const void* first, const void* second)
+{
+    assert(first  != NULL);
+    assert(second != NULL);
+
+    const ProfileCost* first_cost  = (const ProfileCost*)first;
+    const ProfileCost* second_cost = (const ProfileCost*)second;
+
+    if (first_cost->cycles != second_cost->cycles)
+    {
+        return first_cost->cycles > second_cost->cycles ? -1 : 1;
+    }
+
+    if (first_cost->key != second_cost->key)
+    {
+        return first_cost->key < second_cost->key ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+// path holds the names of the callers joined by ';', path_length characters of it
+static void writeFoldedNode(const Profiler* const profiler, FILE* folded, size_t node, char* path, size_t path_length)
+{
+    assert(profiler != NULL);
+    assert(folded   != NULL);
+    assert(path     != NULL);
+
+    char        name_buffer[MAX_NAME_SIZE] = {};
+    const char* name                       = getProcedureName(profiler, profiler->nodes[node].entry, name_buffer);
+
+    if (path_length > 0)
+    {
+        path[path_length++] = ';';
+    }
+
+    strcpy(path + path_length, name);
+    path_length += strlen(name);
+
+    if (profiler->nodes[node].cycles != 0)
+    {
+        fprintf(folded, "%s %llu\n", path, (unsigned long long)profiler->nodes[node].cycles);
+    }
+
+    for (size_t child = profiler->nodes[node].first_child; child != NO_PROFILE_NODE;
+         child = profiler->nodes[child].next_sibling)
+    {
+        writeFoldedNode(profiler, folded, child, path, path_length);
+    }
+}
+
+
+static const char* getProcedureName(const Profiler* const profiler, size_t entry, char* buffer)
+{
+    assert(profiler != NULL);
+    assert(buffer   != NULL);
+
+    if (entry == MAIN_PROGRAM_ENTRY)
+    {
+        return "main";
+    }
+
+    const SourceMap* const source_map = &profiler->source_map;
+    if (source_map->procedures && source_map->procedures[entry] != NO_SOURCE_PROCEDURE)
+    {
+        return source_map->procedure_names[source_map->procedures[entry]];
+    }
+
+    snprintf(buffer, MAX_NAME_SIZE, "proc_%zu", entry);
+
+    return buffer;
+}
+
+
+static uint64_t readCycleCounter(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return getNanoseconds();
+#endif
+}
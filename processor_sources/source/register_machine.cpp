@@ -0,0 +1,1300 @@
+#include "register_machine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+#include "helpful_functions.h"
+#include "command_handler.h"
+#include "value_type.h"
+#include "runtime_error.h"
+#include "stack.h"
+#include "logger.h"
+#include "verifier.h"
+#include "spu_io.h"
+#include "vector_kernels.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+#define HANDLER_INLINE_ static inline __attribute__((always_inline))
+
+static const long   UNKNOWN_DEPTH  = LONG_MIN;
+static const long   DEPTH_LIMIT    = (long)SIZE_OF_STACK;
+static const size_t NO_PROCEDURE   = (size_t)-1;
+static const size_t NO_INSTRUCTION = (size_t)-1;
+
+typedef struct ProcedureFrame
+{
+    size_t entry;
+    bool   returns;
+    long   return_depth;
+    long   min_depth;      // slots used by the procedure, relative to its frame
+    long   max_depth;
+} ProcedureFrame;
+
+// Stack depth of every reachable instruction must be known exactly, relative to the frame of the
+// procedure that owns it, otherwise a stack cell can not be given a fixed virtual register.
+typedef struct DepthMap
+{
+    long*           depths;
+    size_t*         owners;
+    size_t*         procedure_of_entry;
+    ProcedureFrame* procedures;
+    size_t          number_of_procedures;
+    size_t*         worklist;
+    size_t          worklist_size;
+} DepthMap;
+
+typedef struct Translator
+{
+    const Instruction* program;
+    size_t             number_of_instructions;    // decoded program with its closing hlt
+    RegisterProgram*   output;
+    DepthMap           map;
+    bool*              leaders;
+    size_t*            index_to_code;
+
+    // values pushed from registers and constants are not copied into their slot until someone needs them there
+    RegisterOperand*   lazy_operands;             // indexed by slot + SIZE_OF_STACK
+    bool*              is_lazy;
+    long*              lazy_slots;
+    size_t             lazy_count;
+
+    long               depth;
+    size_t             last_result;               // last emitted instruction with a destination in this block
+} Translator;
+
+// registers of the interpreter, slots move with the frame of the current procedure
+typedef struct RegisterCursor
+{
+    size_t          ip;
+    arguments_type* spaces[NUMBER_OF_OPERAND_SPACES];
+} RegisterCursor;
+
+static ProcessorErrorHandler translatorInit(Translator* const translator);
+static void translatorDtor(Translator* const translator);
+static ProcessorErrorHandler analyseDepths(Translator* const translator);
+static ProcessorErrorHandler visitInstruction(DepthMap* const map, size_t index, long depth, size_t owner);
+static size_t addProcedure(DepthMap* const map, size_t entry);
+static ProcessorErrorHandler getCallee(DepthMap* const map, size_t entry, size_t* const callee, bool* const changed);
+static ProcessorErrorHandler addReturnDepth(DepthMap* const map, size_t owner, long depth, bool* const changed);
+static ProcessorErrorHandler measureFrames(Translator* const translator);
+static void markLeaders(Translator* const translator);
+static bool isJump(uint8_t command);
+static void translateInstruction(Translator* const translator, size_t index);
+static void translateConditionalJump(Translator* const    translator,
+                                     const Instruction* const instruction,
+                                     RegisterOperand       first,
+                                     RegisterOperand       second);
+static void popIntoRegister(Translator* const translator, uint8_t register_index);
+static void getPairOperands(Translator* const        translator,
+                            const Instruction* const instruction,
+                            RegisterOperand* const   first,
+                            RegisterOperand* const   second);
+static void resolveTargets(Translator* const translator);
+
+static size_t emit(Translator* const translator, const RegisterInstruction* const instruction);
+static RegisterOperand makeOperand(OperandSpace space, long index);
+static RegisterOperand makeConstant(Translator* const translator, arguments_type value);
+static bool isSameOperand(RegisterOperand first, RegisterOperand second);
+static void pushLazy(Translator* const translator, RegisterOperand operand);
+static RegisterOperand pushResult(Translator* const translator);
+static RegisterOperand popOperand(Translator* const translator);
+static void materialize(Translator* const translator, size_t lazy_position);
+static void flushLazy(Translator* const translator);
+static void invalidateRegister(Translator* const translator, uint8_t register_index);
+
+HANDLER_INLINE_ arguments_type* getOperand(RegisterCursor* const cursor, RegisterOperand operand);
+HANDLER_INLINE_ void callRegisterCommand(SPU* const                      spu,
+                                         RegisterCursor* const            cursor,
+                                         const RegisterInstruction* const instruction);
+HANDLER_INLINE_ void tailcallRegisterCommand(SPU* const                      spu,
+                                             RegisterCursor* const            cursor,
+                                             const RegisterInstruction* const instruction);
+HANDLER_INLINE_ void retRegisterCommand(SPU* const spu, RegisterCursor* const cursor);
+HANDLER_INLINE_ void hltRegisterCommand(SPU* const                      spu,
+                                        RegisterCursor* const            cursor,
+                                        const RegisterInstruction* const instruction);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+ProcessorErrorHandler translateToRegisterMachine(const SPU* const spu, RegisterProgram* const register_program)
+{
+    assert(spu              != NULL);
+    assert(spu->program     != NULL);
+    assert(register_program != NULL);
+
+    *register_program = {};
+
+    Translator translator = {
+        .program                = spu->program,
+        .number_of_instructions = spu->program_size + 1,
+        .output                 = register_program,
+    };
+
+    ProcessorErrorHandler return_code = translatorInit(&translator);
+
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = analyseDepths(&translator);
+    }
+
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = measureFrames(&translator);
+    }
+
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        markLeaders(&translator);
+
+        for (size_t index = 0; index < translator.number_of_instructions; index++)
+        {
+            if (translator.map.depths[index] != UNKNOWN_DEPTH)
+            {
+                translateInstruction(&translator, index);
+            }
+        }
+
+        resolveTargets(&translator);
+
+        Log(LogLevel_INFO, "Register machine: %zu stack instructions translated into %zu register instructions",
+            spu->program_size, register_program->size);
+    }
+
+    translatorDtor(&translator);
+
+    return return_code;
+}
+
+
+// Same dispatch scheme as the threaded stack engine, operands are fetched through
+// spaces[] so one handler serves every combination of slots, registers and constants.
+void processRegisterProgram(SPU* const spu, const RegisterProgram* const register_program)
+{
+    assert(spu                    != NULL);
+    assert(register_program       != NULL);
+    assert(register_program->code != NULL);
+
+    RegisterCursor cursor = {
+        .ip     = 0,
+        .spaces = {spu->operand_stack, spu->registers, register_program->constants},
+    };
+
+    const RegisterInstruction* const code        = register_program->code;
+    const RegisterInstruction*       instruction = NULL;
+
+#define FIRST_         (*getOperand(&cursor, instruction->first))
+#define SECOND_        (*getOperand(&cursor, instruction->second))
+#define DESTINATION_   (*getOperand(&cursor, instruction->destination))
+#define JUMP_IF_(condition)                  \
+    if (condition)                           \
+    {                                        \
+        cursor.ip = instruction->target;     \
+    }
+
+#if defined(__GNUC__)
+    static const void* const dispatch_table[NUMBER_OF_REGISTER_COMMANDS] = {
+        &&label_HLT,   &&label_MOV,   &&label_ADD,   &&label_SUB,
+        &&label_MUL,   &&label_DIV,   &&label_SQRT,  &&label_LOAD,
+        &&label_STORE, &&label_OUT,   &&label_IN,    &&label_JMP,
+        &&label_JA,    &&label_JAE,   &&label_JB,    &&label_JBE,
+        &&label_JE,    &&label_JNE,   &&label_CALL,  &&label_RET,
+        &&label_DRAW,  &&label_VEC,   &&label_TAILCALL, &&label_CALL_DEPTH,
+        &&label_TIMESTAMP,
+    };
+
+#define DISPATCH_()                      \
+    instruction = code + cursor.ip;      \
+    cursor.ip++;                         \
+    goto *dispatch_table[instruction->command]
+
+#define REGISTER_HANDLER_(command, body)  \
+    label_##command:                      \
+        body;                             \
+        DISPATCH_();
+
+    DISPATCH_();
+
+    REGISTER_HANDLER_(MOV,   DESTINATION_ = FIRST_);
+    REGISTER_HANDLER_(ADD,   DESTINATION_ = FIRST_ + SECOND_);
+    REGISTER_HANDLER_(SUB,   DESTINATION_ = FIRST_ - SECOND_);
+    REGISTER_HANDLER_(MUL,   DESTINATION_ = FIRST_ * SECOND_);
+    REGISTER_HANDLER_(DIV,   DESTINATION_ = divideValues(FIRST_, SECOND_));
+    REGISTER_HANDLER_(SQRT,  DESTINATION_ = getValueSqrt(FIRST_));
+    REGISTER_HANDLER_(LOAD,  DESTINATION_ = spu->ram[(int)(FIRST_ + instruction->immediate)]);
+    REGISTER_HANDLER_(STORE, spu->ram[(int)SECOND_ + (int)instruction->immediate] = FIRST_);
+    REGISTER_HANDLER_(OUT,   printProgramOut(&spu->io, FIRST_));
+    REGISTER_HANDLER_(IN,    DESTINATION_ = scanProgramIn(&spu->io));
+    REGISTER_HANDLER_(JMP,   cursor.ip = instruction->target);
+    REGISTER_HANDLER_(JA,    JUMP_IF_(FIRST_ >  SECOND_));
+    REGISTER_HANDLER_(JAE,   JUMP_IF_(FIRST_ >= SECOND_));
+    REGISTER_HANDLER_(JB,    JUMP_IF_(FIRST_ <  SECOND_));
+    REGISTER_HANDLER_(JBE,   JUMP_IF_(FIRST_ <= SECOND_));
+    REGISTER_HANDLER_(JE,    JUMP_IF_(valuesAreEqual(FIRST_, SECOND_)));
+    REGISTER_HANDLER_(JNE,   JUMP_IF_(!valuesAreEqual(FIRST_, SECOND_)));
+    REGISTER_HANDLER_(CALL,  callRegisterCommand(spu, &cursor, instruction));
+    REGISTER_HANDLER_(RET,   retRegisterCommand(spu, &cursor));
+    REGISTER_HANDLER_(DRAW,  drawRam(&spu->io, spu->ram));
+    REGISTER_HANDLER_(VEC,   DESTINATION_ = executeVectorCommand(instruction->vector_command, spu->ram, &FIRST_));
+    REGISTER_HANDLER_(TAILCALL,   tailcallRegisterCommand(spu, &cursor, instruction));
+    REGISTER_HANDLER_(CALL_DEPTH, DESTINATION_ = (arguments_type)spu->call_depth);
+    REGISTER_HANDLER_(TIMESTAMP,  DESTINATION_ = readProgramClock(&spu->io));
+
+    label_HLT:
+        hltRegisterCommand(spu, &cursor, instruction);
+        return;
+
+#undef REGISTER_HANDLER_
+#undef DISPATCH_
+
+#else
+    while (spu->end_flag)
+    {
+        instruction = code + cursor.ip;
+        cursor.ip++;
+
+        switch (instruction->command)
+        {
+            case RegisterCommands_MOV:   DESTINATION_ = FIRST_;                                              break;
+            case RegisterCommands_ADD:   DESTINATION_ = FIRST_ + SECOND_;                                    break;
+            case RegisterCommands_SUB:   DESTINATION_ = FIRST_ - SECOND_;                                    break;
+            case RegisterCommands_MUL:   DESTINATION_ = FIRST_ * SECOND_;                                    break;
+            case RegisterCommands_DIV:   DESTINATION_ = divideValues(FIRST_, SECOND_);                       break;
+            case RegisterCommands_SQRT:  DESTINATION_ = getValueSqrt(FIRST_);                                break;
+            case RegisterCommands_LOAD:  DESTINATION_ = spu->ram[(int)(FIRST_ + instruction->immediate)];    break;
+            case RegisterCommands_STORE: spu->ram[(int)SECOND_ + (int)instruction->immediate] = FIRST_;      break;
+            case RegisterCommands_OUT:   printProgramOut(&spu->io, FIRST_);                                  break;
+            case RegisterCommands_IN:    DESTINATION_ = scanProgramIn(&spu->io);                             break;
+            case RegisterCommands_JMP:   cursor.ip = instruction->target;                                    break;
+            case RegisterCommands_JA:    JUMP_IF_(FIRST_ >  SECOND_);                                        break;
+            case RegisterCommands_JAE:   JUMP_IF_(FIRST_ >= SECOND_);                                        break;
+            case RegisterCommands_JB:    JUMP_IF_(FIRST_ <  SECOND_);                                        break;
+            case RegisterCommands_JBE:   JUMP_IF_(FIRST_ <= SECOND_);                                        break;
+            case RegisterCommands_JE:    JUMP_IF_(valuesAreEqual(FIRST_, SECOND_));                         break;
+            case RegisterCommands_JNE:   JUMP_IF_(!valuesAreEqual(FIRST_, SECOND_));                        break;
+            case RegisterCommands_CALL:  callRegisterCommand(spu, &cursor, instruction);                     break;
+            case RegisterCommands_RET:   retRegisterCommand(spu, &cursor);                                   break;
+            case RegisterCommands_TAILCALL:   tailcallRegisterCommand(spu, &cursor, instruction);            break;
+            case RegisterCommands_CALL_DEPTH: DESTINATION_ = (arguments_type)spu->call_depth;                break;
+            case RegisterCommands_TIMESTAMP:  DESTINATION_ = readProgramClock(&spu->io);                     break;
+            case RegisterCommands_DRAW:  drawRam(&spu->io, spu->ram);                                        break;
+            case RegisterCommands_VEC:
+                DESTINATION_ = executeVectorCommand(instruction->vector_command, spu->ram, &FIRST_);
+                break;
+            case RegisterCommands_HLT:   hltRegisterCommand(spu, &cursor, instruction);                      break;
+            default:                     abortWithMessage("Unknown command");
+        }
+    }
+#endif
+
+#undef JUMP_IF_
+#undef DESTINATION_
+#undef SECOND_
+#undef FIRST_
+}
+
+
+void registerProgramDtor(RegisterProgram* const register_program)
+{
+    assert(register_program != NULL);
+
+    FREE_NULL(register_program->code);
+    FREE_NULL(register_program->constants);
+
+    *register_program = {};
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static ProcessorErrorHandler translatorInit(Translator* const translator)
+{
+    assert(translator != NULL);
+
+    size_t number_of_instructions = translator->number_of_instructions;
+    size_t number_of_slots        = 2 * SIZE_OF_STACK + 1;
+
+    // every instruction emits at most one instruction of its own and every lazy push at most one move
+    translator->output->capacity           = 2 * number_of_instructions;
+    translator->output->code               = (RegisterInstruction*)calloc(translator->output->capacity,
+                                                                          sizeof(RegisterInstruction));
+    translator->output->constants_capacity = 2 * number_of_instructions + 1;
+    translator->output->constants          = (arguments_type*)calloc(translator->output->constants_capacity,
+                                                                     sizeof(arguments_type));
+
+    translator->map.depths             = (long*)calloc(number_of_instructions, sizeof(long));
+    translator->map.owners             = (size_t*)calloc(number_of_instructions, sizeof(size_t));
+    translator->map.procedure_of_entry = (size_t*)calloc(number_of_instructions, sizeof(size_t));
+    translator->map.procedures         = (ProcedureFrame*)calloc(number_of_instructions, sizeof(ProcedureFrame));
+    translator->map.worklist           = (size_t*)calloc(number_of_instructions, sizeof(size_t));
+
+    translator->leaders       = (bool*)calloc(number_of_instructions + 1, sizeof(bool));
+    translator->index_to_code = (size_t*)calloc(number_of_instructions, sizeof(size_t));
+
+    translator->lazy_operands = (RegisterOperand*)calloc(number_of_slots, sizeof(RegisterOperand));
+    translator->is_lazy       = (bool*)calloc(number_of_slots, sizeof(bool));
+    translator->lazy_slots    = (long*)calloc(number_of_slots, sizeof(long));
+
+    if (!translator->output->code        || !translator->output->constants ||
+        !translator->map.depths          || !translator->map.owners        ||
+        !translator->map.procedure_of_entry || !translator->map.procedures ||
+        !translator->map.worklist        || !translator->leaders           ||
+        !translator->index_to_code       || !translator->lazy_operands     ||
+        !translator->is_lazy             || !translator->lazy_slots)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    for (size_t index = 0; index < number_of_instructions; index++)
+    {
+        translator->map.depths[index]             = UNKNOWN_DEPTH;
+        translator->map.procedure_of_entry[index] = NO_PROCEDURE;
+        translator->index_to_code[index]          = NO_INSTRUCTION;
+    }
+
+    translator->last_result = NO_INSTRUCTION;
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static void translatorDtor(Translator* const translator)
+{
+    assert(translator != NULL);
+
+    FREE_NULL(translator->map.depths);
+    FREE_NULL(translator->map.owners);
+    FREE_NULL(translator->map.procedure_of_entry);
+    FREE_NULL(translator->map.procedures);
+    FREE_NULL(translator->map.worklist);
+    FREE_NULL(translator->leaders);
+    FREE_NULL(translator->index_to_code);
+    FREE_NULL(translator->lazy_operands);
+    FREE_NULL(translator->is_lazy);
+    FREE_NULL(translator->lazy_slots);
+}
+
+
+// Propagates exact depths through every procedure. A call continues only once its callee is known
+// to return, so the whole program is swept again each time a procedure gets its return depth.
+static ProcessorErrorHandler analyseDepths(Translator* const translator)
+{
+    assert(translator != NULL);
+
+    DepthMap* map = &translator->map;
+
+    addProcedure(map, 0);
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        map->worklist_size = 0;
+        for (size_t index = 0; index < translator->number_of_instructions; index++)
+        {
+            if (map->depths[index] != UNKNOWN_DEPTH)
+            {
+                map->worklist[map->worklist_size++] = index;
+            }
+        }
+
+        while (map->worklist_size > 0)
+        {
+            size_t                   index       = map->worklist[--map->worklist_size];
+            const Instruction* const instruction = translator->program + index;
+            size_t                   owner       = map->owners[index];
+
+            long pops   = 0;
+            long pushes = 0;
+            getStackEffect(instruction->command, &pops, &pushes);
+
+            long depth = map->depths[index] - pops + pushes;
+            if (map->depths[index] - pops < -DEPTH_LIMIT || depth > DEPTH_LIMIT)
+            {
+                return ProcessorErrorHandler_NOT_TRANSLATABLE;
+            }
+
+            ProcessorErrorHandler return_code = ProcessorErrorHandler_OK;
+
+            switch (instruction->command)
+            {
+                case MachineCommands_HLT:
+                    break;
+
+                case MachineCommands_RET:
+                    return_code = addReturnDepth(map, owner, depth, &changed);
+                    break;
+
+                case MachineCommands_CALL:
+                case MachineCommands_PURE_CALL:
+                {
+                    size_t callee = NO_PROCEDURE;
+                    return_code = getCallee(map, instruction->target, &callee, &changed);
+
+                    if (return_code == ProcessorErrorHandler_OK && map->procedures[callee].returns)
+                    {
+                        return_code = visitInstruction(map, index + 1,
+                                                       depth + map->procedures[callee].return_depth, owner);
+                    }
+                    break;
+                }
+
+                // the callee gets a frame of its own and whatever it returns with is returned by the owner
+                case MachineCommands_TAILCALL:
+                {
+                    size_t callee = NO_PROCEDURE;
+                    return_code = getCallee(map, instruction->target, &callee, &changed);
+
+                    if (return_code == ProcessorErrorHandler_OK && map->procedures[callee].returns)
+                    {
+                        return_code = addReturnDepth(map, owner, depth + map->procedures[callee].return_depth,
+                                                     &changed);
+                    }
+                    break;
+                }
+
+                case MachineCommands_JMP:
+                    return_code = visitInstruction(map, instruction->target, depth, owner);
+                    break;
+
+                default:
+                    if (isJump(instruction->command))
+                    {
+                        return_code = visitInstruction(map, instruction->target, depth, owner);
+                    }
+
+                    if (return_code == ProcessorErrorHandler_OK)
+                    {
+                        return_code = visitInstruction(map, index + 1, depth, owner);
+                    }
+                    break;
+            }
+
+            if (return_code != ProcessorErrorHandler_OK)
+            {
+                return return_code;
+            }
+        }
+    }
+
+    // ret of the main program has nothing to return to
+    if (map->procedures[0].returns)
+    {
+        return ProcessorErrorHandler_NOT_TRANSLATABLE;
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static ProcessorErrorHandler visitInstruction(DepthMap* const map, size_t index, long depth, size_t owner)
+{
+    assert(map != NULL);
+
+    if (map->depths[index] == UNKNOWN_DEPTH)
+    {
+        map->depths[index] = depth;
+        map->owners[index] = owner;
+        map->worklist[map->worklist_size++] = index;
+
+        return ProcessorErrorHandler_OK;
+    }
+
+    // code shared between procedures or a depth that depends on the path has no fixed slot layout
+    if (map->depths[index] != depth || map->owners[index] != owner)
+    {
+        return ProcessorErrorHandler_NOT_TRANSLATABLE;
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static size_t addProcedure(DepthMap* const map, size_t entry)
+{
+    assert(map != NULL);
+
+    size_t procedure = map->number_of_procedures++;
+
+    map->procedures[procedure]       = {};
+    map->procedures[procedure].entry = entry;
+    map->procedure_of_entry[entry]   = procedure;
+
+    map->depths[entry] = 0;
+    map->owners[entry] = procedure;
+    map->worklist[map->worklist_size++] = entry;
+
+    return procedure;
+}
+
+
+static ProcessorErrorHandler getCallee(DepthMap* const map, size_t entry, size_t* const callee, bool* const changed)
+{
+    assert(map     != NULL);
+    assert(callee  != NULL);
+    assert(changed != NULL);
+
+    *callee = map->procedure_of_entry[entry];
+    if (*callee != NO_PROCEDURE)
+    {
+        return ProcessorErrorHandler_OK;
+    }
+
+    // procedure entry that is also reached by jumps from its caller
+    if (map->depths[entry] != UNKNOWN_DEPTH)
+    {
+        return ProcessorErrorHandler_NOT_TRANSLATABLE;
+    }
+
+    *callee  = addProcedure(map, entry);
+    *changed = true;
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static ProcessorErrorHandler addReturnDepth(DepthMap* const map, size_t owner, long depth, bool* const changed)
+{
+    assert(map     != NULL);
+    assert(changed != NULL);
+
+    ProcedureFrame* procedure = map->procedures + owner;
+    if (!procedure->returns)
+    {
+        procedure->returns      = true;
+        procedure->return_depth = depth;
+        *changed = true;
+    }
+    else if (procedure->return_depth != depth)
+    {
+        return ProcessorErrorHandler_NOT_TRANSLATABLE;
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// Frames of procedures are checked on every call at run time, the main program is checked here once.
+static ProcessorErrorHandler measureFrames(Translator* const translator)
+{
+    assert(translator != NULL);
+
+    DepthMap* map = &translator->map;
+
+    for (size_t index = 0; index < translator->number_of_instructions; index++)
+    {
+        if (map->depths[index] == UNKNOWN_DEPTH)
+        {
+            continue;
+        }
+
+        long pops   = 0;
+        long pushes = 0;
+        getStackEffect(translator->program[index].command, &pops, &pushes);
+
+        ProcedureFrame* procedure = map->procedures + map->owners[index];
+
+        long min = map->depths[index] - pops;
+        long max = min + pushes;
+
+        procedure->min_depth = min < procedure->min_depth ? min : procedure->min_depth;
+        procedure->max_depth = max > procedure->max_depth ? max : procedure->max_depth;
+    }
+
+    if (map->procedures[0].min_depth < 0 || map->procedures[0].max_depth > DEPTH_LIMIT)
+    {
+        return ProcessorErrorHandler_NOT_TRANSLATABLE;
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static void markLeaders(Translator* const translator)
+{
+    assert(translator != NULL);
+
+    translator->leaders[0] = true;
+
+    for (size_t index = 0; index < translator->number_of_instructions; index++)
+    {
+        if (translator->map.depths[index] == UNKNOWN_DEPTH)
+        {
+            continue;
+        }
+
+        uint8_t command = translator->program[index].command;
+
+        bool is_call = command == MachineCommands_CALL || command == MachineCommands_TAILCALL
+                    || command == MachineCommands_PURE_CALL;
+
+        if (isJump(command) || is_call)
+        {
+            translator->leaders[translator->program[index].target] = true;
+        }
+
+        if (isJump(command) || is_call || command == MachineCommands_RET || command == MachineCommands_HLT)
+        {
+            translator->leaders[index + 1] = true;
+        }
+    }
+}
+
+
+static bool isJump(uint8_t command)
+{
+    switch (command)
+    {
+        case MachineCommands_JMP:
+        case MachineCommands_JA:
+        case MachineCommands_JAE:
+        case MachineCommands_JB:
+        case MachineCommands_JBE:
+        case MachineCommands_JE:
+        case MachineCommands_JNE:
+        case DecodedCommands_JA_PAIR:
+        case DecodedCommands_JAE_PAIR:
+        case DecodedCommands_JB_PAIR:
+        case DecodedCommands_JBE_PAIR:
+        case DecodedCommands_JE_PAIR:
+        case DecodedCommands_JNE_PAIR:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+
+static void translateInstruction(Translator* const translator, size_t index)
+{
+    assert(translator != NULL);
+
+    const Instruction* const instruction = translator->program + index;
+
+    if (translator->leaders[index])
+    {
+        assert(translator->lazy_count == 0);
+
+        translator->depth       = translator->map.depths[index];
+        translator->last_result = NO_INSTRUCTION;
+    }
+
+    assert(translator->depth == translator->map.depths[index]);
+
+    translator->index_to_code[index] = translator->output->size;
+
+    RegisterInstruction result = {};
+    result.target = instruction->target;
+
+    switch (instruction->command)
+    {
+        case MachineCommands_PUSH:
+        {
+            RegisterOperand reg      = makeOperand(OperandSpace_REGISTER, instruction->register_index);
+            RegisterOperand constant = makeConstant(translator, (instruction->flags & CONST_FLAG)
+                                                              ? instruction->immediate : 0);
+            RegisterOperand zero     = makeConstant(translator, 0);
+
+            if (instruction->flags & RAM_FLAG)
+            {
+                result.command   = RegisterCommands_LOAD;
+                result.first     = (instruction->flags & REGISTER_FLAG) ? reg : zero;
+                result.immediate = (instruction->flags & CONST_FLAG) ? instruction->immediate : 0;
+            }
+            else if ((instruction->flags & REGISTER_FLAG) && (instruction->flags & CONST_FLAG))
+            {
+                result.command = RegisterCommands_ADD;
+                result.first   = reg;
+                result.second  = constant;
+            }
+            else
+            {
+                pushLazy(translator, (instruction->flags & REGISTER_FLAG) ? reg : constant);
+                break;
+            }
+
+            result.destination = pushResult(translator);
+            emit(translator, &result);
+            break;
+        }
+
+        case MachineCommands_POP:
+            if (instruction->flags & RAM_FLAG)
+            {
+                result.command   = RegisterCommands_STORE;
+                result.first     = popOperand(translator);
+                result.second    = (instruction->flags & REGISTER_FLAG)
+                                 ? makeOperand(OperandSpace_REGISTER, instruction->register_index)
+                                 : makeConstant(translator, 0);
+                result.immediate = (instruction->flags & CONST_FLAG) ? instruction->immediate : 0;
+                emit(translator, &result);
+            }
+            else
+            {
+                popIntoRegister(translator, instruction->register_index);
+            }
+            break;
+
+        case MachineCommands_ADD:
+        case MachineCommands_SUB:
+        case MachineCommands_MUL:
+        case MachineCommands_DIV:
+            result.command     = instruction->command == MachineCommands_ADD ? RegisterCommands_ADD
+                               : instruction->command == MachineCommands_SUB ? RegisterCommands_SUB
+                               : instruction->command == MachineCommands_MUL ? RegisterCommands_MUL
+                               :                                               RegisterCommands_DIV;
+            result.first       = popOperand(translator);
+            result.second      = popOperand(translator);
+            result.destination = pushResult(translator);
+            emit(translator, &result);
+            break;
+
+        case MachineCommands_SQRT:
+            result.command     = RegisterCommands_SQRT;
+            result.first       = popOperand(translator);
+            result.destination = pushResult(translator);
+            emit(translator, &result);
+            break;
+
+        case MachineCommands_OUT:
+            result.command = RegisterCommands_OUT;
+            result.first   = popOperand(translator);
+            emit(translator, &result);
+            break;
+
+        case MachineCommands_IN:
+            result.command     = RegisterCommands_IN;
+            result.destination = pushResult(translator);
+            emit(translator, &result);
+            break;
+
+        case MachineCommands_CALL_DEPTH:
+            result.command     = RegisterCommands_CALL_DEPTH;
+            result.destination = pushResult(translator);
+            emit(translator, &result);
+            break;
+
+        case MachineCommands_TIMESTAMP:
+            result.command     = RegisterCommands_TIMESTAMP;
+            result.destination = pushResult(translator);
+            emit(translator, &result);
+            break;
+
+        case MachineCommands_JMP:
+            flushLazy(translator);
+            result.command = RegisterCommands_JMP;
+            emit(translator, &result);
+            break;
+
+        case MachineCommands_JA:
+        case MachineCommands_JAE:
+        case MachineCommands_JB:
+        case MachineCommands_JBE:
+        case MachineCommands_JE:
+        case MachineCommands_JNE:
+        {
+            RegisterOperand first  = popOperand(translator);
+            RegisterOperand second = popOperand(translator);
+            translateConditionalJump(translator, instruction, first, second);
+            break;
+        }
+
+        case MachineCommands_CALL:
+        case MachineCommands_TAILCALL:
+        case MachineCommands_PURE_CALL:
+        {
+            const ProcedureFrame* callee = translator->map.procedures
+                                         + translator->map.procedure_of_entry[instruction->target];
+
+            flushLazy(translator);
+            result.command     = instruction->command == MachineCommands_TAILCALL ? RegisterCommands_TAILCALL
+                                                                                  : RegisterCommands_CALL;
+            result.frame_shift = (int32_t)translator->depth;
+            result.frame_min   = (int32_t)(translator->depth + callee->min_depth);
+            result.frame_max   = (int32_t)(translator->depth + callee->max_depth);
+            emit(translator, &result);
+
+            translator->depth += callee->return_depth;
+            break;
+        }
+
+        case MachineCommands_RET:
+            flushLazy(translator);
+            result.command = RegisterCommands_RET;
+            emit(translator, &result);
+            break;
+
+        case MachineCommands_HLT:
+            flushLazy(translator);
+            result.command     = RegisterCommands_HLT;
+            result.frame_shift = (int32_t)translator->depth;
+            emit(translator, &result);
+            break;
+
+        case MachineCommands_DRAW:
+            result.command = RegisterCommands_DRAW;
+            emit(translator, &result);
+            break;
+
+        case MachineCommands_PUSH_SUB:
+            result.command     = RegisterCommands_SUB;
+            getPairOperands(translator, instruction, &result.first, &result.second);
+            result.destination = pushResult(translator);
+            emit(translator, &result);
+            break;
+
+        case MachineCommands_INC:
+            invalidateRegister(translator, instruction->register_index);
+            result.command     = RegisterCommands_ADD;
+            result.destination = makeOperand(OperandSpace_REGISTER, instruction->register_index);
+            result.first       = result.destination;
+            result.second      = makeConstant(translator, instruction->immediate);
+            emit(translator, &result);
+            break;
+
+        case DecodedCommands_VADD:
+        case DecodedCommands_VSUB:
+        case DecodedCommands_VMUL:
+        case DecodedCommands_VDIV:
+        case DecodedCommands_VSCALE:
+        case DecodedCommands_VFILL:
+        case DecodedCommands_VCOPY:
+        case DecodedCommands_VSUM:
+        case DecodedCommands_VDOT:
+        case DecodedCommands_VLESS:
+        {
+            const VectorCommandInfo* info = VECTOR_COMMANDS + (instruction->command - DecodedCommands_VADD);
+
+            // operands have to be in their slots, the result (if any) goes into the slot of the first one,
+            // commands without a result write there too, the slot is free by then
+            flushLazy(translator);
+            translator->depth -= info->operands;
+
+            result.command        = RegisterCommands_VEC;
+            result.vector_command = (uint8_t)(instruction->command - DecodedCommands_VADD);
+            result.first          = makeOperand(OperandSpace_SLOT, translator->depth);
+            result.destination    = info->results ? pushResult(translator) : result.first;
+            emit(translator, &result);
+            break;
+        }
+
+        case DecodedCommands_JA_PAIR:
+        case DecodedCommands_JAE_PAIR:
+        case DecodedCommands_JB_PAIR:
+        case DecodedCommands_JBE_PAIR:
+        case DecodedCommands_JE_PAIR:
+        case DecodedCommands_JNE_PAIR:
+        {
+            RegisterOperand first  = {};
+            RegisterOperand second = {};
+            getPairOperands(translator, instruction, &first, &second);
+            translateConditionalJump(translator, instruction, first, second);
+            break;
+        }
+
+        default:
+            assert(0 && "Decoder let through an unknown command");
+            break;
+    }
+
+    if (translator->leaders[index + 1])
+    {
+        flushLazy(translator);
+    }
+}
+
+
+static void translateConditionalJump(Translator* const    translator,
+                                     const Instruction* const instruction,
+                                     RegisterOperand       first,
+                                     RegisterOperand       second)
+{
+    assert(translator  != NULL);
+    assert(instruction != NULL);
+
+    // operands of the jump are registers or constants, so moving the rest of the block is safe
+    flushLazy(translator);
+
+    uint8_t condition = instruction->command >= DecodedCommands_JA_PAIR
+                      ? (uint8_t)(instruction->command - DecodedCommands_JA_PAIR)
+                      : (uint8_t)(instruction->command - MachineCommands_JA);
+
+    RegisterInstruction result = {
+        .command = (uint8_t)(RegisterCommands_JA + condition),
+        .first   = first,
+        .second  = second,
+        .target  = instruction->target,
+    };
+
+    emit(translator, &result);
+}
+
+
+// pop reg right after the instruction that computed the value just renames its destination
+static void popIntoRegister(Translator* const translator, uint8_t register_index)
+{
+    assert(translator != NULL);
+
+    RegisterOperand destination = makeOperand(OperandSpace_REGISTER, register_index);
+    RegisterOperand source      = popOperand(translator);
+
+    bool register_is_pending = false;
+    for (size_t position = 0; position < translator->lazy_count; position++)
+    {
+        long slot = translator->lazy_slots[position];
+        register_is_pending |= isSameOperand(translator->lazy_operands[slot + DEPTH_LIMIT], destination);
+    }
+
+    // only a slot is dead after the pop, a register result (inc, or a value popped there before) is still read
+    if (!register_is_pending && source.space == OperandSpace_SLOT && translator->last_result != NO_INSTRUCTION &&
+        isSameOperand(translator->output->code[translator->last_result].destination, source))
+    {
+        translator->output->code[translator->last_result].destination = destination;
+        translator->last_result = NO_INSTRUCTION;
+        return;
+    }
+
+    invalidateRegister(translator, register_index);
+
+    if (isSameOperand(source, destination))
+    {
+        return;
+    }
+
+    RegisterInstruction result = {
+        .command     = RegisterCommands_MOV,
+        .destination = destination,
+        .first       = source,
+    };
+
+    emit(translator, &result);
+}
+
+
+// same order as loadPairOperands of the stack engines: first is the value that would be on top
+static void getPairOperands(Translator* const        translator,
+                            const Instruction* const instruction,
+                            RegisterOperand* const   first,
+                            RegisterOperand* const   second)
+{
+    assert(translator  != NULL);
+    assert(instruction != NULL);
+    assert(first       != NULL);
+    assert(second      != NULL);
+
+    *first  = (instruction->flags & PAIR_SECOND_REGISTER_FLAG)
+            ? makeOperand(OperandSpace_REGISTER, instruction->second_register_index)
+            : makeConstant(translator, instruction->second_immediate);
+
+    *second = (instruction->flags & PAIR_FIRST_REGISTER_FLAG)
+            ? makeOperand(OperandSpace_REGISTER, instruction->register_index)
+            : makeConstant(translator, instruction->immediate);
+}
+
+
+static void resolveTargets(Translator* const translator)
+{
+    assert(translator != NULL);
+
+    RegisterProgram* output = translator->output;
+
+    for (size_t index = 0; index < output->size; index++)
+    {
+        uint8_t command = output->code[index].command;
+
+        if ((command >= RegisterCommands_JMP && command <= RegisterCommands_JNE) ||
+             command == RegisterCommands_CALL || command == RegisterCommands_TAILCALL)
+        {
+            output->code[index].target = translator->index_to_code[output->code[index].target];
+            assert(output->code[index].target != NO_INSTRUCTION);
+        }
+    }
+}
+
+
+static size_t emit(Translator* const translator, const RegisterInstruction* const instruction)
+{
+    assert(translator  != NULL);
+    assert(instruction != NULL);
+    assert(translator->output->size < translator->output->capacity);
+
+    size_t index = translator->output->size++;
+    translator->output->code[index] = *instruction;
+
+    bool has_destination = (instruction->command >= RegisterCommands_MOV &&
+                            instruction->command <= RegisterCommands_LOAD) ||
+                            instruction->command == RegisterCommands_IN    ||
+                            instruction->command == RegisterCommands_CALL_DEPTH ||
+                            instruction->command == RegisterCommands_TIMESTAMP;
+
+    translator->last_result = has_destination ? index : NO_INSTRUCTION;
+
+    return index;
+}
+
+
+static RegisterOperand makeOperand(OperandSpace space, long index)
+{
+    RegisterOperand operand = {
+        .space = (uint8_t)space,
+        .index = (int32_t)index,
+    };
+
+    return operand;
+}
+
+
+static RegisterOperand makeConstant(Translator* const translator, arguments_type value)
+{
+    assert(translator != NULL);
+
+    RegisterProgram* output = translator->output;
+
+    // compared bitwise so -0 and 0 stay different constants
+    for (size_t index = 0; index < output->constants_size; index++)
+    {
+        if (!memcmp(output->constants + index, &value, sizeof(arguments_type)))
+        {
+            return makeOperand(OperandSpace_CONSTANT, (long)index);
+        }
+    }
+
+    assert(output->constants_size < output->constants_capacity);
+
+    output->constants[output->constants_size] = value;
+
+    return makeOperand(OperandSpace_CONSTANT, (long)output->constants_size++);
+}
+
+
+static bool isSameOperand(RegisterOperand first, RegisterOperand second)
+{
+    return first.space == second.space && first.index == second.index;
+}
+
+
+static void pushLazy(Translator* const translator, RegisterOperand operand)
+{
+    assert(translator != NULL);
+
+    long slot = translator->depth++;
+
+    translator->lazy_operands[slot + DEPTH_LIMIT]       = operand;
+    translator->is_lazy[slot + DEPTH_LIMIT]             = true;
+    translator->lazy_slots[translator->lazy_count++]    = slot;
+}
+
+
+static RegisterOperand pushResult(Translator* const translator)
+{
+    assert(translator != NULL);
+
+    long slot = translator->depth++;
+    assert(!translator->is_lazy[slot + DEPTH_LIMIT]);
+
+    return makeOperand(OperandSpace_SLOT, slot);
+}
+
+
+static RegisterOperand popOperand(Translator* const translator)
+{
+    assert(translator != NULL);
+
+    long slot = --translator->depth;
+
+    if (!translator->is_lazy[slot + DEPTH_LIMIT])
+    {
+        return makeOperand(OperandSpace_SLOT, slot);
+    }
+
+    // lazy values are pushed and popped in stack order, so the top one is the last in the list
+    assert(translator->lazy_count > 0 && translator->lazy_slots[translator->lazy_count - 1] == slot);
+
+    translator->is_lazy[slot + DEPTH_LIMIT] = false;
+    translator->lazy_count--;
+
+    return translator->lazy_operands[slot + DEPTH_LIMIT];
+}
+
+
+static void materialize(Translator* const translator, size_t lazy_position)
+{
+    assert(translator != NULL);
+    assert(lazy_position < translator->lazy_count);
+
+    long slot = translator->lazy_slots[lazy_position];
+
+    RegisterInstruction result = {
+        .command     = RegisterCommands_MOV,
+        .destination = makeOperand(OperandSpace_SLOT, slot),
+        .first       = translator->lazy_operands[slot + DEPTH_LIMIT],
+    };
+
+    emit(translator, &result);
+
+    translator->is_lazy[slot + DEPTH_LIMIT] = false;
+}
+
+
+static void flushLazy(Translator* const translator)
+{
+    assert(translator != NULL);
+
+    for (size_t position = 0; position < translator->lazy_count; position++)
+    {
+        materialize(translator, position);
+    }
+
+    translator->lazy_count  = 0;
+    translator->last_result = NO_INSTRUCTION;
+}
+
+
+// a register is about to change, values pushed from it earlier have to be saved in their slots first
+static void invalidateRegister(Translator* const translator, uint8_t register_index)
+{
+    assert(translator != NULL);
+
+    RegisterOperand changed_register = makeOperand(OperandSpace_REGISTER, register_index);
+
+    size_t kept = 0;
+    for (size_t position = 0; position < translator->lazy_count; position++)
+    {
+        long slot = translator->lazy_slots[position];
+
+        if (isSameOperand(translator->lazy_operands[slot + DEPTH_LIMIT], changed_register))
+        {
+            materialize(translator, position);
+        }
+        else
+        {
+            translator->lazy_slots[kept++] = slot;
+        }
+    }
+
+    translator->lazy_count = kept;
+}
+
+
+HANDLER_INLINE_ arguments_type* getOperand(RegisterCursor* const cursor, RegisterOperand operand)
+{
+    assert(cursor != NULL);
+
+    return cursor->spaces[operand.space] + operand.index;
+}
+
+
+HANDLER_INLINE_ void callRegisterCommand(SPU* const                      spu,
+                                         RegisterCursor* const            cursor,
+                                         const RegisterInstruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
+
+    long frame = cursor->spaces[OperandSpace_SLOT] - spu->operand_stack;
+
+    // recursion is not bounded statically, so the callee frame is checked on every call
+    if (frame + instruction->frame_min < 0)
+    {
+        raiseRuntimeError("Operand stack underflow");
+    }
+
+    if (frame + instruction->frame_max > DEPTH_LIMIT)
+    {
+        raiseRuntimeError("Operand stack overflow");
+    }
+
+    if (spu->call_depth == CALL_STACK_SIZE)
+    {
+        raiseRuntimeError("Call stack overflow");
+    }
+
+    spu->call_stack[spu->call_depth] = {
+        .return_ip = cursor->ip,
+        .frame     = frame,
+    };
+    spu->call_depth++;
+
+    cursor->spaces[OperandSpace_SLOT] += instruction->frame_shift;
+    cursor->ip = instruction->target;
+}
+
+
+// same frame checks as call, the frame saved by the call of the current procedure is the one ret restores
+HANDLER_INLINE_ void tailcallRegisterCommand(SPU* const                      spu,
+                                             RegisterCursor* const            cursor,
+                                             const RegisterInstruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
+
+    long frame = cursor->spaces[OperandSpace_SLOT] - spu->operand_stack;
+
+    if (frame + instruction->frame_min < 0)
+    {
+        raiseRuntimeError("Operand stack underflow");
+    }
+
+    if (frame + instruction->frame_max > DEPTH_LIMIT)
+    {
+        raiseRuntimeError("Operand stack overflow");
+    }
+
+    cursor->spaces[OperandSpace_SLOT] += instruction->frame_shift;
+    cursor->ip = instruction->target;
+}
+
+
+// the translator refuses programs whose main part returns, so there is always a frame to go back to
+HANDLER_INLINE_ void retRegisterCommand(SPU* const spu, RegisterCursor* const cursor)
+{
+    assert(spu    != NULL);
+    assert(cursor != NULL);
+
+    spu->call_depth--;
+
+    const CallFrame* call_frame = spu->call_stack + spu->call_depth;
+
+    cursor->spaces[OperandSpace_SLOT] = spu->operand_stack + call_frame->frame;
+    cursor->ip = call_frame->return_ip;
+}
+
+
+HANDLER_INLINE_ void hltRegisterCommand(SPU* const                      spu,
+                                        RegisterCursor* const            cursor,
+                                        const RegisterInstruction* const instruction)
+{
+    assert(spu         != NULL);
+    assert(cursor      != NULL);
+    assert(instruction != NULL);
+
+    spu->end_flag  = false;
+    spu->ip        = cursor->ip;
+    spu->stack_top = cursor->spaces[OperandSpace_SLOT] + instruction->frame_shift;
+
+    size_t size = (size_t)(spu->stack_top - spu->operand_stack);
+
+    lockSpuLog();
+
+    Log(LogLevel_INFO, "Operand stack: size = %zu, capacity = %zu", size, SIZE_OF_STACK);
+    for (size_t current_element = 0; current_element < size; current_element++)
+    {
+        Log(LogLevel_INFO, "    [%zu] = %lg", current_element, (double)spu->operand_stack[current_element]);
+    }
+
+    unlockSpuLog();
+
+    printProgramEnd(&spu->io);
+}
@@ -0,0 +1,709 @@
+#include "scheduler.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "helpful_functions.h"
+#include "logger.h"
+#include "monotonic_clock.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const size_t   START_THREADS_CAPACITY = 64;
+static const size_t   START_INPUT_CAPACITY   = 16;
+
+typedef struct GreenThread GreenThread;
+
+struct GreenThread
+{
+    SpuContext*           context;
+    GreenThread*          next_queued;       // in the run queue it is in, if any
+
+    pthread_mutex_t       lock;              // everything below
+    arguments_type*       input;
+    size_t                input_size;        // values sent and not read yet end at input_size
+    size_t                input_capacity;
+    size_t                input_position;
+    bool                  input_closed;
+    bool                  parked;            // waits for input in no run queue
+    GreenThreadStatistics statistics;
+
+    SpuOutputCallback     write_value;       // the ones of the spawning options, io_context is this thread now
+    void*                 io_context;
+};
+
+typedef struct RunQueue
+{
+    pthread_mutex_t lock;
+    GreenThread*    head;
+    GreenThread*    tail;
+} RunQueue;
+
+typedef struct SchedulerWorker
+{
+    Scheduler* scheduler;
+    size_t     index;
+    pthread_t  thread;
+    bool       started;
+    RunQueue   queue;
+} SchedulerWorker;
+
+struct Scheduler
+{
+    size_t           quantum;
+    bool             pin_workers;
+    SchedulerWorker* workers;
+    size_t           number_of_workers;
+
+    pthread_mutex_t  lock;               // the threads array, live_threads and both conditions
+    bool             stopping;           // set under the lock, read by running workers without it
+    pthread_cond_t   work_ready;
+    pthread_cond_t   all_halted;
+    GreenThread**    threads;
+    size_t           threads_size;
+    size_t           threads_capacity;
+    size_t           live_threads;
+
+    // atomics, a worker counts itself sleeping before it looks at queued for the last time
+    // and an enqueue adds to queued before it looks at sleeping_workers, so no wake up is lost
+    size_t           queued;
+    size_t           sleeping_workers;
+    size_t           next_queue;         // spawned and unparked threads are spread over the queues
+};
+
+static void* schedulerWorkerMain(void* argument);
+static void pinSchedulerWorker(size_t index);
+static bool waitForWork(Scheduler* const scheduler);
+static GreenThread* findWork(SchedulerWorker* const worker, bool* const stolen);
+static void runSlice(SchedulerWorker* const worker, GreenThread* const thread, bool stolen);
+static void threadHalted(Scheduler* const scheduler);
+
+static void enqueueThread(Scheduler* const scheduler, GreenThread* const thread, size_t queue_index);
+static size_t pickQueue(Scheduler* const scheduler);
+static GreenThread* popRunQueue(Scheduler* const scheduler, RunQueue* const queue);
+
+static GreenThread* getThread(Scheduler* const scheduler, size_t thread);
+static ProcessorErrorHandler addThread(Scheduler* const scheduler, GreenThread* const thread, size_t* const index);
+static void greenThreadDtor(GreenThread* const thread);
+
+static arguments_type readGreenInput(void* io_context);
+static bool isGreenInputReady(void* io_context);
+static void writeGreenOutput(void* io_context, arguments_type value);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+ProcessorErrorHandler schedulerCtor(const SchedulerOptions* const options, Scheduler** const scheduler)
+{
+    assert(options   != NULL);
+    assert(scheduler != NULL);
+
+    size_t number_of_workers = options->number_of_workers;
+    if (number_of_workers == 0)
+    {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        number_of_workers = online > 0 ? (size_t)online : 1;
+    }
+
+    Scheduler* new_scheduler = (Scheduler*)calloc(1, sizeof(Scheduler));
+    if (!new_scheduler)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    new_scheduler->workers = (SchedulerWorker*)calloc(number_of_workers, sizeof(SchedulerWorker));
+    if (!new_scheduler->workers)
+    {
+        FREE_NULL(new_scheduler);
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    new_scheduler->quantum           = options->quantum ? options->quantum : DEFAULT_QUANTUM;
+    new_scheduler->pin_workers       = options->pin_workers;
+    new_scheduler->number_of_workers = number_of_workers;
+
+    pthread_mutex_init(&new_scheduler->lock, NULL);
+    pthread_cond_init(&new_scheduler->work_ready, NULL);
+    pthread_cond_init(&new_scheduler->all_halted, NULL);
+
+    for (size_t index = 0; index < number_of_workers; index++)
+    {
+        new_scheduler->workers[index].scheduler = new_scheduler;
+        new_scheduler->workers[index].index     = index;
+        pthread_mutex_init(&new_scheduler->workers[index].queue.lock, NULL);
+    }
+
+    // a worker that did not start leaves its queue to be stolen from by the others
+    size_t started_workers = 0;
+    for (size_t index = 0; index < number_of_workers; index++)
+    {
+        SchedulerWorker* worker = new_scheduler->workers + index;
+
+        worker->started  = pthread_create(&worker->thread, NULL, schedulerWorkerMain, worker) == 0;
+        started_workers += worker->started;
+    }
+
+    *scheduler = new_scheduler;
+
+    if (started_workers == 0)
+    {
+        schedulerDtor(new_scheduler);
+        *scheduler = NULL;
+
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    Log(LogLevel_INFO, "Scheduler: %zu workers, quantum of %zu instructions",
+        started_workers, new_scheduler->quantum);
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+void schedulerDtor(Scheduler* const scheduler)
+{
+    assert(scheduler != NULL);
+
+    pthread_mutex_lock(&scheduler->lock);
+    __atomic_store_n(&scheduler->stopping, true, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&scheduler->work_ready);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for (size_t index = 0; index < scheduler->number_of_workers; index++)
+    {
+        if (scheduler->workers[index].started)
+        {
+            pthread_join(scheduler->workers[index].thread, NULL);
+        }
+    }
+
+    // a worker still running may be stealing from any queue, so no queue goes before all of them stopped
+    for (size_t index = 0; index < scheduler->number_of_workers; index++)
+    {
+        pthread_mutex_destroy(&scheduler->workers[index].queue.lock);
+    }
+
+    for (size_t index = 0; index < scheduler->threads_size; index++)
+    {
+        greenThreadDtor(scheduler->threads[index]);
+    }
+
+    pthread_cond_destroy(&scheduler->all_halted);
+    pthread_cond_destroy(&scheduler->work_ready);
+    pthread_mutex_destroy(&scheduler->lock);
+
+    FREE_NULL(scheduler->threads);
+    FREE_NULL(scheduler->workers);
+    free(scheduler);
+}
+
+
+ProcessorErrorHandler spawnGreenThread(Scheduler* const              scheduler,
+                                       const LoadedProgram* const    program,
+                                       const ProcessorOptions* const options,
+                                       size_t* const                 thread)
+{
+    assert(scheduler != NULL);
+    assert(program   != NULL);
+    assert(options   != NULL);
+    assert(thread    != NULL);
+
+    GreenThread* new_thread = (GreenThread*)calloc(1, sizeof(GreenThread));
+    if (!new_thread)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    pthread_mutex_init(&new_thread->lock, NULL);
+    new_thread->write_value = options->streams.write_value;
+    new_thread->io_context  = options->streams.io_context;
+
+    // slices always run on the switch engine, nothing else of a context would be used
+    ProcessorOptions thread_options = *options;
+    thread_options.engine              = ProcessorEngine_SWITCH;
+    thread_options.profile             = false;
+    thread_options.perf_counters       = false;
+    thread_options.streams.input       = NULL;
+    thread_options.streams.read_value  = readGreenInput;
+    thread_options.streams.input_ready = isGreenInputReady;
+    thread_options.streams.write_value = options->streams.write_value ? writeGreenOutput : NULL;
+    thread_options.streams.io_context  = new_thread;
+
+    ProcessorErrorHandler return_code = spuContextCtor(program, &thread_options, &new_thread->context);
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = startSpuContextSlices(new_thread->context);
+    }
+
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = addThread(scheduler, new_thread, thread);
+    }
+
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        greenThreadDtor(new_thread);
+        return return_code;
+    }
+
+    enqueueThread(scheduler, new_thread, pickQueue(scheduler));
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+ProcessorErrorHandler sendGreenThreadInput(Scheduler* const scheduler, size_t thread, arguments_type value)
+{
+    assert(scheduler != NULL);
+
+    GreenThread* green_thread = getThread(scheduler, thread);
+
+    pthread_mutex_lock(&green_thread->lock);
+
+    if (green_thread->input_size == green_thread->input_capacity)
+    {
+        size_t          new_capacity = green_thread->input_capacity ? green_thread->input_capacity * 2
+                                                                    : START_INPUT_CAPACITY;
+        arguments_type* new_input    = (arguments_type*)realloc(green_thread->input,
+                                                                 new_capacity * sizeof(arguments_type));
+        if (!new_input)
+        {
+            pthread_mutex_unlock(&green_thread->lock);
+            return ProcessorErrorHandler_ERROR;
+        }
+
+        green_thread->input          = new_input;
+        green_thread->input_capacity = new_capacity;
+    }
+
+    green_thread->input[green_thread->input_size++] = value;
+
+    bool wake            = green_thread->parked;
+    green_thread->parked = false;
+
+    pthread_mutex_unlock(&green_thread->lock);
+
+    if (wake)
+    {
+        enqueueThread(scheduler, green_thread, pickQueue(scheduler));
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+void closeGreenThreadInput(Scheduler* const scheduler, size_t thread)
+{
+    assert(scheduler != NULL);
+
+    GreenThread* green_thread = getThread(scheduler, thread);
+
+    pthread_mutex_lock(&green_thread->lock);
+
+    green_thread->input_closed = true;
+
+    bool wake            = green_thread->parked;
+    green_thread->parked = false;
+
+    pthread_mutex_unlock(&green_thread->lock);
+
+    if (wake)
+    {
+        enqueueThread(scheduler, green_thread, pickQueue(scheduler));
+    }
+}
+
+
+void waitForGreenThreads(Scheduler* const scheduler)
+{
+    assert(scheduler != NULL);
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    while (scheduler->live_threads > 0)
+    {
+        pthread_cond_wait(&scheduler->all_halted, &scheduler->lock);
+    }
+
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+
+void getGreenThreadStatistics(Scheduler* const scheduler, size_t thread, GreenThreadStatistics* const statistics)
+{
+    assert(scheduler  != NULL);
+    assert(statistics != NULL);
+
+    GreenThread* green_thread = getThread(scheduler, thread);
+
+    pthread_mutex_lock(&green_thread->lock);
+    *statistics = green_thread->statistics;
+    pthread_mutex_unlock(&green_thread->lock);
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static void* schedulerWorkerMain(void* argument)
+{
+    assert(argument != NULL);
+
+    SchedulerWorker* worker    = (SchedulerWorker*)argument;
+    Scheduler*       scheduler = worker->scheduler;
+
+    if (scheduler->pin_workers)
+    {
+        pinSchedulerWorker(worker->index);
+    }
+
+    // the queues are not drained when the scheduler stops, whatever is in them is destroyed unfinished
+    while (!__atomic_load_n(&scheduler->stopping, __ATOMIC_RELAXED))
+    {
+        bool         stolen = false;
+        GreenThread* thread = findWork(worker, &stolen);
+
+        if (thread)
+        {
+            runSlice(worker, thread, stolen);
+        }
+        else if (!waitForWork(scheduler))
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void pinSchedulerWorker(size_t index)
+{
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online <= 0)
+    {
+        return;
+    }
+
+    cpu_set_t cpus = {};
+    CPU_ZERO(&cpus);
+    CPU_SET(index % (size_t)online, &cpus);
+
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+
+// false once the scheduler is stopping
+static bool waitForWork(Scheduler* const scheduler)
+{
+    assert(scheduler != NULL);
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    __atomic_add_fetch(&scheduler->sleeping_workers, 1, __ATOMIC_SEQ_CST);
+
+    while (!scheduler->stopping && __atomic_load_n(&scheduler->queued, __ATOMIC_SEQ_CST) == 0)
+    {
+        pthread_cond_wait(&scheduler->work_ready, &scheduler->lock);
+    }
+
+    __atomic_sub_fetch(&scheduler->sleeping_workers, 1, __ATOMIC_SEQ_CST);
+
+    bool stopping = scheduler->stopping;
+
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return !stopping;
+}
+
+
+// the own queue first, then the others starting from the next worker
+static GreenThread* findWork(SchedulerWorker* const worker, bool* const stolen)
+{
+    assert(worker != NULL);
+    assert(stolen != NULL);
+
+    Scheduler* scheduler = worker->scheduler;
+
+    GreenThread* thread = popRunQueue(scheduler, &worker->queue);
+    if (thread)
+    {
+        return thread;
+    }
+
+    for (size_t offset = 1; offset < scheduler->number_of_workers; offset++)
+    {
+        size_t victim = (worker->index + offset) % scheduler->number_of_workers;
+
+        thread = popRunQueue(scheduler, &scheduler->workers[victim].queue);
+        if (thread)
+        {
+            *stolen = true;
+            return thread;
+        }
+    }
+
+    return NULL;
+}
+
+
+// Only the worker that popped a thread runs it, so the context itself needs no lock. A thread stopped
+// at an in is parked unless a value or the close came in while the slice was finishing.
+static void runSlice(SchedulerWorker* const worker, GreenThread* const thread, bool stolen)
+{
+    assert(worker != NULL);
+    assert(thread != NULL);
+
+    Scheduler* scheduler = worker->scheduler;
+
+    uint64_t    executed = 0;
+    uint64_t    start    = getNanoseconds();
+    SpuSliceEnd end      = runSpuContextSlice(thread->context, scheduler->quantum, &executed);
+    uint64_t    time     = getNanoseconds() - start;
+
+    pthread_mutex_lock(&thread->lock);
+
+    GreenThreadStatistics* statistics = &thread->statistics;
+
+    statistics->instructions += executed;
+    statistics->nanoseconds  += time;
+    statistics->slices       += 1;
+    statistics->steals       += stolen;
+    statistics->last_worker   = worker->index;
+    statistics->halted        = end == SpuSliceEnd_HALTED || end == SpuSliceEnd_FAILED;
+    statistics->failed        = end == SpuSliceEnd_FAILED;
+
+    bool requeue = end == SpuSliceEnd_PREEMPTED;
+    if (end == SpuSliceEnd_WAITING_INPUT)
+    {
+        requeue = thread->input_position < thread->input_size || thread->input_closed;
+        if (!requeue)
+        {
+            thread->parked = true;
+            statistics->waits++;
+        }
+    }
+
+    pthread_mutex_unlock(&thread->lock);
+
+    if (requeue)
+    {
+        enqueueThread(scheduler, thread, worker->index);
+    }
+    else if (end == SpuSliceEnd_HALTED || end == SpuSliceEnd_FAILED)
+    {
+        threadHalted(scheduler);
+    }
+}
+
+
+static void threadHalted(Scheduler* const scheduler)
+{
+    assert(scheduler != NULL);
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    scheduler->live_threads--;
+    if (scheduler->live_threads == 0)
+    {
+        pthread_cond_broadcast(&scheduler->all_halted);
+    }
+
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+
+static void enqueueThread(Scheduler* const scheduler, GreenThread* const thread, size_t queue_index)
+{
+    assert(scheduler != NULL);
+    assert(thread    != NULL);
+
+    RunQueue* queue = &scheduler->workers[queue_index].queue;
+
+    pthread_mutex_lock(&queue->lock);
+
+    thread->next_queued = NULL;
+    if (queue->tail)
+    {
+        queue->tail->next_queued = thread;
+    }
+    else
+    {
+        queue->head = thread;
+    }
+    queue->tail = thread;
+
+    pthread_mutex_unlock(&queue->lock);
+
+    __atomic_add_fetch(&scheduler->queued, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&scheduler->sleeping_workers, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&scheduler->lock);
+        pthread_cond_signal(&scheduler->work_ready);
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+}
+
+
+static size_t pickQueue(Scheduler* const scheduler)
+{
+    assert(scheduler != NULL);
+
+    return __atomic_fetch_add(&scheduler->next_queue, 1, __ATOMIC_RELAXED) % scheduler->number_of_workers;
+}
+
+
+static GreenThread* popRunQueue(Scheduler* const scheduler, RunQueue* const queue)
+{
+    assert(scheduler != NULL);
+    assert(queue     != NULL);
+
+    pthread_mutex_lock(&queue->lock);
+
+    GreenThread* thread = queue->head;
+    if (thread)
+    {
+        queue->head = thread->next_queued;
+        if (!queue->head)
+        {
+            queue->tail = NULL;
+        }
+
+        thread->next_queued = NULL;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    if (thread)
+    {
+        __atomic_sub_fetch(&scheduler->queued, 1, __ATOMIC_SEQ_CST);
+    }
+
+    return thread;
+}
+
+
+static GreenThread* getThread(Scheduler* const scheduler, size_t thread)
+{
+    assert(scheduler != NULL);
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    assert(thread < scheduler->threads_size);
+    GreenThread* green_thread = scheduler->threads[thread];
+
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return green_thread;
+}
+
+
+static ProcessorErrorHandler addThread(Scheduler* const scheduler, GreenThread* const thread, size_t* const index)
+{
+    assert(scheduler != NULL);
+    assert(thread    != NULL);
+    assert(index     != NULL);
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    if (scheduler->threads_size == scheduler->threads_capacity)
+    {
+        size_t        new_capacity = scheduler->threads_capacity ? scheduler->threads_capacity * 2
+                                                                 : START_THREADS_CAPACITY;
+        GreenThread** new_threads  = (GreenThread**)realloc(scheduler->threads, new_capacity * sizeof(GreenThread*));
+        if (!new_threads)
+        {
+            pthread_mutex_unlock(&scheduler->lock);
+            return ProcessorErrorHandler_ERROR;
+        }
+
+        scheduler->threads          = new_threads;
+        scheduler->threads_capacity = new_capacity;
+    }
+
+    *index = scheduler->threads_size;
+    scheduler->threads[scheduler->threads_size++] = thread;
+    scheduler->live_threads++;
+
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static void greenThreadDtor(GreenThread* const thread)
+{
+    assert(thread != NULL);
+
+    if (thread->context)
+    {
+        spuContextDtor(thread->context);
+    }
+
+    pthread_mutex_destroy(&thread->lock);
+
+    FREE_NULL(thread->input);
+    free(thread);
+}
+
+
+// the stream callbacks of every green thread get the thread itself as io_context
+static arguments_type readGreenInput(void* io_context)
+{
+    assert(io_context != NULL);
+
+    GreenThread* thread = (GreenThread*)io_context;
+
+    pthread_mutex_lock(&thread->lock);
+
+    arguments_type value = 0;
+    if (thread->input_position < thread->input_size)
+    {
+        value = thread->input[thread->input_position++];
+
+        // everything sent was read, the buffer starts over
+        if (thread->input_position == thread->input_size)
+        {
+            thread->input_position = 0;
+            thread->input_size     = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&thread->lock);
+
+    return value;
+}
+
+
+static bool isGreenInputReady(void* io_context)
+{
+    assert(io_context != NULL);
+
+    GreenThread* thread = (GreenThread*)io_context;
+
+    pthread_mutex_lock(&thread->lock);
+    bool ready = thread->input_position < thread->input_size || thread->input_closed;
+    pthread_mutex_unlock(&thread->lock);
+
+    return ready;
+}
+
+
+static void writeGreenOutput(void* io_context, arguments_type value)
+{
+    assert(io_context != NULL);
+
+    GreenThread* thread = (GreenThread*)io_context;
+
+    thread->write_value(thread->io_context, value);
+}
@@ -0,0 +1,423 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "helpful_functions.h"
+#include "command_handler.h"
+#include "value_type.h"
+#include "logger.h"
+#include "monotonic_clock.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const uint64_t FNV_OFFSET_BASIS     = 0xCBF29CE484222325;
+static const uint64_t FNV_PRIME            = 0x100000001B3;
+static const double   NANOSECONDS_IN_MICRO = 1e3;
+static const size_t   RAM_BYTES            = SIZE_OF_RAM * sizeof(arguments_type);
+
+typedef struct SnapshotOpcode
+{
+    const char* name;
+    int         opcode;
+} SnapshotOpcode;
+
+static const SnapshotOpcode SNAPSHOT_OPCODES[] = {
+    {HLT_COMMAND,        MachineCommands_HLT},
+    {PUSH_COMMAND,       MachineCommands_PUSH},
+    {POP_COMMAND,        MachineCommands_POP},
+    {ADD_COMMAND,        MachineCommands_ADD},
+    {MUL_COMMAND,        MachineCommands_MUL},
+    {SUB_COMMAND,        MachineCommands_SUB},
+    {DIV_COMMAND,        MachineCommands_DIV},
+    {SQRT_COMMAND,       MachineCommands_SQRT},
+    {OUT_COMMAND,        MachineCommands_OUT},
+    {IN_COMMAND,         MachineCommands_IN},
+    {JMP_COMMAND,        MachineCommands_JMP},
+    {JA_COMMAND,         MachineCommands_JA},
+    {JAE_COMMAND,        MachineCommands_JAE},
+    {JB_COMMAND,         MachineCommands_JB},
+    {JBE_COMMAND,        MachineCommands_JBE},
+    {JE_COMMAND,         MachineCommands_JE},
+    {JNE_COMMAND,        MachineCommands_JNE},
+    {CALL_COMMAND,       MachineCommands_CALL},
+    {RET_COMMAND,        MachineCommands_RET},
+    {DRAW_COMMAND,       MachineCommands_DRAW},
+    {TAILCALL_COMMAND,   MachineCommands_TAILCALL},
+    {CALL_DEPTH_COMMAND, MachineCommands_CALL_DEPTH},
+    {TIMESTAMP_COMMAND,  MachineCommands_TIMESTAMP},
+};
+
+static const size_t NUMBER_OF_SNAPSHOT_OPCODES = sizeof(SNAPSHOT_OPCODES) / sizeof(SNAPSHOT_OPCODES[0]);
+
+#ifndef USE_STACK_LIBRARY
+static ProcessorErrorHandler checkSnapshotHeader(const SnapshotHeader* const header,
+                                                 const SPU* const            spu,
+                                                 uint64_t                    program_hash,
+                                                 size_t                      file_size);
+static ProcessorErrorHandler readSnapshotStacks(FILE* const                 snapshot,
+                                                const SnapshotHeader* const header,
+                                                const SPU* const            spu,
+                                                arguments_type* const       operand_stack,
+                                                CallFrame* const            call_stack);
+static arguments_type* mapSnapshotRam(FILE* const snapshot, const SnapshotHeader* const header);
+#endif
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+uint64_t hashProgramCode(const uint8_t* code, size_t size_of_code)
+{
+    assert(code != NULL);
+
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < size_of_code; i++)
+    {
+        hash = (hash ^ code[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+
+int findSnapshotOpcode(const char* name)
+{
+    assert(name != NULL);
+
+    for (size_t i = 0; i < NUMBER_OF_SNAPSHOT_OPCODES; i++)
+    {
+        if (!strcmp(name, SNAPSHOT_OPCODES[i].name))
+        {
+            return SNAPSHOT_OPCODES[i].opcode;
+        }
+    }
+
+    for (size_t i = 0; i < NUMBER_OF_VECTOR_COMMANDS; i++)
+    {
+        if (!strcmp(name, VECTOR_COMMANDS[i].name))
+        {
+            return DecodedCommands_VADD + (int)i;
+        }
+    }
+
+    return MachineCommands_UNKNOWN;
+}
+
+
+bool runsSnapshotOpcode(uint8_t command, int opcode)
+{
+    switch (command)
+    {
+        case MachineCommands_PUSH_SUB:
+            return opcode == MachineCommands_PUSH || opcode == MachineCommands_SUB;
+
+        case MachineCommands_INC:
+            return opcode == MachineCommands_PUSH || opcode == MachineCommands_ADD || opcode == MachineCommands_POP;
+
+        case DecodedCommands_JA_PAIR:  return opcode == MachineCommands_PUSH || opcode == MachineCommands_JA;
+        case DecodedCommands_JAE_PAIR: return opcode == MachineCommands_PUSH || opcode == MachineCommands_JAE;
+        case DecodedCommands_JB_PAIR:  return opcode == MachineCommands_PUSH || opcode == MachineCommands_JB;
+        case DecodedCommands_JBE_PAIR: return opcode == MachineCommands_PUSH || opcode == MachineCommands_JBE;
+        case DecodedCommands_JE_PAIR:  return opcode == MachineCommands_PUSH || opcode == MachineCommands_JE;
+        case DecodedCommands_JNE_PAIR: return opcode == MachineCommands_PUSH || opcode == MachineCommands_JNE;
+
+        // the call of call X; ret, its ret is never run
+        case MachineCommands_TAILCALL:
+            return opcode == MachineCommands_TAILCALL || opcode == MachineCommands_CALL;
+
+        case MachineCommands_PURE_CALL:
+            return opcode == MachineCommands_CALL;
+
+        default:
+            return command == opcode;
+    }
+}
+
+
+#ifdef USE_STACK_LIBRARY
+ProcessorErrorHandler writeSnapshot(const char* path, const SPU* const spu, uint64_t program_hash, uint64_t executed)
+{
+    assert(path != NULL);
+    assert(spu  != NULL);
+    (void)program_hash;
+    (void)executed;
+
+    Log(LogLevel_INFO, "Snapshots need the operand stack inside the SPU, USE_STACK_LIBRARY builds have none");
+
+    return ProcessorErrorHandler_ERROR;
+}
+
+
+ProcessorErrorHandler readSnapshot(const char* path, SPU* const spu, uint64_t program_hash)
+{
+    assert(path != NULL);
+    assert(spu  != NULL);
+    (void)program_hash;
+
+    Log(LogLevel_INFO, "Snapshots need the operand stack inside the SPU, USE_STACK_LIBRARY builds have none");
+
+    return ProcessorErrorHandler_ERROR;
+}
+#else
+ProcessorErrorHandler writeSnapshot(const char* path, const SPU* const spu, uint64_t program_hash, uint64_t executed)
+{
+    assert(path != NULL);
+    assert(spu  != NULL);
+
+    size_t stack_depth = (size_t)(spu->stack_top - spu->operand_stack);
+    size_t stacks_end  = sizeof(SnapshotHeader) + stack_depth * sizeof(arguments_type)
+                       + spu->call_depth * sizeof(CallFrame);
+
+    SnapshotHeader header = {
+        .magic        = SNAPSHOT_MAGIC,
+        .version      = SNAPSHOT_VERSION,
+        .header_size  = (uint16_t)sizeof(SnapshotHeader),
+        .value_type   = (uint32_t)VALUE_TYPE,
+        .reserved     = 0,
+        .program_hash = program_hash,
+        .program_size = spu->program_size,
+        .ip           = spu->ip,
+        .stack_depth  = stack_depth,
+        .call_depth   = spu->call_depth,
+        .executed     = executed,
+        .ram_offset   = (stacks_end + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE * SNAPSHOT_PAGE_SIZE,
+        .ram_size     = SIZE_OF_RAM,
+        .registers    = {},
+    };
+
+    memcpy(header.registers, spu->registers, sizeof(header.registers));
+
+    FILE* snapshot = fopen(path, "wb");
+    if (!snapshot)
+    {
+        return ProcessorErrorHandler_OPEN_FILE_ERROR;
+    }
+
+    bool written = fwrite(&header, sizeof(header), 1, snapshot) == 1
+                && fwrite(spu->operand_stack, sizeof(arguments_type), stack_depth, snapshot) == stack_depth
+                && fwrite(spu->call_stack, sizeof(CallFrame), spu->call_depth, snapshot) == spu->call_depth
+                && fseek(snapshot, (long)header.ram_offset, SEEK_SET) == 0
+                && fwrite(spu->ram, sizeof(arguments_type), SIZE_OF_RAM, snapshot) == SIZE_OF_RAM;
+
+    written = fclose(snapshot) == 0 && written;
+    if (!written)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    Log(LogLevel_INFO, "Snapshot %s taken after %llu instructions at instruction %zu",
+        path, (unsigned long long)executed, spu->ip);
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// Everything is checked and read aside first, the SPU is changed only once nothing can fail any more.
+ProcessorErrorHandler readSnapshot(const char* path, SPU* const spu, uint64_t program_hash)
+{
+    assert(path != NULL);
+    assert(spu  != NULL);
+
+    uint64_t start = getNanoseconds();
+
+    FILE* snapshot = fopen(path, "rb");
+    if (!snapshot)
+    {
+        return ProcessorErrorHandler_OPEN_FILE_ERROR;
+    }
+
+    struct stat    file_info = {};
+    SnapshotHeader header    = {};
+
+    ProcessorErrorHandler return_code = ProcessorErrorHandler_INVALID_SNAPSHOT;
+    if (fstat(fileno(snapshot), &file_info) == 0 && fread(&header, sizeof(header), 1, snapshot) == 1)
+    {
+        return_code = checkSnapshotHeader(&header, spu, program_hash, (size_t)file_info.st_size);
+    }
+
+    arguments_type operand_stack[SIZE_OF_STACK] = {};
+    CallFrame*     call_stack                   = NULL;
+
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        call_stack  = (CallFrame*)calloc(header.call_depth + 1, sizeof(CallFrame));
+        return_code = call_stack ? readSnapshotStacks(snapshot, &header, spu, operand_stack, call_stack)
+                                 : ProcessorErrorHandler_ERROR;
+    }
+
+    arguments_type* ram = NULL;
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        ram         = mapSnapshotRam(snapshot, &header);
+        return_code = ram ? ProcessorErrorHandler_OK : ProcessorErrorHandler_ERROR;
+    }
+
+    FCLOSE_NULL(snapshot);
+
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        FREE_NULL(call_stack);
+        return return_code;
+    }
+
+    releaseSpuRam(spu);
+
+    spu->ram           = ram;
+    spu->ram_is_mapped = true;
+    spu->ip            = header.ip;
+    spu->stack_top     = spu->operand_stack + header.stack_depth;
+    spu->call_depth    = header.call_depth;
+
+    memcpy(spu->registers, header.registers, sizeof(spu->registers));
+    memcpy(spu->operand_stack, operand_stack, header.stack_depth * sizeof(arguments_type));
+    memcpy(spu->call_stack, call_stack, header.call_depth * sizeof(CallFrame));
+
+    FREE_NULL(call_stack);
+
+    Log(LogLevel_INFO, "Snapshot %s restored in %.1lf us, it was taken after %llu instructions",
+        path, (double)(getNanoseconds() - start) / NANOSECONDS_IN_MICRO, (unsigned long long)header.executed);
+
+    return ProcessorErrorHandler_OK;
+}
+#endif
+
+
+void releaseSpuRam(SPU* const spu)
+{
+    assert(spu != NULL);
+
+    if (spu->ram_is_mapped)
+    {
+        munmap(spu->ram, RAM_BYTES);
+    }
+    else
+    {
+        free(spu->ram);
+    }
+
+    spu->ram           = NULL;
+    spu->ram_is_mapped = false;
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+#ifndef USE_STACK_LIBRARY
+static ProcessorErrorHandler checkSnapshotHeader(const SnapshotHeader* const header,
+                                                 const SPU* const            spu,
+                                                 uint64_t                    program_hash,
+                                                 size_t                      file_size)
+{
+    assert(header != NULL);
+    assert(spu    != NULL);
+
+    if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION
+     || header->header_size != sizeof(SnapshotHeader))
+    {
+        Log(LogLevel_INFO, "Not a snapshot of this processor version");
+        return ProcessorErrorHandler_INVALID_SNAPSHOT;
+    }
+
+    if (header->value_type != (uint32_t)VALUE_TYPE || header->ram_size != SIZE_OF_RAM)
+    {
+        Log(LogLevel_INFO, "Snapshot was taken by a processor with other values or another RAM size");
+        return ProcessorErrorHandler_INVALID_SNAPSHOT;
+    }
+
+    if (header->program_hash != program_hash || header->program_size != spu->program_size)
+    {
+        Log(LogLevel_INFO, "Snapshot was taken of another program");
+        return ProcessorErrorHandler_INVALID_SNAPSHOT;
+    }
+
+    // the implicit hlt behind the last instruction is a valid place to be
+    size_t stacks_end = sizeof(SnapshotHeader) + header->stack_depth * sizeof(arguments_type)
+                      + header->call_depth * sizeof(CallFrame);
+
+    if (header->ip > spu->program_size || header->stack_depth > SIZE_OF_STACK || header->call_depth > CALL_STACK_SIZE
+     || header->ram_offset < stacks_end || header->ram_offset % SNAPSHOT_PAGE_SIZE != 0
+     || header->ram_offset + RAM_BYTES > file_size)
+    {
+        Log(LogLevel_INFO, "Snapshot is damaged");
+        return ProcessorErrorHandler_INVALID_SNAPSHOT;
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static ProcessorErrorHandler readSnapshotStacks(FILE* const                 snapshot,
+                                                const SnapshotHeader* const header,
+                                                const SPU* const            spu,
+                                                arguments_type* const       operand_stack,
+                                                CallFrame* const            call_stack)
+{
+    assert(snapshot      != NULL);
+    assert(header        != NULL);
+    assert(spu           != NULL);
+    assert(operand_stack != NULL);
+    assert(call_stack    != NULL);
+
+    if (fread(operand_stack, sizeof(arguments_type), header->stack_depth, snapshot) != header->stack_depth
+     || fread(call_stack, sizeof(CallFrame), header->call_depth, snapshot) != header->call_depth)
+    {
+        return ProcessorErrorHandler_INVALID_SNAPSHOT;
+    }
+
+    for (size_t frame = 0; frame < header->call_depth; frame++)
+    {
+        if (call_stack[frame].return_ip > spu->program_size)
+        {
+            Log(LogLevel_INFO, "Snapshot is damaged: return address %zu", call_stack[frame].return_ip);
+            return ProcessorErrorHandler_INVALID_SNAPSHOT;
+        }
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// Pages of the mapping are read from the page cache when first touched and copied when first written,
+// the file itself never changes. Machines with pages larger than the file alignment read RAM in.
+static arguments_type* mapSnapshotRam(FILE* const snapshot, const SnapshotHeader* const header)
+{
+    assert(snapshot != NULL);
+    assert(header   != NULL);
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size > 0 && header->ram_offset % (uint64_t)page_size == 0)
+    {
+        void* mapping = mmap(NULL, RAM_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(snapshot),
+                             (off_t)header->ram_offset);
+        if (mapping != MAP_FAILED)
+        {
+            return (arguments_type*)mapping;
+        }
+    }
+
+    // the copy has to be unmappable just like the mapping, see releaseSpuRam
+    void* ram = mmap(NULL, RAM_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ram == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    if (fseek(snapshot, (long)header->ram_offset, SEEK_SET) != 0
+     || fread(ram, sizeof(arguments_type), SIZE_OF_RAM, snapshot) != SIZE_OF_RAM)
+    {
+        munmap(ram, RAM_BYTES);
+        return NULL;
+    }
+
+    return (arguments_type*)ram;
+}
+#endif
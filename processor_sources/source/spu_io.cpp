@@ -0,0 +1,461 @@
+#include "spu_io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "monotonic_clock.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const char   SPACE              = ' ';
+static const size_t OUTPUT_BUFFER_SIZE = 1 << 16;
+static const size_t INPUT_BUFFER_SIZE  = 1 << 16;
+static const size_t MAX_OUT_LENGTH     = 64;   // "Program out: " and a value in VALUE_PRINT_FORMAT
+static const char   END_MESSAGE[]      = "Program end\n";
+static const size_t MAX_ERROR_LENGTH   = 128;   // "Runtime error: " and the message
+static const char   CLEAR_SCREEN[]     = "\x1b[H\x1b[2J";
+static const size_t ROW_TEXT_SIZE      = COLUMNS * 2 + 1;   // every cell and a space after it, then '\n'
+static const size_t MAX_MOVE_SIZE      = 16;                // "\x1b[row;1H"
+static const size_t FRAME_TEXT_SIZE    = sizeof(CLEAR_SCREEN) + ROWS * (MAX_MOVE_SIZE + ROW_TEXT_SIZE) + MAX_MOVE_SIZE;
+
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void writeOutput(SpuIo* const io, const void* data, size_t size);
+static void writeFrame(SpuIo* const io, const char* text, size_t size);
+static size_t writeRowText(char* const text, const char* const row);
+static void drawRows(SpuIo* const io, const arguments_type* const ram);
+static arguments_type readBufferedValue(SpuIo* const io);
+static void refillInput(SpuIo* const io);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+void spuIoCtor(SpuIo* const io, const SpuStreams* const streams)
+{
+    assert(io      != NULL);
+    assert(streams != NULL);
+
+    memset(io, 0, sizeof(SpuIo));
+
+    io->streams            = *streams;
+    io->output_is_terminal = streams->output && isatty(fileno(streams->output));
+
+    startProgramClock(io);
+}
+
+
+void spuIoDtor(SpuIo* const io)
+{
+    assert(io != NULL);
+
+    flushProgramOut(io);
+
+    free(io->output_buffer);
+    free(io->input_buffer);
+    free(io->frame);
+    free(io->frame_text);
+
+    memset(io, 0, sizeof(SpuIo));
+}
+
+
+void printProgramOut(SpuIo* const io, arguments_type value)
+{
+    assert(io != NULL);
+
+    const SpuStreams* streams = &io->streams;
+
+    if (streams->write_value)
+    {
+        streams->write_value(streams->io_context, value);
+    }
+    else if (!streams->output)
+    {
+        return;
+    }
+    else if (streams->output_format == SpuOutputFormat_BINARY)
+    {
+        writeOutput(io, &value, sizeof(value));
+    }
+    else if (streams->mode == SpuIoMode_INTERACTIVE)
+    {
+        fprintf(streams->output, "Program out: " VALUE_PRINT_FORMAT "\n", value);
+        io->frame_on_screen = false;
+    }
+    else
+    {
+        char text[MAX_OUT_LENGTH] = {};
+        int  length               = snprintf(text, sizeof(text), "Program out: " VALUE_PRINT_FORMAT "\n", value);
+
+        writeOutput(io, text, (size_t)length);
+        io->frame_on_screen = false;
+    }
+}
+
+
+arguments_type scanProgramIn(SpuIo* const io)
+{
+    assert(io != NULL);
+
+    const SpuStreams* streams = &io->streams;
+
+    if (streams->read_value)
+    {
+        return streams->read_value(streams->io_context);
+    }
+
+    if (!streams->input)
+    {
+        return 0;
+    }
+
+    if (streams->mode == SpuIoMode_BUFFERED)
+    {
+        return readBufferedValue(io);
+    }
+
+    arguments_type value = 0;
+
+    if (streams->output && streams->output_format == SpuOutputFormat_TEXT)
+    {
+        fprintf(streams->output, "Enter argument: ");
+        io->frame_on_screen = false;
+    }
+
+    fscanf(streams->input, VALUE_SCAN_FORMAT, &value);
+
+    return value;
+}
+
+
+// The video memory cells are turned into bytes and the whole frame is written at once. A terminal that
+// already shows the previous frame only gets the rows that changed, each behind a cursor move.
+void drawRam(SpuIo* const io, const arguments_type* const ram)
+{
+    assert(io  != NULL);
+    assert(ram != NULL);
+
+    if (!io->streams.output || io->streams.output_format == SpuOutputFormat_BINARY)
+    {
+        return;
+    }
+
+    if (!io->frame)
+    {
+        io->frame      = (char*)calloc(ROWS * COLUMNS, sizeof(char));
+        io->frame_text = (char*)calloc(FRAME_TEXT_SIZE, sizeof(char));
+    }
+
+    if (!io->frame || !io->frame_text)
+    {
+        drawRows(io, ram);
+        return;
+    }
+
+    bool   only_changed = io->output_is_terminal && io->frame_on_screen;
+    size_t size         = 0;
+
+    if (io->output_is_terminal && !only_changed)
+    {
+        memcpy(io->frame_text, CLEAR_SCREEN, sizeof(CLEAR_SCREEN) - 1);
+        size += sizeof(CLEAR_SCREEN) - 1;
+    }
+
+    for (size_t i = 0; i < ROWS; i++)
+    {
+        char  row[COLUMNS] = {};
+        char* drawn_row    = io->frame + i * COLUMNS;
+
+        for (size_t j = 0; j < COLUMNS; j++)
+        {
+            row[j] = (char)(int)ram[ROWS * i + j];
+        }
+
+        if (only_changed && !memcmp(row, drawn_row, COLUMNS))
+        {
+            continue;
+        }
+
+        memcpy(drawn_row, row, COLUMNS);
+
+        if (only_changed)
+        {
+            size += (size_t)snprintf(io->frame_text + size, MAX_MOVE_SIZE, "\x1b[%zu;1H", i + 1);
+        }
+
+        size += writeRowText(io->frame_text + size, row);
+    }
+
+    if (only_changed)
+    {
+        size += (size_t)snprintf(io->frame_text + size, MAX_MOVE_SIZE, "\x1b[%zu;1H", ROWS + 1);
+    }
+
+    writeFrame(io, io->frame_text, size);
+
+    io->frame_on_screen = io->output_is_terminal;
+}
+
+
+void printProgramEnd(SpuIo* const io)
+{
+    assert(io != NULL);
+
+    if (io->streams.output && io->streams.output_format == SpuOutputFormat_TEXT)
+    {
+        writeOutput(io, END_MESSAGE, sizeof(END_MESSAGE) - 1);
+        io->frame_on_screen = false;
+    }
+
+    flushProgramOut(io);
+}
+
+
+void printProgramError(SpuIo* const io, const char* message)
+{
+    assert(io      != NULL);
+    assert(message != NULL);
+
+    if (io->streams.output && io->streams.output_format == SpuOutputFormat_TEXT)
+    {
+        char text[MAX_ERROR_LENGTH] = {};
+        int  length = snprintf(text, sizeof(text), "Runtime error: %s\n", message);
+
+        writeOutput(io, text, length < (int)sizeof(text) ? (size_t)length : sizeof(text) - 1);
+        io->frame_on_screen = false;
+    }
+
+    flushProgramOut(io);
+}
+
+
+void flushProgramOut(SpuIo* const io)
+{
+    assert(io != NULL);
+
+    if (!io->streams.output)
+    {
+        return;
+    }
+
+    if (io->output_size > 0)
+    {
+        fwrite(io->output_buffer, sizeof(char), io->output_size, io->streams.output);
+        io->output_size = 0;
+    }
+
+    fflush(io->streams.output);
+}
+
+
+void startProgramClock(SpuIo* const io)
+{
+    assert(io != NULL);
+
+    io->clock_origin = getNanoseconds();
+}
+
+
+// a float holds the nanoseconds exactly for the first 16 ms only, later it loses the lowest bits
+arguments_type readProgramClock(SpuIo* const io)
+{
+    assert(io != NULL);
+
+    return (arguments_type)(getNanoseconds() - io->clock_origin);
+}
+
+
+void lockSpuLog(void)
+{
+    pthread_mutex_lock(&log_mutex);
+}
+
+
+void unlockSpuLog(void)
+{
+    pthread_mutex_unlock(&log_mutex);
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+// interactive output goes straight to the file, buffered output only when the buffer is full or at hlt
+static void writeOutput(SpuIo* const io, const void* data, size_t size)
+{
+    assert(io   != NULL);
+    assert(data != NULL);
+
+    if (io->streams.mode == SpuIoMode_BUFFERED && !io->output_buffer)
+    {
+        io->output_buffer = (char*)malloc(OUTPUT_BUFFER_SIZE);
+    }
+
+    if (io->streams.mode == SpuIoMode_INTERACTIVE || !io->output_buffer)
+    {
+        fwrite(data, sizeof(char), size, io->streams.output);
+        return;
+    }
+
+    if (io->output_size + size > OUTPUT_BUFFER_SIZE)
+    {
+        fwrite(io->output_buffer, sizeof(char), io->output_size, io->streams.output);
+        io->output_size = 0;
+    }
+
+    if (size > OUTPUT_BUFFER_SIZE)
+    {
+        fwrite(data, sizeof(char), size, io->streams.output);
+        return;
+    }
+
+    memcpy(io->output_buffer + io->output_size, data, size);
+    io->output_size += size;
+}
+
+
+// Values are parsed with parseValue right inside a big chunk of the input, like scanf would do.
+// A number cut by the end of the chunk is moved to the front before the next chunk is read.
+static arguments_type readBufferedValue(SpuIo* const io)
+{
+    assert(io != NULL);
+
+    if (!io->input_buffer)
+    {
+        io->input_buffer = (char*)calloc(INPUT_BUFFER_SIZE + 1, sizeof(char));
+        if (!io->input_buffer)
+        {
+            arguments_type value = 0;
+            fscanf(io->streams.input, VALUE_SCAN_FORMAT, &value);
+            return value;
+        }
+    }
+
+    while (true)
+    {
+        while (io->input_position < io->input_size && isspace((unsigned char)io->input_buffer[io->input_position]))
+        {
+            io->input_position++;
+        }
+
+        size_t end = io->input_position;
+        while (end < io->input_size && !isspace((unsigned char)io->input_buffer[end]))
+        {
+            end++;
+        }
+
+        bool is_cut = end == io->input_size && !io->input_ended;
+        if (is_cut && (io->input_position > 0 || io->input_size < INPUT_BUFFER_SIZE))
+        {
+            refillInput(io);
+            continue;
+        }
+
+        if (io->input_position == io->input_size)
+        {
+            return 0;
+        }
+
+        char*          number_end = NULL;
+        arguments_type value      = parseValue(io->input_buffer + io->input_position, &number_end);
+
+        io->input_position = (size_t)(number_end - io->input_buffer);
+
+        return value;
+    }
+}
+
+
+static void refillInput(SpuIo* const io)
+{
+    assert(io != NULL);
+
+    size_t left = io->input_size - io->input_position;
+
+    memmove(io->input_buffer, io->input_buffer + io->input_position, left);
+
+    size_t read = fread(io->input_buffer + left, sizeof(char), INPUT_BUFFER_SIZE - left, io->streams.input);
+
+    io->input_position = 0;
+    io->input_size     = left + read;
+    io->input_ended    = read == 0;
+
+    io->input_buffer[io->input_size] = '\0';
+}
+
+
+// one write for the frame: straight into the file descriptor, or into the output buffer in the buffered mode
+static void writeFrame(SpuIo* const io, const char* text, size_t size)
+{
+    assert(io   != NULL);
+    assert(text != NULL);
+
+    if (io->streams.mode == SpuIoMode_BUFFERED)
+    {
+        writeOutput(io, text, size);
+        return;
+    }
+
+    fflush(io->streams.output);
+
+    int file_descriptor = fileno(io->streams.output);
+    while (size > 0)
+    {
+        ssize_t written = write(file_descriptor, text, size);
+        if (written <= 0)
+        {
+            return;
+        }
+
+        text += written;
+        size -= (size_t)written;
+    }
+}
+
+
+static size_t writeRowText(char* const text, const char* const row)
+{
+    assert(text != NULL);
+    assert(row  != NULL);
+
+    for (size_t j = 0; j < COLUMNS; j++)
+    {
+        text[2 * j]     = row[j];
+        text[2 * j + 1] = SPACE;
+    }
+
+    text[COLUMNS * 2] = '\n';
+
+    return ROW_TEXT_SIZE;
+}
+
+
+// draw without a frame buffer, when there is no memory for one
+static void drawRows(SpuIo* const io, const arguments_type* const ram)
+{
+    assert(io  != NULL);
+    assert(ram != NULL);
+
+    char row[COLUMNS]        = {};
+    char text[ROW_TEXT_SIZE] = {};
+
+    for (size_t i = 0; i < ROWS; i++)
+    {
+        for (size_t j = 0; j < COLUMNS; j++)
+        {
+            row[j] = (char)(int)ram[ROWS * i + j];
+        }
+
+        writeOutput(io, text, writeRowText(text, row));
+    }
+
+    io->frame_on_screen = false;
+}
@@ -0,0 +1,387 @@
+#include "tracer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "helpful_functions.h"
+#include "command_handler.h"
+#include "logger.h"
+#include "monotonic_clock.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const size_t START_STEPS_CAPACITY = 256;
+
+static void startRecording(Tracer* const    tracer,
+                           const SPU* const spu,
+                           TraceTree* const tree,
+                           size_t           start,
+                           size_t           parent_exit);
+static void finishRecording(Tracer* const tracer, const SPU* const spu);
+static void abortRecording(Tracer* const tracer);
+static bool appendStep(TraceTree* const tree, size_t index, size_t next);
+
+static TraceTree* traceTreeCtor(size_t head);
+static void traceTreeDtor(TraceTree* tree);
+static bool resizeExitCounters(TraceTree* const tree, size_t number_of_exits);
+
+static bool isJump(uint8_t command);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+ProcessorErrorHandler tracerCtor(Tracer* const tracer, const SPU* const spu, bool checked)
+{
+    assert(tracer       != NULL);
+    assert(spu          != NULL);
+    assert(spu->program != NULL);
+
+    *tracer = {
+        .program_size = spu->program_size + 1,
+        .checked      = checked,
+        .enabled      = true,
+    };
+
+    tracer->loop_counters = (uint32_t*)calloc(tracer->program_size, sizeof(uint32_t));
+    tracer->trees         = (TraceTree**)calloc(tracer->program_size, sizeof(TraceTree*));
+    if (!tracer->loop_counters || !tracer->trees)
+    {
+        tracerDtor(tracer);
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+void tracerDtor(Tracer* const tracer)
+{
+    assert(tracer != NULL);
+
+    if (tracer->recording)
+    {
+        abortRecording(tracer);
+    }
+
+    if (tracer->trees)
+    {
+        for (size_t head = 0; head < tracer->program_size; head++)
+        {
+            traceTreeDtor(tracer->trees[head]);
+        }
+    }
+
+    free(tracer->loop_counters);
+    free(tracer->trees);
+
+    *tracer = {};
+}
+
+
+void enterHotLoop(Tracer* const tracer, SPU* const spu, uint8_t command)
+{
+    assert(tracer != NULL);
+    assert(spu    != NULL);
+    assert(!tracer->recording);
+
+    if (!isJump(command))
+    {
+        return;
+    }
+
+    size_t     head = spu->ip;
+    TraceTree* tree = tracer->trees[head];
+
+    if (!tree)
+    {
+        if (tracer->enabled && ++tracer->loop_counters[head] == HOT_LOOP_THRESHOLD)
+        {
+            startRecording(tracer, spu, NULL, head, NO_PARENT_EXIT);
+        }
+        return;
+    }
+
+    uint64_t start_time  = getNanoseconds();
+    size_t   exit_number = runJitTrace(spu, &tree->native);
+
+    tracer->stats.nanoseconds_in_traces += getNanoseconds() - start_time;
+    tracer->stats.trace_entries++;
+    tracer->stats.side_exits++;
+
+    assert(exit_number < tree->number_of_exits);
+
+    if (++tree->exit_counters[exit_number] == HOT_EXIT_THRESHOLD
+        && tree->fragments_size < MAX_SIDE_TRACES + 1)
+    {
+        startRecording(tracer, spu, tree, spu->ip, exit_number);
+    }
+}
+
+
+void recordTraceStep(Tracer* const tracer, const SPU* const spu, size_t index, size_t next)
+{
+    assert(tracer != NULL);
+    assert(spu    != NULL);
+    assert(tracer->recording);
+
+    TraceTree* const           tree     = tracer->recording_tree;
+    const TraceFragment* const fragment = tree->fragments + tree->fragments_size;
+    uint8_t                    command  = spu->program[index].command;
+
+    // native code keeps no return addresses of the interpreter, so calls end the recording,
+    // a tail call is a plain jump and stays in the trace
+    if (!spu->end_flag
+        || command == MachineCommands_CALL
+        || command == MachineCommands_PURE_CALL
+        || command == MachineCommands_RET
+        || command == MachineCommands_CALL_DEPTH
+        || command == MachineCommands_HLT
+        || tree->steps_size - fragment->first_step >= MAX_TRACE_LENGTH)
+    {
+        abortRecording(tracer);
+        return;
+    }
+
+    // an inner loop that already runs natively is not unrolled into this one
+    if (isJump(command) && next <= index && next != tree->head && tracer->trees[next])
+    {
+        abortRecording(tracer);
+        return;
+    }
+
+    if (!appendStep(tree, index, next))
+    {
+        abortRecording(tracer);
+        return;
+    }
+
+    if (next == tree->head)
+    {
+        finishRecording(tracer, spu);
+    }
+}
+
+
+void writeTraceStatsLog(const Tracer* const tracer)
+{
+    assert(tracer != NULL);
+
+    const TraceStats* const stats = &tracer->stats;
+
+    Log(LogLevel_INFO, "Traces: %zu compiled, %zu aborted", stats->traces_compiled, stats->traces_aborted);
+    Log(LogLevel_INFO, "Traces: %zu entries, %zu side exits, %.3lf ms in native code",
+        stats->trace_entries, stats->side_exits, (double)stats->nanoseconds_in_traces / 1e6);
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+// tree is NULL for a new loop, otherwise the side trace starting at parent_exit is recorded into it
+static void startRecording(Tracer* const    tracer,
+                           const SPU* const spu,
+                           TraceTree* const tree,
+                           size_t           start,
+                           size_t           parent_exit)
+{
+    assert(tracer != NULL);
+    assert(spu    != NULL);
+    assert(!tracer->recording);
+
+    TraceTree* recording_tree = tree ? tree : traceTreeCtor(start);
+    if (!recording_tree)
+    {
+        return;
+    }
+
+    recording_tree->fragments[recording_tree->fragments_size] = {
+        .first_step  = recording_tree->steps_size,
+        .steps_size  = 0,
+        .parent_exit = parent_exit,
+    };
+
+    tracer->recording      = true;
+    tracer->recording_tree = recording_tree;
+
+    Log(LogLevel_INFO, parent_exit == NO_PARENT_EXIT ? "Recording loop at instruction %zu"
+                                                     : "Recording side trace from instruction %zu",
+        start);
+
+    // a guard that leads straight back to the head only needs a jump there
+    if (tree && start == tree->head)
+    {
+        finishRecording(tracer, spu);
+    }
+}
+
+
+static void finishRecording(Tracer* const tracer, const SPU* const spu)
+{
+    assert(tracer != NULL);
+    assert(spu    != NULL);
+
+    TraceTree* const tree     = tracer->recording_tree;
+    TraceFragment*   fragment = tree->fragments + tree->fragments_size;
+
+    fragment->steps_size = tree->steps_size - fragment->first_step;
+    tree->fragments_size++;
+
+    JitProgram native          = {};
+    size_t     number_of_exits = 0;
+
+    ProcessorErrorHandler return_code = compileTrace(spu, tree, tracer->checked, &native, &number_of_exits);
+    if (return_code == ProcessorErrorHandler_OK && !resizeExitCounters(tree, number_of_exits))
+    {
+        jitProgramDtor(&native);
+        return_code = ProcessorErrorHandler_ERROR;
+    }
+
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        if (return_code == ProcessorErrorHandler_NOT_TRANSLATABLE)
+        {
+            Log(LogLevel_INFO, "Native code is not available in this build, loops stay interpreted");
+            tracer->enabled = false;
+        }
+
+        tree->fragments_size--;
+        abortRecording(tracer);
+        return;
+    }
+
+    jitProgramDtor(&tree->native);
+    tree->native = native;
+
+    tracer->trees[tree->head] = tree;
+    tracer->recording         = false;
+    tracer->recording_tree    = NULL;
+    tracer->stats.traces_compiled++;
+
+    Log(LogLevel_INFO, "Loop at instruction %zu: %zu traces of %zu instructions in total, %zu bytes of native code",
+        tree->head, tree->fragments_size, tree->steps_size, tree->native.size);
+}
+
+
+static void abortRecording(Tracer* const tracer)
+{
+    assert(tracer != NULL);
+    assert(tracer->recording);
+
+    TraceTree* const tree = tracer->recording_tree;
+
+    tree->steps_size = tree->fragments[tree->fragments_size].first_step;
+    if (tree->fragments_size == 0)
+    {
+        traceTreeDtor(tree);
+    }
+
+    tracer->recording      = false;
+    tracer->recording_tree = NULL;
+    tracer->stats.traces_aborted++;
+}
+
+
+static bool appendStep(TraceTree* const tree, size_t index, size_t next)
+{
+    assert(tree != NULL);
+
+    if (tree->steps_size == tree->steps_capacity)
+    {
+        size_t     new_capacity = tree->steps_capacity ? 2 * tree->steps_capacity : START_STEPS_CAPACITY;
+        TraceStep* new_steps    = (TraceStep*)realloc(tree->steps, new_capacity * sizeof(TraceStep));
+        if (!new_steps)
+        {
+            return false;
+        }
+
+        tree->steps          = new_steps;
+        tree->steps_capacity = new_capacity;
+    }
+
+    tree->steps[tree->steps_size++] = {
+        .index = index,
+        .next  = next,
+    };
+
+    return true;
+}
+
+
+static TraceTree* traceTreeCtor(size_t head)
+{
+    TraceTree* tree = (TraceTree*)calloc(1, sizeof(TraceTree));
+    if (!tree)
+    {
+        return NULL;
+    }
+
+    tree->head = head;
+
+    return tree;
+}
+
+
+static void traceTreeDtor(TraceTree* tree)
+{
+    if (!tree)
+    {
+        return;
+    }
+
+    jitProgramDtor(&tree->native);
+    free(tree->steps);
+    free(tree->exit_counters);
+    free(tree);
+}
+
+
+// guards are numbered in compilation order, so the counters of the old ones stay where they were
+static bool resizeExitCounters(TraceTree* const tree, size_t number_of_exits)
+{
+    assert(tree != NULL);
+    assert(number_of_exits >= tree->number_of_exits);
+
+    uint32_t* new_counters = (uint32_t*)realloc(tree->exit_counters, (number_of_exits + 1) * sizeof(uint32_t));
+    if (!new_counters)
+    {
+        return false;
+    }
+
+    memset(new_counters + tree->number_of_exits, 0,
+           (number_of_exits + 1 - tree->number_of_exits) * sizeof(uint32_t));
+
+    tree->exit_counters   = new_counters;
+    tree->number_of_exits = number_of_exits;
+
+    return true;
+}
+
+
+static bool isJump(uint8_t command)
+{
+    switch (command)
+    {
+        case MachineCommands_JMP:
+        case MachineCommands_TAILCALL:
+        case MachineCommands_JA:
+        case MachineCommands_JAE:
+        case MachineCommands_JB:
+        case MachineCommands_JBE:
+        case MachineCommands_JE:
+        case MachineCommands_JNE:
+        case DecodedCommands_JA_PAIR:
+        case DecodedCommands_JAE_PAIR:
+        case DecodedCommands_JB_PAIR:
+        case DecodedCommands_JBE_PAIR:
+        case DecodedCommands_JE_PAIR:
+        case DecodedCommands_JNE_PAIR:
+            return true;
+
+        default:
+            return false;
+    }
+}
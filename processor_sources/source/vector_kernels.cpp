@@ -0,0 +1,465 @@
+#include "vector_kernels.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "helpful_functions.h"
+#include "command_handler.h"
+#include "value_type.h"
+#include "runtime_error.h"
+
+// the AVX2 kernels work on packed doubles, f32 and i64 builds always run the scalar ones
+#if defined(__x86_64__) && defined(__GNUC__) && defined(SPU_VALUE_F64)
+#include <immintrin.h>
+#define HAS_AVX2_KERNELS_
+#endif
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+typedef void (*BinaryKernel)(arguments_type* destination,
+                             const arguments_type* first,
+                             const arguments_type* second,
+                             size_t count);
+typedef void (*ScaleKernel)(arguments_type* destination, const arguments_type* source, arguments_type scalar,
+                            size_t count);
+typedef void (*FillKernel)(arguments_type* destination, arguments_type value, size_t count);
+typedef arguments_type (*DotKernel)(const arguments_type* first, const arguments_type* second, size_t count);
+typedef arguments_type (*SumKernel)(const arguments_type* source, size_t count);
+
+typedef struct VectorKernels
+{
+    const char*  name;
+    BinaryKernel add;
+    BinaryKernel sub;
+    BinaryKernel mul;
+    BinaryKernel div;
+    BinaryKernel less;
+    ScaleKernel  scale;
+    FillKernel   fill;
+    SumKernel    sum;
+    DotKernel    dot;
+} VectorKernels;
+
+__attribute__((constructor)) static void selectVectorKernels(void);
+static size_t getRange(arguments_type address, size_t count);
+static size_t getCount(arguments_type count);
+static bool isPartialOverlap(size_t destination, size_t source, size_t count);
+
+static void addScalar(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                      size_t count);
+static void subScalar(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                      size_t count);
+static void mulScalar(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                      size_t count);
+static void divScalar(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                      size_t count);
+static void lessScalar(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                       size_t count);
+static void scaleScalar(arguments_type* destination, const arguments_type* source, arguments_type scalar,
+                        size_t count);
+static void fillScalar(arguments_type* destination, arguments_type value, size_t count);
+static arguments_type sumScalar(const arguments_type* source, size_t count);
+static arguments_type dotScalar(const arguments_type* first, const arguments_type* second, size_t count);
+
+static const VectorKernels SCALAR_KERNELS = {
+    .name  = "scalar",
+    .add   = addScalar,
+    .sub   = subScalar,
+    .mul   = mulScalar,
+    .div   = divScalar,
+    .less  = lessScalar,
+    .scale = scaleScalar,
+    .fill  = fillScalar,
+    .sum   = sumScalar,
+    .dot   = dotScalar,
+};
+
+#ifdef HAS_AVX2_KERNELS_
+
+static const size_t LANES = sizeof(__m256d) / sizeof(arguments_type);
+
+static void addAvx2(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                    size_t count);
+static void subAvx2(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                    size_t count);
+static void mulAvx2(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                    size_t count);
+static void divAvx2(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                    size_t count);
+static void lessAvx2(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                     size_t count);
+static void scaleAvx2(arguments_type* destination, const arguments_type* source, arguments_type scalar,
+                      size_t count);
+static void fillAvx2(arguments_type* destination, arguments_type value, size_t count);
+static arguments_type sumAvx2(const arguments_type* source, size_t count);
+static arguments_type dotAvx2(const arguments_type* first, const arguments_type* second, size_t count);
+static arguments_type addLanes(__m256d lanes);
+
+static const VectorKernels AVX2_KERNELS = {
+    .name  = "avx2",
+    .add   = addAvx2,
+    .sub   = subAvx2,
+    .mul   = mulAvx2,
+    .div   = divAvx2,
+    .less  = lessAvx2,
+    .scale = scaleAvx2,
+    .fill  = fillAvx2,
+    .sum   = sumAvx2,
+    .dot   = dotAvx2,
+};
+
+#endif // HAS_AVX2_KERNELS_
+
+// set before main and never changed, so every thread reads the same kernels
+static const VectorKernels* vector_kernels = &SCALAR_KERNELS;
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+arguments_type executeVectorCommand(uint8_t vector_command, arguments_type* ram, const arguments_type* operands)
+{
+    assert(ram      != NULL);
+    assert(operands != NULL);
+
+    const VectorKernels* kernels = vector_kernels;
+
+    switch (vector_command)
+    {
+        case VectorCommands_ADD:
+        case VectorCommands_SUB:
+        case VectorCommands_MUL:
+        case VectorCommands_DIV:
+        case VectorCommands_LESS:
+        {
+            size_t count       = getCount(operands[3]);
+            size_t destination = getRange(operands[0], count);
+            size_t first       = getRange(operands[1], count);
+            size_t second      = getRange(operands[2], count);
+
+            // lanes would see a partly overwritten source in another order than one cell at a time
+            if (isPartialOverlap(destination, first, count) || isPartialOverlap(destination, second, count))
+            {
+                kernels = &SCALAR_KERNELS;
+            }
+
+            BinaryKernel kernel = vector_command == VectorCommands_ADD ? kernels->add
+                                : vector_command == VectorCommands_SUB ? kernels->sub
+                                : vector_command == VectorCommands_MUL ? kernels->mul
+                                : vector_command == VectorCommands_DIV ? kernels->div
+                                :                                        kernels->less;
+
+            kernel(ram + destination, ram + first, ram + second, count);
+            return 0;
+        }
+
+        case VectorCommands_SCALE:
+        {
+            size_t count       = getCount(operands[3]);
+            size_t destination = getRange(operands[0], count);
+            size_t source      = getRange(operands[1], count);
+
+            if (isPartialOverlap(destination, source, count))
+            {
+                kernels = &SCALAR_KERNELS;
+            }
+
+            kernels->scale(ram + destination, ram + source, operands[2], count);
+            return 0;
+        }
+
+        case VectorCommands_FILL:
+        {
+            size_t count = getCount(operands[2]);
+            kernels->fill(ram + getRange(operands[0], count), operands[1], count);
+            return 0;
+        }
+
+        case VectorCommands_COPY:
+        {
+            size_t count       = getCount(operands[2]);
+            size_t destination = getRange(operands[0], count);
+            size_t source      = getRange(operands[1], count);
+
+            memmove(ram + destination, ram + source, count * sizeof(arguments_type));
+            return 0;
+        }
+
+        case VectorCommands_SUM:
+        {
+            size_t count = getCount(operands[1]);
+            return kernels->sum(ram + getRange(operands[0], count), count);
+        }
+
+        case VectorCommands_DOT:
+        {
+            size_t count = getCount(operands[2]);
+            return kernels->dot(ram + getRange(operands[0], count), ram + getRange(operands[1], count), count);
+        }
+
+        default:
+            abortWithMessage("Unknown vector command");
+    }
+}
+
+
+const char* getVectorKernelsName(void)
+{
+    return vector_kernels->name;
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+// constructors run before __builtin_cpu_supports is ready, so the CPUID data is filled in by hand
+__attribute__((constructor)) static void selectVectorKernels(void)
+{
+#ifdef HAS_AVX2_KERNELS_
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        vector_kernels = &AVX2_KERNELS;
+    }
+#endif
+}
+
+
+// addresses are truncated the same way push [address] and pop [address] do it
+static size_t getRange(arguments_type address, size_t count)
+{
+    if (!(address >= 0 && address < (arguments_type)SIZE_OF_RAM))
+    {
+        raiseRuntimeError("Vector command outside of RAM");
+    }
+
+    size_t start = (size_t)(int)address;
+    if (count > SIZE_OF_RAM - start)
+    {
+        raiseRuntimeError("Vector command outside of RAM");
+    }
+
+    return start;
+}
+
+
+static size_t getCount(arguments_type count)
+{
+    if (!(count >= 0 && count <= (arguments_type)SIZE_OF_RAM))
+    {
+        raiseRuntimeError("Vector command outside of RAM");
+    }
+
+    return (size_t)(int)count;
+}
+
+
+static bool isPartialOverlap(size_t destination, size_t source, size_t count)
+{
+    return destination != source && destination < source + count && source < destination + count;
+}
+
+
+static void addScalar(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                      size_t count)
+{
+    for (size_t index = 0; index < count; index++)
+    {
+        destination[index] = first[index] + second[index];
+    }
+}
+
+
+static void subScalar(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                      size_t count)
+{
+    for (size_t index = 0; index < count; index++)
+    {
+        destination[index] = first[index] - second[index];
+    }
+}
+
+
+static void mulScalar(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                      size_t count)
+{
+    for (size_t index = 0; index < count; index++)
+    {
+        destination[index] = first[index] * second[index];
+    }
+}
+
+
+static void divScalar(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                      size_t count)
+{
+    for (size_t index = 0; index < count; index++)
+    {
+        destination[index] = divideValues(first[index], second[index]);
+    }
+}
+
+
+static void lessScalar(arguments_type* destination, const arguments_type* first, const arguments_type* second,
+                       size_t count)
+{
+    for (size_t index = 0; index < count; index++)
+    {
+        destination[index] = first[index] < second[index] ? 1 : 0;
+    }
+}
+
+
+static void scaleScalar(arguments_type* destination, const arguments_type* source, arguments_type scalar,
+                        size_t count)
+{
+    for (size_t index = 0; index < count; index++)
+    {
+        destination[index] = source[index] * scalar;
+    }
+}
+
+
+static void fillScalar(arguments_type* destination, arguments_type value, size_t count)
+{
+    for (size_t index = 0; index < count; index++)
+    {
+        destination[index] = value;
+    }
+}
+
+
+static arguments_type sumScalar(const arguments_type* source, size_t count)
+{
+    arguments_type sum = 0;
+    for (size_t index = 0; index < count; index++)
+    {
+        sum += source[index];
+    }
+
+    return sum;
+}
+
+
+static arguments_type dotScalar(const arguments_type* first, const arguments_type* second, size_t count)
+{
+    arguments_type sum = 0;
+    for (size_t index = 0; index < count; index++)
+    {
+        sum += first[index] * second[index];
+    }
+
+    return sum;
+}
+
+
+#ifdef HAS_AVX2_KERNELS_
+
+// Four cells per instruction, the tail that does not fill a whole register goes through the scalar kernel.
+// Element-wise results are the same as the scalar ones, sums are added up in four lanes and may differ
+// from the scalar order in the last bits.
+#define AVX2_BINARY_KERNEL_(name, scalar_kernel, operation)                                             \
+    __attribute__((target("avx2")))                                                                    \
+    static void name(arguments_type* destination, const arguments_type* first,                         \
+                     const arguments_type* second, size_t count)                                        \
+    {                                                                                                   \
+        size_t index = 0;                                                                               \
+        for (; index + LANES <= count; index += LANES)                                                  \
+        {                                                                                               \
+            _mm256_storeu_pd(destination + index, operation(_mm256_loadu_pd(first  + index),           \
+                                                            _mm256_loadu_pd(second + index)));          \
+        }                                                                                               \
+                                                                                                        \
+        scalar_kernel(destination + index, first + index, second + index, count - index);               \
+    }
+
+__attribute__((target("avx2")))
+static inline __m256d lessLanes(__m256d first, __m256d second)
+{
+    return _mm256_and_pd(_mm256_cmp_pd(first, second, _CMP_LT_OQ), _mm256_set1_pd(1));
+}
+
+AVX2_BINARY_KERNEL_(addAvx2,  addScalar,  _mm256_add_pd)
+AVX2_BINARY_KERNEL_(subAvx2,  subScalar,  _mm256_sub_pd)
+AVX2_BINARY_KERNEL_(mulAvx2,  mulScalar,  _mm256_mul_pd)
+AVX2_BINARY_KERNEL_(divAvx2,  divScalar,  _mm256_div_pd)
+AVX2_BINARY_KERNEL_(lessAvx2, lessScalar, lessLanes)
+
+#undef AVX2_BINARY_KERNEL_
+
+
+__attribute__((target("avx2")))
+static void scaleAvx2(arguments_type* destination, const arguments_type* source, arguments_type scalar,
+                      size_t count)
+{
+    __m256d scalars = _mm256_set1_pd(scalar);
+
+    size_t index = 0;
+    for (; index + LANES <= count; index += LANES)
+    {
+        _mm256_storeu_pd(destination + index, _mm256_mul_pd(_mm256_loadu_pd(source + index), scalars));
+    }
+
+    scaleScalar(destination + index, source + index, scalar, count - index);
+}
+
+
+__attribute__((target("avx2")))
+static void fillAvx2(arguments_type* destination, arguments_type value, size_t count)
+{
+    __m256d values = _mm256_set1_pd(value);
+
+    size_t index = 0;
+    for (; index + LANES <= count; index += LANES)
+    {
+        _mm256_storeu_pd(destination + index, values);
+    }
+
+    fillScalar(destination + index, value, count - index);
+}
+
+
+__attribute__((target("avx2")))
+static arguments_type sumAvx2(const arguments_type* source, size_t count)
+{
+    __m256d sums = _mm256_setzero_pd();
+
+    size_t index = 0;
+    for (; index + LANES <= count; index += LANES)
+    {
+        sums = _mm256_add_pd(sums, _mm256_loadu_pd(source + index));
+    }
+
+    return addLanes(sums) + sumScalar(source + index, count - index);
+}
+
+
+__attribute__((target("avx2")))
+static arguments_type dotAvx2(const arguments_type* first, const arguments_type* second, size_t count)
+{
+    __m256d sums = _mm256_setzero_pd();
+
+    size_t index = 0;
+    for (; index + LANES <= count; index += LANES)
+    {
+        sums = _mm256_add_pd(sums, _mm256_mul_pd(_mm256_loadu_pd(first + index), _mm256_loadu_pd(second + index)));
+    }
+
+    return addLanes(sums) + dotScalar(first + index, second + index, count - index);
+}
+
+
+__attribute__((target("avx2")))
+static arguments_type addLanes(__m256d lanes)
+{
+    arguments_type cells[LANES] = {};
+    _mm256_storeu_pd(cells, lanes);
+
+    return (cells[0] + cells[1]) + (cells[2] + cells[3]);
+}
+
+#endif // HAS_AVX2_KERNELS_
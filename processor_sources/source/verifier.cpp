@@ -0,0 +1,481 @@
+#include "verifier.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "helpful_functions.h"
+#include "command_handler.h"
+#include "logger.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+// effect of one procedure on the operand stack, depths are relative to the stack at its entry
+typedef struct ProcedureSummary
+{
+    bool   analysed;
+    bool   in_progress;
+    bool   returns;
+    long   min_return_depth;
+    long   max_return_depth;
+    long   min_depth;          // lowest depth reached after pops, negative means it eats caller values
+    long   max_depth;
+    size_t call_depth;
+} ProcedureSummary;
+
+typedef struct DepthRange
+{
+    bool seen;
+    long min;
+    long max;
+} DepthRange;
+
+typedef struct Verifier
+{
+    const Instruction* program;
+    size_t             program_size;
+    ProcedureSummary*  summaries;     // indexed by entry instruction
+    bool               bounded;
+} Verifier;
+
+static const long DEPTH_LIMIT = (long)SIZE_OF_STACK;
+
+static ProcessorErrorHandler checkInstruction(const Instruction* const instruction, size_t index, size_t program_size);
+static bool checkRegister(uint8_t register_index);
+static bool isConditionalJump(uint8_t command);
+static const ProcedureSummary* analyseProcedure(Verifier* const verifier, size_t entry);
+static void addReturnDepth(ProcedureSummary* const summary, long min, long max);
+static bool mergeRange(DepthRange* const range, long min, long max);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+ProcessorErrorHandler verifyProgram(const SPU* const spu, VerifierReport* const report)
+{
+    assert(spu          != NULL);
+    assert(spu->program != NULL);
+    assert(report       != NULL);
+
+    *report = {};
+
+    for (size_t index = 0; index < spu->program_size; index++)
+    {
+        ProcessorErrorHandler return_code = checkInstruction(spu->program + index, index, spu->program_size);
+        if (return_code != ProcessorErrorHandler_OK)
+        {
+            return return_code;
+        }
+    }
+
+    Verifier verifier = {
+        .program      = spu->program,
+        .program_size = spu->program_size,
+        .summaries    = (ProcedureSummary*)calloc(spu->program_size + 1, sizeof(ProcedureSummary)),
+        .bounded      = true,
+    };
+    if (!verifier.summaries)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    // the main program is analysed like a procedure whose ret has nowhere to return to
+    const ProcedureSummary* main_summary = analyseProcedure(&verifier, 0);
+
+    if (verifier.bounded && (main_summary->min_depth < 0 || main_summary->returns
+                          || main_summary->call_depth > CALL_STACK_SIZE))
+    {
+        verifier.bounded = false;
+    }
+
+    if (verifier.bounded)
+    {
+        report->max_stack_depth = (size_t)main_summary->max_depth;
+        report->max_call_depth  = main_summary->call_depth;
+        report->bounded         = true;
+    }
+
+    FREE_NULL(verifier.summaries);
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+void getStackEffect(uint8_t command, long* const pops, long* const pushes)
+{
+    assert(pops   != NULL);
+    assert(pushes != NULL);
+
+    *pops   = 0;
+    *pushes = 0;
+
+    switch (command)
+    {
+        case MachineCommands_PUSH:
+        case MachineCommands_PUSH_SUB:
+        case MachineCommands_CALL_DEPTH:
+        case MachineCommands_TIMESTAMP:
+        case MachineCommands_IN:   *pushes = 1;              break;
+
+        case MachineCommands_POP:
+        case MachineCommands_OUT:  *pops = 1;                break;
+
+        case MachineCommands_SQRT: *pops = 1; *pushes = 1;   break;
+
+        case MachineCommands_ADD:
+        case MachineCommands_MUL:
+        case MachineCommands_SUB:
+        case MachineCommands_DIV:  *pops = 2; *pushes = 1;   break;
+
+        case MachineCommands_JA:
+        case MachineCommands_JAE:
+        case MachineCommands_JB:
+        case MachineCommands_JBE:
+        case MachineCommands_JE:
+        case MachineCommands_JNE:  *pops = 2;                break;
+
+        case DecodedCommands_VADD:
+        case DecodedCommands_VSUB:
+        case DecodedCommands_VMUL:
+        case DecodedCommands_VDIV:
+        case DecodedCommands_VSCALE:
+        case DecodedCommands_VFILL:
+        case DecodedCommands_VCOPY:
+        case DecodedCommands_VSUM:
+        case DecodedCommands_VDOT:
+        case DecodedCommands_VLESS:
+            *pops   = VECTOR_COMMANDS[command - DecodedCommands_VADD].operands;
+            *pushes = VECTOR_COMMANDS[command - DecodedCommands_VADD].results;
+            break;
+
+        default:                                             break;
+    }
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static ProcessorErrorHandler checkInstruction(const Instruction* const instruction, size_t index, size_t program_size)
+{
+    assert(instruction != NULL);
+
+    switch (instruction->command)
+    {
+        case MachineCommands_PUSH:
+        case MachineCommands_POP:
+            if ((instruction->flags & REGISTER_FLAG) && !checkRegister(instruction->register_index))
+            {
+                Log(LogLevel_INFO, "Instruction %zu uses unknown register %d", index, instruction->register_index);
+                return ProcessorErrorHandler_INVALID_PROGRAM;
+            }
+
+            if ((instruction->flags & RAM_FLAG)
+             && !(instruction->flags & REGISTER_FLAG)
+             && !(instruction->immediate >= 0 && instruction->immediate < (arguments_type)SIZE_OF_RAM))
+            {
+                Log(LogLevel_INFO, "Instruction %zu addresses RAM cell %lg outside of RAM",
+                    index, (double)instruction->immediate);
+                return ProcessorErrorHandler_INVALID_PROGRAM;
+            }
+            break;
+
+        case MachineCommands_INC:
+            if (!checkRegister(instruction->register_index))
+            {
+                Log(LogLevel_INFO, "Instruction %zu uses unknown register %d", index, instruction->register_index);
+                return ProcessorErrorHandler_INVALID_PROGRAM;
+            }
+            break;
+
+        case MachineCommands_PUSH_SUB:
+        case DecodedCommands_JA_PAIR:
+        case DecodedCommands_JAE_PAIR:
+        case DecodedCommands_JB_PAIR:
+        case DecodedCommands_JBE_PAIR:
+        case DecodedCommands_JE_PAIR:
+        case DecodedCommands_JNE_PAIR:
+            if (((instruction->flags & PAIR_FIRST_REGISTER_FLAG)  && !checkRegister(instruction->register_index))
+             || ((instruction->flags & PAIR_SECOND_REGISTER_FLAG) && !checkRegister(instruction->second_register_index)))
+            {
+                Log(LogLevel_INFO, "Instruction %zu uses unknown register", index);
+                return ProcessorErrorHandler_INVALID_PROGRAM;
+            }
+
+            if (instruction->command != MachineCommands_PUSH_SUB && instruction->target > program_size)
+            {
+                Log(LogLevel_INFO, "Instruction %zu jumps outside of program", index);
+                return ProcessorErrorHandler_INVALID_PROGRAM;
+            }
+            break;
+
+        case MachineCommands_JMP:
+        case MachineCommands_JA:
+        case MachineCommands_JAE:
+        case MachineCommands_JB:
+        case MachineCommands_JBE:
+        case MachineCommands_JE:
+        case MachineCommands_JNE:
+        case MachineCommands_CALL:
+        case MachineCommands_TAILCALL:
+        case MachineCommands_PURE_CALL:
+            // the decoder already refused targets that are not on an instruction boundary
+            if (instruction->target > program_size)
+            {
+                Log(LogLevel_INFO, "Instruction %zu jumps outside of program", index);
+                return ProcessorErrorHandler_INVALID_PROGRAM;
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// Interval analysis of the stack depth over one procedure. Calls use the summary of the callee,
+// recursion or a depth that keeps growing marks the whole program as unbounded.
+static const ProcedureSummary* analyseProcedure(Verifier* const verifier, size_t entry)
+{
+    assert(verifier != NULL);
+
+    ProcedureSummary* summary = verifier->summaries + entry;
+
+    if (summary->analysed)
+    {
+        return summary;
+    }
+
+    if (summary->in_progress)
+    {
+        verifier->bounded = false;
+        return summary;
+    }
+
+    summary->in_progress = true;
+
+    size_t      number_of_instructions = verifier->program_size + 1;
+    DepthRange* ranges   = (DepthRange*)calloc(number_of_instructions, sizeof(DepthRange));
+    size_t*     worklist = (size_t*)calloc(number_of_instructions, sizeof(size_t));
+    bool*       queued   = (bool*)calloc(number_of_instructions, sizeof(bool));
+    if (!ranges || !worklist || !queued)
+    {
+        verifier->bounded = false;
+        free(ranges);
+        free(worklist);
+        free(queued);
+        return summary;
+    }
+
+    size_t worklist_size = 0;
+
+    mergeRange(ranges + entry, 0, 0);
+    worklist[worklist_size++] = entry;
+    queued[entry]             = true;
+
+#define ENQUEUE_(index, min, max)                                    \
+    if (mergeRange(ranges + (index), (min), (max)) && !queued[index]) \
+    {                                                                 \
+        worklist[worklist_size++] = (index);                          \
+        queued[index]             = true;                             \
+    }
+
+    while (worklist_size > 0 && verifier->bounded)
+    {
+        size_t index = worklist[--worklist_size];
+        queued[index] = false;
+
+        const Instruction* instruction = verifier->program + index;
+
+        long pops   = 0;
+        long pushes = 0;
+        getStackEffect(instruction->command, &pops, &pushes);
+
+        long min = ranges[index].min - pops;
+        long max = ranges[index].max - pops + pushes;
+
+        if (min < summary->min_depth)
+        {
+            summary->min_depth = min;
+        }
+
+        if (max > summary->max_depth)
+        {
+            summary->max_depth = max;
+        }
+
+        min += pushes;
+
+        if (summary->max_depth > DEPTH_LIMIT || summary->min_depth < -DEPTH_LIMIT)
+        {
+            verifier->bounded = false;
+            break;
+        }
+
+        switch (instruction->command)
+        {
+            case MachineCommands_HLT:
+                break;
+
+            case MachineCommands_RET:
+                addReturnDepth(summary, min, max);
+                break;
+
+            case MachineCommands_JMP:
+                ENQUEUE_(instruction->target, min, max);
+                break;
+
+            // a procedure that calls itself in tail position only loops, any other callee returns for it
+            case MachineCommands_TAILCALL:
+            {
+                if (instruction->target == entry)
+                {
+                    ENQUEUE_(entry, min, max);
+                    break;
+                }
+
+                const ProcedureSummary* callee = analyseProcedure(verifier, instruction->target);
+                if (!verifier->bounded)
+                {
+                    break;
+                }
+
+                if (min + callee->min_depth < summary->min_depth)
+                {
+                    summary->min_depth = min + callee->min_depth;
+                }
+
+                if (max + callee->max_depth > summary->max_depth)
+                {
+                    summary->max_depth = max + callee->max_depth;
+                }
+
+                if (callee->call_depth > summary->call_depth)
+                {
+                    summary->call_depth = callee->call_depth;
+                }
+
+                if (callee->returns)
+                {
+                    addReturnDepth(summary, min + callee->min_return_depth, max + callee->max_return_depth);
+                }
+                break;
+            }
+
+            case MachineCommands_CALL:
+            case MachineCommands_PURE_CALL:
+            {
+                const ProcedureSummary* callee = analyseProcedure(verifier, instruction->target);
+                if (!verifier->bounded)
+                {
+                    break;
+                }
+
+                if (min + callee->min_depth < summary->min_depth)
+                {
+                    summary->min_depth = min + callee->min_depth;
+                }
+
+                if (max + callee->max_depth > summary->max_depth)
+                {
+                    summary->max_depth = max + callee->max_depth;
+                }
+
+                if (callee->call_depth + 1 > summary->call_depth)
+                {
+                    summary->call_depth = callee->call_depth + 1;
+                }
+
+                if (callee->returns)
+                {
+                    ENQUEUE_(index + 1, min + callee->min_return_depth, max + callee->max_return_depth);
+                }
+                break;
+            }
+
+            default:
+                if (isConditionalJump(instruction->command))
+                {
+                    ENQUEUE_(instruction->target, min, max);
+                }
+
+                ENQUEUE_(index + 1, min, max);
+                break;
+        }
+    }
+
+#undef ENQUEUE_
+
+    free(ranges);
+    free(worklist);
+    free(queued);
+
+    summary->in_progress = false;
+    summary->analysed    = true;
+
+    return summary;
+}
+
+
+static void addReturnDepth(ProcedureSummary* const summary, long min, long max)
+{
+    assert(summary != NULL);
+
+    if (!summary->returns)
+    {
+        summary->returns          = true;
+        summary->min_return_depth = min;
+        summary->max_return_depth = max;
+        return;
+    }
+
+    summary->min_return_depth = min < summary->min_return_depth ? min : summary->min_return_depth;
+    summary->max_return_depth = max > summary->max_return_depth ? max : summary->max_return_depth;
+}
+
+
+static bool mergeRange(DepthRange* const range, long min, long max)
+{
+    assert(range != NULL);
+
+    if (!range->seen)
+    {
+        range->seen = true;
+        range->min  = min;
+        range->max  = max;
+        return true;
+    }
+
+    bool changed = false;
+
+    if (min < range->min)
+    {
+        range->min = min;
+        changed    = true;
+    }
+
+    if (max > range->max)
+    {
+        range->max = max;
+        changed    = true;
+    }
+
+    return changed;
+}
+
+
+static bool checkRegister(uint8_t register_index)
+{
+    return register_index >= Registers_AX && (size_t)register_index <= NUMBER_OF_REGISTERS;
+}
+
+
+static bool isConditionalJump(uint8_t command)
+{
+    return (command >= MachineCommands_JA      && command <= MachineCommands_JNE)
+        || (command >= DecodedCommands_JA_PAIR && command <= DecodedCommands_JNE_PAIR);
+}
@@ -0,0 +1,539 @@
+#include "x86_emitter.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include "helpful_functions.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static const size_t  START_CAPACITY   = 4096;
+static const uint8_t REX              = 0x40;
+static const uint8_t REX_WIDE         = 0x08;
+static const uint8_t SSE_DOUBLE       = 0xF2;
+static const uint8_t OPERAND_SIZE     = 0x66;
+static const uint8_t TWO_BYTE_OPCODE  = 0x0F;
+static const uint8_t MOD_REGISTER     = 0b11;
+
+static void reserve(CodeBuffer* const buffer, size_t size);
+static void emitRex(CodeBuffer* const buffer, bool wide, unsigned reg, unsigned index, unsigned base);
+static void emitMemory(CodeBuffer* const buffer, unsigned reg, X86Register base, int32_t displacement);
+static void emitIndexedMemory(CodeBuffer* const buffer, unsigned reg, X86Register base, X86Register index);
+static void emitRegisterOperand(CodeBuffer* const buffer, unsigned reg, unsigned rm);
+static bool fitsInByte(int32_t value);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+void codeBufferDtor(CodeBuffer* const buffer)
+{
+    assert(buffer != NULL);
+
+    FREE_NULL(buffer->bytes);
+
+    *buffer = {};
+}
+
+
+void emitByte(CodeBuffer* const buffer, uint8_t byte)
+{
+    assert(buffer != NULL);
+
+    reserve(buffer, 1);
+    if (buffer->failed)
+    {
+        return;
+    }
+
+    buffer->bytes[buffer->size++] = byte;
+}
+
+
+void emit32(CodeBuffer* const buffer, uint32_t value)
+{
+    assert(buffer != NULL);
+
+    for (size_t byte = 0; byte < sizeof(value); byte++)
+    {
+        emitByte(buffer, (uint8_t)(value >> (8 * byte)));
+    }
+}
+
+
+void emit64(CodeBuffer* const buffer, uint64_t value)
+{
+    assert(buffer != NULL);
+
+    for (size_t byte = 0; byte < sizeof(value); byte++)
+    {
+        emitByte(buffer, (uint8_t)(value >> (8 * byte)));
+    }
+}
+
+
+void patchRelative(CodeBuffer* const buffer, size_t position, size_t target)
+{
+    assert(buffer != NULL);
+
+    if (buffer->failed)
+    {
+        return;
+    }
+
+    assert(position + sizeof(int32_t) <= buffer->size);
+
+    int32_t relative = (int32_t)((long)target - (long)(position + sizeof(int32_t)));
+    memcpy(buffer->bytes + position, &relative, sizeof(relative));
+}
+
+
+void emitMoveImmediate(CodeBuffer* const buffer, X86Register destination, uint64_t value)
+{
+    emitRex(buffer, true, 0, 0, destination);
+    emitByte(buffer, (uint8_t)(0xB8 + (destination & 7)));
+    emit64(buffer, value);
+}
+
+
+void emitMoveRegister(CodeBuffer* const buffer, X86Register destination, X86Register source)
+{
+    emitRex(buffer, true, source, 0, destination);
+    emitByte(buffer, 0x89);
+    emitRegisterOperand(buffer, source, destination);
+}
+
+
+void emitLoad(CodeBuffer* const buffer, X86Register destination, X86Register base, int32_t displacement)
+{
+    emitRex(buffer, true, destination, 0, base);
+    emitByte(buffer, 0x8B);
+    emitMemory(buffer, destination, base, displacement);
+}
+
+
+void emitStore(CodeBuffer* const buffer, X86Register base, int32_t displacement, X86Register source)
+{
+    emitRex(buffer, true, source, 0, base);
+    emitByte(buffer, 0x89);
+    emitMemory(buffer, source, base, displacement);
+}
+
+
+void emitStoreImmediate32(CodeBuffer* const buffer, X86Register base, int32_t displacement, int32_t value)
+{
+    emitRex(buffer, false, 0, 0, base);
+    emitByte(buffer, 0xC7);
+    emitMemory(buffer, 0, base, displacement);
+    emit32(buffer, (uint32_t)value);
+}
+
+
+void emitAddImmediate(CodeBuffer* const buffer, X86Register destination, int32_t value)
+{
+    emitRex(buffer, true, 0, 0, destination);
+    emitByte(buffer, fitsInByte(value) ? 0x83 : 0x81);
+    emitRegisterOperand(buffer, 0, destination);
+    fitsInByte(value) ? emitByte(buffer, (uint8_t)value) : emit32(buffer, (uint32_t)value);
+}
+
+
+void emitAddImmediate32(CodeBuffer* const buffer, X86Register destination, int32_t value)
+{
+    emitRex(buffer, false, 0, 0, destination);
+    emitByte(buffer, fitsInByte(value) ? 0x83 : 0x81);
+    emitRegisterOperand(buffer, 0, destination);
+    fitsInByte(value) ? emitByte(buffer, (uint8_t)value) : emit32(buffer, (uint32_t)value);
+}
+
+
+void emitSubRegister(CodeBuffer* const buffer, X86Register destination, X86Register source)
+{
+    emitRex(buffer, true, source, 0, destination);
+    emitByte(buffer, 0x29);
+    emitRegisterOperand(buffer, source, destination);
+}
+
+
+void emitAndImmediate(CodeBuffer* const buffer, X86Register destination, int8_t value)
+{
+    emitRex(buffer, true, 0, 0, destination);
+    emitByte(buffer, 0x83);
+    emitRegisterOperand(buffer, 4, destination);
+    emitByte(buffer, (uint8_t)value);
+}
+
+
+void emitCompareImmediate(CodeBuffer* const buffer, X86Register first, int32_t value)
+{
+    emitRex(buffer, true, 0, 0, first);
+    emitByte(buffer, fitsInByte(value) ? 0x83 : 0x81);
+    emitRegisterOperand(buffer, 7, first);
+    fitsInByte(value) ? emitByte(buffer, (uint8_t)value) : emit32(buffer, (uint32_t)value);
+}
+
+
+void emitCompareMemory(CodeBuffer* const buffer, X86Register first, X86Register base, int32_t displacement)
+{
+    emitRex(buffer, true, first, 0, base);
+    emitByte(buffer, 0x3B);
+    emitMemory(buffer, first, base, displacement);
+}
+
+
+void emitTest(CodeBuffer* const buffer, X86Register first, X86Register second)
+{
+    emitRex(buffer, true, second, 0, first);
+    emitByte(buffer, 0x85);
+    emitRegisterOperand(buffer, second, first);
+}
+
+
+void emitTestByte(CodeBuffer* const buffer, X86Register first)
+{
+    // without REX only al, cl, dl and bl are byte registers
+    assert(first <= X86Register_RBX);
+
+    emitByte(buffer, 0x84);
+    emitRegisterOperand(buffer, first, first);
+}
+
+
+void emitSignExtend32(CodeBuffer* const buffer, X86Register destination, X86Register source)
+{
+    emitRex(buffer, true, destination, 0, source);
+    emitByte(buffer, 0x63);
+    emitRegisterOperand(buffer, destination, source);
+}
+
+
+void emitIncrement(CodeBuffer* const buffer, X86Register destination)
+{
+    emitRex(buffer, true, 0, 0, destination);
+    emitByte(buffer, 0xFF);
+    emitRegisterOperand(buffer, 0, destination);
+}
+
+
+void emitDecrement(CodeBuffer* const buffer, X86Register destination)
+{
+    emitRex(buffer, true, 0, 0, destination);
+    emitByte(buffer, 0xFF);
+    emitRegisterOperand(buffer, 1, destination);
+}
+
+
+void emitPush(CodeBuffer* const buffer, X86Register source)
+{
+    emitRex(buffer, false, 0, 0, source);
+    emitByte(buffer, (uint8_t)(0x50 + (source & 7)));
+}
+
+
+void emitPop(CodeBuffer* const buffer, X86Register destination)
+{
+    emitRex(buffer, false, 0, 0, destination);
+    emitByte(buffer, (uint8_t)(0x58 + (destination & 7)));
+}
+
+
+void emitCallRegister(CodeBuffer* const buffer, X86Register target)
+{
+    emitRex(buffer, false, 0, 0, target);
+    emitByte(buffer, 0xFF);
+    emitRegisterOperand(buffer, 2, target);
+}
+
+
+void emitReturn(CodeBuffer* const buffer)
+{
+    emitByte(buffer, 0xC3);
+}
+
+
+size_t emitCallRelative(CodeBuffer* const buffer)
+{
+    emitByte(buffer, 0xE8);
+    emit32(buffer, 0);
+
+    return buffer->size - sizeof(int32_t);
+}
+
+
+size_t emitJumpRelative(CodeBuffer* const buffer)
+{
+    emitByte(buffer, 0xE9);
+    emit32(buffer, 0);
+
+    return buffer->size - sizeof(int32_t);
+}
+
+
+size_t emitJumpConditional(CodeBuffer* const buffer, X86Condition condition)
+{
+    emitByte(buffer, TWO_BYTE_OPCODE);
+    emitByte(buffer, (uint8_t)(0x80 + condition));
+    emit32(buffer, 0);
+
+    return buffer->size - sizeof(int32_t);
+}
+
+
+X86Condition invertCondition(X86Condition condition)
+{
+    return (X86Condition)(condition ^ 1);
+}
+
+
+void emitSseLoad(CodeBuffer* const buffer, uint8_t destination, X86Register base, int32_t displacement)
+{
+    emitByte(buffer, SSE_DOUBLE);
+    emitRex(buffer, false, destination, 0, base);
+    emitByte(buffer, TWO_BYTE_OPCODE);
+    emitByte(buffer, 0x10);
+    emitMemory(buffer, destination, base, displacement);
+}
+
+
+void emitSseStore(CodeBuffer* const buffer, X86Register base, int32_t displacement, uint8_t source)
+{
+    emitByte(buffer, SSE_DOUBLE);
+    emitRex(buffer, false, source, 0, base);
+    emitByte(buffer, TWO_BYTE_OPCODE);
+    emitByte(buffer, 0x11);
+    emitMemory(buffer, source, base, displacement);
+}
+
+
+void emitSseLoadIndexed(CodeBuffer* const buffer, uint8_t destination, X86Register base, X86Register index)
+{
+    emitByte(buffer, SSE_DOUBLE);
+    emitRex(buffer, false, destination, index, base);
+    emitByte(buffer, TWO_BYTE_OPCODE);
+    emitByte(buffer, 0x10);
+    emitIndexedMemory(buffer, destination, base, index);
+}
+
+
+void emitSseStoreIndexed(CodeBuffer* const buffer, X86Register base, X86Register index, uint8_t source)
+{
+    emitByte(buffer, SSE_DOUBLE);
+    emitRex(buffer, false, source, index, base);
+    emitByte(buffer, TWO_BYTE_OPCODE);
+    emitByte(buffer, 0x11);
+    emitIndexedMemory(buffer, source, base, index);
+}
+
+
+void emitSseMove(CodeBuffer* const buffer, uint8_t destination, uint8_t source)
+{
+    // movapd copies the whole register and does not depend on the old destination
+    emitByte(buffer, OPERAND_SIZE);
+    emitRex(buffer, false, destination, 0, source);
+    emitByte(buffer, TWO_BYTE_OPCODE);
+    emitByte(buffer, 0x28);
+    emitRegisterOperand(buffer, destination, source);
+}
+
+
+void emitSseOperation(CodeBuffer* const buffer, SseOperation operation, uint8_t destination, uint8_t source)
+{
+    emitByte(buffer, SSE_DOUBLE);
+    emitRex(buffer, false, destination, 0, source);
+    emitByte(buffer, TWO_BYTE_OPCODE);
+    emitByte(buffer, (uint8_t)operation);
+    emitRegisterOperand(buffer, destination, source);
+}
+
+
+void emitSseOperationMemory(CodeBuffer* const buffer,
+                            SseOperation      operation,
+                            uint8_t           destination,
+                            X86Register       base,
+                            int32_t           displacement)
+{
+    emitByte(buffer, SSE_DOUBLE);
+    emitRex(buffer, false, destination, 0, base);
+    emitByte(buffer, TWO_BYTE_OPCODE);
+    emitByte(buffer, (uint8_t)operation);
+    emitMemory(buffer, destination, base, displacement);
+}
+
+
+void emitSseCompare(CodeBuffer* const buffer, uint8_t first, uint8_t second)
+{
+    emitByte(buffer, OPERAND_SIZE);
+    emitRex(buffer, false, first, 0, second);
+    emitByte(buffer, TWO_BYTE_OPCODE);
+    emitByte(buffer, 0x2E);
+    emitRegisterOperand(buffer, first, second);
+}
+
+
+void emitSseFromRegister(CodeBuffer* const buffer, uint8_t destination, X86Register source)
+{
+    emitByte(buffer, OPERAND_SIZE);
+    emitRex(buffer, true, destination, 0, source);
+    emitByte(buffer, TWO_BYTE_OPCODE);
+    emitByte(buffer, 0x6E);
+    emitRegisterOperand(buffer, destination, source);
+}
+
+
+void emitSseFromInteger(CodeBuffer* const buffer, uint8_t destination, X86Register source)
+{
+    // 64-bit source, the same conversion as a (double) cast
+    emitByte(buffer, SSE_DOUBLE);
+    emitRex(buffer, true, destination, 0, source);
+    emitByte(buffer, TWO_BYTE_OPCODE);
+    emitByte(buffer, 0x2A);
+    emitRegisterOperand(buffer, destination, source);
+}
+
+
+void emitSseTruncate(CodeBuffer* const buffer, X86Register destination, uint8_t source)
+{
+    // 32-bit destination, the same conversion as an (int) cast
+    emitByte(buffer, SSE_DOUBLE);
+    emitRex(buffer, false, destination, 0, source);
+    emitByte(buffer, TWO_BYTE_OPCODE);
+    emitByte(buffer, 0x2C);
+    emitRegisterOperand(buffer, destination, source);
+}
+
+
+uint8_t* makeExecutable(const CodeBuffer* const buffer)
+{
+    assert(buffer != NULL);
+
+    if (buffer->failed || buffer->size == 0)
+    {
+        return NULL;
+    }
+
+    void* code = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    memcpy(code, buffer->bytes, buffer->size);
+
+    // never writable and executable at the same time
+    if (mprotect(code, buffer->size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(code, buffer->size);
+        return NULL;
+    }
+
+    return (uint8_t*)code;
+}
+
+
+void freeExecutable(uint8_t* code, size_t size)
+{
+    if (code)
+    {
+        munmap(code, size);
+    }
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static void reserve(CodeBuffer* const buffer, size_t size)
+{
+    assert(buffer != NULL);
+
+    if (buffer->failed || buffer->size + size <= buffer->capacity)
+    {
+        return;
+    }
+
+    size_t   new_capacity = buffer->capacity ? 2 * buffer->capacity : START_CAPACITY;
+    uint8_t* new_bytes    = (uint8_t*)realloc(buffer->bytes, new_capacity);
+    if (!new_bytes)
+    {
+        buffer->failed = true;
+        return;
+    }
+
+    buffer->bytes    = new_bytes;
+    buffer->capacity = new_capacity;
+}
+
+
+static void emitRex(CodeBuffer* const buffer, bool wide, unsigned reg, unsigned index, unsigned base)
+{
+    uint8_t rex = (uint8_t)(REX | (wide ? REX_WIDE : 0)
+                                | (((reg   >> 3) & 1) << 2)
+                                | (((index >> 3) & 1) << 1)
+                                |  ((base  >> 3) & 1));
+
+    if (rex != REX)
+    {
+        emitByte(buffer, rex);
+    }
+}
+
+
+static void emitMemory(CodeBuffer* const buffer, unsigned reg, X86Register base, int32_t displacement)
+{
+    unsigned low = base & 7;
+
+    // rbp and r13 have no encoding without displacement, rsp and r12 need a SIB byte
+    unsigned mod = (displacement == 0 && low != 5) ? 0b00u
+                 : fitsInByte(displacement)          ? 0b01u
+                 :                                     0b10u;
+
+    emitByte(buffer, (uint8_t)((mod << 6) | ((reg & 7) << 3) | low));
+
+    if (low == 4)
+    {
+        emitByte(buffer, 0x24);
+    }
+
+    if (mod == 0b01)
+    {
+        emitByte(buffer, (uint8_t)displacement);
+    }
+    else if (mod == 0b10)
+    {
+        emit32(buffer, (uint32_t)displacement);
+    }
+}
+
+
+// [base + index * 8]
+static void emitIndexedMemory(CodeBuffer* const buffer, unsigned reg, X86Register base, X86Register index)
+{
+    assert(index != X86Register_RSP);
+
+    unsigned low = base & 7;
+    unsigned mod = (low == 5) ? 0b01u : 0b00u;
+
+    emitByte(buffer, (uint8_t)((mod << 6) | ((reg & 7) << 3) | 0b100));
+    emitByte(buffer, (uint8_t)((0b11u << 6) | (((unsigned)index & 7u) << 3) | low));
+
+    if (mod == 0b01)
+    {
+        emitByte(buffer, 0);
+    }
+}
+
+
+static void emitRegisterOperand(CodeBuffer* const buffer, unsigned reg, unsigned rm)
+{
+    emitByte(buffer, (uint8_t)((MOD_REGISTER << 6u) | ((reg & 7) << 3) | (rm & 7)));
+}
+
+
+static bool fitsInByte(int32_t value)
+{
+    return value >= INT8_MIN && value <= INT8_MAX;
+}
@@ -0,0 +1,13 @@
+call OUTER
+ret
+
+OUTER proc
+    call SHOW
+    ret
+OUTER endp
+
+SHOW proc
+    calldepth
+    out
+    hlt
+SHOW endp
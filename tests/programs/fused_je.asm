@@ -0,0 +1,15 @@
+push 0
+pop ax
+LOOP:
+    push ax
+    out
+    push ax
+    push 1
+    add
+    pop ax
+    push ax
+    push 3
+    je DONE
+    jmp LOOP
+DONE:
+hlt
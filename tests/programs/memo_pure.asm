@@ -0,0 +1,74 @@
+push 0
+pop cx
+
+LOOP:
+    push 10
+    pop ax
+    call FACTORIAL
+    out
+    push ax
+    out
+
+    push 100
+    pop ax
+    push 0
+    pop bx
+    call SUM
+    push bx
+    out
+    push ax
+    out
+
+    push 1
+    push cx
+    add
+    pop cx
+
+    push 3
+    push cx
+    jb LOOP
+
+hlt
+
+FACTORIAL proc
+    push 0
+    push ax
+
+    jne NEXT_FACTOR
+        push 1
+        ret
+    NEXT_FACTOR:
+    push ax
+
+    push 1
+    push ax
+    sub
+    pop ax
+
+    call FACTORIAL
+
+    mul
+
+    ret
+FACTORIAL endp
+
+SUM proc
+    push 0
+    push ax
+
+    jne NEXT_TERM
+        ret
+    NEXT_TERM:
+    push ax
+    push bx
+    add
+    pop bx
+
+    push 1
+    push ax
+    sub
+    pop ax
+
+    call SUM
+    ret
+SUM endp
@@ -0,0 +1,36 @@
+push 1
+pop ax
+call UNEVEN
+out
+
+push 0
+pop ax
+call UNEVEN
+out
+out
+
+push 1
+pop ax
+call UNEVEN
+out
+
+push 0
+pop ax
+call UNEVEN
+out
+out
+
+hlt
+
+UNEVEN proc
+    push 0
+    push ax
+
+    je ZERO
+        push 1
+        ret
+    ZERO:
+    push 2
+    push 3
+    ret
+UNEVEN endp
@@ -0,0 +1,30 @@
+push 200000
+pop ax
+push 0
+pop bx
+call COUNT
+push bx
+out
+hlt
+
+COUNT proc
+    push 0
+    push ax
+    jne STEP
+        calldepth
+        out
+        ret
+    STEP:
+    push bx
+    push ax
+    add
+    pop bx
+
+    push 1
+    push ax
+    sub
+    pop ax
+
+    call COUNT
+    ret
+COUNT endp
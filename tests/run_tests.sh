@@ -0,0 +1,75 @@
+#!/bin/bash
+# make test: every tests/programs/NAME.asm is assembled and run on every engine, with and without stack checks,
+# and has to print tests/expected/NAME.out (NAME.in is its input if there is one). The programs:
+#   tail_recursion  a procedure calls itself 200000 times in tail position, three times what the return stack
+#                   holds, and prints the call depth at the bottom: tail calls run in constant stack space
+#   entry_call_ret  call X; ret becomes a tail call inside of procedures only, the entry code keeps its call
+#   fused_je        counts to 3 with a compare and branch, its je exists only inside that superinstruction
+#   memo_pure       calls a recursive pure procedure that writes ax and a tail recursive one that writes ax and bx
+#                   three times with the same arguments: the cache hits have to give the same results and registers
+#   memo_refused    a procedure with no side effects that returns with one value or two has to stay a plain call
+# fused_je is also snapshotted at je and restored, which has to print what comes after its first je only.
+
+cd "$(dirname "$0")/.." || exit 1
+
+BUILD_DIR=build_tests
+ENGINES="--switch --threaded --register --jit --trace"
+
+passed=0
+failed=0
+
+fail()
+{
+    echo "FAIL: $*"
+    failed=$((failed + 1))
+}
+
+mkdir -p $BUILD_DIR
+
+for source in tests/programs/*.asm; do
+    name=$(basename "$source" .asm)
+    binary=$BUILD_DIR/$name.bin
+
+    if ! ./compiler "$source" "$binary" > /dev/null; then
+        fail "$name does not assemble"
+        continue
+    fi
+
+    input=/dev/null
+    if [ -f "tests/programs/$name.in" ]; then
+        input=tests/programs/$name.in
+    fi
+
+    for engine in $ENGINES; do
+        for checks in "" --checked; do
+            if ./processor --buffered $engine $checks "$binary" < "$input" 2>&1 | cmp -s - "tests/expected/$name.out"
+            then
+                passed=$((passed + 1))
+            else
+                fail "$name $engine $checks"
+            fi
+        done
+    done
+done
+
+snapshot=$BUILD_DIR/fused_je.snap
+
+for engine in $ENGINES; do
+    rm -f "$snapshot"
+
+    if ! ./processor --buffered $engine --snapshot "$snapshot" --snapshot-at je "$BUILD_DIR/fused_je.bin" 2>&1 \
+       | cmp -s - tests/expected/fused_je.out || [ ! -f "$snapshot" ]
+    then
+        fail "fused_je $engine --snapshot-at je"
+    elif ! ./processor --buffered $engine --restore "$snapshot" "$BUILD_DIR/fused_je.bin" 2>&1 \
+         | cmp -s - tests/expected/fused_je_restored.out
+    then
+        fail "fused_je $engine --restore"
+    else
+        passed=$((passed + 1))
+    fi
+done
+
+echo "$passed passed, $failed failed"
+
+[ $failed -eq 0 ]
@@ -0,0 +1,17 @@
+#ifndef TRANSLATOR_H
+#define TRANSLATOR_H
+
+#include "processor.h"
+
+typedef struct TranslatorOptions
+{
+    bool force_checks;   // keep stack checks even if the verifier proved them redundant
+} TranslatorOptions;
+
+// writes a source file that runs the assembled program without any interpreter,
+// it is built together with spu_io.cpp so out, in and draw behave exactly as in the processor
+ProcessorErrorHandler translateProgram(const char*                     path_to_program,
+                                       const char*                     path_to_output,
+                                       const TranslatorOptions* const options);
+
+#endif // TRANSLATOR_H
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "translator.h"
+#include "logger.h"
+
+
+static const char* CHECKED_OPTION = "--checked";
+
+
+int main(const int argc, const char** argv)
+{
+    openLogFile("log.txt");
+
+    TranslatorOptions options = {
+        .force_checks = false,
+    };
+
+    const char* files[2]        = {};
+    int         number_of_files = 0;
+
+    for (int current_arg = 1; current_arg < argc; current_arg++)
+    {
+        if (!strcmp(argv[current_arg], CHECKED_OPTION))
+        {
+            options.force_checks = true;
+        }
+        else if (number_of_files < 2)
+        {
+            files[number_of_files++] = argv[current_arg];
+        }
+    }
+
+    if (number_of_files != 2)
+    {
+        printf("Usage: ./translator [%s] program_code.bin program.cpp\n", CHECKED_OPTION);
+        return 0;
+    }
+
+    ProcessorErrorHandler return_code = translateProgram(files[0], files[1], &options);
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        printf("Failed to translate %s (error %d)\n", files[0], return_code);
+        return 1;
+    }
+
+    return 0;
+}
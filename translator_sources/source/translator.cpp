@@ -0,0 +1,721 @@
+#include "translator.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "helpful_functions.h"
+#include "command_handler.h"
+#include "logger.h"
+#include "spu.h"
+#include "decoder.h"
+#include "verifier.h"
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+// the generated code names its registers the way the assembler does
+static const char* const REGISTER_NAMES[] = {
+    NULL, AX_REGISTER, BX_REGISTER, CX_REGISTER, DX_REGISTER, EX_REGISTER, FX_REGISTER,
+};
+
+typedef struct Translator
+{
+    const Instruction*  program;
+    size_t              program_size;   // without the implicit hlt behind the last instruction
+    const ProgramImage* image;          // data section becomes the initial RAM contents
+    bool*               is_label;       // instruction is a jump or call target or a return address
+    bool                uses_register[NUMBER_OF_REGISTERS + 1];
+    bool                has_calls;
+    bool                checked;
+    size_t              return_stack_size;
+    FILE*               output;
+} Translator;
+
+// operand stack, return address stack and the checks the processor does, folded away when CHECKED is false
+static const char* const PRELUDE =
+    "#include <stdlib.h>\n"
+    "#include <math.h>\n"
+    "\n"
+    "#include \"helpful_functions.h\"\n"
+    "#include \"work_with_doubles.h\"\n"
+    "#include \"spu.h\"\n"
+    "#include \"spu_io.h\"\n"
+    "#include \"vector_kernels.h\"\n"
+    "\n"
+    "\n"
+    "#define PUSH_(value)                                                  \\\n"
+    "    do {                                                              \\\n"
+    "        arguments_type pushed_ = (value);                             \\\n"
+    "        if (CHECKED && stack_top == operand_stack + SIZE_OF_STACK)    \\\n"
+    "        {                                                             \\\n"
+    "            abortWithMessage(\"Operand stack overflow\");               \\\n"
+    "        }                                                             \\\n"
+    "        *stack_top++ = pushed_;                                       \\\n"
+    "    } while (0)\n"
+    "\n"
+    "#define POP_(variable)                                                \\\n"
+    "    do {                                                              \\\n"
+    "        if (CHECKED && stack_top == operand_stack)                    \\\n"
+    "        {                                                             \\\n"
+    "            abortWithMessage(\"Operand stack underflow\");              \\\n"
+    "        }                                                             \\\n"
+    "        (variable) = *--stack_top;                                    \\\n"
+    "    } while (0)\n"
+    "\n"
+    "#define DROP_(count)                                                  \\\n"
+    "    do {                                                              \\\n"
+    "        if (CHECKED && stack_top - operand_stack < (count))           \\\n"
+    "        {                                                             \\\n"
+    "            abortWithMessage(\"Operand stack underflow\");              \\\n"
+    "        }                                                             \\\n"
+    "        stack_top -= (count);                                         \\\n"
+    "    } while (0)\n"
+    "\n"
+    "#define CALL_(return_address, target)                                 \\\n"
+    "    do {                                                              \\\n"
+    "        if (CHECKED && return_top == return_stack + RETURN_STACK_SIZE)\\\n"
+    "        {                                                             \\\n"
+    "            abortWithMessage(\"Call stack overflow\");                  \\\n"
+    "        }                                                             \\\n"
+    "        *return_top++ = (return_address);                             \\\n"
+    "        goto target;                                                  \\\n"
+    "    } while (0)\n"
+    "\n"
+    "\n";
+
+static ProcessorErrorHandler readProgramCode(const char* path_to_program, SPU* const spu);
+static ProcessorErrorHandler scanProgram(Translator* const translator);
+static void markPairRegisters(Translator* const translator, const Instruction* const instruction);
+
+static void writeHeader(const Translator* const translator, const char* path_to_program);
+static void writeInstruction(const Translator* const translator, size_t index);
+static void writeReturnDispatch(const Translator* const translator);
+static void writeConstant(FILE* output, arguments_type value);
+static void writePairOperands(FILE* output, const Instruction* const instruction);
+static void writeConditionalJump(FILE* output, uint8_t condition, size_t target);
+
+static const char* getRegisterName(uint8_t register_index);
+
+
+// public --------------------------------------------------------------------------------------------------------------
+
+
+ProcessorErrorHandler translateProgram(const char*                     path_to_program,
+                                       const char*                     path_to_output,
+                                       const TranslatorOptions* const options)
+{
+    assert(path_to_program != NULL);
+    assert(path_to_output  != NULL);
+    assert(options         != NULL);
+
+    SPU spu = {};
+
+    ProcessorErrorHandler return_code = readProgramCode(path_to_program, &spu);
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = decodeProgram(&spu);
+    }
+
+    VerifierReport report = {};
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        return_code = verifyProgram(&spu, &report);
+    }
+
+    if (return_code != ProcessorErrorHandler_OK)
+    {
+        free(spu.code);
+        free(spu.program);
+        return return_code;
+    }
+
+    Translator translator = {
+        .program           = spu.program,
+        .program_size      = spu.program_size,
+        .image             = &spu.image,
+        .checked           = options->force_checks || !report.bounded,
+        .return_stack_size = report.bounded ? report.max_call_depth + 1 : CALL_STACK_SIZE,
+    };
+
+    return_code = scanProgram(&translator);
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        translator.output = fopen(path_to_output, "w");
+        return_code       = translator.output ? ProcessorErrorHandler_OK : ProcessorErrorHandler_OPEN_FILE_ERROR;
+    }
+
+    if (return_code == ProcessorErrorHandler_OK)
+    {
+        writeHeader(&translator, path_to_program);
+
+        // the decoder puts a hlt behind the last instruction, falling off the end stops there as well
+        for (size_t index = 0; index <= translator.program_size; index++)
+        {
+            writeInstruction(&translator, index);
+        }
+
+        writeReturnDispatch(&translator);
+
+        fprintf(translator.output, "}\n");
+
+        if (ferror(translator.output))
+        {
+            return_code = ProcessorErrorHandler_ERROR;
+        }
+
+        FCLOSE_NULL(translator.output);
+
+        Log(LogLevel_INFO, "Translated %zu instructions of %s into %s%s", translator.program_size,
+            path_to_program, path_to_output, translator.checked ? " with stack checks" : "");
+    }
+
+    free(translator.is_label);
+    free(spu.code);
+    free(spu.program);
+
+    return return_code;
+}
+
+
+// static --------------------------------------------------------------------------------------------------------------
+
+
+static ProcessorErrorHandler readProgramCode(const char* path_to_program, SPU* const spu)
+{
+    assert(path_to_program != NULL);
+    assert(spu             != NULL);
+
+    FILE* program_file = fopen(path_to_program, "rb");
+    if (!program_file)
+    {
+        return ProcessorErrorHandler_OPEN_FILE_ERROR;
+    }
+
+    spu->size_of_code = getFileSize(program_file);
+
+    spu->code = (uint8_t*)calloc(spu->size_of_code + 1, sizeof(uint8_t));
+    if (!spu->code)
+    {
+        FCLOSE_NULL(program_file);
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    size_t return_code = fread(spu->code,
+                               sizeof(spu->code[0]),
+                               spu->size_of_code,
+                               program_file);
+    FCLOSE_NULL(program_file);
+
+    if (return_code != spu->size_of_code)
+    {
+        FREE_NULL(spu->code);
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+// Only instructions something jumps to get a label and only used registers get a variable,
+// so the output builds without unused warnings.
+static ProcessorErrorHandler scanProgram(Translator* const translator)
+{
+    assert(translator != NULL);
+
+    translator->is_label = (bool*)calloc(translator->program_size + 1, sizeof(bool));
+    if (!translator->is_label)
+    {
+        return ProcessorErrorHandler_ERROR;
+    }
+
+    for (size_t index = 0; index < translator->program_size; index++)
+    {
+        const Instruction* const instruction = translator->program + index;
+
+        switch (instruction->command)
+        {
+            case MachineCommands_PUSH:
+            case MachineCommands_POP:
+                if (instruction->flags & REGISTER_FLAG)
+                {
+                    translator->uses_register[instruction->register_index] = true;
+                }
+                break;
+
+            case MachineCommands_INC:
+                translator->uses_register[instruction->register_index] = true;
+                break;
+
+            case MachineCommands_PUSH_SUB:
+                markPairRegisters(translator, instruction);
+                break;
+
+            case MachineCommands_CALL:
+            case MachineCommands_PURE_CALL:
+                translator->has_calls                     = true;
+                translator->is_label[index + 1]           = true;
+                translator->is_label[instruction->target] = true;
+                break;
+
+            case MachineCommands_RET:
+            case MachineCommands_CALL_DEPTH:
+                translator->has_calls = true;
+                break;
+
+            case MachineCommands_TAILCALL:
+                translator->is_label[instruction->target] = true;
+                break;
+
+            case DecodedCommands_JA_PAIR:
+            case DecodedCommands_JAE_PAIR:
+            case DecodedCommands_JB_PAIR:
+            case DecodedCommands_JBE_PAIR:
+            case DecodedCommands_JE_PAIR:
+            case DecodedCommands_JNE_PAIR:
+                markPairRegisters(translator, instruction);
+                translator->is_label[instruction->target] = true;
+                break;
+
+            case MachineCommands_JMP:
+            case MachineCommands_JA:
+            case MachineCommands_JAE:
+            case MachineCommands_JB:
+            case MachineCommands_JBE:
+            case MachineCommands_JE:
+            case MachineCommands_JNE:
+                translator->is_label[instruction->target] = true;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return ProcessorErrorHandler_OK;
+}
+
+
+static void markPairRegisters(Translator* const translator, const Instruction* const instruction)
+{
+    assert(translator  != NULL);
+    assert(instruction != NULL);
+
+    if (instruction->flags & PAIR_FIRST_REGISTER_FLAG)
+    {
+        translator->uses_register[instruction->register_index] = true;
+    }
+
+    if (instruction->flags & PAIR_SECOND_REGISTER_FLAG)
+    {
+        translator->uses_register[instruction->second_register_index] = true;
+    }
+}
+
+
+static void writeHeader(const Translator* const translator, const char* path_to_program)
+{
+    assert(translator      != NULL);
+    assert(path_to_program != NULL);
+
+    FILE* output = translator->output;
+
+    fprintf(output, "// Translated from %s by translator, regenerate it instead of editing.\n\n", path_to_program);
+    fprintf(output, "%s", PRELUDE);
+
+    fprintf(output, "static const bool   CHECKED           = %s;\n", translator->checked ? "true" : "false");
+    if (translator->has_calls)
+    {
+        fprintf(output, "static const size_t RETURN_STACK_SIZE = %zu;\n", translator->return_stack_size);
+    }
+
+    fprintf(output,
+            "\n"
+            "\n"
+            "int main(void)\n"
+            "{\n");
+
+    for (uint8_t register_index = Registers_AX; register_index <= NUMBER_OF_REGISTERS; register_index++)
+    {
+        if (translator->uses_register[register_index])
+        {
+            fprintf(output, "    arguments_type %s = 0;\n", getRegisterName(register_index));
+        }
+    }
+
+    fprintf(output,
+            "\n"
+            "    arguments_type  operand_stack[SIZE_OF_STACK] = {};\n"
+            "    arguments_type* stack_top                    = operand_stack;\n"
+            "    arguments_type  first                        = 0;\n"
+            "    arguments_type  second                       = 0;\n"
+            "    (void)first;\n"
+            "    (void)second;\n"
+            "\n"
+            "    SpuStreams streams = {.input = stdin, .output = stdout};\n"
+            "    SpuIo      io      = {};\n"
+            "    spuIoCtor(&io, &streams);\n");
+
+    if (translator->has_calls)
+    {
+        fprintf(output,
+                "\n"
+                "    size_t* return_stack = (size_t*)calloc(RETURN_STACK_SIZE, sizeof(size_t));\n"
+                "    size_t* return_top   = return_stack;\n"
+                "    if (!return_stack)\n"
+                "    {\n"
+                "        return 1;\n"
+                "    }\n");
+    }
+
+    fprintf(output,
+            "\n"
+            "    arguments_type* ram = (arguments_type*)calloc(SIZE_OF_RAM, sizeof(arguments_type));\n"
+            "    if (!ram)\n"
+            "    {\n"
+            "        return 1;\n"
+            "    }\n"
+            "\n"
+            "    for (size_t i = 0; i < SIZE_OF_RAM; i++)\n"
+            "    {\n"
+            "        ram[i] = ' ';\n"
+            "    }\n"
+            "\n");
+
+    for (size_t cell = 0; cell < translator->image->data_size / sizeof(arguments_type); cell++)
+    {
+        arguments_type value = 0;
+        memcpy(&value, translator->image->data + cell * sizeof(arguments_type), sizeof(arguments_type));
+
+        fprintf(output, "    ram[%zu] = ", cell);
+        writeConstant(output, value);
+        fprintf(output, ";\n");
+    }
+
+    if (translator->image->data_size > 0)
+    {
+        fprintf(output, "\n");
+    }
+}
+
+
+static void writeInstruction(const Translator* const translator, size_t index)
+{
+    assert(translator != NULL);
+
+    const Instruction* const instruction = translator->program + index;
+    FILE*                    output      = translator->output;
+
+    if (translator->is_label[index])
+    {
+        fprintf(output, "instruction_%zu:\n", index);
+    }
+
+    switch (instruction->command)
+    {
+        case MachineCommands_PUSH:
+        {
+            fprintf(output, "    PUSH_(");
+
+            if (instruction->flags & RAM_FLAG)
+            {
+                fprintf(output, "ram[(int)(");
+            }
+
+            if (instruction->flags & REGISTER_FLAG)
+            {
+                fprintf(output, "%s", getRegisterName(instruction->register_index));
+
+                if (instruction->flags & CONST_FLAG)
+                {
+                    fprintf(output, " + ");
+                    writeConstant(output, instruction->immediate);
+                }
+            }
+            else
+            {
+                // folded here exactly the way pushArgument adds it to zero
+                arguments_type argument = 0;
+                argument += instruction->immediate;
+
+                writeConstant(output, argument);
+            }
+
+            fprintf(output, (instruction->flags & RAM_FLAG) ? ")]);\n" : ");\n");
+            break;
+        }
+
+        case MachineCommands_POP:
+            if (instruction->flags & RAM_FLAG)
+            {
+                fprintf(output, "    POP_(ram[");
+
+                if (instruction->flags & REGISTER_FLAG)
+                {
+                    fprintf(output, "(int)%s", getRegisterName(instruction->register_index));
+                }
+
+                if (instruction->flags & CONST_FLAG)
+                {
+                    fprintf(output, (instruction->flags & REGISTER_FLAG) ? " + (int)" : "(int)");
+                    writeConstant(output, instruction->immediate);
+                }
+
+                fprintf(output, "]);\n");
+            }
+            else
+            {
+                fprintf(output, "    POP_(%s);\n", getRegisterName(instruction->register_index));
+            }
+            break;
+
+        case MachineCommands_ADD:
+            fprintf(output, "    POP_(first);\n    POP_(second);\n    PUSH_(first + second);\n");
+            break;
+
+        case MachineCommands_MUL:
+            fprintf(output, "    POP_(first);\n    POP_(second);\n    PUSH_(first * second);\n");
+            break;
+
+        case MachineCommands_SUB:
+            fprintf(output, "    POP_(first);\n    POP_(second);\n    PUSH_(first - second);\n");
+            break;
+
+        case MachineCommands_DIV:
+            fprintf(output, "    POP_(first);\n    POP_(second);\n    PUSH_(first / second);\n");
+            break;
+
+        case MachineCommands_SQRT:
+            fprintf(output, "    POP_(first);\n    PUSH_(sqrt(first));\n");
+            break;
+
+        case MachineCommands_OUT:
+            fprintf(output, "    POP_(first);\n    printProgramOut(&io, first);\n");
+            break;
+
+        case MachineCommands_IN:
+            fprintf(output, "    PUSH_(scanProgramIn(&io));\n");
+            break;
+
+        case MachineCommands_TIMESTAMP:
+            fprintf(output, "    PUSH_(readProgramClock(&io));\n");
+            break;
+
+        case MachineCommands_DRAW:
+            fprintf(output, "    drawRam(&io, ram);\n");
+            break;
+
+        case MachineCommands_JMP:
+            fprintf(output, "    goto instruction_%zu;\n", instruction->target);
+            break;
+
+        case MachineCommands_JA:
+        case MachineCommands_JAE:
+        case MachineCommands_JB:
+        case MachineCommands_JBE:
+        case MachineCommands_JE:
+        case MachineCommands_JNE:
+            fprintf(output, "    POP_(first);\n    POP_(second);\n");
+            writeConditionalJump(output, (uint8_t)(instruction->command - MachineCommands_JA), instruction->target);
+            break;
+
+        case DecodedCommands_JA_PAIR:
+        case DecodedCommands_JAE_PAIR:
+        case DecodedCommands_JB_PAIR:
+        case DecodedCommands_JBE_PAIR:
+        case DecodedCommands_JE_PAIR:
+        case DecodedCommands_JNE_PAIR:
+            writePairOperands(output, instruction);
+            writeConditionalJump(output, (uint8_t)(instruction->command - DecodedCommands_JA_PAIR),
+                                 instruction->target);
+            break;
+
+        case MachineCommands_CALL:
+        case MachineCommands_PURE_CALL:
+            fprintf(output, "    CALL_(%zu, instruction_%zu);\n", index + 1, instruction->target);
+            break;
+
+        case MachineCommands_RET:
+            fprintf(output, "    goto return_dispatch;\n");
+            break;
+
+        case MachineCommands_TAILCALL:
+            fprintf(output, "    goto instruction_%zu;\n", instruction->target);
+            break;
+
+        case MachineCommands_CALL_DEPTH:
+            fprintf(output, "    PUSH_((arguments_type)(return_top - return_stack));\n");
+            break;
+
+        case MachineCommands_PUSH_SUB:
+            writePairOperands(output, instruction);
+            fprintf(output, "    PUSH_(first - second);\n");
+            break;
+
+        case MachineCommands_INC:
+            fprintf(output, "    %s = %s + ", getRegisterName(instruction->register_index),
+                    getRegisterName(instruction->register_index));
+            writeConstant(output, instruction->immediate);
+            fprintf(output, ";\n");
+            break;
+
+        case DecodedCommands_VADD:
+        case DecodedCommands_VSUB:
+        case DecodedCommands_VMUL:
+        case DecodedCommands_VDIV:
+        case DecodedCommands_VSCALE:
+        case DecodedCommands_VFILL:
+        case DecodedCommands_VCOPY:
+        case DecodedCommands_VSUM:
+        case DecodedCommands_VDOT:
+        case DecodedCommands_VLESS:
+        {
+            uint8_t                  vector_command = (uint8_t)(instruction->command - DecodedCommands_VADD);
+            const VectorCommandInfo* info           = VECTOR_COMMANDS + vector_command;
+
+            fprintf(output, "    DROP_(%d);\n    first = executeVectorCommand(%d, ram, stack_top);\n",
+                    info->operands, vector_command);
+
+            if (info->results)
+            {
+                fprintf(output, "    PUSH_(first);\n");
+            }
+            break;
+        }
+
+        case MachineCommands_HLT:
+            fprintf(output, "    goto program_end;\n");
+            break;
+
+        default:
+            assert(0 && "Verifier let through an unknown command");
+            break;
+    }
+}
+
+
+// ret jumps back through a switch over every place a call returns to
+static void writeReturnDispatch(const Translator* const translator)
+{
+    assert(translator != NULL);
+
+    FILE* output = translator->output;
+
+    fprintf(output,
+            "\n"
+            "program_end:\n"
+            "    printProgramEnd(&io);\n"
+            "    spuIoDtor(&io);\n"
+            "\n"
+            "    free(ram);\n");
+
+    if (!translator->has_calls)
+    {
+        fprintf(output, "    return 0;\n");
+        return;
+    }
+
+    fprintf(output,
+            "    free(return_stack);\n"
+            "    return 0;\n"
+            "\n"
+            "return_dispatch:\n"
+            "    if (CHECKED && return_top == return_stack)\n"
+            "    {\n"
+            "        abortWithMessage(\"Return without call\");\n"
+            "    }\n"
+            "\n"
+            "    switch (*--return_top)\n"
+            "    {\n");
+
+    for (size_t index = 0; index < translator->program_size; index++)
+    {
+        if (translator->program[index].command == MachineCommands_CALL
+         || translator->program[index].command == MachineCommands_PURE_CALL)
+        {
+            fprintf(output, "        case %zu: goto instruction_%zu;\n", index + 1, index + 1);
+        }
+    }
+
+    fprintf(output,
+            "        default: abortWithMessage(\"Return address is not after a call\");\n"
+            "    }\n");
+}
+
+
+// hexadecimal floating literals keep every bit of the constant
+static void writeConstant(FILE* output, arguments_type value)
+{
+    assert(output != NULL);
+
+    const char* sign = signbit(value) ? "-" : "";
+
+    if (isnan(value))
+    {
+        fprintf(output, "(%sNAN)", sign);
+    }
+    else if (isinf(value))
+    {
+        fprintf(output, "(%sINFINITY)", sign);
+    }
+    else
+    {
+        fprintf(output, "(%a)", value);
+    }
+}
+
+
+// same order as loadPairOperands: the operand that would be on top is first
+static void writePairOperands(FILE* output, const Instruction* const instruction)
+{
+    assert(output      != NULL);
+    assert(instruction != NULL);
+
+    fprintf(output, "    first  = ");
+    if (instruction->flags & PAIR_SECOND_REGISTER_FLAG)
+    {
+        fprintf(output, "%s", getRegisterName(instruction->second_register_index));
+    }
+    else
+    {
+        writeConstant(output, instruction->second_immediate);
+    }
+
+    fprintf(output, ";\n    second = ");
+    if (instruction->flags & PAIR_FIRST_REGISTER_FLAG)
+    {
+        fprintf(output, "%s", getRegisterName(instruction->register_index));
+    }
+    else
+    {
+        writeConstant(output, instruction->immediate);
+    }
+
+    fprintf(output, ";\n");
+}
+
+
+static void writeConditionalJump(FILE* output, uint8_t condition, size_t target)
+{
+    assert(output != NULL);
+
+    static const char* const CONDITIONS[] = {
+        "first > second", "first >= second", "first < second", "first <= second",
+        "equatTwoDoubles(first, second)", "!equatTwoDoubles(first, second)",
+    };
+
+    assert(condition < sizeof(CONDITIONS) / sizeof(CONDITIONS[0]));
+
+    fprintf(output, "    if (%s) goto instruction_%zu;\n", CONDITIONS[condition], target);
+}
+
+
+static const char* getRegisterName(uint8_t register_index)
+{
+    assert(register_index >= Registers_AX && register_index <= NUMBER_OF_REGISTERS);
+
+    return REGISTER_NAMES[register_index];
+}